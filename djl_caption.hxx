@@ -0,0 +1,186 @@
+#pragma once
+
+//
+// Draws outlined captions (white outline, black fill) by blitting glyphs from an atlas.
+// Each glyph is rasterized once per font size into two 8-bit coverage masks: the outline stroke and the fill.
+// The rasterizing is done by whatever font engine the platform has; this code doesn't depend on one.
+// Once built the atlas is read-only, so any number of threads can draw captions concurrently without locks.
+//
+
+#include <vector>
+#include <unordered_map>
+
+using namespace std;
+
+class CCaptionAtlas
+{
+    private:
+        struct Glyph
+        {
+            size_t offset;   // where the glyph's masks start in the outline and fill arrays
+            int width;       // width of the masks, including padding on both sides
+            int advance;     // how far the pen moves after this glyph
+        };
+
+        int fontSize;
+        int lineHeight;      // height of a line of text
+        int padding;         // the masks extend this far beyond the pen box on every side for the outline
+        vector<byte> outline;
+        vector<byte> fill;
+        unordered_map<WCHAR, Glyph> glyphs;
+
+        int Advance( WCHAR c ) const
+        {
+            auto it = glyphs.find( c );
+            return ( it == glyphs.end() ) ? 0 : it->second.advance;
+        } //Advance
+
+        int TextWidth( WCHAR const * pwc, size_t len ) const
+        {
+            int width = 0;
+            for ( size_t i = 0; i < len; i++ )
+                width += Advance( pwc[ i ] );
+            return width;
+        } //TextWidth
+
+        // Composite one glyph mask. Outline coverage blends toward white, fill coverage toward black.
+        // Only the color channels are touched; clipping is to the full image like GDI+ would.
+
+        void BlitGlyph( Glyph const & g, bool isFill, byte * pOut, int stride, int bpp, int fullWidth, int fullHeight, int x, int y ) const
+        {
+            int bytesPP = bpp / 8;
+            int maskHeight = MaskHeight();
+            byte const * pMask = ( isFill ? fill.data() : outline.data() ) + g.offset;
+
+            for ( int my = 0; my < maskHeight; my++ )
+            {
+                int oy = y + my;
+                if ( oy < 0 || oy >= fullHeight )
+                    continue;
+
+                byte const * pRow = pMask + my * g.width;
+                byte * pOutRow = pOut + (size_t) oy * stride;
+
+                for ( int mx = 0; mx < g.width; mx++ )
+                {
+                    int c = pRow[ mx ];
+                    int ox = x + mx;
+                    if ( 0 == c || ox < 0 || ox >= fullWidth )
+                        continue;
+
+                    byte * p = pOutRow + ox * bytesPP;
+
+                    for ( int b = 0; b < 3; b++ )
+                    {
+                        if ( isFill )
+                            p[ b ] = (byte) ( p[ b ] - ( p[ b ] * c + 127 ) / 255 );
+                        else
+                            p[ b ] = (byte) ( p[ b ] + ( ( 255 - p[ b ] ) * c + 127 ) / 255 );
+                    }
+                }
+            }
+        } //BlitGlyph
+
+    public:
+        CCaptionAtlas() : fontSize( 0 ), lineHeight( 0 ), padding( 0 ) {}
+
+        void Initialize( int size, int height, int pad )
+        {
+            fontSize = size;
+            lineHeight = height;
+            padding = pad;
+            outline.clear();
+            fill.clear();
+            glyphs.clear();
+        } //Initialize
+
+        int FontSize() const { return fontSize; }
+        int Padding() const { return padding; }
+        int MaskHeight() const { return lineHeight + 2 * padding; }
+        bool Contains( WCHAR c ) const { return glyphs.end() != glyphs.find( c ); }
+
+        // The masks are width by MaskHeight() bytes, rows pitch bytes apart. The pen origin is at ( padding, padding ).
+
+        void AddGlyph( WCHAR c, int width, int advance, byte const * pOutline, byte const * pFill, int pitch )
+        {
+            Glyph g = { outline.size(), width, advance };
+            int maskHeight = MaskHeight();
+
+            for ( int y = 0; y < maskHeight; y++ )
+            {
+                outline.insert( outline.end(), pOutline + y * pitch, pOutline + y * pitch + width );
+                fill.insert( fill.end(), pFill + y * pitch, pFill + y * pitch + width );
+            }
+
+            glyphs[ c ] = g;
+        } //AddGlyph
+
+        // Draw text centered in the rectangle, wrapping at spaces (or anywhere if there are none) when it's
+        // too wide. Characters not in the atlas are skipped. Safe to call from many threads at once.
+
+        void Draw( WCHAR const * pwcText, byte * pOut, int stride, int bpp, int fullWidth, int fullHeight,
+                   int rectX, int rectY, int rectWidth, int rectHeight ) const
+        {
+            struct Line { size_t start; size_t len; };
+            vector<Line> lines;
+            size_t len = wcslen( pwcText );
+            size_t start = 0;
+
+            while ( start < len )
+            {
+                size_t end = start;
+                size_t lastSpace = 0;
+                int width = 0;
+
+                while ( end < len )
+                {
+                    int advance = Advance( pwcText[ end ] );
+                    if ( ( width + advance ) > rectWidth && end > start )
+                        break;
+
+                    if ( L' ' == pwcText[ end ] )
+                        lastSpace = end;
+
+                    width += advance;
+                    end++;
+                }
+
+                if ( end < len && lastSpace > start )
+                    end = lastSpace;
+
+                size_t lineLen = end - start;
+                while ( lineLen > 0 && L' ' == pwcText[ start + lineLen - 1 ] )
+                    lineLen--;
+
+                lines.push_back( { start, lineLen } );
+
+                start = end;
+                while ( start < len && L' ' == pwcText[ start ] )
+                    start++;
+            }
+
+            int y = rectY + ( rectHeight - (int) lines.size() * lineHeight ) / 2;
+
+            // Draw all of the outlines before any fill so neighboring glyphs' outlines don't cover fills
+
+            for ( int pass = 0; pass < 2; pass++ )
+            {
+                for ( size_t l = 0; l < lines.size(); l++ )
+                {
+                    WCHAR const * pwcLine = pwcText + lines[ l ].start;
+                    int x = rectX + ( rectWidth - TextWidth( pwcLine, lines[ l ].len ) ) / 2;
+                    int lineY = y + (int) l * lineHeight;
+
+                    for ( size_t i = 0; i < lines[ l ].len; i++ )
+                    {
+                        auto it = glyphs.find( pwcLine[ i ] );
+                        if ( it == glyphs.end() )
+                            continue;
+
+                        BlitGlyph( it->second, 1 == pass, pOut, stride, bpp, fullWidth, fullHeight, x - padding, lineY - padding );
+                        x += it->second.advance;
+                    }
+                }
+            }
+        } //Draw
+};
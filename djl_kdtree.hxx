@@ -214,6 +214,46 @@ class KDTreeBGR
             nodesAllocated = 1;
         } //KDTreeBGR
 
+        // Load a tree saved with NodeData(). Check IsValid() before using it if the data isn't trusted.
+
+        KDTreeBGR( void const * pNodes, int count, int head )
+        {
+            nodeArray.resize( count + 1 );
+            memcpy( nodeArray.data(), pNodes, ( count + 1 ) * sizeof KDNode );
+            treeHead = (ushort) head;
+            nodesAllocated = (ushort) ( count + 1 );
+        } //KDTreeBGR
+
+        // The nodes as a flat array of NodeCount() + 1 entries, for saving a prebuilt tree
+
+        void const * NodeData( size_t & cb, int & head )
+        {
+            static_assert( 8 == sizeof( KDNode ), "KDNode is persisted, so its size can't change" );
+
+            cb = nodesAllocated * sizeof KDNode;
+            head = treeHead;
+            return nodeArray.data();
+        } //NodeData
+
+        // Children are always allocated after their parents, so this also guarantees there are no cycles
+
+        bool IsValid()
+        {
+            if ( treeHead >= nodesAllocated || ( 0 == treeHead && nodesAllocated > 1 ) )
+                return false;
+
+            for ( ushort i = 1; i < nodesAllocated; i++ )
+            {
+                KDNode & n = nodeArray[ i ];
+
+                if ( ( 0 != n.left && ( n.left <= i || n.left >= nodesAllocated ) ) ||
+                     ( 0 != n.right && ( n.right <= i || n.right >= nodesAllocated ) ) )
+                    return false;
+            }
+
+            return true;
+        } //IsValid
+
         int NodeCount()
         {
             return nodesAllocated - 1; // the 0th element is reserved
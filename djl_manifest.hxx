@@ -0,0 +1,289 @@
+#pragma once
+
+//
+// Build manifest for skipping outputs that are already up to date, much like make. For each output it records
+// a digest of everything the output was made from: the app build, the options that affect pixels, and each
+// input's full path, size, and last-write time. It also records the output's own size and last-write time so
+// an output that was deleted or edited since is rebuilt. The file is UTF-8 text with one output per line.
+// Jobs that write more than one file (atlas pages and the atlas index) record the extra files as companions
+// of the primary output, written as "path<tab>primary path", and the job is current only if they all are.
+//
+
+#include <vector>
+#include <map>
+#include <string>
+#include <mutex>
+#include <atomic>
+
+#include <djl_mdcache.hxx>
+
+using namespace std;
+
+class CBuildManifest
+{
+    private:
+        struct ManifestEntry
+        {
+            unsigned long long digest;
+            unsigned long long outputSize;
+            unsigned long long outputWrite;
+            wstring owner;                      // primary output key for companions, empty otherwise
+        };
+
+        WCHAR awcPath[ MAX_PATH ];
+        unsigned long long optionsDigest;
+        mutex mtx;
+        map<wstring, ManifestEntry> entries;    // keyed by lowercase full output path
+        multimap<wstring, wstring> companions;  // primary output key to companion keys
+        bool dirty;
+        atomic<size_t> skipped;
+        atomic<size_t> built;
+
+        static const WCHAR * Signature() { return L"ICMANIFEST1"; }
+
+        static bool OutputKey( WCHAR const * pwcOutput, wstring & key )
+        {
+            WCHAR awcFull[ MAX_PATH ];
+            if ( 0 == _wfullpath( awcFull, pwcOutput, _countof( awcFull ) ) )
+                return false;
+
+            _wcslwr_s( awcFull, _countof( awcFull ) );
+            key = awcFull;
+            return true;
+        } //OutputKey
+
+        static bool SizeAndWrite( WCHAR const * pwcPath, unsigned long long & size, unsigned long long & lastWrite )
+        {
+            WIN32_FILE_ATTRIBUTE_DATA fad;
+            if ( !GetFileAttributesEx( pwcPath, GetFileExInfoStandard, &fad ) )
+                return false;
+
+            size = ( (unsigned long long) fad.nFileSizeHigh << 32 ) | fad.nFileSizeLow;
+            lastWrite = ( (unsigned long long) fad.ftLastWriteTime.dwHighDateTime << 32 ) | fad.ftLastWriteTime.dwLowDateTime;
+            return true;
+        } //SizeAndWrite
+
+    public:
+        // FNV-1a over whatever is added
+
+        class CDigest
+        {
+            private:
+                unsigned long long hash;
+
+            public:
+                CDigest() : hash( 14695981039346656037ull ) {}
+
+                void Add( void const * pv, size_t cb )
+                {
+                    byte const * pb = (byte const *) pv;
+
+                    for ( size_t i = 0; i < cb; i++ )
+                    {
+                        hash ^= pb[ i ];
+                        hash *= 1099511628211ull;
+                    }
+                } //Add
+
+                template <class T> void Add( T const & t ) { Add( &t, sizeof t ); }
+
+                unsigned long long Get() const { return ( 0 == hash ) ? 1 : hash; }
+        };
+
+        CBuildManifest( WCHAR const * pwcPath, unsigned long long options ) : optionsDigest( options ), dirty( false ), skipped( 0 ), built( 0 )
+        {
+            wcscpy_s( awcPath, _countof( awcPath ), pwcPath );
+
+            FILE * fp = _wfopen( awcPath, L"rt, ccs=UTF-8" );
+            if ( !fp )
+                return; // nothing built yet
+
+            WCHAR awcLine[ 2 * MAX_PATH + 100 ];
+
+            if ( !fgetws( awcLine, _countof( awcLine ), fp ) || wcsncmp( awcLine, Signature(), wcslen( Signature() ) ) )
+            {
+                tracer.Trace( "manifest %ws is invalid and will be rebuilt\n", awcPath );
+                fclose( fp );
+                return;
+            }
+
+            while ( fgetws( awcLine, _countof( awcLine ), fp ) )
+            {
+                ManifestEntry entry;
+                int consumed = 0;
+
+                if ( 3 != swscanf_s( awcLine, L"%llx %llu %llu %n", &entry.digest, &entry.outputSize, &entry.outputWrite, &consumed ) || 0 == consumed )
+                    continue;
+
+                WCHAR * pwcOutput = awcLine + consumed;
+                size_t len = wcslen( pwcOutput );
+                while ( len > 0 && ( L'\n' == pwcOutput[ len - 1 ] || L'\r' == pwcOutput[ len - 1 ] ) )
+                    pwcOutput[ --len ] = 0;
+
+                WCHAR * pwcTab = wcschr( pwcOutput, L'\t' ); // tabs can't appear in paths
+                if ( pwcTab )
+                {
+                    *pwcTab = 0;
+                    entry.owner = pwcTab + 1;
+                }
+
+                if ( 0 != pwcOutput[ 0 ] )
+                {
+                    entries[ pwcOutput ] = entry;
+                    if ( !entry.owner.empty() )
+                        companions.emplace( entry.owner, pwcOutput );
+                }
+            }
+
+            fclose( fp );
+            tracer.Trace( "manifest %ws has %zd outputs\n", awcPath, entries.size() );
+        }
+
+        size_t Skipped() { return skipped; }
+        size_t Built() { return built; }
+
+        // Digest of one input's full path, size, and last-write time. Returns false if it can't be found.
+
+        static bool InputDigest( WCHAR const * pwcInput, unsigned long long & digest )
+        {
+            WCHAR awcFull[ MAX_PATH ];
+            unsigned long long size, lastWrite;
+
+            if ( 0 == _wfullpath( awcFull, pwcInput, _countof( awcFull ) ) || !SizeAndWrite( awcFull, size, lastWrite ) )
+                return false;
+
+            CDigest d;
+            d.Add( CMetadataCache::HashPath( awcFull ) );
+            d.Add( size );
+            d.Add( lastWrite );
+            digest = d.Get();
+            return true;
+        } //InputDigest
+
+        // Digest of the options and the inputs in order, since collage layout depends on input order
+
+        unsigned long long JobDigest( vector<unsigned long long> const & inputDigests )
+        {
+            CDigest d;
+            d.Add( optionsDigest );
+            d.Add( inputDigests.size() );
+            d.Add( inputDigests.data(), inputDigests.size() * sizeof( unsigned long long ) );
+            return d.Get();
+        } //JobDigest
+
+        // True if the output and its companions exist, are unchanged since they were recorded, and were made from the same job digest
+
+        bool IsCurrent( WCHAR const * pwcOutput, unsigned long long digest )
+        {
+            wstring key;
+            unsigned long long size, lastWrite;
+
+            if ( !OutputKey( pwcOutput, key ) || !SizeAndWrite( key.c_str(), size, lastWrite ) )
+                return false;
+
+            lock_guard<mutex> lock( mtx );
+            auto it = entries.find( key );
+
+            if ( it == entries.end() || it->second.digest != digest || it->second.outputSize != size || it->second.outputWrite != lastWrite )
+                return false;
+
+            auto range = companions.equal_range( key );
+            for ( auto c = range.first; c != range.second; c++ )
+            {
+                auto ce = entries.find( c->second );
+                if ( ce == entries.end() || !SizeAndWrite( c->second.c_str(), size, lastWrite ) ||
+                     ce->second.outputSize != size || ce->second.outputWrite != lastWrite )
+                    return false;
+            }
+
+            skipped++;
+            return true;
+        } //IsCurrent
+
+        // Call after the output and any other files the job wrote are written successfully
+
+        void Record( WCHAR const * pwcOutput, unsigned long long digest, vector<wstring> const & companionOutputs = vector<wstring>() )
+        {
+            wstring key;
+            ManifestEntry entry = { digest, 0, 0 };
+
+            if ( !OutputKey( pwcOutput, key ) || !SizeAndWrite( key.c_str(), entry.outputSize, entry.outputWrite ) )
+                return;
+
+            vector<pair<wstring, ManifestEntry>> companionEntries;
+
+            for ( size_t i = 0; i < companionOutputs.size(); i++ )
+            {
+                wstring companionKey;
+                ManifestEntry companion = { digest, 0, 0, key };
+
+                // If a companion can't be found the job can't be checked, so leave it out of the manifest
+
+                if ( !OutputKey( companionOutputs[ i ].c_str(), companionKey ) ||
+                     !SizeAndWrite( companionKey.c_str(), companion.outputSize, companion.outputWrite ) )
+                    return;
+
+                companionEntries.emplace_back( companionKey, companion );
+            }
+
+            lock_guard<mutex> lock( mtx );
+
+            auto range = companions.equal_range( key );
+            for ( auto c = range.first; c != range.second; c++ )
+                entries.erase( c->second );
+            companions.erase( key );
+
+            entries[ key ] = entry;
+
+            for ( size_t i = 0; i < companionEntries.size(); i++ )
+            {
+                entries[ companionEntries[ i ].first ] = companionEntries[ i ].second;
+                companions.emplace( key, companionEntries[ i ].first );
+            }
+
+            dirty = true;
+            built++;
+        } //Record
+
+        HRESULT Save()
+        {
+            if ( !dirty )
+                return S_OK;
+
+            wstring temp( awcPath );
+            temp += L".tmp";
+            WCHAR const * pwcTemp = temp.c_str();
+
+            FILE * fp = _wfopen( pwcTemp, L"wt, ccs=UTF-8" );
+            if ( !fp )
+            {
+                printf( "can't create manifest file %ws\n", pwcTemp );
+                return E_FAIL;
+            }
+
+            bool ok = ( fwprintf( fp, L"%ws\n", Signature() ) > 0 );
+
+            for ( auto it = entries.begin(); ok && it != entries.end(); it++ )
+            {
+                if ( it->second.owner.empty() )
+                    ok = ( fwprintf( fp, L"%016llx %llu %llu %ws\n", it->second.digest, it->second.outputSize,
+                                     it->second.outputWrite, it->first.c_str() ) > 0 );
+                else
+                    ok = ( fwprintf( fp, L"%016llx %llu %llu %ws\t%ws\n", it->second.digest, it->second.outputSize,
+                                     it->second.outputWrite, it->first.c_str(), it->second.owner.c_str() ) > 0 );
+            }
+
+            ok = ( 0 == fclose( fp ) ) && ok;
+
+            if ( !ok || !MoveFileEx( pwcTemp, awcPath, MOVEFILE_REPLACE_EXISTING ) )
+            {
+                printf( "can't write manifest file %ws\n", awcPath );
+                DeleteFile( pwcTemp );
+                return E_FAIL;
+            }
+
+            tracer.Trace( "manifest %ws written with %zd outputs\n", awcPath, entries.size() );
+            dirty = false;
+            return S_OK;
+        } //Save
+};
@@ -0,0 +1,270 @@
+#pragma once
+
+//
+// Persistent cache of per-image metadata that's expensive to compute: dimensions, dominant colors, and
+// orientation. Records are keyed by a hash of the full path and are only used if the file's size and
+// last-write time still match. The file is a header followed by fixed-size records sorted by key.
+// It's memory-mapped read-only, so lookups are a lock-free binary search. Records added during a run are
+// kept in memory and merged into a new file by Save().
+//
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+
+using namespace std;
+
+enum MetadataFlags { mdDimensions = 1, mdColors = 2, mdOrientation = 8 };
+
+struct ImageMetadata
+{
+    unsigned long long pathHash;       // 0 if the file couldn't be found, in which case it can't be cached
+    unsigned long long fileSize;
+    unsigned long long lastWrite;      // FILETIME
+    UINT flags;                        // MetadataFlags for the fields below that are valid
+    UINT width;
+    UINT height;
+    UINT primaryHSV;                   // h << 16 | s << 8 | v of the most common color
+    DWORD colors[ 4 ];                 // dominant colors, most common first
+    UINT orientation;                  // exif orientation 1..8
+    UINT reserved;
+};
+
+static_assert( 64 == sizeof( ImageMetadata ), "ImageMetadata is persisted, so its size can't change" );
+
+class CMetadataCache
+{
+    private:
+        struct CacheHeader
+        {
+            char signature[ 8 ];
+            UINT recordSize;
+            UINT reserved;
+            unsigned long long count;
+        };
+
+        WCHAR awcPath[ MAX_PATH ];
+        HANDLE hFile;
+        HANDLE hMapping;
+        void * pView;
+        ImageMetadata const * records;
+        size_t recordCount;
+
+        mutex mtx;
+        unordered_map<unsigned long long, ImageMetadata> added;
+
+        atomic<size_t> addedCount;             // added.size(), so lookups can skip the lock until something is added
+        atomic<size_t> hits;
+        atomic<size_t> misses;
+
+        static const char * Signature() { return "ICCACHE2"; }
+
+        static bool KeyCompare( ImageMetadata const & a, ImageMetadata const & b )
+        {
+            return a.pathHash < b.pathHash;
+        } //KeyCompare
+
+        void Close()
+        {
+            if ( pView )
+                UnmapViewOfFile( pView );
+            if ( hMapping )
+                CloseHandle( hMapping );
+            if ( INVALID_HANDLE_VALUE != hFile )
+                CloseHandle( hFile );
+
+            pView = 0;
+            hMapping = 0;
+            hFile = INVALID_HANDLE_VALUE;
+            records = 0;
+            recordCount = 0;
+        } //Close
+
+    public:
+        static unsigned long long HashPath( WCHAR const * pwcPath )
+        {
+            // FNV-1a, case-insensitive since Windows paths are
+
+            unsigned long long hash = 14695981039346656037ull;
+
+            for ( WCHAR const * p = pwcPath; *p; p++ )
+            {
+                hash ^= (unsigned long long) towlower( *p );
+                hash *= 1099511628211ull;
+            }
+
+            return ( 0 == hash ) ? 1 : hash;
+        } //HashPath
+
+        CMetadataCache( WCHAR const * pwcPath ) : hFile( INVALID_HANDLE_VALUE ), hMapping( 0 ), pView( 0 ), records( 0 ),
+                                                  recordCount( 0 ), addedCount( 0 ), hits( 0 ), misses( 0 )
+        {
+            wcscpy_s( awcPath, _countof( awcPath ), pwcPath );
+
+            hFile = CreateFile( awcPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, 0, OPEN_EXISTING, 0, 0 );
+            if ( INVALID_HANDLE_VALUE == hFile )
+                return; // no cache yet
+
+            LARGE_INTEGER size;
+            if ( !GetFileSizeEx( hFile, &size ) || (unsigned long long) size.QuadPart < sizeof( CacheHeader ) )
+            {
+                Close();
+                return;
+            }
+
+            hMapping = CreateFileMapping( hFile, 0, PAGE_READONLY, 0, 0, 0 );
+            if ( hMapping )
+                pView = MapViewOfFile( hMapping, FILE_MAP_READ, 0, 0, 0 );
+
+            if ( !pView )
+            {
+                Close();
+                return;
+            }
+
+            CacheHeader const * pHeader = (CacheHeader const *) pView;
+
+            if ( memcmp( pHeader->signature, Signature(), sizeof pHeader->signature ) ||
+                 sizeof( ImageMetadata ) != pHeader->recordSize ||
+                 ( sizeof( CacheHeader ) + pHeader->count * sizeof( ImageMetadata ) ) > (unsigned long long) size.QuadPart )
+            {
+                tracer.Trace( "metadata cache %ws is invalid and will be rebuilt\n", awcPath );
+                Close();
+                return;
+            }
+
+            records = (ImageMetadata const *) ( pHeader + 1 );
+            recordCount = (size_t) pHeader->count;
+            tracer.Trace( "metadata cache %ws has %zd records\n", awcPath, recordCount );
+        }
+
+        ~CMetadataCache()
+        {
+            Close();
+        }
+
+        size_t Hits() { return hits; }
+        size_t Misses() { return misses; }
+
+        // Returns true if metadata for the file is cached. Either way, md is ready to be updated and passed to Store().
+        // md.flags says which fields were found. The mapped records are searched without a lock; the records
+        // added in this run are checked under the lock, and only once there are some.
+
+        bool Lookup( WCHAR const * pwcPath, ImageMetadata & md )
+        {
+            memset( &md, 0, sizeof md );
+
+            WIN32_FILE_ATTRIBUTE_DATA fad;
+            if ( !GetFileAttributesEx( pwcPath, GetFileExInfoStandard, &fad ) )
+                return false;
+
+            WCHAR awcFull[ MAX_PATH ];
+            if ( 0 == _wfullpath( awcFull, pwcPath, _countof( awcFull ) ) )
+                return false;
+
+            md.pathHash = HashPath( awcFull );
+            md.fileSize = ( (unsigned long long) fad.nFileSizeHigh << 32 ) | fad.nFileSizeLow;
+            md.lastWrite = ( (unsigned long long) fad.ftLastWriteTime.dwHighDateTime << 32 ) | fad.ftLastWriteTime.dwLowDateTime;
+
+            ImageMetadata const * pFound = 0;
+            ImageMetadata const * pEnd = records + recordCount;
+            ImageMetadata const * p = lower_bound( records, pEnd, md, KeyCompare );
+
+            if ( p != pEnd && p->pathHash == md.pathHash )
+                pFound = p;
+
+            ImageMetadata fromAdded;
+
+            if ( 0 != addedCount.load( memory_order_acquire ) )
+            {
+                // Records added in this run may be more complete than the mapped one
+
+                lock_guard<mutex> lock( mtx );
+                auto it = added.find( md.pathHash );
+                if ( it != added.end() )
+                {
+                    fromAdded = it->second;
+                    pFound = &fromAdded;
+                }
+            }
+
+            if ( 0 == pFound || pFound->fileSize != md.fileSize || pFound->lastWrite != md.lastWrite )
+            {
+                misses++;
+                return false;
+            }
+
+            md = *pFound;
+            hits++;
+            return true;
+        } //Lookup
+
+        void Store( ImageMetadata const & md )
+        {
+            if ( 0 == md.pathHash )
+                return;
+
+            lock_guard<mutex> lock( mtx );
+            added[ md.pathHash ] = md;
+            addedCount.store( added.size(), memory_order_release );
+        } //Store
+
+        // Write the existing and added records to a new file that replaces the old one
+
+        HRESULT Save()
+        {
+            if ( 0 == added.size() )
+                return S_OK;
+
+            vector<ImageMetadata> all;
+            all.reserve( recordCount + added.size() );
+
+            for ( auto it = added.begin(); it != added.end(); it++ )
+                all.push_back( it->second );
+
+            sort( all.begin(), all.end(), KeyCompare );
+
+            for ( size_t i = 0; i < recordCount; i++ )
+                if ( !binary_search( all.begin(), all.begin() + added.size(), records[ i ], KeyCompare ) )
+                    all.push_back( records[ i ] );
+
+            sort( all.begin(), all.end(), KeyCompare );
+
+            wstring temp( awcPath );
+            temp += L".tmp";
+            WCHAR const * pwcTemp = temp.c_str();
+
+            FILE * fp = _wfopen( pwcTemp, L"wb" );
+            if ( !fp )
+            {
+                printf( "can't create metadata cache file %ws\n", pwcTemp );
+                return E_FAIL;
+            }
+
+            CacheHeader header = {};
+            memcpy( header.signature, Signature(), sizeof header.signature );
+            header.recordSize = sizeof( ImageMetadata );
+            header.count = all.size();
+
+            bool ok = ( 1 == fwrite( &header, sizeof header, 1, fp ) ) &&
+                      ( all.size() == fwrite( all.data(), sizeof( ImageMetadata ), all.size(), fp ) );
+            ok = ( 0 == fclose( fp ) ) && ok;
+
+            Close();
+
+            if ( !ok || !MoveFileEx( pwcTemp, awcPath, MOVEFILE_REPLACE_EXISTING ) )
+            {
+                printf( "can't write metadata cache file %ws\n", awcPath );
+                DeleteFile( pwcTemp );
+                return E_FAIL;
+            }
+
+            tracer.Trace( "metadata cache %ws written with %zd records\n", awcPath, all.size() );
+            added.clear();
+            addedCount = 0;
+            return S_OK;
+        } //Save
+};
@@ -0,0 +1,621 @@
+#pragma once
+
+//
+// Columnar index of the metadata used to select and sort photos: capture time, camera, lens, 35mm-equivalent
+// focal length, GPS location, and rating. It's built once by parsing every file in parallel, then memory-mapped
+// read-only, so a query over a large library scans a few tightly packed arrays rather than opening files.
+// Layout: header, then one array per column each padded to 8 bytes, then the path pool (null-terminated WCHAR),
+// the string dictionary offsets, and the string pool (null-terminated UTF-8). Rows are sorted by path.
+// Camera and lens columns hold dictionary ids; 0 is the empty string, meaning unknown.
+//
+// Queries are comma-separated terms, all of which must match, e.g. "date=2023,fl<35,sort=time":
+//     date=2023  date>=2023-06  date<2023-06-15   capture date; = matches the year, month, or day given
+//     fl<35  fl>=200                               35mm-equivalent focal length
+//     rating>=4                                    xmp rating
+//     camera=z 7  lens!=50mm                       case-insensitive substring match; != excludes matches
+//     gps=yes  gps=no                              whether the photo has a location
+//     sort=time  sort=-fl                          time, fl, rating, camera, lens, or path. - is descending
+//
+
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+
+#include <djl_pa.hxx>
+
+using namespace std;
+
+class CMetadataIndex
+{
+    private:
+        struct IndexHeader
+        {
+            char signature[ 8 ];
+            UINT count;            // rows
+            UINT stringCount;      // dictionary entries, including the empty string at 0
+            unsigned long long cwcPaths;
+            unsigned long long cbStrings;
+        };
+
+        static const char * Signature() { return "ICINDEX1"; }
+        static float NoCoordinate() { return 1000.0f; }
+
+        static size_t Padded( size_t cb ) { return ( cb + 7 ) & ~(size_t) 7; }
+
+        HANDLE hFile;
+        HANDLE hMapping;
+        void * pView;
+        UINT count;
+        UINT stringCount;
+
+        unsigned long long const * captureTimes;  // FILETIME, 0 if unknown
+        float const * focalLengths;               // 0 if unknown
+        float const * latitudes;                  // NoCoordinate if unknown
+        float const * longitudes;
+        signed char const * ratings;              // -1 if unknown
+        UINT const * cameras;
+        UINT const * lenses;
+        UINT const * pathOffsets;                 // in WCHARs
+        WCHAR const * paths;
+        UINT const * stringOffsets;
+        char const * strings;
+
+        enum QueryOp { opEQ, opNE, opLT, opLE, opGT, opGE };
+
+        static size_t ColumnBytes( size_t count, size_t stringCount, size_t cwcPaths, size_t cbStrings )
+        {
+            return Padded( count * sizeof( unsigned long long ) ) + 3 * Padded( count * sizeof( float ) ) + Padded( count ) +
+                   3 * Padded( count * sizeof( UINT ) ) + Padded( cwcPaths * sizeof( WCHAR ) ) + Padded( stringCount * sizeof( UINT ) ) +
+                   cbStrings;
+        } //ColumnBytes
+
+        static bool ParseOp( WCHAR const * & pwc, QueryOp & op )
+        {
+            if ( L'<' == pwc[ 0 ] && L'=' == pwc[ 1 ] )      { op = opLE; pwc += 2; }
+            else if ( L'>' == pwc[ 0 ] && L'=' == pwc[ 1 ] ) { op = opGE; pwc += 2; }
+            else if ( L'!' == pwc[ 0 ] && L'=' == pwc[ 1 ] ) { op = opNE; pwc += 2; }
+            else if ( L'<' == pwc[ 0 ] )                     { op = opLT; pwc++; }
+            else if ( L'>' == pwc[ 0 ] )                     { op = opGT; pwc++; }
+            else if ( L'=' == pwc[ 0 ] )                     { op = opEQ; pwc++; }
+            else
+                return false;
+
+            return true;
+        } //ParseOp
+
+        template <class T> static bool Compare( T a, QueryOp op, T b )
+        {
+            switch ( op )
+            {
+                case opEQ: return a == b;
+                case opNE: return a != b;
+                case opLT: return a < b;
+                case opLE: return a <= b;
+                case opGT: return a > b;
+                default:   return a >= b;
+            }
+        } //Compare
+
+        static unsigned long long ToFileTime( int year, int month, int day )
+        {
+            SYSTEMTIME st = {};
+            st.wYear = (WORD) year;
+            st.wMonth = (WORD) month;
+            st.wDay = (WORD) day;
+
+            FILETIME ft = {};
+            SystemTimeToFileTime( &st, &ft );
+            return ( (unsigned long long) ft.dwHighDateTime << 32 ) | ft.dwLowDateTime;
+        } //ToFileTime
+
+        // A date of yyyy, yyyy-mm, or yyyy-mm-dd becomes the range [start, end) it covers
+
+        static bool ParseDate( WCHAR const * pwc, unsigned long long & start, unsigned long long & end )
+        {
+            int year = 0, month = 0, day = 0;
+            int fields = swscanf_s( pwc, L"%d%*1[-:/]%d%*1[-:/]%d", &year, &month, &day );
+
+            if ( fields < 1 || year < 1601 || year > 9999 || ( fields >= 2 && ( month < 1 || month > 12 ) ) || ( 3 == fields && ( day < 1 || day > 31 ) ) )
+                return false;
+
+            if ( 1 == fields )
+            {
+                start = ToFileTime( year, 1, 1 );
+                end = ToFileTime( year + 1, 1, 1 );
+            }
+            else if ( 2 == fields )
+            {
+                start = ToFileTime( year, month, 1 );
+                end = ( 12 == month ) ? ToFileTime( year + 1, 1, 1 ) : ToFileTime( year, month + 1, 1 );
+            }
+            else
+            {
+                start = ToFileTime( year, month, day );
+                end = start + 24ull * 60 * 60 * 10000000;
+            }
+
+            return ( 0 != start );
+        } //ParseDate
+
+        // Exif strings are usually UTF-8 or plain ASCII, but older cameras may use the ANSI code page
+
+        static void WideLower( char const * psz, wstring & ws )
+        {
+            UINT codePage = CP_UTF8;
+            int cwc = MultiByteToWideChar( codePage, MB_ERR_INVALID_CHARS, psz, -1, 0, 0 );
+            if ( 0 == cwc )
+            {
+                codePage = CP_ACP;
+                cwc = MultiByteToWideChar( codePage, 0, psz, -1, 0, 0 );
+            }
+
+            ws.resize( __max( cwc, 1 ) );
+            if ( 0 == cwc || 0 == MultiByteToWideChar( codePage, 0, psz, -1, &ws[ 0 ], cwc ) )
+                ws[ 0 ] = 0;
+
+            ws.resize( wcslen( ws.c_str() ) );
+            for ( size_t c = 0; c < ws.length(); c++ )
+                ws[ c ] = towlower( ws[ c ] );
+        } //WideLower
+
+        // Dictionary ids whose strings contain the substring, ignoring case
+
+        void MatchStrings( WCHAR const * pwcValue, vector<bool> & matches )
+        {
+            wstring value( pwcValue );
+            for ( size_t c = 0; c < value.length(); c++ )
+                value[ c ] = towlower( value[ c ] );
+
+            matches.assign( stringCount, false );
+            wstring s;
+
+            for ( UINT i = 1; i < stringCount; i++ )
+            {
+                WideLower( strings + stringOffsets[ i ], s );
+                matches[ i ] = ( wstring::npos != s.find( value ) );
+            }
+        } //MatchStrings
+
+        template <class Keep> static void Filter( vector<UINT> & rows, Keep keep )
+        {
+            size_t kept = 0;
+
+            for ( size_t i = 0; i < rows.size(); i++ )
+                if ( keep( rows[ i ] ) )
+                    rows[ kept++ ] = rows[ i ];
+
+            rows.resize( kept );
+        } //Filter
+
+        bool ApplyTerm( wstring const & term, vector<UINT> & rows )
+        {
+            size_t nameLen = 0;
+            while ( nameLen < term.length() && iswalpha( term[ nameLen ] ) )
+                nameLen++;
+
+            wstring name = term.substr( 0, nameLen );
+            WCHAR const * pwc = term.c_str() + nameLen;
+            QueryOp op;
+
+            if ( 0 == nameLen || !ParseOp( pwc, op ) )
+                return false;
+
+            if ( !_wcsicmp( name.c_str(), L"date" ) )
+            {
+                unsigned long long start, end;
+                if ( !ParseDate( pwc, start, end ) )
+                    return false;
+
+                unsigned long long const * times = captureTimes;
+
+                if ( opEQ == op )
+                    Filter( rows, [&] ( UINT r ) { return times[ r ] >= start && times[ r ] < end; } );
+                else if ( opNE == op )
+                    Filter( rows, [&] ( UINT r ) { return 0 != times[ r ] && ( times[ r ] < start || times[ r ] >= end ); } );
+                else
+                {
+                    unsigned long long bound = ( opLT == op || opGE == op ) ? start : end;
+                    QueryOp boundOp = ( opLE == op ) ? opLT : ( opGT == op ) ? opGE : op;
+                    Filter( rows, [&] ( UINT r ) { return 0 != times[ r ] && Compare( times[ r ], boundOp, bound ); } );
+                }
+            }
+            else if ( !_wcsicmp( name.c_str(), L"fl" ) || !_wcsicmp( name.c_str(), L"rating" ) )
+            {
+                WCHAR * pwcEnd = 0;
+                double value = wcstod( pwc, &pwcEnd );
+                if ( pwcEnd == pwc || 0 != *pwcEnd )
+                    return false;
+
+                if ( !_wcsicmp( name.c_str(), L"fl" ) )
+                {
+                    float const * fl = focalLengths;
+                    Filter( rows, [&] ( UINT r ) { return 0.0f != fl[ r ] && Compare( (double) fl[ r ], op, value ); } );
+                }
+                else
+                {
+                    signed char const * rt = ratings;
+                    Filter( rows, [&] ( UINT r ) { return rt[ r ] >= 0 && Compare( (double) rt[ r ], op, value ); } );
+                }
+            }
+            else if ( !_wcsicmp( name.c_str(), L"camera" ) || !_wcsicmp( name.c_str(), L"lens" ) )
+            {
+                if ( opEQ != op && opNE != op )
+                    return false;
+
+                vector<bool> matches;
+                MatchStrings( pwc, matches );
+                UINT const * ids = !_wcsicmp( name.c_str(), L"camera" ) ? cameras : lenses;
+                bool want = ( opEQ == op );
+
+                Filter( rows, [&] ( UINT r ) { return want == matches[ ids[ r ] ]; } );
+            }
+            else if ( !_wcsicmp( name.c_str(), L"gps" ) )
+            {
+                bool yes = !_wcsicmp( pwc, L"yes" );
+                if ( ( !yes && _wcsicmp( pwc, L"no" ) ) || ( opEQ != op && opNE != op ) )
+                    return false;
+
+                bool want = ( yes == ( opEQ == op ) );
+                float const * lat = latitudes;
+                Filter( rows, [&] ( UINT r ) { return want == ( NoCoordinate() != lat[ r ] ); } );
+            }
+            else
+                return false;
+
+            return true;
+        } //ApplyTerm
+
+        template <class Less> static void SortRows( vector<UINT> & rows, bool descending, Less less )
+        {
+            // rows are in path order, and stable_sort keeps that order for ties
+
+            if ( descending )
+                stable_sort( rows.begin(), rows.end(), [&] ( UINT a, UINT b ) { return less( b, a ); } );
+            else
+                stable_sort( rows.begin(), rows.end(), less );
+        } //SortRows
+
+        bool ApplySort( WCHAR const * pwcKey, vector<UINT> & rows )
+        {
+            bool descending = ( L'-' == *pwcKey );
+            if ( descending )
+                pwcKey++;
+
+            if ( !_wcsicmp( pwcKey, L"time" ) )
+                SortRows( rows, descending, [&] ( UINT a, UINT b ) { return captureTimes[ a ] < captureTimes[ b ]; } );
+            else if ( !_wcsicmp( pwcKey, L"fl" ) )
+                SortRows( rows, descending, [&] ( UINT a, UINT b ) { return focalLengths[ a ] < focalLengths[ b ]; } );
+            else if ( !_wcsicmp( pwcKey, L"rating" ) )
+                SortRows( rows, descending, [&] ( UINT a, UINT b ) { return ratings[ a ] < ratings[ b ]; } );
+            else if ( !_wcsicmp( pwcKey, L"camera" ) || !_wcsicmp( pwcKey, L"lens" ) )
+            {
+                UINT const * ids = !_wcsicmp( pwcKey, L"camera" ) ? cameras : lenses;
+                SortRows( rows, descending, [&] ( UINT a, UINT b )
+                    { return strcmp( strings + stringOffsets[ ids[ a ] ], strings + stringOffsets[ ids[ b ] ] ) < 0; } );
+            }
+            else if ( !_wcsicmp( pwcKey, L"path" ) )
+            {
+                if ( descending )
+                    reverse( rows.begin(), rows.end() );
+            }
+            else
+                return false;
+
+            return true;
+        } //ApplySort
+
+        void Close()
+        {
+            if ( pView )
+                UnmapViewOfFile( pView );
+            if ( hMapping )
+                CloseHandle( hMapping );
+            if ( INVALID_HANDLE_VALUE != hFile )
+                CloseHandle( hFile );
+
+            hFile = INVALID_HANDLE_VALUE;
+            hMapping = 0;
+            pView = 0;
+            count = 0;
+        } //Close
+
+    public:
+        CMetadataIndex() : hFile( INVALID_HANDLE_VALUE ), hMapping( 0 ), pView( 0 ), count( 0 ), stringCount( 0 ) {}
+        ~CMetadataIndex() { Close(); }
+
+        static bool IsIndexFile( WCHAR const * pwcPath )
+        {
+            return !_wcsicmp( PathFindExtension( pwcPath ), L".icindex" );
+        } //IsIndexFile
+
+        // An input of the form library.icindex?query selects photos from an index. Returns a pointer to the ? or
+        // the terminating null if pwcInput names an index, and 0 otherwise.
+
+        static WCHAR const * FindQuery( WCHAR const * pwcInput )
+        {
+            WCHAR const * pwcQuery = wcschr( pwcInput, L'?' );
+            size_t len = pwcQuery ? pwcQuery - pwcInput : wcslen( pwcInput );
+            size_t extLen = wcslen( L".icindex" );
+
+            if ( len < extLen || _wcsnicmp( pwcInput + len - extLen, L".icindex", extLen ) )
+                return 0;
+
+            return pwcInput + len;
+        } //FindQuery
+
+        // Parse every path in parallel and write the index, replacing any that exists
+
+        static HRESULT Build( CPathArray & pathArray, WCHAR const * pwcIndex )
+        {
+            size_t count = pathArray.Count();
+            if ( count >= UINT_MAX )
+                return E_INVALIDARG;
+
+            vector<ImageDataResult> results( count );
+            DWORD const fields = idfCaptureTime | idfCamera | idfLens | idfFocalLength | idfGPS | idfRating;
+
+            pathArray.ParseAll( fields, [&] ( size_t i, ImageDataResult const & idr ) { results[ i ] = idr; } );
+
+            vector<UINT> order( count );
+            for ( UINT i = 0; i < count; i++ )
+                order[ i ] = i;
+
+            sort( order.begin(), order.end(), [&] ( UINT a, UINT b ) { return wcscmp( pathArray[ a ].pwcPath, pathArray[ b ].pwcPath ) < 0; } );
+
+            vector<unsigned long long> captureTimes( count );
+            vector<float> focalLengths( count ), latitudes( count ), longitudes( count );
+            vector<signed char> ratings( count );
+            vector<UINT> cameras( count ), lenses( count ), pathOffsets( count );
+            vector<WCHAR> paths;
+            vector<char> strings( 1, 0 );
+            vector<UINT> stringOffsets( 1, 0 );
+            map<string, UINT> dictionary;
+            dictionary[ "" ] = 0;
+
+            auto intern = [&] ( string const & s ) -> UINT
+            {
+                auto it = dictionary.find( s );
+                if ( it != dictionary.end() )
+                    return it->second;
+
+                UINT id = (UINT) stringOffsets.size();
+                stringOffsets.push_back( (UINT) strings.size() );
+                strings.insert( strings.end(), s.c_str(), s.c_str() + s.length() + 1 );
+                dictionary[ s ] = id;
+                return id;
+            };
+
+            for ( size_t row = 0; row < count; row++ )
+            {
+                UINT i = order[ row ];
+                ImageDataResult & r = results[ i ];
+                WCHAR const * pwcPath = pathArray[ i ].pwcPath;
+
+                pathOffsets[ row ] = (UINT) paths.size();
+                paths.insert( paths.end(), pwcPath, pwcPath + wcslen( pwcPath ) + 1 );
+
+                if ( r.fields & idfCaptureTime )
+                {
+                    // 2005:02:17 21:21:31
+
+                    SYSTEMTIME st = {0};
+                    st.wYear = (WORD) atoi( r.acCaptureTime );
+                    st.wMonth = (WORD) atoi( r.acCaptureTime + 5 );
+                    st.wDay = (WORD) atoi( r.acCaptureTime + 8 );
+                    st.wHour = (WORD) atoi( r.acCaptureTime + 11 );
+                    st.wMinute = (WORD) atoi( r.acCaptureTime + 14 );
+                    st.wSecond = (WORD) atoi( r.acCaptureTime + 17 );
+
+                    FILETIME ft;
+                    if ( SystemTimeToFileTime( &st, &ft ) )
+                        captureTimes[ row ] = ( (unsigned long long) ft.dwHighDateTime << 32 ) | ft.dwLowDateTime;
+                }
+
+                focalLengths[ row ] = ( r.fields & idfFocalLength ) ? (float) r.focalLength : 0.0f;
+                latitudes[ row ] = ( r.fields & idfGPS ) ? (float) r.latitude : NoCoordinate();
+                longitudes[ row ] = ( r.fields & idfGPS ) ? (float) r.longitude : NoCoordinate();
+                ratings[ row ] = ( r.fields & idfRating ) ? r.rating : -1;
+
+                if ( r.fields & idfCamera )
+                {
+                    string camera = r.acModel;
+                    size_t makeLen = strlen( r.acMake );
+
+                    // Models usually include the make already, e.g. Canon EOS R5, but not always, e.g. Z 7
+
+                    if ( 0 != makeLen && _strnicmp( r.acModel, r.acMake, __min( makeLen, strcspn( r.acMake, " " ) ) ) )
+                        camera = string( r.acMake ) + ( camera.length() ? " " : "" ) + camera;
+
+                    cameras[ row ] = intern( camera );
+                }
+
+                lenses[ row ] = ( r.fields & idfLens ) ? intern( r.acLens ) : 0;
+            }
+
+            if ( paths.size() >= UINT_MAX || strings.size() >= UINT_MAX )
+                return E_INVALIDARG;
+
+            IndexHeader header = {};
+            memcpy( header.signature, Signature(), sizeof header.signature );
+            header.count = (UINT) count;
+            header.stringCount = (UINT) stringOffsets.size();
+            header.cwcPaths = paths.size();
+            header.cbStrings = strings.size();
+
+            wstring temp( pwcIndex );
+            temp += L".tmp";
+            WCHAR const * pwcTemp = temp.c_str();
+
+            FILE * fp = _wfopen( pwcTemp, L"wb" );
+            if ( !fp )
+            {
+                printf( "can't create index file %ws\n", pwcTemp );
+                return E_FAIL;
+            }
+
+            static const BYTE zeros[ 8 ] = {};
+
+            auto column = [&] ( void const * pv, size_t cb ) -> bool
+            {
+                return ( cb == fwrite( pv, 1, cb, fp ) ) && ( Padded( cb ) - cb == fwrite( zeros, 1, Padded( cb ) - cb, fp ) );
+            };
+
+            bool ok = ( 1 == fwrite( &header, sizeof header, 1, fp ) ) &&
+                      column( captureTimes.data(), count * sizeof( unsigned long long ) ) &&
+                      column( focalLengths.data(), count * sizeof( float ) ) &&
+                      column( latitudes.data(), count * sizeof( float ) ) &&
+                      column( longitudes.data(), count * sizeof( float ) ) &&
+                      column( ratings.data(), count ) &&
+                      column( cameras.data(), count * sizeof( UINT ) ) &&
+                      column( lenses.data(), count * sizeof( UINT ) ) &&
+                      column( pathOffsets.data(), count * sizeof( UINT ) ) &&
+                      column( paths.data(), paths.size() * sizeof( WCHAR ) ) &&
+                      column( stringOffsets.data(), stringOffsets.size() * sizeof( UINT ) ) &&
+                      ( strings.size() == fwrite( strings.data(), 1, strings.size(), fp ) );
+            ok = ( 0 == fclose( fp ) ) && ok;
+
+            if ( !ok || !MoveFileEx( pwcTemp, pwcIndex, MOVEFILE_REPLACE_EXISTING ) )
+            {
+                printf( "can't write index file %ws\n", pwcIndex );
+                DeleteFile( pwcTemp );
+                return E_FAIL;
+            }
+
+            tracer.Trace( "index %ws written with %zd rows and %zd strings\n", pwcIndex, count, stringOffsets.size() );
+            return S_OK;
+        } //Build
+
+        HRESULT Open( WCHAR const * pwcIndex )
+        {
+            Close();
+
+            hFile = CreateFile( pwcIndex, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, 0, OPEN_EXISTING, 0, 0 );
+            if ( INVALID_HANDLE_VALUE == hFile )
+            {
+                printf( "can't open index file %ws\n", pwcIndex );
+                return E_FAIL;
+            }
+
+            LARGE_INTEGER size;
+            if ( GetFileSizeEx( hFile, &size ) && (unsigned long long) size.QuadPart >= sizeof( IndexHeader ) )
+            {
+                hMapping = CreateFileMapping( hFile, 0, PAGE_READONLY, 0, 0, 0 );
+                if ( hMapping )
+                    pView = MapViewOfFile( hMapping, FILE_MAP_READ, 0, 0, 0 );
+            }
+
+            IndexHeader const * pHeader = (IndexHeader const *) pView;
+
+            if ( !pView || memcmp( pHeader->signature, Signature(), sizeof pHeader->signature ) || 0 == pHeader->stringCount ||
+                 pHeader->cwcPaths >= UINT_MAX || pHeader->cbStrings >= UINT_MAX ||
+                 ( sizeof( IndexHeader ) + ColumnBytes( pHeader->count, pHeader->stringCount, (size_t) pHeader->cwcPaths, (size_t) pHeader->cbStrings ) ) >
+                 (unsigned long long) size.QuadPart )
+            {
+                printf( "index file %ws is invalid\n", pwcIndex );
+                Close();
+                return E_FAIL;
+            }
+
+            count = pHeader->count;
+            stringCount = pHeader->stringCount;
+
+            BYTE const * p = (BYTE const *) ( pHeader + 1 );
+            captureTimes = (unsigned long long const *) p;    p += Padded( count * sizeof( unsigned long long ) );
+            focalLengths = (float const *) p;                 p += Padded( count * sizeof( float ) );
+            latitudes = (float const *) p;                    p += Padded( count * sizeof( float ) );
+            longitudes = (float const *) p;                   p += Padded( count * sizeof( float ) );
+            ratings = (signed char const *) p;                p += Padded( count );
+            cameras = (UINT const *) p;                       p += Padded( count * sizeof( UINT ) );
+            lenses = (UINT const *) p;                        p += Padded( count * sizeof( UINT ) );
+            pathOffsets = (UINT const *) p;                   p += Padded( count * sizeof( UINT ) );
+            paths = (WCHAR const *) p;                        p += Padded( (size_t) pHeader->cwcPaths * sizeof( WCHAR ) );
+            stringOffsets = (UINT const *) p;                 p += Padded( stringCount * sizeof( UINT ) );
+            strings = (char const *) p;
+
+            // Offsets are checked once here so queries needn't
+
+            bool valid = ( 0 == count || ( 0 != pHeader->cwcPaths && 0 == paths[ pHeader->cwcPaths - 1 ] ) ) &&
+                         0 != pHeader->cbStrings && 0 == strings[ pHeader->cbStrings - 1 ];
+
+            for ( UINT i = 0; valid && i < count; i++ )
+                valid = ( pathOffsets[ i ] < pHeader->cwcPaths ) && ( cameras[ i ] < stringCount ) && ( lenses[ i ] < stringCount );
+
+            for ( UINT i = 0; valid && i < stringCount; i++ )
+                valid = ( stringOffsets[ i ] < pHeader->cbStrings );
+
+            if ( !valid )
+            {
+                printf( "index file %ws is invalid\n", pwcIndex );
+                Close();
+                return E_FAIL;
+            }
+
+            tracer.Trace( "index %ws has %u rows and %u strings\n", pwcIndex, count, stringCount );
+            return S_OK;
+        } //Open
+
+        UINT Count() { return count; }
+
+        // Add the paths of rows matching the query to pathArray in the query's sort order, along with their capture
+        // times so CPathArray::SortOnCapture needn't parse the files again. An empty query matches every row.
+
+        HRESULT Query( WCHAR const * pwcQuery, CPathArray & pathArray )
+        {
+            long long timeQuery = 0;
+            CTimed timedQuery( timeQuery );
+
+            vector<UINT> rows( count );
+            for ( UINT i = 0; i < count; i++ )
+                rows[ i ] = i;
+
+            wstring sortKey;
+            wstring query( pwcQuery );
+            size_t start = 0;
+
+            while ( start <= query.length() )
+            {
+                size_t comma = query.find( L',', start );
+                if ( wstring::npos == comma )
+                    comma = query.length();
+
+                wstring term = query.substr( start, comma - start );
+                start = comma + 1;
+
+                if ( 0 == term.length() )
+                    continue;
+
+                if ( 0 == _wcsnicmp( term.c_str(), L"sort=", 5 ) )
+                    sortKey = term.substr( 5 );
+                else if ( !ApplyTerm( term, rows ) )
+                {
+                    printf( "invalid index query term '%ws'\n", term.c_str() );
+                    return E_INVALIDARG;
+                }
+            }
+
+            if ( sortKey.length() && !ApplySort( sortKey.c_str(), rows ) )
+            {
+                printf( "invalid index sort key '%ws'\n", sortKey.c_str() );
+                return E_INVALIDARG;
+            }
+
+            bool allCaptured = ( 0 == pathArray.Count() );
+
+            for ( size_t i = 0; i < rows.size(); i++ )
+            {
+                FILETIME ft;
+                ft.dwLowDateTime = (DWORD) captureTimes[ rows[ i ] ];
+                ft.dwHighDateTime = (DWORD) ( captureTimes[ rows[ i ] ] >> 32 );
+                pathArray.AddCaptured( paths + pathOffsets[ rows[ i ] ], ft );
+            }
+
+            if ( allCaptured )
+                pathArray.CaptureTimesKnown();
+
+            timedQuery.Complete();
+            tracer.Trace( "index query '%ws' matched %zd of %u rows in %lld milliseconds\n", pwcQuery, rows.size(), count,
+                          timeQuery / CTimed::NanoPerMilli() );
+            return S_OK;
+        } //Query
+};
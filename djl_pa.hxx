@@ -7,9 +7,17 @@
 #include <djltrace.hxx>
 #include <djlimagedata.hxx>
 #include <djltimed.hxx>
+#include <djl_radix.hxx>
 
 #include <random>
-#include <ppl.h>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#ifdef _WIN32
+    #include <ppl.h>
+#endif
 
 using namespace concurrency;
 
@@ -25,54 +33,79 @@ class CPathArray
             ULONG ulAttribute;     // can be used to sort on anything, e.g. primary color
         };
 
+        // Paths found by one worker, e.g. the matches in one folder, for AddBatch() to add under one lock
+
+        struct PathBatch
+        {
+            vector<WCHAR> pool;        // null-terminated paths
+            vector<size_t> offsets;    // where each item's path starts in pool
+            vector<PathItem> items;    // pwcPath is set by AddBatch()
+
+            void Add( WCHAR const * pwc, size_t len, FILETIME const & creation, FILETIME const & lastWrite )
+            {
+                PathItem pi = {};
+                pi.ftCreation = creation;
+                pi.ftLastWrite = lastWrite;
+
+                offsets.push_back( pool.size() );
+                pool.insert( pool.end(), pwc, pwc + len + 1 );
+                items.push_back( pi );
+            } //Add
+
+            size_t Count() { return items.size(); }
+            void Clear() { pool.clear(); offsets.clear(); items.clear(); }
+        };
+
     private:
         vector<PathItem> elements;
         bool captureTimesLoaded;
         std::mutex mtx;
+        condition_variable cvAdded;
+        bool complete;             // false while a producer is streaming paths in. See BeginStream().
 
-        static int CompareFT( FILETIME & ftA, FILETIME & ftB )
-        {
-            ULARGE_INTEGER ulA, ulB;
-            ulA.LowPart = ftA.dwLowDateTime;
-            ulA.HighPart = ftA.dwHighDateTime;
-            ulB.LowPart = ftB.dwLowDateTime;
-            ulB.HighPart = ftB.dwHighDateTime;
+        // Paths live in a bump arena of large blocks, so adding one is a copy rather than a heap allocation.
+        // Blocks never move, so pwcPath pointers stay valid until Clear() even as elements grows.
+
+        static const size_t ArenaBlock = 64 * 1024;    // in WCHARs
+        vector<unique_ptr<WCHAR[]>> arena;
+        size_t arenaUsed;          // WCHARs used in the last block
+        size_t arenaSize;          // WCHARs in the last block
 
-            return ( ulA.QuadPart > ulB.QuadPart ) ? 1 : ( ulA.QuadPart < ulB.QuadPart ) ? -1 : 0;
-        } //CompareFT
+        // Call with mtx held
 
-        static int PIAttributeCompare( const void * a, const void * b )
+        WCHAR * Allocate( size_t cwc )
         {
-            PathItem *pa = (PathItem *) a;
-            PathItem *pb = (PathItem *) b;
+            if ( arena.empty() || ( arenaSize - arenaUsed ) < cwc )
+            {
+                arenaSize = __max( ArenaBlock, cwc );
+                arena.emplace_back( new WCHAR[ arenaSize ] );
+                arenaUsed = 0;
+            }
 
-            return ( ( pa->ulAttribute > pb->ulAttribute ) ? 1 : ( pa->ulAttribute == pb->ulAttribute ) ? 0 : -1 );
-        } //PIAttributeCompare
+            WCHAR * p = arena.back().get() + arenaUsed;
+            arenaUsed += cwc;
+            return p;
+        } //Allocate
 
-        static int PILastWriteCompare( const void * a, const void * b )
+        void Push( WCHAR const * pwc, PathItem & pi )
         {
-            PathItem *pa = (PathItem *) a;
-            PathItem *pb = (PathItem *) b;
+            size_t len = 1 + wcslen( pwc );
 
-            return CompareFT( pa->ftLastWrite, pb->ftLastWrite );
-        } //PILastWriteCompare
-        
-        static int PICreationCompare( const void * a, const void * b )
-        {
-            PathItem *pa = (PathItem *) a;
-            PathItem *pb = (PathItem *) b;
+            {
+                lock_guard<mutex> lock( mtx );
+                pi.pwcPath = Allocate( len );
+                memcpy( pi.pwcPath, pwc, len * sizeof( WCHAR ) );
+                elements.push_back( pi );
+            }
 
-            return CompareFT( pa->ftCreation, pb->ftCreation );
-        } //PICreationCompare
-        
-        static int PICaptureCompare( const void * a, const void * b )
+            cvAdded.notify_all();
+        } //Push
+
+        static unsigned long long FileTimeKey( FILETIME const & ft )
         {
-            PathItem *pa = (PathItem *) a;
-            PathItem *pb = (PathItem *) b;
+            return ( (unsigned long long) ft.dwHighDateTime << 32 ) | ft.dwLowDateTime;
+        } //FileTimeKey
 
-            return CompareFT( pa->ftCapture, pb->ftCapture );
-        } //PICaptureCompare
-        
         static int PIPathCompare( const void * a, const void * b )
         {
             PathItem *pa = (PathItem *) a;
@@ -81,26 +114,6 @@ class CPathArray
             return wcscmp( pa->pwcPath, pb->pwcPath );
         } //PIPathCompare
 
-        static int PIAttributeCompareDescending( const void * a, const void * b )
-        {
-            return PIAttributeCompare( b, a );
-        } //PIAttributeCompareDescending
-
-        static int PILastWriteCompareDescending( const void * a, const void * b )
-        {
-            return PILastWriteCompare( b, a );
-        } //PILastWriteCompareDescending
-        
-        static int PICreationCompareDescending( const void * a, const void * b )
-        {
-            return PICreationCompare( b, a );
-        } //PICreationCompareDescending
-        
-        static int PICaptureCompareDescending( const void * a, const void * b )
-        {
-            return PICaptureCompare( b, a );
-        } //PICaptureCompareDescending
-        
         static int PIPathCompareDescending( const void * a, const void * b )
         {
             return PIPathCompare( b, a );
@@ -135,7 +148,10 @@ class CPathArray
         
     public:
         CPathArray() :
-            captureTimesLoaded( false )
+            captureTimesLoaded( false ),
+            complete( true ),
+            arenaUsed( 0 ),
+            arenaSize( 0 )
         {
         }
 
@@ -151,13 +167,10 @@ class CPathArray
 
         void Clear()
         {
-            for ( size_t i = 0; i < elements.size(); i++ )
-            {
-                delete elements[ i ].pwcPath;
-                elements[ i ].pwcPath = NULL;
-            }
-
             elements.resize( 0 );
+            arena.clear();
+            arenaUsed = 0;
+            arenaSize = 0;
         } //Clear
 
         void Randomize()
@@ -180,24 +193,62 @@ class CPathArray
 
         void SortOnAttribute( bool ascending = true )
         {
-            qsort( elements.data(), elements.size(), sizeof PathItem, ascending ? PIAttributeCompare : PIAttributeCompareDescending );
+            RadixSort( elements.data(), elements.size(), [] ( PathItem const & pi ) { return (ULONG) pi.ulAttribute; }, !ascending );
         } //SortOnAttribute
 
         void SortOnLastWrite( bool ascending = true )
         {
-            qsort( elements.data(), elements.size(), sizeof PathItem, ascending ? PILastWriteCompare : PILastWriteCompareDescending );
+            RadixSort( elements.data(), elements.size(), [] ( PathItem const & pi ) { return FileTimeKey( pi.ftLastWrite ); }, !ascending );
         } //SortOnLastWrite
 
         void SortOnCreation( bool ascending = true )
         {
-            qsort( elements.data(), elements.size(), sizeof PathItem, ascending ? PICreationCompare : PICreationCompareDescending );
+            RadixSort( elements.data(), elements.size(), [] ( PathItem const & pi ) { return FileTimeKey( pi.ftCreation ); }, !ascending );
         } //SortOnCreation
 
         void SortOnPath( bool ascending = true )
         {
-            qsort( elements.data(), elements.size(), sizeof PathItem, ascending ? PIPathCompare : PIPathCompareDescending );
+            qsort( elements.data(), elements.size(), sizeof( PathItem ), ascending ? PIPathCompare : PIPathCompareDescending );
         } //SortOnPath
 
+        // Parses every path in parallel and calls onParsed( i, result ) from the workers; fields is 0 on failure.
+        // On POSIX the paths are parsed in batches while another thread has the kernel read ahead the headers of
+        // the next batch, so the parsers mostly find them in the page cache instead of each waiting on its reads.
+
+        template <typename T> void ParseAll( DWORD fields, T onParsed )
+        {
+            auto parse = [&] ( size_t i )
+            {
+                ImageDataResult idr;
+                if ( !CImageData::Parse( elements[ i ].pwcPath, fields, idr ) )
+                    idr.fields = 0;
+
+                onParsed( i, idr );
+            };
+
+#ifdef _WIN32
+            parallel_for( (size_t) 0, elements.size(), parse );
+#else
+            const size_t batchSize = 512;
+            size_t count = elements.size();
+
+            for ( size_t start = 0; start < count; start += batchSize )
+            {
+                size_t end = __min( start + batchSize, count );
+                size_t nextEnd = __min( end + batchSize, count );
+
+                thread prefetch( [&] ()
+                {
+                    for ( size_t i = end; i < nextEnd; i++ )
+                        CStream::Prefetch( elements[ i ].pwcPath );
+                } );
+
+                parallel_for( start, end, parse );
+                prefetch.join();
+            }
+#endif
+        } //ParseAll
+
         void SortOnCapture( bool ascending = true )
         {
             if ( !captureTimesLoaded )
@@ -207,18 +258,14 @@ class CPathArray
                 long long timeLoadCapture = 0;
                 CTimed timedLoadCapture( timeLoadCapture );
 
-                //for ( size_t i = 0; i < elements.size(); i++ )
-                parallel_for( (size_t) 0, elements.size(), [&] ( size_t i )
+                ParseAll( idfCaptureTime, [&] ( size_t i, ImageDataResult const & idr )
                 {
-                    CImageData id;
-                    char dateTime[ 20 ];
-                    dateTime[0] = 0;
-
-                    if ( ( id.FindDateTime( elements[i].pwcPath, dateTime, _countof( dateTime ) ) ) &&
-                         ( 19 == strlen( dateTime ) ) )
+                    if ( idr.fields & idfCaptureTime )
                     {
                         // 2005:02:17 21:21:31
 
+                        char const * dateTime = idr.acCaptureTime;
+
                         SYSTEMTIME st = {0};
                         st.wYear = (WORD) atoi( dateTime );
                         st.wMonth = (WORD) atoi( dateTime + 5 );
@@ -240,7 +287,7 @@ class CPathArray
                 captureTimesLoaded = true;
             }
 
-            qsort( elements.data(), elements.size(), sizeof PathItem, ascending ? PICaptureCompare : PICaptureCompareDescending );
+            RadixSort( elements.data(), elements.size(), [] ( PathItem const & pi ) { return FileTimeKey( pi.ftCapture ); }, !ascending );
             tracer.Trace( "sorted on capture time, ascending %d\n", ascending );
             PrintList();
         } //SortOnCapture
@@ -259,42 +306,103 @@ class CPathArray
             PathItem pi;
             pi.ftCreation = creation;
             pi.ftLastWrite = lastWrite;
-            size_t len = 1 + wcslen( pwc );
-            pi.pwcPath = new WCHAR[ len ];
-            wcscpy_s( pi.pwcPath, len, pwc );
 
             // defer loading capture times until absolutely needed because it's slow
 
             ZeroMemory( &pi.ftCapture, sizeof pi.ftCapture );
 
-            lock_guard<mutex> lock( mtx );
-
-            elements.push_back( pi );
+            Push( pwc, pi );
         } //Add
 
         void Add( WCHAR * pwc )
         {
             PathItem pi = {};
-            size_t len = 1 + wcslen( pwc );
-            pi.pwcPath = new WCHAR[ len ];
-            wcscpy_s( pi.pwcPath, len, pwc );
+            Push( pwc, pi );
+        } //Add
+
+        // For paths whose capture times are already known, e.g. from a metadata index
+
+        void AddCaptured( WCHAR const * pwc, FILETIME const & capture )
+        {
+            PathItem pi = {};
+            pi.ftCapture = capture;
+            Push( pwc, pi );
+        } //AddCaptured
+
+        // Add every path in the batch with one lock and one copy, then clear the batch
+
+        void AddBatch( PathBatch & batch )
+        {
+            if ( 0 == batch.items.size() )
+                return;
+
+            {
+                lock_guard<mutex> lock( mtx );
+                WCHAR * pwcPool = Allocate( batch.pool.size() );
+                memcpy( pwcPool, batch.pool.data(), batch.pool.size() * sizeof( WCHAR ) );
+
+                for ( size_t i = 0; i < batch.items.size(); i++ )
+                {
+                    batch.items[ i ].pwcPath = pwcPool + batch.offsets[ i ];
+                    elements.push_back( batch.items[ i ] );
+                }
+            }
+
+            cvAdded.notify_all();
+            batch.Clear();
+        } //AddBatch
+
+        // Streaming lets consumers start on paths before a producer, e.g. a folder enumeration, has found them all.
+        // Call BeginStream() before the producer starts and Complete() when it's done, even if it failed.
+        // Meanwhile consumers call Next() with i = 0, 1, 2, ...; it waits for item i and returns false once
+        // there will be no item i. Don't reorder or delete items or call Count() until Complete().
 
+        void BeginStream()
+        {
             lock_guard<mutex> lock( mtx );
+            complete = false;
+        } //BeginStream
 
-            elements.push_back( pi );
-        } //Add
+        void Complete()
+        {
+            {
+                lock_guard<mutex> lock( mtx );
+                complete = true;
+            }
+
+            cvAdded.notify_all();
+        } //Complete
+
+        bool Next( size_t i, PathItem & item )
+        {
+            unique_lock<mutex> lock( mtx );
+            cvAdded.wait( lock, [&] { return ( i < elements.size() ) || complete; } );
+
+            if ( i >= elements.size() )
+                return false;
+
+            item = elements[ i ];
+            return true;
+        } //Next
+
+        // Call once every element was added with AddCaptured() so SortOnCapture() won't parse the files
+
+        void CaptureTimesKnown() { captureTimesLoaded = true; }
 
         void Add( char * pc )
         {
             PathItem pi = {};
             size_t len = 1 + strlen( pc );
-            pi.pwcPath = new WCHAR[ len ];
             size_t outputLen = 0;
-            mbstowcs_s( &outputLen, pi.pwcPath, len, pc, len );
 
-            lock_guard<mutex> lock( mtx );
+            {
+                lock_guard<mutex> lock( mtx );
+                pi.pwcPath = Allocate( len );
+                mbstowcs_s( &outputLen, pi.pwcPath, len, pc, len );
+                elements.push_back( pi );
+            }
 
-            elements.push_back( pi );
+            cvAdded.notify_all();
         } //Add
 
         bool Delete( size_t item )
@@ -304,8 +412,7 @@ class CPathArray
             if ( item >= elements.size() )
                 return false;
 
-            delete elements[ item ].pwcPath;
-            elements[ item ].pwcPath = NULL;
+            // The path's space in the arena is reclaimed by Clear()
 
             elements.erase( elements.begin() + item );
 
@@ -0,0 +1,127 @@
+#pragma once
+
+//
+// Skyline bin packer for placing rectangles on a fixed-size page, e.g. images on a sprite sheet.
+// The skyline is the top edge of everything placed so far, kept as a list of horizontal segments.
+// Each rectangle goes where its top edge would be lowest (bottom-left rule), ties going to the leftmost.
+// Inserting rectangles sorted by descending height keeps the skyline short, so the cost per insert is
+// proportional to the number of segments rather than the number of rectangles placed.
+//
+
+#include <vector>
+
+using namespace std;
+
+class CSkylinePacker
+{
+    private:
+        struct Segment
+        {
+            int x;
+            int y;
+            int width;
+        };
+
+        int pageWidth;
+        int pageHeight;
+        vector<Segment> skyline;
+
+        // The lowest y at which a rectangle of the given width can sit starting at segment i, or -1 if it won't fit
+
+        int Fit( size_t i, int width, int height ) const
+        {
+            int x = skyline[ i ].x;
+            if ( ( x + width ) > pageWidth )
+                return -1;
+
+            int y = 0;
+            int widthLeft = width;
+
+            while ( widthLeft > 0 )
+            {
+                if ( i >= skyline.size() )
+                    return -1;
+
+                if ( skyline[ i ].y > y )
+                    y = skyline[ i ].y;
+
+                if ( ( y + height ) > pageHeight )
+                    return -1;
+
+                widthLeft -= skyline[ i ].width;
+                i++;
+            }
+
+            return y;
+        } //Fit
+
+    public:
+        CSkylinePacker( int width, int height ) : pageWidth( width ), pageHeight( height )
+        {
+            skyline.push_back( { 0, 0, width } );
+        }
+
+        // Returns false if the rectangle doesn't fit anywhere on the page
+
+        bool Insert( int width, int height, int & x, int & y )
+        {
+            if ( width <= 0 || height <= 0 || width > pageWidth || height > pageHeight )
+                return false;
+
+            int bestIndex = -1;
+            int bestY = pageHeight;
+
+            for ( size_t i = 0; i < skyline.size(); i++ )
+            {
+                int fitY = Fit( i, width, height );
+                if ( fitY >= 0 && fitY < bestY )
+                {
+                    bestY = fitY;
+                    bestIndex = (int) i;
+                }
+            }
+
+            if ( -1 == bestIndex )
+                return false;
+
+            x = skyline[ bestIndex ].x;
+            y = bestY;
+
+            // Add the new segment, then trim or remove the segments it now covers
+
+            Segment placed = { x, y + height, width };
+            skyline.insert( skyline.begin() + bestIndex, placed );
+
+            size_t i = bestIndex + 1;
+            while ( i < skyline.size() )
+            {
+                int overlap = ( placed.x + placed.width ) - skyline[ i ].x;
+                if ( overlap <= 0 )
+                    break;
+
+                if ( overlap >= skyline[ i ].width )
+                    skyline.erase( skyline.begin() + i );
+                else
+                {
+                    skyline[ i ].x += overlap;
+                    skyline[ i ].width -= overlap;
+                    break;
+                }
+            }
+
+            // Merge neighbors at the same height so the skyline stays short
+
+            for ( size_t m = 0; ( m + 1 ) < skyline.size(); )
+            {
+                if ( skyline[ m ].y == skyline[ m + 1 ].y )
+                {
+                    skyline[ m ].width += skyline[ m + 1 ].width;
+                    skyline.erase( skyline.begin() + m + 1 );
+                }
+                else
+                    m++;
+            }
+
+            return true;
+        } //Insert
+};
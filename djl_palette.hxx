@@ -0,0 +1,173 @@
+#pragma once
+
+//
+// Precompiled palette (.icpal) files. Extracting a palette from an image means a decode, a histogram, and
+// k-means clustering with random seeds, so it's slow and can differ from run to run. A palette file holds the
+// colors already sorted for a color mapping plus the search structure built from them: the kd-tree nodes for
+// color mapping or the sorted h, s, or v values otherwise. Loading one is a memory map and a few copies.
+// Layout: header, then count BGR DWORDs, then count h/s/v bytes padded to 8, then the kd-tree nodes.
+//
+
+#include <vector>
+#include <memory>
+
+#include <djl_kdtree.hxx>
+
+using namespace std;
+
+class CPaletteFile
+{
+    private:
+        struct PaletteHeader
+        {
+            char signature[ 8 ];
+            UINT mapping;          // the ColorMapping the data was sorted and built for
+            UINT count;
+            UINT hsvCount;         // 0 or count
+            UINT nodeCount;        // 0 or count, not including the reserved node 0
+            UINT treeHead;
+            UINT reserved;
+        };
+
+        static const char * Signature() { return "ICPAL001"; }
+        static const size_t MaxColors = 256;  // the most colors ic ever writes, so larger counts mean a corrupt file
+
+        static size_t HsvBytes( size_t count ) { return ( count + 7 ) & ~(size_t) 7; }
+        static size_t NodeBytes( size_t count ) { return ( 0 == count ) ? 0 : ( count + 1 ) * 8; }
+
+    public:
+        static bool IsPaletteFile( WCHAR const * pwcPath )
+        {
+            return !_wcsicmp( PathFindExtension( pwcPath ), L".icpal" );
+        } //IsPaletteFile
+
+        static HRESULT Save( WCHAR const * pwcPath, int mapping, vector<DWORD> const & bgrdata, vector<byte> const & hsvdata, KDTreeBGR * pkdtree )
+        {
+            PaletteHeader header = {};
+            memcpy( header.signature, Signature(), sizeof header.signature );
+            header.mapping = mapping;
+            header.count = (UINT) bgrdata.size();
+            header.hsvCount = (UINT) hsvdata.size();
+
+            size_t cbNodes = 0;
+            int head = 0;
+            void const * pNodes = 0;
+
+            if ( pkdtree )
+            {
+                pNodes = pkdtree->NodeData( cbNodes, head );
+                header.nodeCount = pkdtree->NodeCount();
+                header.treeHead = head;
+            }
+
+            vector<byte> hsvPadded( HsvBytes( hsvdata.size() ) );
+            if ( hsvdata.size() )
+                memcpy( hsvPadded.data(), hsvdata.data(), hsvdata.size() );
+
+            FILE * fp = _wfopen( pwcPath, L"wb" );
+            if ( !fp )
+            {
+                printf( "can't create palette file %ws\n", pwcPath );
+                return E_FAIL;
+            }
+
+            bool ok = ( 1 == fwrite( &header, sizeof header, 1, fp ) ) &&
+                      ( bgrdata.size() == fwrite( bgrdata.data(), sizeof( DWORD ), bgrdata.size(), fp ) ) &&
+                      ( hsvPadded.size() == fwrite( hsvPadded.data(), 1, hsvPadded.size(), fp ) ) &&
+                      ( cbNodes == fwrite( pNodes, 1, cbNodes, fp ) );
+            ok = ( 0 == fclose( fp ) ) && ok;
+
+            if ( !ok )
+            {
+                printf( "can't write palette file %ws\n", pwcPath );
+                DeleteFile( pwcPath );
+                return E_FAIL;
+            }
+
+            return S_OK;
+        } //Save
+
+        // The prebuilt hsvdata and kd-tree are returned only if the file was made for the same mapping;
+        // otherwise just the colors are, and the caller builds the rest. Returns S_FALSE in that case.
+
+        static HRESULT Load( WCHAR const * pwcPath, int mapping, vector<DWORD> & bgrdata, vector<byte> & hsvdata, unique_ptr<KDTreeBGR> & kdtree )
+        {
+            HANDLE hFile = CreateFile( pwcPath, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, 0, 0 );
+            if ( INVALID_HANDLE_VALUE == hFile )
+            {
+                printf( "can't open palette file %ws\n", pwcPath );
+                return E_FAIL;
+            }
+
+            HRESULT hr = E_FAIL;
+            HANDLE hMapping = 0;
+            void * pView = 0;
+            LARGE_INTEGER size;
+
+            if ( GetFileSizeEx( hFile, &size ) && (unsigned long long) size.QuadPart >= sizeof( PaletteHeader ) )
+            {
+                hMapping = CreateFileMapping( hFile, 0, PAGE_READONLY, 0, 0, 0 );
+                if ( hMapping )
+                    pView = MapViewOfFile( hMapping, FILE_MAP_READ, 0, 0, 0 );
+            }
+
+            if ( pView )
+            {
+                PaletteHeader const * pHeader = (PaletteHeader const *) pView;
+                size_t count = pHeader->count;
+
+                bool valid = !memcmp( pHeader->signature, Signature(), sizeof pHeader->signature ) &&
+                             count > 0 && count <= MaxColors &&
+                             ( 0 == pHeader->hsvCount || count == pHeader->hsvCount ) &&
+                             ( 0 == pHeader->nodeCount || count == pHeader->nodeCount ) &&
+                             ( sizeof( PaletteHeader ) + count * sizeof( DWORD ) + HsvBytes( pHeader->hsvCount ) +
+                               NodeBytes( pHeader->nodeCount ) ) <= (unsigned long long) size.QuadPart;
+
+                if ( valid )
+                {
+                    DWORD const * pColors = (DWORD const *) ( pHeader + 1 );
+                    byte const * pHsv = (byte const *) ( pColors + count );
+                    byte const * pNodes = pHsv + HsvBytes( pHeader->hsvCount );
+
+                    bgrdata.assign( pColors, pColors + count );
+                    hsvdata.clear();
+                    kdtree.reset();
+                    hr = S_FALSE;
+
+                    if ( (UINT) mapping == pHeader->mapping )
+                    {
+                        hsvdata.assign( pHsv, pHsv + pHeader->hsvCount );
+
+                        if ( 0 != pHeader->nodeCount )
+                        {
+                            kdtree.reset( new KDTreeBGR( pNodes, pHeader->nodeCount, pHeader->treeHead ) );
+                            if ( !kdtree->IsValid() )
+                            {
+                                kdtree.reset();
+                                hsvdata.clear();
+                                bgrdata.clear();
+                                valid = false;
+                                hr = E_FAIL;
+                            }
+                        }
+
+                        if ( valid )
+                            hr = S_OK;
+                    }
+                }
+
+                if ( !valid )
+                    printf( "palette file %ws is invalid\n", pwcPath );
+
+                UnmapViewOfFile( pView );
+            }
+            else
+                printf( "can't read palette file %ws\n", pwcPath );
+
+            if ( hMapping )
+                CloseHandle( hMapping );
+            CloseHandle( hFile );
+
+            return hr;
+        } //Load
+};
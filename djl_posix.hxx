@@ -0,0 +1,519 @@
+#pragma once
+
+//
+// The subset of the Win32 types and file, time, and string functions used by the enumeration, stream, and
+// metadata layers (djlenum, djl_strm, djl_pa, and djlimagedata), implemented with POSIX calls so those layers
+// build and run natively on Linux. A HANDLE is a file descriptor. Paths are WCHAR (wchar_t) like on Windows
+// and are converted to and from UTF-8 at the system call boundary.
+//
+
+#ifndef _WIN32
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+#include <djl_os.hxx>
+
+typedef unsigned char BYTE;
+typedef wchar_t WCHAR;
+typedef wchar_t * PWCHAR;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef uint32_t ULONG;
+typedef int32_t LONG;
+typedef uint32_t UINT;
+typedef int BOOL;
+typedef int64_t __int64;
+typedef uint64_t ULONGLONG;
+typedef void * HANDLE;
+
+#ifndef TRUE
+    #define TRUE 1
+    #define FALSE 0
+#endif
+
+#define INVALID_HANDLE_VALUE ( (HANDLE) (intptr_t) -1 )
+#define GENERIC_READ 0x80000000
+#define GENERIC_WRITE 0x40000000
+#define FILE_SHARE_READ 1
+#define FILE_SHARE_WRITE 2
+#define FILE_SHARE_DELETE 4
+#define CREATE_ALWAYS 2
+#define OPEN_EXISTING 3
+#define FILE_BEGIN 0
+#define FILE_CURRENT 1
+#define FILE_END 2
+
+#ifndef __min
+    #define __min( a, b ) ( ( ( a ) < ( b ) ) ? ( a ) : ( b ) )
+    #define __max( a, b ) ( ( ( a ) > ( b ) ) ? ( a ) : ( b ) )
+#endif
+
+#define ZeroMemory( p, cb ) memset( ( p ), 0, ( cb ) )
+
+inline uint16_t _byteswap_ushort( uint16_t x ) { return __builtin_bswap16( x ); }
+inline uint32_t _byteswap_ulong( uint32_t x ) { return __builtin_bswap32( x ); }
+inline uint64_t _byteswap_uint64( uint64_t x ) { return __builtin_bswap64( x ); }
+
+union LARGE_INTEGER
+{
+    struct { DWORD LowPart; LONG HighPart; };
+    int64_t QuadPart;
+};
+
+union ULARGE_INTEGER
+{
+    struct { DWORD LowPart; DWORD HighPart; };
+    uint64_t QuadPart;
+};
+
+struct FILETIME
+{
+    DWORD dwLowDateTime;
+    DWORD dwHighDateTime;
+};
+
+struct SYSTEMTIME
+{
+    WORD wYear;
+    WORD wMonth;
+    WORD wDayOfWeek;
+    WORD wDay;
+    WORD wHour;
+    WORD wMinute;
+    WORD wSecond;
+    WORD wMilliseconds;
+};
+
+struct OVERLAPPED
+{
+    DWORD Offset;
+    DWORD OffsetHigh;
+};
+
+#pragma pack( push, 2 )
+
+struct BITMAPFILEHEADER
+{
+    WORD bfType;
+    DWORD bfSize;
+    WORD bfReserved1;
+    WORD bfReserved2;
+    DWORD bfOffBits;
+};
+
+#pragma pack( pop )
+
+struct BITMAPINFOHEADER
+{
+    DWORD biSize;
+    LONG biWidth;
+    LONG biHeight;
+    WORD biPlanes;
+    WORD biBitCount;
+    DWORD biCompression;
+    DWORD biSizeImage;
+    LONG biXPelsPerMeter;
+    LONG biYPelsPerMeter;
+    DWORD biClrUsed;
+    DWORD biClrImportant;
+};
+
+struct BITMAPV5HEADER
+{
+    DWORD bV5Size;
+    LONG bV5Width;
+    LONG bV5Height;
+    WORD bV5Planes;
+    WORD bV5BitCount;
+    DWORD bV5Compression;
+    DWORD bV5SizeImage;
+    LONG bV5XPelsPerMeter;
+    LONG bV5YPelsPerMeter;
+    DWORD bV5ClrUsed;
+    DWORD bV5ClrImportant;
+    DWORD bV5RedMask;
+    DWORD bV5GreenMask;
+    DWORD bV5BlueMask;
+    DWORD bV5AlphaMask;
+    DWORD bV5CSType;
+    LONG bV5Endpoints[ 9 ];
+    DWORD bV5GammaRed;
+    DWORD bV5GammaGreen;
+    DWORD bV5GammaBlue;
+    DWORD bV5Intent;
+    DWORD bV5ProfileData;
+    DWORD bV5ProfileSize;
+    DWORD bV5Reserved;
+};
+
+// UTF-8 <=> wide conversions that don't depend on the process locale
+
+inline std::string WideToUtf8( WCHAR const * pwc )
+{
+    std::string s;
+
+    for ( ; *pwc; pwc++ )
+    {
+        uint32_t c = (uint32_t) *pwc;
+
+        if ( c < 0x80 )
+            s += (char) c;
+        else if ( c < 0x800 )
+        {
+            s += (char) ( 0xc0 | ( c >> 6 ) );
+            s += (char) ( 0x80 | ( c & 0x3f ) );
+        }
+        else if ( c < 0x10000 )
+        {
+            s += (char) ( 0xe0 | ( c >> 12 ) );
+            s += (char) ( 0x80 | ( ( c >> 6 ) & 0x3f ) );
+            s += (char) ( 0x80 | ( c & 0x3f ) );
+        }
+        else
+        {
+            s += (char) ( 0xf0 | ( c >> 18 ) );
+            s += (char) ( 0x80 | ( ( c >> 12 ) & 0x3f ) );
+            s += (char) ( 0x80 | ( ( c >> 6 ) & 0x3f ) );
+            s += (char) ( 0x80 | ( c & 0x3f ) );
+        }
+    }
+
+    return s;
+} //WideToUtf8
+
+// Appends to ws. Invalid sequences become U+FFFD.
+
+inline void Utf8ToWide( char const * pc, size_t cb, std::wstring & ws )
+{
+    BYTE const * p = (BYTE const *) pc;
+    BYTE const * end = p + cb;
+
+    while ( p < end )
+    {
+        uint32_t c = *p++;
+        int extra = ( c < 0x80 ) ? 0 : ( c >= 0xf0 ) ? 3 : ( c >= 0xe0 ) ? 2 : ( c >= 0xc0 ) ? 1 : -1;
+
+        if ( extra < 0 || ( end - p ) < extra )
+        {
+            ws += (WCHAR) 0xfffd;
+            continue;
+        }
+
+        if ( extra > 0 )
+            c &= ( 0x3f >> extra );
+
+        for ( int i = 0; i < extra; i++ )
+            c = ( c << 6 ) | ( *p++ & 0x3f );
+
+        ws += (WCHAR) c;
+    }
+} //Utf8ToWide
+
+inline int HandleToFd( HANDLE h ) { return (int) (intptr_t) h; }
+inline HANDLE FdToHandle( int fd ) { return (HANDLE) (intptr_t) fd; }
+
+inline DWORD GetLastError() { return (DWORD) errno; }
+
+inline HANDLE CreateFile( WCHAR const * pwcPath, DWORD access, DWORD share, void * security, DWORD disposition, DWORD flags, HANDLE hTemplate )
+{
+    int oflags = O_CLOEXEC;
+
+    if ( access & GENERIC_WRITE )
+        oflags |= ( access & GENERIC_READ ) ? O_RDWR : O_WRONLY;
+    else
+        oflags |= O_RDONLY;
+
+    if ( CREATE_ALWAYS == disposition )
+        oflags |= O_CREAT | O_TRUNC;
+
+    return FdToHandle( open( WideToUtf8( pwcPath ).c_str(), oflags, 0644 ) );
+} //CreateFile
+
+inline BOOL CloseHandle( HANDLE h ) { return ( 0 == close( HandleToFd( h ) ) ); }
+
+// Reads at the OVERLAPPED offset if one is given, otherwise at the file pointer
+
+inline BOOL ReadFile( HANDLE h, void * pv, DWORD cb, DWORD * pRead, OVERLAPPED * pOverlapped )
+{
+    ssize_t n;
+
+    if ( pOverlapped )
+        n = pread( HandleToFd( h ), pv, cb, (off_t) ( ( (uint64_t) pOverlapped->OffsetHigh << 32 ) | pOverlapped->Offset ) );
+    else
+        n = read( HandleToFd( h ), pv, cb );
+
+    if ( n < 0 )
+        return FALSE;
+
+    if ( pRead )
+        *pRead = (DWORD) n;
+    return TRUE;
+} //ReadFile
+
+inline BOOL WriteFile( HANDLE h, void const * pv, DWORD cb, DWORD * pWritten, OVERLAPPED * pOverlapped )
+{
+    ssize_t n;
+
+    if ( pOverlapped )
+        n = pwrite( HandleToFd( h ), pv, cb, (off_t) ( ( (uint64_t) pOverlapped->OffsetHigh << 32 ) | pOverlapped->Offset ) );
+    else
+        n = write( HandleToFd( h ), pv, cb );
+
+    if ( n < 0 )
+        return FALSE;
+
+    if ( pWritten )
+        *pWritten = (DWORD) n;
+    return TRUE;
+} //WriteFile
+
+inline BOOL SetFilePointerEx( HANDLE h, LARGE_INTEGER distance, LARGE_INTEGER * pNew, DWORD method )
+{
+    int whence = ( FILE_BEGIN == method ) ? SEEK_SET : ( FILE_CURRENT == method ) ? SEEK_CUR : SEEK_END;
+    off_t o = lseek( HandleToFd( h ), (off_t) distance.QuadPart, whence );
+
+    if ( o < 0 )
+        return FALSE;
+
+    if ( pNew )
+        pNew->QuadPart = o;
+    return TRUE;
+} //SetFilePointerEx
+
+inline BOOL GetFileSizeEx( HANDLE h, LARGE_INTEGER * pSize )
+{
+    struct stat st;
+    if ( 0 != fstat( HandleToFd( h ), &st ) )
+        return FALSE;
+
+    pSize->QuadPart = st.st_size;
+    return TRUE;
+} //GetFileSizeEx
+
+// FILETIME is 100ns units since 1601; time_t is seconds since 1970
+
+inline FILETIME TimespecToFileTime( struct timespec const & ts )
+{
+    uint64_t t = ( (uint64_t) ts.tv_sec + 11644473600ull ) * 10000000ull + ts.tv_nsec / 100;
+    FILETIME ft = { (DWORD) t, (DWORD) ( t >> 32 ) };
+    return ft;
+} //TimespecToFileTime
+
+// POSIX has no creation time in stat, so the status change time stands in for it
+
+inline void StatFileTimes( struct stat const & st, FILETIME * pCreation, FILETIME * pWrite )
+{
+#ifdef __APPLE__
+    if ( pCreation )
+        *pCreation = TimespecToFileTime( st.st_ctimespec );
+    if ( pWrite )
+        *pWrite = TimespecToFileTime( st.st_mtimespec );
+#else
+    if ( pCreation )
+        *pCreation = TimespecToFileTime( st.st_ctim );
+    if ( pWrite )
+        *pWrite = TimespecToFileTime( st.st_mtim );
+#endif
+} //StatFileTimes
+
+inline BOOL GetFileTime( HANDLE h, FILETIME * pCreation, FILETIME * pAccess, FILETIME * pWrite )
+{
+    struct stat st;
+    if ( 0 != fstat( HandleToFd( h ), &st ) )
+        return FALSE;
+
+    StatFileTimes( st, pCreation, pWrite );
+
+    if ( pAccess )
+        *pAccess = *pWrite;
+    return TRUE;
+} //GetFileTime
+
+inline BOOL SystemTimeToFileTime( SYSTEMTIME const * pst, FILETIME * pft )
+{
+    struct tm t = {};
+    t.tm_year = pst->wYear - 1900;
+    t.tm_mon = pst->wMonth - 1;
+    t.tm_mday = pst->wDay;
+    t.tm_hour = pst->wHour;
+    t.tm_min = pst->wMinute;
+    t.tm_sec = pst->wSecond;
+
+    struct timespec ts = { timegm( &t ), (long) pst->wMilliseconds * 1000000 };
+    *pft = TimespecToFileTime( ts );
+    return TRUE;
+} //SystemTimeToFileTime
+
+inline BOOL FileTimeToSystemTime( FILETIME const * pft, SYSTEMTIME * pst )
+{
+    uint64_t t = ( (uint64_t) pft->dwHighDateTime << 32 ) | pft->dwLowDateTime;
+    time_t secs = (time_t) ( t / 10000000ull ) - 11644473600ll;
+    struct tm tm;
+    gmtime_r( &secs, &tm );
+
+    pst->wYear = (WORD) ( tm.tm_year + 1900 );
+    pst->wMonth = (WORD) ( tm.tm_mon + 1 );
+    pst->wDayOfWeek = (WORD) tm.tm_wday;
+    pst->wDay = (WORD) tm.tm_mday;
+    pst->wHour = (WORD) tm.tm_hour;
+    pst->wMinute = (WORD) tm.tm_min;
+    pst->wSecond = (WORD) tm.tm_sec;
+    pst->wMilliseconds = (WORD) ( ( t / 10000 ) % 1000 );
+    return TRUE;
+} //FileTimeToSystemTime
+
+// Secure CRT string functions. strcpy_s and wcscpy_s end the process on overflow, just as the CRT's default
+// invalid parameter handler does, so code that's wrong on Windows isn't quietly given a truncated string here.
+// sprintf_s is snprintf, so it truncates.
+
+#define sprintf_s snprintf
+#define _wcsicmp wcscasecmp
+#define _wcsnicmp wcsncasecmp
+#define _strnicmp strncasecmp
+#define wcsicmp wcscasecmp
+#define stricmp strcasecmp
+
+inline void InvalidParameter( char const * pcFunction )
+{
+    fprintf( stderr, "invalid parameter passed to %s\n", pcFunction );
+    abort();
+} //InvalidParameter
+
+inline int strcpy_s( char * pcDest, size_t cbDest, char const * pcSrc )
+{
+    if ( 0 == pcDest || 0 == cbDest || 0 == pcSrc )
+    {
+        InvalidParameter( "strcpy_s" );
+        return EINVAL;
+    }
+
+    size_t len = strlen( pcSrc );
+    if ( len >= cbDest )
+    {
+        pcDest[ 0 ] = 0;
+        InvalidParameter( "strcpy_s" );
+        return ERANGE;
+    }
+
+    memcpy( pcDest, pcSrc, len );
+    pcDest[ len ] = 0;
+    return 0;
+} //strcpy_s
+
+inline int wcscpy_s( WCHAR * pwcDest, size_t cwcDest, WCHAR const * pwcSrc )
+{
+    if ( 0 == pwcDest || 0 == cwcDest || 0 == pwcSrc )
+    {
+        InvalidParameter( "wcscpy_s" );
+        return EINVAL;
+    }
+
+    size_t len = wcslen( pwcSrc );
+    if ( len >= cwcDest )
+    {
+        pwcDest[ 0 ] = 0;
+        InvalidParameter( "wcscpy_s" );
+        return ERANGE;
+    }
+
+    memcpy( pwcDest, pwcSrc, len * sizeof( WCHAR ) );
+    pwcDest[ len ] = 0;
+    return 0;
+} //wcscpy_s
+
+inline int mbstowcs_s( size_t * pConverted, WCHAR * pwcDest, size_t cwcDest, char const * pcSrc, size_t count )
+{
+    std::wstring ws;
+    Utf8ToWide( pcSrc, strnlen( pcSrc, count ), ws );
+    wcscpy_s( pwcDest, cwcDest, ws.c_str() );
+
+    if ( pConverted )
+        *pConverted = wcslen( pwcDest ) + 1;
+    return 0;
+} //mbstowcs_s
+
+inline WCHAR * _wcslwr( WCHAR * pwc )
+{
+    for ( WCHAR * p = pwc; *p; p++ )
+        *p = (WCHAR) towlower( *p );
+    return pwc;
+} //_wcslwr
+
+inline WCHAR const * PathFindExtension( WCHAR const * pwcPath )
+{
+    WCHAR const * pwcDot = wcsrchr( pwcPath, L'.' );
+    WCHAR const * pwcSlash = wcsrchr( pwcPath, L'/' );
+
+    if ( !pwcDot || ( pwcSlash && pwcSlash > pwcDot ) )
+        return pwcPath + wcslen( pwcPath );
+
+    return pwcDot;
+} //PathFindExtension
+
+// The PPL parallel_for used by these layers. Nested calls share a budget of one thread per core beyond the
+// callers, so recursion doesn't create threads without bound; once it's spent, loops run on the calling thread.
+
+namespace concurrency
+{
+    inline std::atomic<int> & ParallelThreadBudget()
+    {
+        static std::atomic<int> budget( (int) std::max( 1u, std::thread::hardware_concurrency() ) - 1 );
+        return budget;
+    } //ParallelThreadBudget
+
+    template <typename T, typename Func> void parallel_for( T first, T last, Func func )
+    {
+        if ( last <= first )
+            return;
+
+        std::atomic<T> next( first );
+        auto run = [&] ()
+        {
+            for ( T i = next++; i < last; i = next++ )
+                func( i );
+        };
+
+        std::vector<std::thread> helpers;
+        std::atomic<int> & budget = ParallelThreadBudget();
+        T wanted = last - first - 1;
+
+        for ( T t = 0; t < wanted; t++ )
+        {
+            if ( budget.fetch_sub( 1 ) <= 0 )
+            {
+                budget++;
+                break;
+            }
+
+            helpers.emplace_back( run );
+        }
+
+        run();
+
+        for ( size_t t = 0; t < helpers.size(); t++ )
+        {
+            helpers[ t ].join();
+            budget++;
+        }
+    } //parallel_for
+}
+
+#endif // _WIN32
@@ -0,0 +1,109 @@
+#pragma once
+
+//
+// LSD radix sort for records sorted on a fixed-width unsigned integer key, e.g. a DWORD color or a FILETIME as a
+// 64-bit value. It makes one counting pass per key byte, skipping bytes that are the same in every key, so it's
+// linear in the record count and never calls a comparator. The sort is stable. Large inputs are split into one
+// chunk per worker; each chunk is counted and scattered in parallel into its own precomputed ranges.
+//
+
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include <thread>
+
+#ifdef _WIN32
+    #include <ppl.h>
+#else
+    #include <djl_posix.hxx>
+#endif
+
+using namespace std;
+
+// getKey( record ) returns the unsigned key. descending reverses the key order; ties keep their input order.
+
+template <typename T, typename GetKey> void RadixSort( T * p, size_t count, GetKey getKey, bool descending = false )
+{
+    typedef typename decay<decltype( getKey( *p ) )>::type K;
+    static_assert( is_unsigned<K>::value, "radix sort keys must be unsigned integers" );
+
+    auto key = [&] ( T const & t ) -> K { return descending ? (K) ~getKey( t ) : getKey( t ); };
+
+    if ( count < 256 )
+    {
+        stable_sort( p, p + count, [&] ( T const & a, T const & b ) { return key( a ) < key( b ); } );
+        return;
+    }
+
+    const size_t ParallelThreshold = 128 * 1024;
+    size_t chunks = 1;
+    if ( count >= ParallelThreshold )
+        chunks = __min( (size_t) __max( 1u, thread::hardware_concurrency() ), count / ( ParallelThreshold / 2 ) );
+
+    size_t chunkSize = ( count + chunks - 1 ) / chunks;
+    vector<T> buffer( count );
+    T * src = p;
+    T * dst = buffer.data();
+    vector<size_t> counts( chunks * 256 );
+
+    for ( int shift = 0; shift < (int) ( 8 * sizeof( K ) ); shift += 8 )
+    {
+        // count each chunk's digits
+
+        concurrency::parallel_for( (size_t) 0, chunks, [&] ( size_t c )
+        {
+            size_t * pc = counts.data() + c * 256;
+            fill( pc, pc + 256, (size_t) 0 );
+
+            size_t end = __min( count, ( c + 1 ) * chunkSize );
+            for ( size_t i = c * chunkSize; i < end; i++ )
+                pc[ ( key( src[ i ] ) >> shift ) & 0xff ]++;
+        } );
+
+        // skip the pass if every key has the same digit
+
+        bool trivial = false;
+        for ( size_t d = 0; d < 256; d++ )
+        {
+            size_t total = 0;
+            for ( size_t c = 0; c < chunks; c++ )
+                total += counts[ c * 256 + d ];
+
+            if ( 0 != total )
+            {
+                trivial = ( count == total );
+                break;
+            }
+        }
+
+        if ( trivial )
+            continue;
+
+        // turn counts into where each chunk's run of each digit starts: digit-major, then chunk order for stability
+
+        size_t offset = 0;
+        for ( size_t d = 0; d < 256; d++ )
+        {
+            for ( size_t c = 0; c < chunks; c++ )
+            {
+                size_t n = counts[ c * 256 + d ];
+                counts[ c * 256 + d ] = offset;
+                offset += n;
+            }
+        }
+
+        concurrency::parallel_for( (size_t) 0, chunks, [&] ( size_t c )
+        {
+            size_t * pc = counts.data() + c * 256;
+            size_t end = __min( count, ( c + 1 ) * chunkSize );
+
+            for ( size_t i = c * chunkSize; i < end; i++ )
+                dst[ pc[ ( key( src[ i ] ) >> shift ) & 0xff ]++ ] = src[ i ];
+        } );
+
+        swap( src, dst );
+    }
+
+    if ( src != p )
+        copy( src, src + count, p );
+} //RadixSort
@@ -0,0 +1,174 @@
+#pragma once
+
+//
+// Cost-aware scheduler for independent work items, e.g. decoding images for a collage.
+// Items are sorted by estimated cost and dispatched largest-first. One worker runs per core and each pulls
+// the next item from a shared atomic cursor, so the big items start early and the small ones fill in the
+// gaps at the end. This avoids a 100MB RAW that happens to start last from becoming the tail.
+// An optional budget caps the sum of the memory estimates of the items in flight at any time.
+// Per-item start and end times are recorded so callers can report the tail.
+//
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <ppl.h>
+
+using namespace std;
+using namespace concurrency;
+
+class CCostScheduler
+{
+    public:
+        struct ItemTiming
+        {
+            size_t index;         // index as passed to Add()
+            int worker;           // which worker ran the item
+            long long start;      // nanoseconds since Run() started
+            long long end;
+        };
+
+    private:
+        struct WorkItem
+        {
+            size_t index;
+            double cost;
+            unsigned long long memory;
+        };
+
+        vector<WorkItem> items;
+        vector<ItemTiming> timings;
+        int workers;
+        int workersUsed;
+        long long runTime;
+
+        mutex mtx;
+        condition_variable cv;
+        unsigned long long memoryInFlight;
+        unsigned long long memoryBudget;
+
+        static bool CostDescending( WorkItem const & a, WorkItem const & b )
+        {
+            return ( a.cost > b.cost );
+        } //CostDescending
+
+        void AcquireMemory( unsigned long long memory )
+        {
+            if ( 0 == memoryBudget )
+                return;
+
+            // Always let at least one item run, even if it alone exceeds the budget
+
+            unique_lock<mutex> lock( mtx );
+            cv.wait( lock, [&] { return ( 0 == memoryInFlight ) || ( ( memoryInFlight + memory ) <= memoryBudget ); } );
+            memoryInFlight += memory;
+        } //AcquireMemory
+
+        void ReleaseMemory( unsigned long long memory )
+        {
+            if ( 0 == memoryBudget )
+                return;
+
+            {
+                lock_guard<mutex> lock( mtx );
+                memoryInFlight -= memory;
+            }
+
+            cv.notify_all();
+        } //ReleaseMemory
+
+    public:
+        // budget: 0 for no cap, otherwise the most memory (in the units of Add's memory argument) in flight at once
+
+        CCostScheduler( unsigned long long budget = 0, int workerCount = 0 ) :
+            workers( workerCount ), workersUsed( 0 ), runTime( 0 ), memoryInFlight( 0 ), memoryBudget( budget )
+        {
+            if ( workers <= 0 )
+                workers = __max( 1, (int) thread::hardware_concurrency() );
+        }
+
+        void Add( size_t index, double cost, unsigned long long memory = 0 )
+        {
+            items.push_back( { index, cost, memory } );
+        } //Add
+
+        size_t Count() { return items.size(); }
+        int Workers() { return workers; }
+        long long RunTime() { return runTime; }
+        vector<ItemTiming> & Timings() { return timings; }
+
+        // Calls work( index ) once for each added item, most expensive first. Returns when all items are complete.
+
+        template <typename Func> void Run( Func work )
+        {
+            stable_sort( items.begin(), items.end(), CostDescending );
+
+            size_t count = items.size();
+            timings.resize( count );
+            workersUsed = (int) __min( (size_t) workers, __max( (size_t) 1, count ) );
+            atomic<size_t> next( 0 );
+            auto tStart = chrono::high_resolution_clock::now();
+
+            auto since = [&] () -> long long
+            {
+                return chrono::duration_cast<chrono::nanoseconds>( chrono::high_resolution_clock::now() - tStart ).count();
+            };
+
+            //for ( int w = 0; w < workersUsed; w++ )
+            parallel_for( 0, workersUsed, [&] ( int w )
+            {
+                do
+                {
+                    size_t i = next.fetch_add( 1 );
+                    if ( i >= count )
+                        break;
+
+                    WorkItem & item = items[ i ];
+                    AcquireMemory( item.memory );
+
+                    ItemTiming & timing = timings[ i ];
+                    timing.index = item.index;
+                    timing.worker = w;
+                    timing.start = since();
+
+                    work( item.index );
+
+                    timing.end = since();
+                    ReleaseMemory( item.memory );
+                } while ( true );
+            });
+
+            runTime = since();
+        } //Run
+
+        // Once the first worker runs out of items, the remaining cores are idle until the last one finishes.
+        // tailTime: wall time from the first worker going idle to the end of Run()
+        // idleTime: total time summed across workers spent idle after finishing their last item
+        // Workers that got no items aren't counted; on a small collage the others took them all before they started.
+
+        void TailStats( long long & tailTime, long long & idleTime )
+        {
+            vector<long long> lastEnd( workersUsed, -1 );
+
+            for ( size_t i = 0; i < timings.size(); i++ )
+                lastEnd[ timings[ i ].worker ] = __max( lastEnd[ timings[ i ].worker ], timings[ i ].end );
+
+            long long firstIdle = runTime;
+            idleTime = 0;
+
+            for ( int w = 0; w < workersUsed; w++ )
+            {
+                if ( -1 == lastEnd[ w ] )
+                    continue;
+
+                firstIdle = __min( firstIdle, lastEnd[ w ] );
+                idleTime += runTime - lastEnd[ w ];
+            }
+
+            tailTime = runTime - firstIdle;
+        } //TailStats
+};
@@ -2,11 +2,34 @@
 
 //
 // Stream over a file or subset of a file
+// Streams opened for reading go through a small cache of aligned 64k blocks. Metadata parsers read a few
+// bytes at a time all over a file, and without the cache each of those reads is a seek and a ReadFile.
+// On POSIX, files opened for reading are mapped instead and reads are copies from the mapping; the cache is
+// used only if the mapping fails. Reads at an offset use pread there, via ReadFile with an OVERLAPPED.
 //
 
+#include <memory>
+
+#ifndef _WIN32
+    #include <djl_posix.hxx>
+#endif
+
 class CStream
 {
     private:
+        static const ULONG BlockSize = 64 * 1024;
+        static const int BlockCount = 4;
+
+        struct Block
+        {
+            Block() : start( -1 ), valid( 0 ), lastUse( 0 ) {}
+
+            __int64 start;               // file offset, a multiple of BlockSize. -1 if unused
+            ULONG valid;                 // bytes read, less than BlockSize at the end of the file
+            ULONG lastUse;
+            std::unique_ptr<BYTE[]> data;
+        };
+
         __int64 length;
         __int64 offset;
         __int64 embedOffset;
@@ -14,6 +37,96 @@ class CStream
         bool handleOwned;
         bool seekCalled;
         bool forWrite;
+        Block blocks[ BlockCount ];
+        ULONG useClock;
+        BYTE const * pMapped;            // POSIX only: the whole file, or 0 if not mapped
+        size_t mappedLength;
+
+        // Read at an absolute file offset. This doesn't depend on or care about the file pointer.
+
+        ULONG ReadAt( __int64 location, void * pv, ULONG cb )
+        {
+            OVERLAPPED o = {};
+            o.Offset = (DWORD) location;
+            o.OffsetHigh = (DWORD) ( location >> 32 );
+
+            DWORD dwRead = 0;
+            if ( !ReadFile( hFile, pv, cb, &dwRead, &o ) )
+                return 0;
+
+            return dwRead;
+        } //ReadAt
+
+        void MapForRead()
+        {
+            pMapped = 0;
+            mappedLength = 0;
+
+#ifndef _WIN32
+            LARGE_INTEGER liSize;
+            if ( INVALID_HANDLE_VALUE == hFile || !GetFileSizeEx( hFile, &liSize ) || 0 == liSize.QuadPart )
+                return;
+
+            void * pv = mmap( 0, (size_t) liSize.QuadPart, PROT_READ, MAP_PRIVATE, HandleToFd( hFile ), 0 );
+            if ( MAP_FAILED == pv )
+                return;
+
+            pMapped = (BYTE const *) pv;
+            mappedLength = (size_t) liSize.QuadPart;
+#endif
+        } //MapForRead
+
+        void Unmap()
+        {
+#ifndef _WIN32
+            if ( pMapped )
+                munmap( (void *) pMapped, mappedLength );
+#endif
+            pMapped = 0;
+            mappedLength = 0;
+        } //Unmap
+
+        // Returns a pointer to the cached bytes at an absolute file offset and how many follow it in the block
+
+        BYTE const * CachedBytes( __int64 location, ULONG & available )
+        {
+            __int64 start = location & ~( (__int64) BlockSize - 1 );
+            Block * pBlock = 0;
+
+            for ( int i = 0; i < BlockCount; i++ )
+            {
+                if ( start == blocks[ i ].start )
+                {
+                    pBlock = & blocks[ i ];
+                    break;
+                }
+            }
+
+            if ( !pBlock )
+            {
+                // replace the least recently used block
+
+                pBlock = & blocks[ 0 ];
+                for ( int i = 1; i < BlockCount; i++ )
+                    if ( blocks[ i ].lastUse < pBlock->lastUse )
+                        pBlock = & blocks[ i ];
+
+                if ( !pBlock->data )
+                    pBlock->data.reset( new BYTE[ BlockSize ] );
+
+                pBlock->start = start;
+                pBlock->valid = ReadAt( start, pBlock->data.get(), BlockSize );
+            }
+
+            pBlock->lastUse = ++useClock;
+
+            ULONG blockOffset = (ULONG) ( location - start );
+            if ( blockOffset >= pBlock->valid )
+                return 0;
+
+            available = pBlock->valid - blockOffset;
+            return pBlock->data.get() + blockOffset;
+        } //CachedBytes
 
     public:
         CStream()
@@ -25,6 +138,9 @@ class CStream
             handleOwned = false;
             seekCalled = false;
             forWrite = false;
+            useClock = 0;
+            pMapped = 0;
+            mappedLength = 0;
         } //CStream
 
         CStream( WCHAR const * pwcFile, bool write = false )
@@ -35,6 +151,9 @@ class CStream
             seekCalled = false;
             handleOwned = true;
             forWrite = write;
+            useClock = 0;
+            pMapped = 0;
+            mappedLength = 0;
 
             if ( forWrite )
                 hFile = CreateFile( pwcFile, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, CREATE_ALWAYS, 0, 0 );
@@ -47,6 +166,7 @@ class CStream
                     LARGE_INTEGER liSize;
                     GetFileSizeEx( hFile, &liSize );
                     length = liSize.QuadPart;
+                    MapForRead();
                 }
             }
         } //CStream
@@ -60,11 +180,16 @@ class CStream
             handleOwned = false;
             hFile = h;
             forWrite = false;
+            useClock = 0;
+            pMapped = 0;
+            mappedLength = 0;
 
             LARGE_INTEGER liSize;
             BOOL ok = GetFileSizeEx( hFile, &liSize );
             if ( ok )
                 length = liSize.QuadPart;
+
+            MapForRead();
         } //CStream
 
         CStream( WCHAR const * pwcFile, __int64 embeddedOffset, __int64 embeddedLength )
@@ -81,6 +206,9 @@ class CStream
             seekCalled = true; // need to get to virtual 0 on first read
             handleOwned = true;
             forWrite = false;
+            useClock = 0;
+            pMapped = 0;
+            mappedLength = 0;
             hFile = CreateFile( pwcFile, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, 0 );
 
             if ( INVALID_HANDLE_VALUE == hFile )
@@ -106,11 +234,15 @@ class CStream
                     length = 0;
                     embedOffset = 0;
                 }
+
+                MapForRead();
              }
         } //CStream
 
         void CloseFile()
         {
+            Unmap();
+
             if ( handleOwned && INVALID_HANDLE_VALUE != hFile )
             {
                 CloseHandle( hFile );
@@ -128,6 +260,9 @@ class CStream
             if ( 0 == length )
                 return 0;
 
+            if ( !forWrite )
+                return CachedRead( pv, cb );
+
             if ( seekCalled )
             {
                 LARGE_INTEGER li;
@@ -155,6 +290,56 @@ class CStream
             return cb;
         } //Read
 
+        // Small reads are copies from the block cache. Reads of a block or more go straight to the file.
+
+        ULONG CachedRead( void * pv, ULONG cb )
+        {
+            if ( ( offset + cb ) > length )
+            {
+                if ( length > offset )
+                    cb = __min( cb, (ULONG) ( length - offset ) );
+                else
+                    cb = 0;
+            }
+
+            if ( pMapped )
+            {
+                __int64 location = offset + embedOffset;
+                if ( location >= (__int64) mappedLength )
+                    return 0;
+
+                cb = (ULONG) __min( (__int64) cb, (__int64) mappedLength - location );
+                memcpy( pv, pMapped + location, cb );
+                offset += cb;
+                return cb;
+            }
+
+            if ( cb >= BlockSize )
+            {
+                cb = ReadAt( offset + embedOffset, pv, cb );
+                offset += cb;
+                return cb;
+            }
+
+            BYTE * pb = (BYTE *) pv;
+            ULONG done = 0;
+
+            while ( done < cb )
+            {
+                ULONG available = 0;
+                BYTE const * pCached = CachedBytes( offset + embedOffset + done, available );
+                if ( !pCached )
+                    break;
+
+                ULONG n = __min( cb - done, available );
+                memcpy( pb + done, pCached, n );
+                done += n;
+            }
+
+            offset += done;
+            return done;
+        } //CachedRead
+
         bool Seek( __int64 location )
         {
             if ( location < 0 || location > length )
@@ -169,6 +354,21 @@ class CStream
             return true;
         } //Seek
 
+        // Asks the OS to start reading the first cb bytes of a file so a later open and read finds them cached.
+        // Only POSIX has a way to do this without waiting for the read; elsewhere it does nothing.
+
+        static void Prefetch( WCHAR const * pwcFile, ULONG cb = BlockSize )
+        {
+#if !defined( _WIN32 ) && defined( POSIX_FADV_WILLNEED )
+            HANDLE h = CreateFile( pwcFile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, 0 );
+            if ( INVALID_HANDLE_VALUE != h )
+            {
+                posix_fadvise( HandleToFd( h ), 0, cb, POSIX_FADV_WILLNEED );
+                CloseHandle( h );
+            }
+#endif
+        } //Prefetch
+
         bool Ok() { return ( INVALID_HANDLE_VALUE != hFile ); }
         __int64 Tell() { return offset; }
         __int64 Length() { return length; }
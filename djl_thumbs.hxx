@@ -0,0 +1,220 @@
+#pragma once
+
+//
+// On-disk cache of downscaled copies of images so repeated jobs over the same folders needn't decode originals.
+// Each image can have a pyramid of levels: copies whose long edge is 256, 512, 1024, or 2048 pixels (or the
+// original size if that's smaller). Each level is a separate file holding a small header followed by raw
+// 24bpp BGR rows, so loading one is a memory map and no decompression. A level is only used if the original
+// file's size and last-write time match what was recorded when the level was written.
+//
+
+#include <atomic>
+#include <string>
+
+#include <djl_mdcache.hxx>
+
+using namespace std;
+
+class CThumbnailCache
+{
+    public:
+        static const UINT SmallestLevel = 256;
+        static const UINT LargestLevel = 2048;
+
+        struct ThumbnailKey
+        {
+            unsigned long long pathHash;
+            unsigned long long fileSize;
+            unsigned long long lastWrite;
+        };
+
+        // A level mapped into memory. pixels is valid until the object is destroyed.
+
+        class CThumbnail
+        {
+            private:
+                HANDLE hFile;
+                HANDLE hMapping;
+                void * pView;
+
+                CThumbnail( CThumbnail const & );
+                CThumbnail & operator = ( CThumbnail const & );
+
+            public:
+                UINT width;
+                UINT height;
+                UINT stride;
+                byte const * pixels;
+
+                CThumbnail() : hFile( INVALID_HANDLE_VALUE ), hMapping( 0 ), pView( 0 ), width( 0 ), height( 0 ), stride( 0 ), pixels( 0 ) {}
+                ~CThumbnail() { Close(); }
+
+                void Close()
+                {
+                    if ( pView )
+                        UnmapViewOfFile( pView );
+                    if ( hMapping )
+                        CloseHandle( hMapping );
+                    if ( INVALID_HANDLE_VALUE != hFile )
+                        CloseHandle( hFile );
+
+                    hFile = INVALID_HANDLE_VALUE;
+                    hMapping = 0;
+                    pView = 0;
+                    pixels = 0;
+                } //Close
+
+                friend class CThumbnailCache;
+        };
+
+    private:
+        struct ThumbnailHeader
+        {
+            char signature[ 8 ];
+            UINT width;
+            UINT height;
+            UINT stride;
+            UINT reserved;
+            unsigned long long fileSize;
+            unsigned long long lastWrite;
+        };
+
+        WCHAR awcFolder[ MAX_PATH ];
+        atomic<size_t> hits;
+        atomic<size_t> misses;
+
+        static const char * Signature() { return "ICTHUMB1"; }
+
+        // The folder can be long, so the path is built as a string rather than formatted into a fixed buffer
+
+        wstring LevelPath( ThumbnailKey const & key, UINT level )
+        {
+            WCHAR awcName[ 64 ];
+            swprintf_s( awcName, _countof( awcName ), L"\\%016llx_%u.icthumb", key.pathHash, level );
+            return wstring( awcFolder ) + awcName;
+        } //LevelPath
+
+    public:
+        CThumbnailCache( WCHAR const * pwcFolder ) : hits( 0 ), misses( 0 )
+        {
+            wcscpy_s( awcFolder, _countof( awcFolder ), pwcFolder );
+
+            size_t len = wcslen( awcFolder );
+            if ( len > 0 && L'\\' == awcFolder[ len - 1 ] )
+                awcFolder[ len - 1 ] = 0;
+        }
+
+        size_t Hits() { return hits; }
+        size_t Misses() { return misses; }
+        void RecordLookup( bool hit ) { if ( hit ) hits++; else misses++; }
+
+        // The smallest level at least longEdge pixels, or 0 if longEdge is larger than the largest level
+
+        static UINT LevelFor( UINT longEdge )
+        {
+            for ( UINT level = SmallestLevel; level <= LargestLevel; level *= 2 )
+                if ( level >= longEdge )
+                    return level;
+
+            return 0;
+        } //LevelFor
+
+        // Returns false if the file can't be found
+
+        static bool GetKey( WCHAR const * pwcPath, ThumbnailKey & key )
+        {
+            WCHAR awcFull[ MAX_PATH ];
+            WIN32_FILE_ATTRIBUTE_DATA fad;
+
+            if ( 0 == _wfullpath( awcFull, pwcPath, _countof( awcFull ) ) ||
+                 !GetFileAttributesEx( awcFull, GetFileExInfoStandard, &fad ) )
+                return false;
+
+            key.pathHash = CMetadataCache::HashPath( awcFull );
+            key.fileSize = ( (unsigned long long) fad.nFileSizeHigh << 32 ) | fad.nFileSizeLow;
+            key.lastWrite = ( (unsigned long long) fad.ftLastWriteTime.dwHighDateTime << 32 ) | fad.ftLastWriteTime.dwLowDateTime;
+            return true;
+        } //GetKey
+
+        // Map the level into memory. Returns false if it isn't cached or is stale.
+
+        bool Load( ThumbnailKey const & key, UINT level, CThumbnail & thumb )
+        {
+            thumb.Close();
+
+            wstring path = LevelPath( key, level );
+
+            thumb.hFile = CreateFile( path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, 0, OPEN_EXISTING, 0, 0 );
+            if ( INVALID_HANDLE_VALUE == thumb.hFile )
+                return false;
+
+            LARGE_INTEGER size;
+            if ( GetFileSizeEx( thumb.hFile, &size ) && (unsigned long long) size.QuadPart >= sizeof( ThumbnailHeader ) )
+            {
+                thumb.hMapping = CreateFileMapping( thumb.hFile, 0, PAGE_READONLY, 0, 0, 0 );
+                if ( thumb.hMapping )
+                    thumb.pView = MapViewOfFile( thumb.hMapping, FILE_MAP_READ, 0, 0, 0 );
+            }
+
+            if ( thumb.pView )
+            {
+                ThumbnailHeader const * pHeader = (ThumbnailHeader const *) thumb.pView;
+
+                if ( !memcmp( pHeader->signature, Signature(), sizeof pHeader->signature ) &&
+                     pHeader->fileSize == key.fileSize && pHeader->lastWrite == key.lastWrite &&
+                     pHeader->stride >= 3 * pHeader->width &&
+                     ( sizeof( ThumbnailHeader ) + (unsigned long long) pHeader->stride * pHeader->height ) <= (unsigned long long) size.QuadPart )
+                {
+                    thumb.width = pHeader->width;
+                    thumb.height = pHeader->height;
+                    thumb.stride = pHeader->stride;
+                    thumb.pixels = (byte const *) ( pHeader + 1 );
+                    return true;
+                }
+            }
+
+            thumb.Close();
+            return false;
+        } //Load
+
+        // Write a level. pixels are 24bpp BGR with rows stride bytes apart.
+
+        HRESULT Store( ThumbnailKey const & key, UINT level, UINT width, UINT height, UINT stride, byte const * pixels )
+        {
+            wstring path = LevelPath( key, level );
+
+            // Write to a unique temporary file then rename, so readers in this or other processes never see partial files
+
+            WCHAR awcSuffix[ 32 ];
+            swprintf_s( awcSuffix, _countof( awcSuffix ), L".%u.%u.tmp", GetCurrentProcessId(), GetCurrentThreadId() );
+            wstring temp = path + awcSuffix;
+
+            FILE * fp = _wfopen( temp.c_str(), L"wb" );
+            if ( !fp )
+            {
+                printf( "can't create thumbnail cache file %ws\n", temp.c_str() );
+                return E_FAIL;
+            }
+
+            ThumbnailHeader header = {};
+            memcpy( header.signature, Signature(), sizeof header.signature );
+            header.width = width;
+            header.height = height;
+            header.stride = stride;
+            header.fileSize = key.fileSize;
+            header.lastWrite = key.lastWrite;
+
+            bool ok = ( 1 == fwrite( &header, sizeof header, 1, fp ) ) &&
+                      ( 1 == fwrite( pixels, (size_t) stride * height, 1, fp ) );
+            ok = ( 0 == fclose( fp ) ) && ok;
+
+            if ( !ok || !MoveFileEx( temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING ) )
+            {
+                printf( "can't write thumbnail cache file %ws\n", path.c_str() );
+                DeleteFile( temp.c_str() );
+                return E_FAIL;
+            }
+
+            return S_OK;
+        } //Store
+};
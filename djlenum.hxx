@@ -4,13 +4,29 @@
 // Enumerate the filesystem to build a list of paths matching a criteria
 //
 
-#include <windows.h>
-#include <windowsx.h>
+#ifdef _WIN32
+    #include <windows.h>
+    #include <windowsx.h>
+    #include <ppl.h>
+#else
+    #include <djl_posix.hxx>
+    #include <dirent.h>
+    #include <fnmatch.h>
+    #ifdef __linux__
+        #include <sys/syscall.h>
+    #endif
+#endif
 
-#include <djlsav.hxx>
 #include <djl_pa.hxx>
+#include <djlsav.hxx>
 #include <djltrace.hxx>
-#include <ppl.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 using namespace concurrency;
 
@@ -48,6 +64,150 @@ class CEnumFolder
             return false;
         }
 
+#ifdef _WIN32
+        // Paths of MAX_PATH or more can only be opened with the \\?\ prefix, or \\?\UNC\ for shares
+
+        static wstring LongPath( wstring const & path )
+        {
+            if ( path.length() < MAX_PATH || !wcsncmp( path.c_str(), L"\\\\?\\", 4 ) )
+                return path;
+
+            if ( !wcsncmp( path.c_str(), L"\\\\", 2 ) )
+                return L"\\\\?\\UNC\\" + path.substr( 2 );
+
+            return L"\\\\?\\" + path;
+        } //LongPath
+
+#endif
+
+        void AddResult( wstring & path, CPathArray::PathBatch & batch, FILETIME const & ftCreation, FILETIME const & ftLastWrite )
+        {
+            if ( 0 != resultPaths )
+                batch.Add( path.c_str(), path.length(), ftCreation, ftLastWrite );
+            if ( 0 != resultStrings )
+                resultStrings->Add( (WCHAR *) path.c_str() );
+        } //AddResult
+
+#ifndef _WIN32
+        // Reads one folder with getdents64 (readdir where that isn't available). Files are matched against the
+        // spec ignoring case like Windows does, and their times come from fstatat relative to the open folder,
+        // so no full paths are resolved. Subfolders are returned rather than enumerated here.
+
+        void EnumerateOne( string const & folder, char const * pcSpec, bool allFiles, vector<string> & aDirs )
+        {
+            int dirfd = open( folder.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+            if ( -1 == dirfd )
+                return;
+
+            wstring path;
+            Utf8ToWide( folder.c_str(), folder.length(), path );
+            if ( L'/' != path.back() )
+                path += L'/';
+            size_t len = path.length();
+
+            CPathArray::PathBatch batch;
+
+            auto onEntry = [&] ( char const * pcName, unsigned char type )
+            {
+                if ( !strcmp( pcName, "." ) || !strcmp( pcName, ".." ) )
+                    return;
+
+                struct stat st;
+                bool haveStat = false;
+
+                if ( DT_UNKNOWN == type || DT_LNK == type )
+                {
+                    // follow links to files, but not to folders since that can loop
+
+                    if ( 0 != fstatat( dirfd, pcName, &st, 0 ) )
+                        return;
+
+                    haveStat = true;
+                    type = S_ISDIR( st.st_mode ) ? ( ( DT_LNK == type ) ? DT_LNK : DT_DIR ) : S_ISREG( st.st_mode ) ? DT_REG : DT_UNKNOWN;
+                }
+
+                if ( DT_DIR == type )
+                {
+                    if ( recurse )
+                        aDirs.push_back( ( '/' == folder.back() ) ? folder + pcName : folder + '/' + pcName );
+                    return;
+                }
+
+                if ( DT_REG != type || ( !allFiles && 0 != fnmatch( pcSpec, pcName, FNM_CASEFOLD ) ) )
+                    return;
+
+                path.resize( len );
+                Utf8ToWide( pcName, strlen( pcName ), path );
+
+                // extensions are compared lowercase, but names keep their case since it's significant here
+
+                wstring name( path.c_str() + len );
+                _wcslwr( &name[ 0 ] );
+                if ( !HasValidExtension( name.c_str() ) )
+                    return;
+
+                FILETIME ftCreation = {}, ftLastWrite = {};
+
+                if ( 0 != resultPaths )
+                {
+                    if ( !haveStat && 0 != fstatat( dirfd, pcName, &st, 0 ) )
+                        return;
+
+                    StatFileTimes( st, &ftCreation, &ftLastWrite );
+                }
+
+                AddResult( path, batch, ftCreation, ftLastWrite );
+            };
+
+#ifdef __linux__
+            struct LinuxDirent64
+            {
+                uint64_t d_ino;
+                int64_t d_off;
+                unsigned short d_reclen;
+                unsigned char d_type;
+                char d_name[ 256 ];
+            };
+
+            static const int cbBuffer = 64 * 1024;
+            unique_ptr<uint64_t[]> buffer( new uint64_t[ cbBuffer / sizeof( uint64_t ) ] );
+            char * pcBuffer = (char *) buffer.get();
+
+            do
+            {
+                long cb = syscall( SYS_getdents64, dirfd, pcBuffer, cbBuffer );
+                if ( cb <= 0 )
+                    break;
+
+                for ( long pos = 0; pos < cb; )
+                {
+                    LinuxDirent64 const * pEntry = (LinuxDirent64 const *) ( pcBuffer + pos );
+                    onEntry( pEntry->d_name, pEntry->d_type );
+                    pos += pEntry->d_reclen;
+                }
+            } while ( true );
+
+            close( dirfd );
+#else
+            DIR * pDir = fdopendir( dirfd );
+            if ( 0 == pDir )
+            {
+                close( dirfd );
+                return;
+            }
+
+            struct dirent * pEntry;
+            while ( 0 != ( pEntry = readdir( pDir ) ) )
+                onEntry( pEntry->d_name, pEntry->d_type );
+
+            closedir( pDir );
+#endif
+
+            if ( 0 != resultPaths )
+                resultPaths->AddBatch( batch );
+        } //EnumerateOne
+#endif
+
     public:
         // recurse:      true to recurse into folders
         // pPathArray:   files found
@@ -74,38 +234,37 @@ class CEnumFolder
 
         // pwcFolder:   the root of the enumeration, e.g. C:\users
         // pwcFileSpec: a wildcard string like "*", "*.jpg", or "??.jpg". Can be NULL for "*"
-
+        //
+        // Each folder's matches are gathered in a local batch and added to the results with one lock, so workers
+        // don't contend per file. Subfolders are enumerated with parallel_for, whose scheduler steals work, so
+        // idle workers pick up folders that others haven't gotten to. Paths can be longer than MAX_PATH; those
+        // are returned with the \\?\ prefix that Windows requires to open them.
+        // On POSIX, one thread per core takes folders from a shared queue and adds the subfolders it finds back
+        // to it, so the walk stays parallel however unbalanced the tree is.
+
+#ifdef _WIN32
         void Enumerate( const WCHAR * pwcFolder, const WCHAR * pwcFileSpec )
         {
             size_t len = wcslen( pwcFolder );
             if ( 0 == len )
                 return;
 
-            WCHAR *pwcSpec = ( 0 == pwcFileSpec ) ? L"*" : pwcFileSpec;
-            size_t specLen = wcslen( pwcSpec );
+            const WCHAR * pwcSpec = ( 0 == pwcFileSpec ) ? L"*" : pwcFileSpec;
 
-            WCHAR awc[ MAX_PATH ];
-
-            if ( ( len + 1 + specLen ) >= _countof( awc ) )
+            wstring path( pwcFolder );
+            if ( L'\\' != path[ len - 1 ] )
             {
-                tracer.Trace( "skipping very long enumerate path %ws\n", pwcFolder );
-                return;
+                path += L'\\';
+                len++;
             }
 
-            wcscpy_s( awc, len + 1, pwcFolder );
-            if ( L'\\' != awc[ len - 1 ] )
-            {
-                awc[ len++ ] = L'\\';
-                awc[ len ] = 0;
-            }
-
-            wcscpy_s( awc + len, specLen + 1, pwcSpec );
-
             bool allFiles = ( !wcscmp( pwcSpec, L"*" ) || !wcscmp( pwcSpec, L"*.*" ) );
 
-            CStringArray aDirs;
+            vector<wstring> aDirs;
+            CPathArray::PathBatch batch;
             WIN32_FIND_DATA fd;
-            HANDLE hFile = FindFirstFileEx( awc, FindExInfoBasic, &fd, FindExSearchNameMatch, 0, FIND_FIRST_EX_LARGE_FETCH | FIND_FIRST_EX_ON_DISK_ENTRIES_ONLY );
+            HANDLE hFile = FindFirstFileEx( LongPath( path + pwcSpec ).c_str(), FindExInfoBasic, &fd, FindExSearchNameMatch, 0,
+                                            FIND_FIRST_EX_LARGE_FETCH | FIND_FIRST_EX_ON_DISK_ENTRIES_ONLY );
 
             if ( INVALID_HANDLE_VALUE != hFile )
             {
@@ -114,28 +273,23 @@ class CEnumFolder
                     if ( wcscmp( fd.cFileName, L"." ) && wcscmp( fd.cFileName, L".." ) )
                     {
                         _wcslwr( fd.cFileName );
-                        size_t namelen = wcslen( fd.cFileName );
-        
-                        if ( ( namelen + len ) < _countof( awc ) )
-                        {
-                            wcscpy_s( awc + len, namelen + 1, fd.cFileName );
+                        path.resize( len );
+                        path += fd.cFileName;
 
-                            if ( fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY )
-                            {
-                                if ( recurse && allFiles )
-                                    aDirs.Add( awc );
-                            }
-                            else if ( HasValidExtension( fd.cFileName ) )
-                            {
-                                if ( 0 != resultPaths )
-                                    resultPaths->Add( awc, fd.ftCreationTime, fd.ftLastWriteTime );
-                                if ( 0 != resultStrings )
-                                    resultStrings->Add( awc );
-                            }
+                        if ( fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY )
+                        {
+                            if ( recurse && allFiles )
+                                aDirs.push_back( path );
                         }
-                        else
+                        else if ( HasValidExtension( fd.cFileName ) )
                         {
-                            tracer.Trace( "skipping very long path %ws and file %ws\n", awc, fd.cFileName );
+                            if ( path.length() >= MAX_PATH )
+                            {
+                                wstring longPath = LongPath( path );
+                                AddResult( longPath, batch, fd.ftCreationTime, fd.ftLastWriteTime );
+                            }
+                            else
+                                AddResult( path, batch, fd.ftCreationTime, fd.ftLastWriteTime );
                         }
                     }
                 } while ( FindNextFile( hFile, &fd ) );
@@ -143,14 +297,17 @@ class CEnumFolder
                 FindClose( hFile );
             }
 
+            if ( 0 != resultPaths )
+                resultPaths->AddBatch( batch );
+
             if ( recurse )
             {
                 // If the filespec didn't include all files, look for folders here
 
                 if ( !allFiles )
                 {
-                    wcscpy_s( awc + len, 2, L"*" );
-                    hFile = FindFirstFileEx( awc, FindExInfoBasic, &fd, FindExSearchLimitToDirectories, 0, FIND_FIRST_EX_LARGE_FETCH );
+                    path.resize( len );
+                    hFile = FindFirstFileEx( LongPath( path + L"*" ).c_str(), FindExInfoBasic, &fd, FindExSearchLimitToDirectories, 0, FIND_FIRST_EX_LARGE_FETCH );
                 
                     if ( INVALID_HANDLE_VALUE != hFile )
                     {
@@ -160,18 +317,9 @@ class CEnumFolder
                                  ( 0 != wcscmp( fd.cFileName, L".") ) &&
                                  ( 0 != wcscmp( fd.cFileName, L"..") ) )
                             {
-                                size_t fileLen = wcslen( fd.cFileName );
-                
-                                if ( ( len + fileLen + 2 ) >= _countof( awc ) )
-                                {
-                                    tracer.Trace( "skipping very long path %ws and directory %ws\n", awc, fd.cFileName );
-                                    continue;
-                                }
-
-                                wcscpy_s( awc + len, fileLen + 1, fd.cFileName );
-                                wcscpy_s( awc + len + fileLen, 2, L"\\" );
-
-                                aDirs.Add( awc );
+                                path.resize( len );
+                                path += fd.cFileName;
+                                aDirs.push_back( path );
                             }
                         } while ( FindNextFile( hFile, &fd ) );
                 
@@ -179,11 +327,64 @@ class CEnumFolder
                     }
                 }
 
-                parallel_for( 0, (int) aDirs.Count(), [&] ( int i )
+                parallel_for( 0, (int) aDirs.size(), [&] ( int i )
                 {
-                    Enumerate( aDirs[ i ], pwcFileSpec );
+                    Enumerate( aDirs[ i ].c_str(), pwcFileSpec );
                 } );
             }
         }
+#else
+        void Enumerate( const WCHAR * pwcFolder, const WCHAR * pwcFileSpec )
+        {
+            if ( 0 == wcslen( pwcFolder ) )
+                return;
+
+            string spec = WideToUtf8( ( 0 == pwcFileSpec ) ? L"*" : pwcFileSpec );
+            bool allFiles = ( "*" == spec || "*.*" == spec );
+
+            deque<string> folders;
+            folders.push_back( WideToUtf8( pwcFolder ) );
+            size_t busy = 0;
+            mutex mtx;
+            condition_variable cvWork;
+
+            auto worker = [&] ()
+            {
+                vector<string> aDirs;
+                unique_lock<mutex> lock( mtx );
+
+                do
+                {
+                    cvWork.wait( lock, [&] { return !folders.empty() || 0 == busy; } );
+                    if ( folders.empty() )
+                        break;
+
+                    string folder = move( folders.front() );
+                    folders.pop_front();
+                    busy++;
+                    lock.unlock();
+
+                    aDirs.clear();
+                    EnumerateOne( folder, spec.c_str(), allFiles, aDirs );
+
+                    lock.lock();
+                    for ( size_t i = 0; i < aDirs.size(); i++ )
+                        folders.push_back( move( aDirs[ i ] ) );
+                    busy--;
+                    cvWork.notify_all();
+                } while ( true );
+            };
+
+            vector<thread> threads;
+            if ( recurse )
+                for ( unsigned i = 1; i < thread::hardware_concurrency(); i++ )
+                    threads.emplace_back( worker );
+
+            worker();
+
+            for ( size_t i = 0; i < threads.size(); i++ )
+                threads[ i ].join();
+        }
+#endif
 };
 
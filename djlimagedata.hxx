@@ -7,18 +7,23 @@
 // Multi-threaded runtime is:   48% in ReadFile,   28% in CreateFile, 4% in CloseHandle, 1.0% in SetFilePointerEx, 0.6% in GetFileSizeEx.
 //
 // This code reduces the calls to ReadFile at the expense of some clarity.
-
-#include <windows.h>
-#include <shlwapi.h>
+// CStream also serves reads from a cache of 64k blocks, so most field reads don't call ReadFile at all.
+
+#ifdef _WIN32
+    #include <windows.h>
+    #include <shlwapi.h>
+    #include <io.h>
+    #include <eh.h>
+#else
+    #include <djl_posix.hxx>
+#endif
 
 #include <stdlib.h>
 #include <stdio.h>
-#include <io.h>
 #include <limits.h>
 #include <float.h>
-#include <eh.h>
 #include <math.h>
-#include <sys\stat.h>
+#include <sys/stat.h>
 #include <assert.h>
 
 #include <string>
@@ -49,6 +54,47 @@ using namespace std;
   13 = IFD pointer (Olympus ORF uses this)
 */
 
+// Fields that can be requested from CImageData::Parse()
+
+enum ImageDataField
+{
+    idfCaptureTime = 1,
+    idfOrientation = 2,
+    idfDimensions = 4,
+    idfCamera = 8,
+    idfGPS = 0x10,
+    idfRating = 0x20,
+    idfFocalLength = 0x40,
+    idfLens = 0x80,
+    idfEmbeddedImage = 0x100,
+};
+
+// The results of CImageData::Parse(). fields has the ImageDataField bits for the members that were found.
+
+struct ImageDataResult
+{
+    DWORD fields;
+    char acCaptureTime[ 20 ];    // e.g. 2005:02:17 21:21:31
+    int orientation;             // exif orientation 1..8
+    int width;
+    int height;
+    char acMake[ 100 ];
+    char acModel[ 100 ];
+    double latitude;
+    double longitude;
+    char rating;                 // 0..5
+    double focalLength;          // best guess at the 35mm-equivalent focal length
+    char acLens[ 100 ];          // lens model
+    __int64 embeddedOffset;      // where the preview image in a RAW or HEIF file starts, e.g. a JPG
+    __int64 embeddedLength;
+    int embeddedWidth;           // 0 if the parser didn't find the preview's dimensions
+    int embeddedHeight;
+};
+
+// The public methods other than Parse() cache results for the most recent path and lock to protect that cache,
+// so one instance can be shared by threads but they'll take turns. Parse() uses a fresh instance on the stack
+// as its parsing context, so any number of threads can call it concurrently without sharing anything mutable.
+
 class CImageData
 {
 private:
@@ -119,13 +165,12 @@ private:
     };
     
     std::mutex g_mtx;
-    CCropFactor g_factor;
     CStream * g_pStream = NULL;
     const double InvalidCoordinate = 1000.0;
     static const WORD MaxIFDHeaders = 200; // assume anything more than this is a corrupt or badly parsed file.
                                            // panasonic makernotes sometimes have 133 entries.
     
-    WCHAR g_awcPath[ MAX_PATH + 1 ];
+    wstring g_path;                        // enumeration can return \\?\ paths longer than MAX_PATH
     FILETIME g_ftWrite;
     
     DWORD g_Heif_Exif_ItemID                = 0xffffffff;
@@ -180,7 +225,16 @@ private:
     bool g_holdsAdobeEditsInXMP;
     __int64 g_RatingInXMP_Offset = 0; // offset of 1 ascii character in the range of 0-5.
     char g_RatingInXMP = 0;
+    char g_acAspect[ 20 ];
     
+    // The crop factor table is read-only, so all instances share one lookup object
+
+    static CCropFactor & CropFactors()
+    {
+        static CCropFactor factor;
+        return factor;
+    } //CropFactors
+
     WORD FixEndianWORD( WORD w, bool littleEndian )
     {
         if ( !littleEndian )
@@ -234,9 +288,9 @@ private:
         return w;
     } //GetWORD
     
-    byte GetBYTE( __int64 offset )
+    BYTE GetBYTE( __int64 offset )
     {
-        byte b = 0;
+        BYTE b = 0;
 
         if ( g_pStream->Seek( offset ) )
             g_pStream->Read( &b, sizeof b );
@@ -258,7 +312,7 @@ private:
             return true;
 
         bool ok = true;
-        int cb = sizeof IFDHeader * numHeaders;
+        int cb = sizeof( IFDHeader ) * numHeaders;
 
         GetBytes( offset, pHeader, cb );
         for ( WORD i = 0; i < numHeaders; i++ )
@@ -275,7 +329,7 @@ private:
 
             if ( pHeader[i].type > 13 )
             {
-                tracer.Trace( "record %d has invalid type %#x make %s, model %s, path %ws\n", i, pHeader[i].type, g_acMake, g_acModel, g_awcPath );
+                tracer.Trace( "record %d has invalid type %#x make %s, model %s, path %ws\n", i, pHeader[i].type, g_acMake, g_acModel, g_path.c_str() );
                 ok = false;
                 break;
             }
@@ -286,9 +340,9 @@ private:
     
     int GetTwoDWORDs( __int64 offset, TwoDWORDs * pb, bool littleEndian )
     {
-        GetBytes( offset, pb, sizeof TwoDWORDs );
+        GetBytes( offset, pb, sizeof( TwoDWORDs ) );
         pb->Endian( littleEndian );
-        return sizeof TwoDWORDs;
+        return sizeof( TwoDWORDs );
     } //GetTwoDWORDs
     
     void GetString( __int64 offset, char * pcOutput, int outputSize, int maxBytes )
@@ -390,7 +444,7 @@ private:
             for ( int i = 0; i < NumTags; i++ )
             {
                 IFDHeader & head = aHeaders[ i ];
-                IFDOffset += sizeof IFDHeader;
+                IFDOffset += sizeof( IFDHeader );
 
                 if ( 1 == head.id && 2 == head.type )
                 {
@@ -476,7 +530,7 @@ private:
             for ( int i = 0; i < NumTags; i++ )
             {
                 IFDHeader & head = aHeaders[ i ];
-                IFDOffset += sizeof IFDHeader;
+                IFDOffset += sizeof( IFDHeader );
 
                 if ( 0x201 == head.id && 4 == head.type )
                 {
@@ -518,7 +572,7 @@ private:
             for ( int i = 0; i < NumTags; i++ )
             {
                 IFDHeader & head = aHeaders[ i ];
-                IFDOffset += sizeof IFDHeader;
+                IFDOffset += sizeof( IFDHeader );
 
                 if ( 2 == head.id && 3 == head.type )
                 {
@@ -558,7 +612,7 @@ private:
             for ( int i = 0; i < NumTags; i++ )
             {
                 IFDHeader & head = aHeaders[ i ];
-                IFDOffset += sizeof IFDHeader;
+                IFDOffset += sizeof( IFDHeader );
 
                 if ( 256 == head.id && 4 == head.type )
                 {
@@ -604,7 +658,7 @@ private:
             for ( int i = 0; i < NumTags; i++ )
             {
                 IFDHeader & head = aHeaders[ i ];
-                IFDOffset += sizeof IFDHeader;
+                IFDOffset += sizeof( IFDHeader );
     
                 if ( 16 == head.id )
                 {
@@ -663,7 +717,7 @@ private:
             for ( int i = 0; i < NumTags; i++ )
             {
                 IFDHeader & head = aHeaders[ i ];
-                IFDOffset += sizeof IFDHeader;
+                IFDOffset += sizeof( IFDHeader );
                 
                 if ( 37 == head.id && 7 == head.type && 16 == head.count )
                 {
@@ -862,7 +916,7 @@ private:
             for ( int i = 0; i < NumTags; i++ )
             {
                 IFDHeader & head = aHeaders[ i ];
-                IFDOffset += sizeof IFDHeader;
+                IFDOffset += sizeof( IFDHeader );
 
                 if ( 5 == head.id && 7 == head.type && isRicohTheta )
                 {
@@ -955,7 +1009,7 @@ private:
             for ( int i = 0; i < NumTags; i++ )
             {
                 IFDHeader & head = aHeaders[ i ];
-                IFDOffset += sizeof IFDHeader;
+                IFDOffset += sizeof( IFDHeader );
 
                 if ( 33434 == head.id && 5 == head.type )
                 {
@@ -1139,7 +1193,7 @@ private:
             for ( int i = 0; i < NumTags; i++ )
             {
                 IFDHeader & head = aHeaders[ i ];
-                IFDOffset += sizeof IFDHeader;
+                IFDOffset += sizeof( IFDHeader );
 
                 //tracer.Trace( "genericifd head.id %d\n", head.id );
     
@@ -1381,9 +1435,9 @@ private:
                 return w;
             } //GetWORD
     
-            byte GetBYTE( __int64 & streamOffset )
+            BYTE GetBYTE( __int64 & streamOffset )
             {
-                byte b = 0;
+                BYTE b = 0;
 
                 if ( pStream->Seek( offset + streamOffset ) )
                 {
@@ -1826,7 +1880,7 @@ private:
             for ( int i = 0; i < NumTags; i++ )
             {
                 IFDHeader & head = aHeaders[ i ];
-                IFDOffset += sizeof IFDHeader;
+                IFDOffset += sizeof( IFDHeader );
 
                 if ( ( !_wcsicmp( pwcExt, L".rw2" ) ) && ( ( head.id < 254 ) || ( head.id >= 280 && head.id <= 290 ) ) )
                 {
@@ -2194,7 +2248,7 @@ private:
     {
         __int64 len = g_pStream->Length();
 
-        if ( len < ( sizeof BITMAPFILEHEADER + sizeof BITMAPINFOHEADER ) )
+        if ( len < ( sizeof( BITMAPFILEHEADER ) + sizeof( BITMAPINFOHEADER ) ) )
             return;
 
         BITMAPFILEHEADER bfh;
@@ -2260,8 +2314,8 @@ private:
         struct ID3v2Header
         {
             char id[ 3 ];
-            byte ver[ 2 ];
-            byte flags;
+            BYTE ver[ 2 ];
+            BYTE flags;
             DWORD size;
         };
     
@@ -2291,7 +2345,7 @@ private:
         struct ID3v22FrameHeader
         {
             char id[3];
-            byte size[3];
+            BYTE size[3];
         };
     
         while ( frameOffset < ( start.size + firstFrameOffset ) )
@@ -2362,11 +2416,11 @@ private:
                 // Every MP3 in my collection had far less than 100 bytes of data prior to the image itself.
                 // I'm using 200 in case there are really odd MP3s out there
 
-                byte apicdata[ 200 ];
+                BYTE apicdata[ 200 ];
                 GetBytes( o, &apicdata, sizeof apicdata );
 
                 int datao = 0;
-                byte encoding = apicdata[ datao++ ];
+                BYTE encoding = apicdata[ datao++ ];
     
                 if ( 0 != encoding && 1 != encoding && 3 != encoding )
                 {
@@ -2432,7 +2486,7 @@ private:
                    return;
                }
 
-                byte pictureType = apicdata[ datao++ ];
+                BYTE pictureType = apicdata[ datao++ ];
     
                 i = 0;
                 bool foundEndOfString = false;
@@ -3024,7 +3078,7 @@ private:
         FILETIME ftCreate, ftAccess, ftWrite;
 #endif
     
-        if ( !_wcsicmp( pwcPath, g_awcPath ) )
+        if ( !_wcsicmp( pwcPath, g_path.c_str() ) )
         {
 #if HANDLE_FILE_CHANGES
             hFile = CreateFile( pwcPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL );
@@ -3052,7 +3106,7 @@ private:
     
             if ( INVALID_HANDLE_VALUE != hFile )
             {
-                wcscpy_s( g_awcPath, _countof( g_awcPath ), pwcPath );
+                g_path = pwcPath;
 
 #if HANDLE_FILE_CHANGES
                 FILETIME ftCreate, ftAccess, ftWrite;
@@ -3119,7 +3173,7 @@ private:
     {
         // find the closest matching whole integer aspect ratio 1x20 to 20x1
 
-        static char acAspect[ 20 ];
+        char * acAspect = g_acAspect;
         acAspect[ 0 ] = 0;
 
         if ( 0 == w || 0 == h )
@@ -3149,26 +3203,21 @@ private:
         }
 
         if ( bestdiff < 0.01 )
-            sprintf_s( acAspect, _countof( acAspect ), " (%dx%d)", bestw, besth );
+            sprintf_s( acAspect, _countof( g_acAspect ), " (%dx%d)", bestw, besth );
 
         return acAspect;
     } //FindAspectRatio
     
-public:
-
-    double FindFocalLength( const WCHAR * pwcPath, double &focalLength, int & flIn35mmFilm, double &flGuess, double &flComputed, char * pcModel, int modelLen )
+    double ComputeFocalLength( double &focalLength, int & flIn35mmFilm, double &flGuess, double &flComputed )
     {
-        UpdateCache( pwcPath );
-
         double flBestGuess = 0.0;
         focalLength = 0.0;
         flIn35mmFilm = 0;
         flGuess = 0.0;
         flComputed = 0.0;
         flBestGuess = 0.0;
-        strcpy_s( pcModel, modelLen, g_acModel );
 
-        double cropGuess = g_factor.GetCropFactor( g_acModel );
+        double cropGuess = CropFactors().GetCropFactor( g_acModel );
         double cropComputed = GetComputedCropFactor();
         bool validFL = validFLVal( g_FocalLengthNum ) && validFLVal( g_FocalLengthDen );
         bool validCropGuess = validFLVal( cropGuess );
@@ -3206,6 +3255,110 @@ public:
         }
 
         return flBestGuess;
+    } //ComputeFocalLength
+
+    void CopyResult( DWORD fields, ImageDataResult & result )
+    {
+        if ( fields & idfCaptureTime )
+        {
+            char const * p = ( 0 != g_acDateTimeOriginal[ 0 ] ) ? g_acDateTimeOriginal : g_acDateTime;
+
+            if ( 19 == strlen( p ) )
+            {
+                strcpy_s( result.acCaptureTime, _countof( result.acCaptureTime ), p );
+                result.fields |= idfCaptureTime;
+            }
+        }
+
+        if ( ( fields & idfOrientation ) && -1 != g_Orientation_Value )
+        {
+            result.orientation = g_Orientation_Value;
+            result.fields |= idfOrientation;
+        }
+
+        if ( ( fields & idfDimensions ) && g_ImageWidth > 0 && g_ImageHeight > 0 )
+        {
+            result.width = g_ImageWidth;
+            result.height = g_ImageHeight;
+            result.fields |= idfDimensions;
+        }
+
+        if ( ( fields & idfCamera ) && ( 0 != g_acMake[ 0 ] || 0 != g_acModel[ 0 ] ) )
+        {
+            strcpy_s( result.acMake, _countof( result.acMake ), g_acMake );
+            strcpy_s( result.acModel, _countof( result.acModel ), g_acModel );
+            result.fields |= idfCamera;
+        }
+
+        if ( ( fields & idfGPS ) && InvalidCoordinate != g_Latitude && InvalidCoordinate != g_Longitude )
+        {
+            result.latitude = g_Latitude;
+            result.longitude = g_Longitude;
+            result.fields |= idfGPS;
+        }
+
+        if ( ( fields & idfRating ) && 0 != g_RatingInXMP_Offset )
+        {
+            result.rating = g_RatingInXMP;
+            result.fields |= idfRating;
+        }
+
+        if ( fields & idfFocalLength )
+        {
+            double focalLength, flGuess, flComputed;
+            int flIn35mmFilm;
+            result.focalLength = ComputeFocalLength( focalLength, flIn35mmFilm, flGuess, flComputed );
+
+            if ( result.focalLength > 0.0 )
+                result.fields |= idfFocalLength;
+        }
+
+        if ( ( fields & idfLens ) && 0 != g_acLensModel[ 0 ] )
+        {
+            strcpy_s( result.acLens, _countof( result.acLens ), g_acLensModel );
+            result.fields |= idfLens;
+        }
+
+        if ( ( fields & idfEmbeddedImage ) && 0 != g_Embedded_Image_Offset && 0 != g_Embedded_Image_Length )
+        {
+            result.embeddedOffset = g_Embedded_Image_Offset;
+            result.embeddedLength = g_Embedded_Image_Length;
+            result.embeddedWidth = g_Embedded_Image_Width;
+            result.embeddedHeight = g_Embedded_Image_Height;
+            result.fields |= idfEmbeddedImage;
+        }
+    } //CopyResult
+
+public:
+
+    // Parse a file and return just the requested ImageDataField fields. Reentrant; see the comment above the class.
+    // Returns false if the file can't be opened. Fields that aren't in the file aren't set in result.fields.
+
+    static bool Parse( const WCHAR * pwcPath, DWORD fields, ImageDataResult & result )
+    {
+        memset( &result, 0, sizeof result );
+        result.orientation = 1;
+
+        HANDLE hFile = CreateFile( pwcPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL );
+        if ( INVALID_HANDLE_VALUE == hFile )
+            return false;
+
+        CImageData context;
+        context.g_path = pwcPath;
+        context.EnumerateImageData( hFile, pwcPath );
+        CloseHandle( hFile );
+
+        context.CopyResult( fields, result );
+        return true;
+    } //Parse
+
+    double FindFocalLength( const WCHAR * pwcPath, double &focalLength, int & flIn35mmFilm, double &flGuess, double &flComputed, char * pcModel, int modelLen )
+    {
+        UpdateCache( pwcPath );
+
+        strcpy_s( pcModel, modelLen, g_acModel );
+
+        return ComputeFocalLength( focalLength, flIn35mmFilm, flGuess, flComputed );
     } //FindFocalLength
 
     bool FindFNumber( const WCHAR * pwcPath, double * pFNumber )
@@ -3328,7 +3481,7 @@ public:
         // Try to find both the focal length and effective focal length (if it's different / not full frame)
     
         {
-            double cropGuess = g_factor.GetCropFactor( g_acModel );
+            double cropGuess = CropFactors().GetCropFactor( g_acModel );
             double cropComputed = GetComputedCropFactor();
             bool validFL = validFLVal( g_FocalLengthNum ) && validFLVal( g_FocalLengthDen );
             bool validCropGuess = validFLVal( cropGuess );
@@ -3495,6 +3648,13 @@ public:
             return false;
         }
 
+        if ( g_Orientation_Value > 8 || g_Orientation_Value < 1 )
+        {
+            tracer.Trace( "ignoring illegal orientation value %d\n", g_Orientation_Value );
+            return false;
+        }
+
+        *orientation = g_Orientation_Value;
         return true;
     } //GetOrientation
 
@@ -3743,7 +3903,7 @@ public:
     void PurgeCache()
     {
         InitializeGlobals();
-        g_awcPath[ 0 ] = 0;
+        g_path.clear();
     }
     
     CImageData()
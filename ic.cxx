@@ -7,18 +7,30 @@
 #include <wincodec.h>
 #include <wincodecsdk.h>
 #include <shlwapi.h>
+#include <shellapi.h>
+#include <sddl.h>
 #include <wrl.h>
 #include <mferror.h>
 #include <psapi.h>
 #include <gdiplus.h>
 
 #include <stdio.h>
+#include <io.h>
+#include <fcntl.h>
 #include <assert.h>
 #include <math.h>
+#include <float.h>
 #include <ppl.h>
 
 #include <chrono>
 #include <memory>
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
 
 using namespace std;
 using namespace std::chrono;
@@ -34,19 +46,34 @@ using namespace Gdiplus;
 #include <djl_kmeans.hxx>
 #include <djl_kdtree.hxx>
 #include <djl_common.hxx>
+#include <djl_sched.hxx>
+#include <djl_caption.hxx>
+#include <djl_pack.hxx>
+#include <djl_mdcache.hxx>
+#include <djl_thumbs.hxx>
+#include <djl_manifest.hxx>
+#include <djl_palette.hxx>
+#include <djl_mdindex.hxx>
+#include <djl_radix.hxx>
 //#include <warp_sort.hxx>
 
 #pragma comment( lib, "ole32.lib" )
 #pragma comment( lib, "shlwapi.lib" )
+#pragma comment( lib, "shell32.lib" )
 #pragma comment( lib, "oleaut32.lib" )
 #pragma comment( lib, "windowscodecs.lib" )
 #pragma comment( lib, "gdi32.lib" )
 #pragma comment( lib, "user32.lib" )
 #pragma comment( lib, "Gdiplus.lib" )
+#pragma comment( lib, "advapi32.lib" )
 
 CDJLTrace tracer;
 std::mutex g_mtxGDI;
 ComPtr<IWICImagingFactory> g_IWICFactory;
+CMetadataCache * g_pMetadataCache = 0;
+CThumbnailCache * g_pThumbnailCache = 0;
+bool g_UseEmbeddedPreviews = false;   // -j
+CBuildManifest * g_pManifest = 0;
 long long g_CollagePrepTime = 0;
 long long g_CollageStitchTime = 0;
 long long g_CollageStitchFloodTime = 0;
@@ -63,6 +90,8 @@ long long g_ShowColorsPostClusterTime = 0;
 long long g_ShowColorsPaletteTime = 0;
 long long g_PosterizePixelsTime = 0;
 long long g_ReadPixelsTime = 0;
+long long g_ReducedDecodeTime = 0;
+long long g_EmbeddedPreviewTime = 0;
 long long g_WritePixelsTime = 0;
 long long g_ShowColorsCopyTime = 0;
 long long g_ShowColorsSortTime = 0;
@@ -84,6 +113,14 @@ struct BitmapDimensions
     UINT height;
 };
 
+struct CellRect
+{
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
 enum ColorMapping { mapNone, mapColor, mapBrightness, mapHue, mapSaturation, mapGradient };
 
 union ColorBytes
@@ -98,8 +135,9 @@ union ColorBytes
 
 struct ColorizationData
 {
-    ColorizationData() : mapping( mapNone ) {}
+    ColorizationData() : mapping( mapNone ), prepared( false ) {}
     ColorMapping mapping;
+    bool prepared;               // true once sorted and hsvdata or kdtree are built, e.g. loaded from a .icpal file
     vector<DWORD> bgrdata;
     vector<byte> hsvdata;        // may contain h, s, or v depending on mapping
     unique_ptr<KDTreeBGR> kdtree;
@@ -377,78 +415,10 @@ HRESULT ConvertBitmapTo24bppBGROr48bppRGB( ComPtr<IWICBitmapSource> & source, bo
     return hr;
 } //ConvertBitmapTo24bppBGROr48bppRGB
 
-HRESULT LoadWICBitmap( WCHAR const * pwcPath, ComPtr<IWICBitmapSource> & source, ComPtr<IWICBitmapFrameDecode> & frame, bool force24bppBGR )
-{
-    ComPtr<IWICBitmapDecoder> decoder;
-    HRESULT hr = S_OK;
-
-    hr = g_IWICFactory->CreateDecoderFromFilename( pwcPath, NULL, GENERIC_READ, WICDecodeMetadataCacheOnDemand, decoder.GetAddressOf() );
-
-    if ( FAILED( hr ) )
-    {
-        if ( WINCODEC_ERR_COMPONENTINITIALIZEFAILURE == hr )
-            printf( "  WINCODEC_ERR_COMPONENTINITIALIZEFAILURE:" );
-        printf( "  hr from CreateDecoderFromFilename: %#x for %ws\n", hr, pwcPath );
-        return hr;
-    }
-
-    hr = decoder->GetFrame( 0, frame.GetAddressOf() );
-
-    if ( SUCCEEDED( hr ) )
-        hr = frame->QueryInterface( IID_IWICBitmapSource, reinterpret_cast<void **> ( source.GetAddressOf() ) );
-
-    // Convert to a smaller format to reduce RAM usage and make it something the JPG encoder is known to accept.
-
-    if ( SUCCEEDED( hr ) )
-        hr = ConvertBitmapTo24bppBGROr48bppRGB( source, force24bppBGR );
-
-    return hr;
-} //LoadWICBitmap
-
-HRESULT CopyMetadata( ComPtr<IWICBitmapFrameEncode> encoder, ComPtr<IWICBitmapFrameDecode> & decoder )
-{
-    ComPtr<IWICMetadataBlockWriter> blockWriter;
-    ComPtr<IWICMetadataBlockReader> blockReader;
-    
-    HRESULT hr = decoder->QueryInterface( IID_IWICMetadataBlockReader, (void **) blockReader.GetAddressOf() );
-    if ( FAILED( hr ) )
-        printf( "can't qi block reader: %#x\n", hr );
-
-    if ( SUCCEEDED( hr ) )
-    {
-        hr = encoder->QueryInterface( IID_IWICMetadataBlockWriter, (void **) blockWriter.GetAddressOf() );
-        if ( FAILED( hr ) )
-            printf( "can't qi block writer: %#x\n", hr );
-    }
-    
-    if ( SUCCEEDED( hr ) )
-    {
-        hr = blockWriter->InitializeFromBlockReader( blockReader.Get() );
-        if ( FAILED( hr ) )
-            printf( "can't initializefromblockreader (copy metadata): %#x\n", hr );
-    }
-    else if ( E_NOINTERFACE == hr )
-    {
-        // bmp files do this -- they have no metadata block and so don't support the interface
-
-        hr = S_OK;
-    }
-    
-    return hr;
-} //CopyMetadata
+// The dimensions of an image after scaling it so its long edge is longEdge pixels
 
-HRESULT ScaleWICBitmap( ComPtr<IWICBitmapSource> & source, int longEdge, bool highQualityScaling )
+void ScaledSize( UINT width, UINT height, int longEdge, UINT & targetWidth, UINT & targetHeight )
 {
-    UINT width, height;
-    HRESULT hr = source->GetSize( &width, &height );
-    if ( FAILED( hr ) )
-    {
-        printf( "can't get size of input bitmap: %#x\n", hr );
-        return hr;
-    }
-
-    UINT targetWidth, targetHeight;
-
     if ( width > height )
     {
         targetWidth = longEdge;
@@ -459,11 +429,12 @@ HRESULT ScaleWICBitmap( ComPtr<IWICBitmapSource> & source, int longEdge, bool hi
         targetHeight = longEdge;
         targetWidth = (UINT) round( (double) longEdge / (double) height * (double) width );
     }
+} //ScaledSize
 
-    //printf( "original dimensions %u by %u, target %u by %u\n", width, height, targetWidth, targetHeight );
-
+HRESULT ScaleWICBitmapToSize( ComPtr<IWICBitmapSource> & source, UINT targetWidth, UINT targetHeight, bool highQualityScaling )
+{
     ComPtr<IWICBitmapScaler> scaler;
-    hr = g_IWICFactory->CreateBitmapScaler( scaler.GetAddressOf() );
+    HRESULT hr = g_IWICFactory->CreateBitmapScaler( scaler.GetAddressOf() );
     if ( FAILED( hr ) )
     {
         printf( "can't create a scaler: %#x\n", hr );
@@ -483,12 +454,11 @@ HRESULT ScaleWICBitmap( ComPtr<IWICBitmapSource> & source, int longEdge, bool hi
     source.Attach( scaler.Detach() );
 
     return hr;
-} //ScaleWICBitmap
+} //ScaleWICBitmapToSize
 
-HRESULT ClipWICBitmap( ComPtr<IWICBitmapSource> & source, int outputWidth, int outputHeight )
+HRESULT ScaleWICBitmap( ComPtr<IWICBitmapSource> & source, int longEdge, bool highQualityScaling )
 {
     UINT width, height;
-
     HRESULT hr = source->GetSize( &width, &height );
     if ( FAILED( hr ) )
     {
@@ -496,3092 +466,5925 @@ HRESULT ClipWICBitmap( ComPtr<IWICBitmapSource> & source, int outputWidth, int o
         return hr;
     }
 
-    double targetAspectRatio = (double) outputWidth / (double) outputHeight;
-    double inputAspectRatio = (double) width / (double) height;
-
     UINT targetWidth, targetHeight;
-    WICRect roiRect;
+    ScaledSize( width, height, longEdge, targetWidth, targetHeight );
 
-    if ( targetAspectRatio >= inputAspectRatio )
-    {
-        roiRect.X = 0;
-        roiRect.Width = width;
-        roiRect.Height = (int) ( (double) width / targetAspectRatio );
-        roiRect.Y = ( height - roiRect.Height ) / 2;
-    }
-    else
-    {
-        roiRect.Y = 0;
-        roiRect.Height = height;
-        roiRect.Width = (int) ( (double) height * targetAspectRatio );
-        roiRect.X = ( width - roiRect.Width ) / 2;
-    }
+    //printf( "original dimensions %u by %u, target %u by %u\n", width, height, targetWidth, targetHeight );
 
-    //printf( "original dimensions %u by %u, clip.x %d, clip.width %d, clip.y %d, clip.height %d\n",
-    //        width, height, roiRect.X, roiRect.Width, roiRect.Y, roiRect.Height );
+    return ScaleWICBitmapToSize( source, targetWidth, targetHeight, highQualityScaling );
+} //ScaleWICBitmap
 
-    ComPtr<IWICBitmapClipper> clipper;
-    hr = g_IWICFactory->CreateBitmapClipper( clipper.GetAddressOf() );
+// Some codecs (JPG in particular) can decode directly at 1/2, 1/4, or 1/8 scale in the DCT domain, which is
+// much faster than a full decode followed by a scale. Find the smallest such reduction whose long edge is still
+// at least minLongEdge so the high-quality scaler only has to do the last, under-2x step.
+// The same codecs can rotate and flip while they decode. If the codec supports transformOptions, it's applied
+// here, even at full scale, and transformOptions is set to WICBitmapTransformRotate0 so the caller knows.
+// Returns S_FALSE and leaves source untouched if the codec can't help.
+
+bool TransformSwapsAxes( WICBitmapTransformOptions transformOptions )
+{
+    // Rotate90 and Rotate270 both have this bit; Rotate180 and the flips don't
+
+    return 0 != ( transformOptions & WICBitmapTransformRotate90 );
+} //TransformSwapsAxes
+
+HRESULT LoadReducedWICBitmap( ComPtr<IWICBitmapFrameDecode> & frame, ComPtr<IWICBitmapSource> & source, UINT minLongEdge,
+                              WICBitmapTransformOptions & transformOptions )
+{
+    ComPtr<IWICBitmapSourceTransform> transform;
+    HRESULT hr = frame->QueryInterface( IID_IWICBitmapSourceTransform, (void **) transform.GetAddressOf() );
     if ( FAILED( hr ) )
+        return S_FALSE;
+
+    bool orient = false;
+    if ( WICBitmapTransformRotate0 != transformOptions )
     {
-        printf( "can't create a clipper: %#x\n", hr );
-        return hr;
+        BOOL supported = FALSE;
+        orient = SUCCEEDED( transform->DoesSupportTransform( transformOptions, &supported ) ) && supported;
     }
 
-    hr = clipper->Initialize( source.Get(), &roiRect );
+    UINT width, height;
+    hr = frame->GetSize( &width, &height );
     if ( FAILED( hr ) )
     {
-        printf( "can't initialize clipper: %#x\n", hr );
+        printf( "can't get size of frame for reduced decode: %#x\n", hr );
         return hr;
     }
 
-    source.Reset();
-    source.Attach( clipper.Detach() );
-
-    return hr;
-} //ClipWICBitmap
+    UINT longEdge = __max( width, height );
+    UINT scale = 1;
 
-static int StrideInBytes( int width, int bitsPerPixel )
-{
-    // Not sure if it's documented anywhere, but Windows seems to use 4-byte-aligned strides.
-    // Stride is the number of bytes per row of an image. The last bytes to get to 4-byte alignment are unused.
-    // Based on Internet searches, some other platforms use 8-byte-aligned strides.
-    // I don't know how to query the runtime environment to tell what the default stride alignment is. Assume 4.
+    while ( ( 0 != minLongEdge ) && ( scale < 8 ) && ( ( longEdge / ( scale * 2 ) ) >= minLongEdge ) )
+        scale *= 2;
 
-    int bytesPerPixel = bitsPerPixel / 8;
+    if ( 1 == scale && !orient )
+        return S_FALSE;
 
-    if ( 0 != ( bitsPerPixel % 8 ) )
-        bytesPerPixel++;
+    UINT reducedWidth = width;
+    UINT reducedHeight = height;
 
-    const int AlignmentForStride = 4;
+    if ( scale > 1 )
+    {
+        reducedWidth = ( width + scale - 1 ) / scale;
+        reducedHeight = ( height + scale - 1 ) / scale;
 
-    return (((width * bytesPerPixel) + (AlignmentForStride - 1)) / AlignmentForStride) * AlignmentForStride;
-} //StrideInBytes
+        hr = transform->GetClosestSize( &reducedWidth, &reducedHeight );
+        if ( FAILED( hr ) || ( reducedWidth >= width ) || ( __max( reducedWidth, reducedHeight ) < minLongEdge ) )
+        {
+            if ( !orient )
+                return S_FALSE;
 
-HRESULT CreateWICEncoder( WCHAR const * pwcPath, ComPtr<IWICBitmapEncoder> & encoder,
-                          ComPtr<IWICBitmapFrameEncode> & bitmapFrameEncode, WCHAR const * outputMimetype,
-                          bool lowQualityOutput )
-{
-    ComPtr<IWICStream> stream;
-    HRESULT hr = g_IWICFactory->CreateStream( stream.GetAddressOf() );
-    if ( FAILED( hr ) )
-    {
-        printf( "can't create stream from factory, error %#x\n", hr );
-        return hr;
+            reducedWidth = width;
+            reducedHeight = height;
+        }
     }
 
-    hr = stream->InitializeFromFilename( pwcPath, GENERIC_WRITE );
-    if ( FAILED( hr ) )
-    {
-        printf( "can't initialize from filename, error %#x, path %ws\n", hr, pwcPath );
-        return hr;
-    }
+    // The scaled size is in the frame's orientation; the bitmap is laid out after rotating
 
-    if ( !wcscmp( outputMimetype, L"image/bmp" ) )
-        hr = g_IWICFactory->CreateEncoder( GUID_ContainerFormatBmp, NULL, encoder.GetAddressOf() );
-    else if ( !wcscmp( outputMimetype, L"image/gif" ) )
-        hr = g_IWICFactory->CreateEncoder( GUID_ContainerFormatGif, NULL, encoder.GetAddressOf() );
-    else if ( !wcscmp( outputMimetype, L"image/jpeg" ) )
-        hr = g_IWICFactory->CreateEncoder( GUID_ContainerFormatJpeg, NULL, encoder.GetAddressOf() );
-    else if ( !wcscmp( outputMimetype, L"image/png" ) )
-        hr = g_IWICFactory->CreateEncoder( GUID_ContainerFormatPng, NULL, encoder.GetAddressOf() );
-    else if ( !wcscmp( outputMimetype, L"image/tiff" ) )
-        hr = g_IWICFactory->CreateEncoder( GUID_ContainerFormatTiff, NULL, encoder.GetAddressOf() );
-    else
-    {
-        printf( "unexpected output mimetype %ws\n", outputMimetype );
-        hr = STATUS_INVALID_PARAMETER;
-    }
+    UINT outWidth = reducedWidth;
+    UINT outHeight = reducedHeight;
+    if ( orient && TransformSwapsAxes( transformOptions ) )
+        swap( outWidth, outHeight );
 
-    if ( FAILED( hr ) )
-    {
-        printf( "can't create encoder, error %#x\n", hr );
-        return hr;
-    }
+    // Ask for the native format so 48bpp sources stay 48bpp; conversion happens later if needed
 
-    hr = encoder->Initialize( stream.Get(), WICBitmapEncoderNoCache );
+    WICPixelFormatGUID format;
+    hr = frame->GetPixelFormat( &format );
+    if ( SUCCEEDED( hr ) )
+        hr = transform->GetClosestPixelFormat( &format );
     if ( FAILED( hr ) )
-    {
-        printf( "can't initialize encoder, error %#x\n", hr );
-        return hr;
-    }
+        return S_FALSE;
 
-    ComPtr<IPropertyBag2> propertyBag;
-    hr = encoder->CreateNewFrame( bitmapFrameEncode.GetAddressOf(), propertyBag.GetAddressOf() );
+    CTimed timedReducedDecode( g_ReducedDecodeTime );
+
+    ComPtr<IWICBitmap> bitmap;
+    hr = g_IWICFactory->CreateBitmap( outWidth, outHeight, format, WICBitmapCacheOnLoad, bitmap.GetAddressOf() );
     if ( FAILED( hr ) )
     {
-        printf( "can't create new frame, error %#x\n", hr );
+        printf( "can't create bitmap for reduced decode: %#x\n", hr );
         return hr;
     }
 
-    if ( false ) // useful for debugging
-    {
-        ULONG cProps = 0;
-        HRESULT hrProps = propertyBag->CountProperties( & cProps );
-
-        if ( SUCCEEDED( hrProps ) )
-        {
-            printf( "there are %d properties\n", cProps );
-
-            for ( ULONG i = 0; i < cProps; i++ )
-            {
-                ULONG read;
-                PROPBAG2 bag;
-                hrProps = propertyBag->GetPropertyInfo( i, 1, &bag, &read );
-                if ( SUCCEEDED( hrProps ) )
-                {
-                    printf( "  property name %ws\n", bag.pstrName );
-                    CoTaskMemFree( bag.pstrName );
-                }
-            }
-        }
-    }
-
-    if ( !wcscmp( outputMimetype, L"image/tiff" ) )
     {
-        PROPBAG2 optionQuality = { 0 };
-        optionQuality.pstrName = L"CompressionQuality";
-        VARIANT varValueQuality;
-        VariantInit( &varValueQuality );
-        varValueQuality.vt = VT_R4;
-
-        if ( lowQualityOutput )
-            varValueQuality.fltVal = 0.6;
-        else
-            varValueQuality.fltVal = 1.0;
-
-        hr = propertyBag->Write( 1, &optionQuality, &varValueQuality );
+        WICRect rect = { 0, 0, (INT) outWidth, (INT) outHeight };
+        ComPtr<IWICBitmapLock> lock;
+        hr = bitmap->Lock( &rect, WICBitmapLockWrite, lock.GetAddressOf() );
         if ( FAILED( hr ) )
         {
-            printf( "can't write compressionquality to property bag, error %#x\n", hr );
+            printf( "can't lock bitmap for reduced decode: %#x\n", hr );
             return hr;
         }
-    }
 
-    if ( !wcscmp( outputMimetype, L"image/jpeg" ) )
-    {
-        PROPBAG2 optionQuality = { 0 };
-        optionQuality.pstrName = L"ImageQuality";
-        VARIANT varValueQuality;
-        VariantInit( &varValueQuality );
-        varValueQuality.vt = VT_R4;
+        UINT stride = 0;
+        UINT cb = 0;
+        BYTE * pb = 0;
+        hr = lock->GetStride( &stride );
+        if ( SUCCEEDED( hr ) )
+            hr = lock->GetDataPointer( &cb, &pb );
 
-        if ( lowQualityOutput )
-            varValueQuality.fltVal = 0.6; // lower quality, smaller
-        else
-            varValueQuality.fltVal = 1.0; // slower but more compressed
+        if ( SUCCEEDED( hr ) )
+            hr = transform->CopyPixels( NULL, reducedWidth, reducedHeight, &format, orient ? transformOptions : WICBitmapTransformRotate0,
+                                        stride, cb, pb );
 
-        hr = propertyBag->Write( 1, &optionQuality, &varValueQuality );
         if ( FAILED( hr ) )
         {
-            printf( "can't write imagequality to property bag, error %#x\n", hr );
+            printf( "reduced decode CopyPixels failed: %#x\n", hr );
             return hr;
         }
     }
 
-    if ( !wcscmp( outputMimetype, L"image/jpeg" ) )
-    {
-        PROPBAG2 optionSub = { 0 };
-        optionSub.pstrName = L"JpegYCrCbSubsampling";
-        VARIANT varValueSub;
-        VariantInit( &varValueSub );
-        varValueSub.vt = VT_UI1;
-        if ( lowQualityOutput )
-            varValueSub.iVal = WICJpegYCrCbSubsampling422;  // throw away color data to make it smaller
-        else
-            varValueSub.iVal = WICJpegYCrCbSubsampling444; // preserve color data
+    tracer.Trace( "reduced decode from %u by %u to %u by %u for long edge %u, transform %#x\n", width, height, outWidth, outHeight,
+                  minLongEdge, orient ? transformOptions : 0 );
 
-        hr = propertyBag->Write( 1, &optionSub, &varValueSub );
-        if ( FAILED( hr ) )
-        {
-            printf( "can't write Subsampling to property bag, error %#x\n", hr );
-            return hr;
-        }
-    }
+    if ( orient )
+        transformOptions = WICBitmapTransformRotate0;
 
-    hr = bitmapFrameEncode->Initialize( propertyBag.Get() );
-    if ( FAILED( hr ) )
-    {
-        printf( "can't initialize frame encode with property bag, error %#x\n", hr );
-        return hr;
-    }
+    source.Reset();
+    return bitmap.As( &source );
+} //LoadReducedWICBitmap
 
-    return hr;
-} //CreateWICEncoder
+// RAW and HEIF files usually hold a JPG preview that's a fraction of the size of the full image and far faster to
+// decode. With -j, if the preview's long edge is at least minLongEdge and its aspect ratio matches the image's,
+// frame and source are replaced with the preview's. The caller keeps the original frame for metadata since the
+// preview has none. JPG inputs are skipped: their embedded image is the small EXIF thumbnail, and a reduced
+// decode of the JPG itself is already fast. Returns false with frame and source untouched if it doesn't apply.
 
-HRESULT CommitEncoder( ComPtr<IWICBitmapFrameEncode> & bitmapFrameEncode, ComPtr<IWICBitmapEncoder> & encoder )
+bool UseEmbeddedPreview( WCHAR const * pwcPath, UINT minLongEdge, ComPtr<IWICBitmapFrameDecode> & frame, ComPtr<IWICBitmapSource> & source )
 {
-    HRESULT hr = bitmapFrameEncode->Commit();
-    if ( FAILED( hr ) )
+    if ( !g_UseEmbeddedPreviews || 0 == minLongEdge )
+        return false;
+
+    WCHAR const * pwcExt = PathFindExtension( pwcPath );
+    if ( !_wcsicmp( pwcExt, L".jpg" ) || !_wcsicmp( pwcExt, L".jpeg" ) )
+        return false;
+
+    ImageDataResult idr;
+    if ( !CImageData::Parse( pwcPath, idfEmbeddedImage | idfDimensions, idr ) || !( idr.fields & idfEmbeddedImage ) )
+        return false;
+
+    // When the parser knows the preview's size, don't bother reading one that's too small
+
+    if ( 0 != idr.embeddedWidth && 0 != idr.embeddedHeight && (UINT) __max( idr.embeddedWidth, idr.embeddedHeight ) < minLongEdge )
+        return false;
+
+    if ( idr.embeddedLength > 64 * 1024 * 1024 )
+        return false;
+
+    CTimed timedPreview( g_EmbeddedPreviewTime );
+
+    CStream stream( pwcPath, idr.embeddedOffset, idr.embeddedLength );
+    if ( !stream.Ok() || stream.Length() != idr.embeddedLength )
+        return false;
+
+    vector<byte> preview( (size_t) idr.embeddedLength );
+    if ( preview.size() != stream.Read( preview.data(), (ULONG) preview.size() ) )
+        return false;
+
+    // The memory stream has its own copy of the bytes, so the decoder can outlive preview
+
+    ComPtr<IStream> memoryStream;
+    memoryStream.Attach( SHCreateMemStream( preview.data(), (UINT) preview.size() ) );
+    if ( !memoryStream )
+        return false;
+
+    ComPtr<IWICBitmapDecoder> decoder;
+    ComPtr<IWICBitmapFrameDecode> previewFrame;
+    HRESULT hr = g_IWICFactory->CreateDecoderFromStream( memoryStream.Get(), NULL, WICDecodeMetadataCacheOnDemand, decoder.GetAddressOf() );
+    if ( SUCCEEDED( hr ) )
+        hr = decoder->GetFrame( 0, previewFrame.GetAddressOf() );
+
+    UINT width = 0, height = 0;
+    if ( SUCCEEDED( hr ) )
+        hr = previewFrame->GetSize( &width, &height );
+
+    if ( FAILED( hr ) || 0 == width || 0 == height || __max( width, height ) < minLongEdge )
+        return false;
+
+    // Some previews are letterboxed or cropped to a different shape than the image
+
+    if ( ( idr.fields & idfDimensions ) && idr.width > 0 && idr.height > 0 )
     {
-        printf( "can't commit the frame encoder, error %#x\n", hr );
-        return hr;
+        double previewAspect = (double) __max( width, height ) / (double) __min( width, height );
+        double imageAspect = (double) __max( idr.width, idr.height ) / (double) __min( idr.width, idr.height );
+
+        if ( fabs( previewAspect - imageAspect ) > 0.02 * imageAspect )
+            return false;
     }
 
-    hr = encoder->Commit();
+    ComPtr<IWICBitmapSource> previewSource;
+    hr = previewFrame.As( &previewSource );
+    if ( FAILED( hr ) )
+        return false;
+
+    tracer.Trace( "using the %u by %u embedded preview of %ws for long edge %u\n", width, height, pwcPath, minLongEdge );
+
+    frame = previewFrame;
+    source = previewSource;
+    return true;
+} //UseEmbeddedPreview
+
+// Copy the pixels of a 24bppBGR source into memory, write them as a thumbnail cache level, and make that the source
+
+HRESULT StoreThumbnailLevel( CThumbnailCache::ThumbnailKey const & key, UINT level, ComPtr<IWICBitmapSource> & source )
+{
+    ComPtr<IWICBitmap> bitmap;
+    HRESULT hr = g_IWICFactory->CreateBitmapFromSource( source.Get(), WICBitmapCacheOnLoad, bitmap.GetAddressOf() );
     if ( FAILED( hr ) )
     {
-        printf( "can't commit the encoder, error %#x\n", hr );
+        printf( "can't create bitmap for thumbnail cache: %#x\n", hr );
         return hr;
     }
 
-    return hr;
-} //CommitEncoder
+    {
+        UINT width, height;
+        hr = bitmap->GetSize( &width, &height );
+        if ( FAILED( hr ) )
+            return hr;
 
-template <class T> void FloodFill( T * buffer, int width, int height, int fillColor )
+        WICRect rect = { 0, 0, (INT) width, (INT) height };
+        ComPtr<IWICBitmapLock> lock;
+        hr = bitmap->Lock( &rect, WICBitmapLockRead, lock.GetAddressOf() );
+
+        UINT stride = 0;
+        UINT cb = 0;
+        BYTE * pb = 0;
+        if ( SUCCEEDED( hr ) )
+            hr = lock->GetStride( &stride );
+        if ( SUCCEEDED( hr ) )
+            hr = lock->GetDataPointer( &cb, &pb );
+
+        if ( FAILED( hr ) )
+        {
+            printf( "can't lock bitmap for thumbnail cache: %#x\n", hr );
+            return hr;
+        }
+
+        g_pThumbnailCache->Store( key, level, width, height, stride, pb );
+    }
+
+    source.Reset();
+    return bitmap.As( &source );
+} //StoreThumbnailLevel
+
+// Load the smallest cached level whose long edge is at least minLongEdge instead of decoding the original.
+// If it isn't cached, decode the original once and write that level and each smaller one. Levels are always
+// scaled with high quality since they're reused. Returns S_FALSE with source untouched if the cache can't help.
+// The cache key doesn't say whether pixels came from a -j preview, so levels are only written from full decodes.
+// When -j picks the preview on a miss, its pixels are returned without being cached.
+
+HRESULT LoadCachedThumbnail( WCHAR const * pwcPath, ComPtr<IWICBitmapFrameDecode> & frame, ComPtr<IWICBitmapSource> & source, UINT minLongEdge )
 {
-    // Only written and tested for 24bppBGR and 48bppRGB
+    UINT level = CThumbnailCache::LevelFor( minLongEdge );
+    CThumbnailCache::ThumbnailKey key;
+    if ( 0 == level || !CThumbnailCache::GetKey( pwcPath, key ) )
+        return S_FALSE;
 
-    int bitsShiftLeft = 8 * ( sizeof T - 1 );
-    T fillRed = ( ( fillColor & 0xff0000 ) >> 16 ) << bitsShiftLeft;
-    T fillGreen = ( ( fillColor & 0xff00 ) >> 8 ) << bitsShiftLeft;
-    T fillBlue = ( fillColor & 0xff ) << bitsShiftLeft;
+    for ( UINT l = level; l <= CThumbnailCache::LargestLevel; l *= 2 )
+    {
+        CThumbnailCache::CThumbnail thumb;
+        if ( g_pThumbnailCache->Load( key, l, thumb ) )
+        {
+            // This copies the pixels, so the mapping can go away when thumb does
 
-    if ( 2 == sizeof( T ) )
-        Swap( fillRed, fillBlue );
+            ComPtr<IWICBitmap> bitmap;
+            HRESULT hr = g_IWICFactory->CreateBitmapFromMemory( thumb.width, thumb.height, GUID_WICPixelFormat24bppBGR, thumb.stride,
+                                                                thumb.stride * thumb.height, (BYTE *) thumb.pixels, bitmap.GetAddressOf() );
+            if ( SUCCEEDED( hr ) )
+            {
+                g_pThumbnailCache->RecordLookup( true );
+                source.Reset();
+                return bitmap.As( &source );
+            }
+        }
+    }
 
-    int strideInT = StrideInBytes( width, 3 * 8 * sizeof T ) / sizeof T;
+    g_pThumbnailCache->RecordLookup( false );
 
-    for ( int y = 0; y < height; y++ )
+    // Levels are stored in the file's orientation; the caller orients whichever one it gets
+
+    ComPtr<IWICBitmapFrameDecode> decodeFrame = frame;
+    bool fromPreview = UseEmbeddedPreview( pwcPath, level, decodeFrame, source );
+
+    WICBitmapTransformOptions noTransform = WICBitmapTransformRotate0;
+    HRESULT hr = LoadReducedWICBitmap( decodeFrame, source, level, noTransform );
+    if ( SUCCEEDED( hr ) )
+        hr = ConvertBitmapTo24bppBGROr48bppRGB( source, true );
+
+    UINT width, height;
+    if ( SUCCEEDED( hr ) )
+        hr = source->GetSize( &width, &height );
+
+    if ( SUCCEEDED( hr ) && __max( width, height ) > level )
     {
-        T * p = ( buffer + y * strideInT );
-        for ( int x = 0; x < width; x++ )
+        UINT targetWidth, targetHeight;
+        ScaledSize( width, height, level, targetWidth, targetHeight );
+        hr = ScaleWICBitmapToSize( source, targetWidth, targetHeight, true );
+    }
+
+    if ( SUCCEEDED( hr ) && fromPreview )
+        return S_OK;
+
+    if ( SUCCEEDED( hr ) )
+        hr = StoreThumbnailLevel( key, level, source );
+
+    if ( FAILED( hr ) )
+        return hr;
+
+    // Smaller levels are cheap to make from this one. Failures there don't matter to the caller.
+
+    ComPtr<IWICBitmapSource> smaller = source;
+
+    for ( UINT l = level / 2; l >= CThumbnailCache::SmallestLevel; l /= 2 )
+    {
+        HRESULT hrSmaller = smaller->GetSize( &width, &height );
+
+        if ( SUCCEEDED( hrSmaller ) && __max( width, height ) > l )
         {
-            *p++ = fillBlue;
-            *p++ = fillGreen;
-            *p++ = fillRed;
+            UINT targetWidth, targetHeight;
+            ScaledSize( width, height, l, targetWidth, targetHeight );
+            hrSmaller = ScaleWICBitmapToSize( smaller, targetWidth, targetHeight, true );
         }
+
+        if ( SUCCEEDED( hrSmaller ) )
+            hrSmaller = StoreThumbnailLevel( key, l, smaller );
+
+        if ( FAILED( hrSmaller ) )
+            break;
     }
-} //FloodFill
 
-template <class T> __forceinline T MakeGreyscale( T r, T g, T b )
+    return S_OK;
+} //LoadCachedThumbnail
+
+// An input or output of - means stdin or stdout. An output can have an extension to pick the format, e.g. -.png
+
+bool IsStdio( WCHAR const * pwcPath )
 {
-    // for 24bpp it's 0 and 8. For 48bpp it's 8 and 16;
+    return ( L'-' == pwcPath[ 0 ] ) && ( 0 == pwcPath[ 1 ] || L'.' == pwcPath[ 1 ] );
+} //IsStdio
 
-    const int lshift = 8 * ( sizeof( T ) - 1 );
-    const int rshift = 8 * ( sizeof( T ) );
+// A frame of a multi-frame input (a TIFF page, a GIF or HEIF sequence frame) is named path|N, and path|* stands
+// for every frame. | can't be in a Windows filename, so these never match a file. The metadata and thumbnail
+// caches and the Exif parser don't find them and are skipped, except for frame 0, which is the file's image.
 
-    return (T) ( ( (int) r * ( 54 << lshift ) + (int) g * ( 182 << lshift ) + (int) b * ( 18 << lshift ) ) >> rshift );
-    // very slow: return (T) round( 0.2125 * (double) r + 0.7154 * (double) g + 0.0721 * (double) b );
-} //MakeGreyscale
+WCHAR const * FindFrameSuffix( WCHAR const * pwcPath )
+{
+    // An index query can contain |, which isn't a frame suffix
 
-template <class T> void CopyPixels( int start, int beyond, int width, T * pOutBase, T * pInBase, int strideOut, int strideIn, bool makeGreyscale )
+    if ( CMetadataIndex::FindQuery( pwcPath ) )
+        return 0;
+
+    return wcsrchr( pwcPath, L'|' );
+} //FindFrameSuffix
+
+// Split path|N into the file's path and N. Returns false if pwcPath isn't a frame.
+
+bool SplitFramePath( WCHAR const * pwcPath, WCHAR * pwcFile, size_t cwcFile, UINT & frameIndex )
 {
-    byte * pbOut = (byte *) pOutBase + ( strideOut * start );
-    byte * pbIn = (byte *) pInBase + ( strideIn * start );
-    const int bytesWide = 3 * width * ( sizeof T );
-    
-    for ( int y = start; y < beyond; y++ )
+    WCHAR const * pwcBar = FindFrameSuffix( pwcPath );
+    if ( !pwcBar || (size_t) ( pwcBar - pwcPath ) >= cwcFile )
+        return false;
+
+    memcpy( pwcFile, pwcPath, ( pwcBar - pwcPath ) * sizeof( WCHAR ) );
+    pwcFile[ pwcBar - pwcPath ] = 0;
+    frameIndex = (UINT) _wtoi( pwcBar + 1 );
+    return true;
+} //SplitFramePath
+
+vector<byte> g_StdinImage;          // the whole input image when it's read from stdin
+int g_StdoutFd = -1;                // stdout when the output image goes there; printf then goes to stderr
+ComPtr<IStream> g_StdoutStream;     // the encoded output image, written to g_StdoutFd when committed
+
+HRESULT ReadStdin()
+{
+    _setmode( _fileno( stdin ), _O_BINARY );
+
+    byte abBuffer[ 65536 ];
+    size_t cb;
+
+    while ( 0 != ( cb = fread( abBuffer, 1, sizeof abBuffer, stdin ) ) )
+        g_StdinImage.insert( g_StdinImage.end(), abBuffer, abBuffer + cb );
+
+    if ( ferror( stdin ) || 0 == g_StdinImage.size() )
     {
-        if ( makeGreyscale )
-        {
-            T * pRowIn = (T *) pbIn;
-            T * pRowOut = (T *) pbOut;
-    
-            for ( int x = 0; x < width; x++ )
-            {
-                T b = *pRowIn++; T g = *pRowIn++; T r = *pRowIn++;
+        printf( "can't read an image from stdin\n" );
+        return E_FAIL;
+    }
 
-                // The input/output image is either 24bppGBR or 48bppRGB
+    return S_OK;
+} //ReadStdin
 
-                T grey = ( 1 == sizeof( T ) ) ? MakeGreyscale( r, g, b ) : MakeGreyscale( b, g, r );
+// Keep stdout for the image and send everything printed to stderr so messages can't corrupt the image
 
-                *pRowOut++ = grey; *pRowOut++ = grey; *pRowOut++ = grey;
-            }
+void RedirectStdout()
+{
+    fflush( stdout );
+    g_StdoutFd = _dup( _fileno( stdout ) );
+    _setmode( g_StdoutFd, _O_BINARY );
+    _dup2( _fileno( stderr ), _fileno( stdout ) );
+} //RedirectStdout
+
+HRESULT WriteStdoutStream()
+{
+    STATSTG stat;
+    HRESULT hr = g_StdoutStream->Stat( &stat, STATFLAG_NONAME );
+
+    HGLOBAL hGlobal = 0;
+    if ( SUCCEEDED( hr ) )
+        hr = GetHGlobalFromStream( g_StdoutStream.Get(), &hGlobal );
+
+    if ( FAILED( hr ) )
+    {
+        printf( "can't get the encoded image from the memory stream, error %#x\n", hr );
+        return hr;
+    }
+
+    byte const * pb = (byte const *) GlobalLock( hGlobal );
+    unsigned long long cbLeft = stat.cbSize.QuadPart;
+
+    while ( SUCCEEDED( hr ) && cbLeft > 0 )
+    {
+        unsigned int cbChunk = (unsigned int) __min( cbLeft, (unsigned long long) 0x40000000 );
+        int cbWritten = _write( g_StdoutFd, pb, cbChunk );
+
+        if ( cbWritten <= 0 )
+        {
+            printf( "can't write the image to stdout, errno %d\n", errno );
+            hr = E_FAIL;
         }
         else
         {
-            memcpy( pbOut, pbIn, bytesWide );
+            pb += cbWritten;
+            cbLeft -= cbWritten;
         }
-
-        pbOut += strideOut;
-        pbIn += strideIn;
     }
-} //CopyPixels
 
-ULONG CountPixelsOn( BYTE * image, int width, int height, int stride )
+    GlobalUnlock( hGlobal );
+    g_StdoutStream.Reset();
+    return hr;
+} //WriteStdoutStream
+
+HRESULT CreateDecoderFromStdin( ComPtr<IWICBitmapDecoder> & decoder )
 {
-    ULONG pixelsOn = 0;
-    byte * pb = image;
+    ComPtr<IWICStream> stream;
+    HRESULT hr = g_IWICFactory->CreateStream( stream.GetAddressOf() );
 
-    for ( int y = 0; y < height; y++ )
+    if ( SUCCEEDED( hr ) )
+        hr = stream->InitializeFromMemory( g_StdinImage.data(), (DWORD) g_StdinImage.size() );
+
+    if ( SUCCEEDED( hr ) )
+        hr = g_IWICFactory->CreateDecoderFromStream( stream.Get(), NULL, WICDecodeMetadataCacheOnDemand, decoder.GetAddressOf() );
+
+    return hr;
+} //CreateDecoderFromStdin
+
+// The EXIF orientation from the metadata the decoder already read for the frame, so the file needn't be
+// parsed again. Only JPG and TIFF layouts are known here. Returns false if the container is something else
+// or the read fails for a reason other than the tag being absent.
+
+bool FrameOrientation( IWICBitmapFrameDecode * pFrame, int & orientation )
+{
+    ComPtr<IWICMetadataQueryReader> reader;
+    GUID container;
+
+    if ( FAILED( pFrame->GetMetadataQueryReader( reader.GetAddressOf() ) ) || FAILED( reader->GetContainerFormat( &container ) ) )
+        return false;
+
+    WCHAR const * pwcQuery = 0;
+    if ( GUID_ContainerFormatJpeg == container )
+        pwcQuery = L"/app1/ifd/{ushort=274}";
+    else if ( GUID_ContainerFormatTiff == container )
+        pwcQuery = L"/ifd/{ushort=274}";
+    else
+        return false;
+
+    PROPVARIANT value;
+    PropVariantInit( &value );
+    HRESULT hr = reader->GetMetadataByName( pwcQuery, &value );
+
+    if ( WINCODEC_ERR_PROPERTYNOTFOUND == hr )
     {
-        byte * p = pb;
+        orientation = 1;
+        return true;
+    }
 
-        for ( int x = 0; x < width; x++ )
-        {
-            if ( 0 != *p )
-                pixelsOn++;
+    bool ok = SUCCEEDED( hr ) && VT_UI2 == value.vt && value.uiVal >= 1 && value.uiVal <= 8;
+    if ( ok )
+        orientation = value.uiVal;
 
-            p += 3;
-        }
+    PropVariantClear( &value );
+    return ok;
+} //FrameOrientation
 
-        pb += stride;
+// The EXIF orientation 1..8 of an image, from md if it has it, otherwise read and added to md. If the caller
+// has the image's frame open, its metadata is used; the file is parsed only if that doesn't work.
+// The HEIF and AVIF codecs apply the container's rotation themselves, and stdin can't be parsed.
+
+int ImageOrientation( WCHAR const * pwcPath, ImageMetadata & md, IWICBitmapFrameDecode * pFrame = 0 )
+{
+    if ( md.flags & mdOrientation )
+        return md.orientation;
+
+    int orientation = 1;
+    WCHAR const * pwcExt = PathFindExtension( pwcPath );
+
+    if ( !IsStdio( pwcPath ) && _wcsicmp( pwcExt, L".heic" ) && _wcsicmp( pwcExt, L".heif" ) &&
+         _wcsicmp( pwcExt, L".hif" ) && _wcsicmp( pwcExt, L".avif" ) && !( pFrame && FrameOrientation( pFrame, orientation ) ) )
+    {
+        ImageDataResult idr;
+        if ( CImageData::Parse( pwcPath, idfOrientation, idr ) && ( idr.fields & idfOrientation ) &&
+             idr.orientation >= 1 && idr.orientation <= 8 )
+            orientation = idr.orientation;
     }
 
-    return pixelsOn;
-} //CountPixelsOn
+    md.orientation = orientation;
+    md.flags |= mdOrientation;
+    return orientation;
+} //ImageOrientation
 
-void CreateWAVFromImage( int waveMethod, WCHAR const * pwcWAVBase, BYTE * image, int stride, int width, int height, int bpp )
+int ImageOrientation( WCHAR const * pwcPath, IWICBitmapFrameDecode * pFrame = 0 )
 {
-    // NOTE: This is still very much in prototype mode. Not sure how it will pan out.
-    // NOTE: current code below assumes posterization /p:1 and greyscale /g have been set.
+    ImageMetadata md;
+    if ( !g_pMetadataCache || !g_pMetadataCache->Lookup( pwcPath, md ) )
+        memset( &md, 0, sizeof md );
 
-    if ( waveMethod > 4 || 24 != bpp )
-        return;
+    if ( md.flags & mdOrientation )
+        return md.orientation;
 
-    const WORD bytesPerSample = sizeof( short );
-    const int sampleRate = 88200;
-    WCHAR awcWAV[ MAX_PATH ];
-    wcscpy( awcWAV, pwcWAVBase );
-    wcscat( awcWAV, L".wav" );
-    vector<short> wav;
-    int samples;
-    
-    if ( 1 == waveMethod || 2 == waveMethod )
+    int orientation = ImageOrientation( pwcPath, md, pFrame );
+    if ( g_pMetadataCache )
+        g_pMetadataCache->Store( md );
+
+    return orientation;
+} //ImageOrientation
+
+bool OrientationSwapsAxes( int orientation )
+{
+    return ( orientation >= 5 && orientation <= 8 );
+} //OrientationSwapsAxes
+
+// What WIC must do to show the stored pixels upright. WIC rotates clockwise first, then flips.
+
+WICBitmapTransformOptions OrientationTransform( int orientation )
+{
+    switch ( orientation )
     {
-        // stretch the image as much as needed to make a wav file that contains all on pixels
+        case 2: return WICBitmapTransformFlipHorizontal;
+        case 3: return WICBitmapTransformRotate180;
+        case 4: return WICBitmapTransformFlipVertical;
+        case 5: return (WICBitmapTransformOptions) ( WICBitmapTransformRotate90 | WICBitmapTransformFlipHorizontal );
+        case 6: return WICBitmapTransformRotate90;
+        case 7: return (WICBitmapTransformOptions) ( WICBitmapTransformRotate270 | WICBitmapTransformFlipHorizontal );
+        case 8: return WICBitmapTransformRotate270;
+        default: return WICBitmapTransformRotate0;
+    }
+} //OrientationTransform
 
-        bool allPixels = ( 1 == waveMethod) ? false : true;  // true == airplane?  false == fart?
-        samples = allPixels ? width * height : CountPixelsOn( image, width, height, stride );
-        wav.resize( samples );
-        ZeroMemory( wav.data(), samples * sizeof( short ) );
-        int cur = 0;
-    
-        for ( int x = 0; x < width; x++ )
+// Apply an orientation the codec couldn't apply while decoding. The flip rotator fetches its source a pixel at
+// a time when it rotates, so it's given an in-memory bitmap rather than the decoder. It does its work as the next
+// step (the scaler, a converter, or the encoder) pulls pixels from it, so there's no extra pass over the image.
+
+HRESULT OrientWICBitmap( ComPtr<IWICBitmapSource> & source, WICBitmapTransformOptions transformOptions )
+{
+    if ( WICBitmapTransformRotate0 == transformOptions )
+        return S_OK;
+
+    ComPtr<IWICBitmap> bitmap;
+    HRESULT hr = source.As( &bitmap );
+    if ( FAILED( hr ) )
+    {
+        hr = g_IWICFactory->CreateBitmapFromSource( source.Get(), WICBitmapCacheOnLoad, bitmap.GetAddressOf() );
+        if ( FAILED( hr ) )
         {
-            for ( int y = 0; y < height; y++ )
-            {
-                byte * pb = image + ( y * stride ) + ( 3 * x );
-                if ( *pb )
-                {
-                    // put in the range of -1..1
-                    double yv = ( 2.0 * ( (double) y / (double) height ) - 1.0 );
-    
-                    short v = (short) ( round ( -yv * 32767.0 ) );
-    
-                    wav[ cur++ ] = v;
-                }
-                else if ( allPixels )
-                    wav[ cur++ ] = -32768;
-            }
+            printf( "can't create bitmap to orient: %#x\n", hr );
+            return hr;
         }
     }
-    else if ( 3 == waveMethod || 4 == waveMethod )
-    {
-        byte *pb = image;
-        vector<short> maxY( width );
-        ZeroMemory( maxY.data(), width * sizeof( short ) );
 
-        if ( 3 == waveMethod )
-        {
-            // for each X, only set the vertically highest Y. If no Y are set, set the midpoint. Flip on even/odd X for highest/lowest Y
-    
-            for ( int x = 0; x < width; x++ )
-            {
-                bool anyY = false;
-    
-                if ( true ) //x & 1 )
-                {
-                    for ( int y = 0; y < height; y++ )
-                    {
-                        byte * p = pb + ( y * stride ) + ( x * 3 );
-         
-                        if ( ! anyY )
-                        {
-                            if ( *p )
-                            {
-                                anyY = true;
-                                maxY[ x ] = (short) ( (double) ( height - y ) / (double) height * 32767 );
-                            }
-                        }
-                        else
-                        {
-                            *p++ = 0; *p++ = 0; *p = 0;
-                        }
-                    }
-                }
-                else
-                {
-                    for ( int y = height - 1; y >= 0; y-- )
-                    {
-                        byte * p = pb + ( y * stride ) + ( x * 3 );
-        
-                        if ( ! anyY )
-                        {
-                            if ( *p )
-                            {
-                                anyY = true;
-                                maxY[ x ] = (short) ( (double) ( height - y ) / (double) height * 32767 );
-                            }
-                        }
-                        else
-                        {
-                            *p++ = 0; *p++ = 0; *p = 0;
-                        }
-                    }
-                }
-    
-                if ( !anyY )
-                {
-                    byte * p = pb + ( ( height / 2 ) * stride ) + ( x * 3 );
-                    *p++ = 255; *p++ = 255; *p = 255;
-                    maxY[ x ] = height / 2;
-                }
-            }
-        }
-        else
-        {
-            assert( 4 == waveMethod );
-            // Find the Y offset of the brightest Y for each X
-    
-            for ( int x = 0; x < width; x++ )
-            {
-                byte brightestY = 0;
-                for ( int y = 0; y < height; y++ )
-                {
-                    byte * p = pb + ( y * stride ) + ( x * 3 );
-                    if ( *p > brightestY )
-                    {
-                        brightestY = *p;
-                        maxY[ x ] = (short) ( (double) ( height - y ) / (double) height * 32767 );
-                    }
-                }
-    
-                // if none set, use the midpoint
-    
-                if ( 0 == brightestY )
-                {
-                    byte * p = pb + ( ( height / 2 ) * stride ) + ( x * 3 );
-                    *p++ = 255; *p++ = 255; *p = 255;
-                    maxY[ x ] = height / 2;
-                }
-            }
-        }
+    ComPtr<IWICBitmapFlipRotator> rotator;
+    hr = g_IWICFactory->CreateBitmapFlipRotator( rotator.GetAddressOf() );
+    if ( SUCCEEDED( hr ) )
+        hr = rotator->Initialize( bitmap.Get(), transformOptions );
 
-        // The image is now the first half of the waveform. Invert it to make the second half.
-        // Target A above middle C -- 440 Hz at 88200 samples per second, for one second of sound
+    if ( FAILED( hr ) )
+    {
+        printf( "can't orient bitmap: %#x\n", hr );
+        return hr;
+    }
 
-        samples = 88200;
-        int samplesPerWave = (int) round( (double) 1.0 / (double) 440.0 * (double) samples );
-        int halfSamplesPerWave = samplesPerWave / 2;
-        printf( "width %d, samplesPerWave %d, halfSamplesPerWave %d\n", width, samplesPerWave, halfSamplesPerWave );
+    tracer.Trace( "orienting with flip rotator transform %#x\n", transformOptions );
 
-        wav.resize( samples );
-        ZeroMemory( wav.data(), samples * sizeof( short ) );
+    source.Reset();
+    return rotator.As( &source );
+} //OrientWICBitmap
 
-        for ( int t = 0; t < halfSamplesPerWave; t++ )
-        {
-            int x = (int) round( (double) t / (double) halfSamplesPerWave * (double) width );
-            wav[ t ] = maxY[ x ];
-            wav[ t + halfSamplesPerWave ] = - maxY[ x ];
-        }
+// minLongEdge: if not 0, the caller will scale the image such that its long edge is this many pixels.
+//              The codec may be asked to decode at a reduced resolution that's no smaller than that,
+//              or a cached thumbnail that's no smaller may be used instead of the original.
+// orient:      rotate and flip the pixels as the image's EXIF orientation says so they're upright.
+//              Do it while decoding if the codec can, and otherwise as part of the next step.
 
-        // replicate the wave throughout the buffer
+HRESULT LoadWICBitmap( WCHAR const * pwcPath, ComPtr<IWICBitmapSource> & source, ComPtr<IWICBitmapFrameDecode> & frame, bool force24bppBGR,
+                       UINT minLongEdge = 0, bool orient = true )
+{
+    ComPtr<IWICBitmapDecoder> decoder;
+    HRESULT hr = S_OK;
 
-        int copies = samples / samplesPerWave;
-        for ( int c = 1; c < copies; c++ )
-            memcpy( wav.data() + c * samplesPerWave, wav.data(), samplesPerWave * sizeof( short ) );
-    }
+    WCHAR awcFile[ MAX_PATH ];
+    UINT frameIndex = 0;
+    WCHAR const * pwcFile = SplitFramePath( pwcPath, awcFile, _countof( awcFile ), frameIndex ) ? awcFile : pwcPath;
 
-    // write the WAV to disk
+    if ( 0 == frameIndex )
+        pwcPath = pwcFile;
 
-    DjlParseWav::WavSubchunk fmtOut( 1, 1, sampleRate, bytesPerSample, 8 * bytesPerSample );
-    DjlParseWav output( awcWAV, fmtOut );
-    if ( !output.OpenSuccessful() )
+    if ( IsStdio( pwcFile ) )
+        hr = CreateDecoderFromStdin( decoder );
+    else
+        hr = g_IWICFactory->CreateDecoderFromFilename( pwcFile, NULL, GENERIC_READ, WICDecodeMetadataCacheOnDemand, decoder.GetAddressOf() );
+
+    if ( FAILED( hr ) )
     {
-        printf( "can't open WAV output file %ws\n", awcWAV );
-        return;
+        if ( WINCODEC_ERR_COMPONENTINITIALIZEFAILURE == hr )
+            printf( "  WINCODEC_ERR_COMPONENTINITIALIZEFAILURE:" );
+        printf( "  hr from CreateDecoderFromFilename: %#x for %ws\n", hr, pwcPath );
+        return hr;
     }
-    
-    bool ok = output.WriteWavFile( (byte *) wav.data(), samples * sizeof( short ) );
-    if ( !ok )
-        printf( "can't write WAV file %ws\n", awcWAV );
-    else
-        printf( "created WAV file: %ws\n", awcWAV );
-} //CreateWAVFromImage
 
-template <class T> __forceinline T Posterize( T * pt, int groupSpan, vector<int> & values )
-{
-    // posterization level 1 values: 255         // it'll be all white
-    //                     2       : 0 and 255
-    //                     3       : 0, 127, 255
-    //                     4       : 0, 85, 170, 255
-    //                     5       : 0, 63, 127, 191, 255
-    //                     6       : 0, 51, 102, 153, 204, 255
-    //                     7       : 0, 42, 85, 127, 170, 212, 255
+    hr = decoder->GetFrame( frameIndex, frame.GetAddressOf() );
+    if ( FAILED( hr ) )
+    {
+        printf( "can't get frame %u of %ws: %#x\n", frameIndex, pwcFile, hr );
+        return hr;
+    }
 
-    int element = *pt / groupSpan;
-    assert( element < values.size() );
-    return values[ element ];
-} //Posterize
+    hr = frame->QueryInterface( IID_IWICBitmapSource, reinterpret_cast<void **> ( source.GetAddressOf() ) );
 
-template <class T> void PosterizeImage( T * image, int stride, int width, int height, int posterizeLevel )
-{
-    CTimed timePosterize( g_PosterizePixelsTime );
-    assert( 0 != posterizeLevel );
-    const int maxT = ( 1 << sizeof( T ) * 8 ) - 1;
-    const int groupSpan = ( maxT + 1 ) / posterizeLevel;
+    WICBitmapTransformOptions transformOptions = WICBitmapTransformRotate0;
+    if ( SUCCEEDED( hr ) && orient )
+        transformOptions = OrientationTransform( ImageOrientation( pwcPath, ( 0 == frameIndex ) ? frame.Get() : 0 ) );
 
-    // use the vector so double math can compute the values once
+    // The thumbnail cache only has 24bppBGR pixels, so callers that keep 48bpp always decode the original
 
-    vector<int> values( posterizeLevel + 1 );
-    for ( int v = 0; v < posterizeLevel; v++ )
-        values[ v ] = floor( (double) v * (double) maxT / (double) ( posterizeLevel - 1 ) );
+    if ( SUCCEEDED( hr ) && ( 0 != minLongEdge ) && g_pThumbnailCache && force24bppBGR )
+    {
+        hr = LoadCachedThumbnail( pwcPath, frame, source, minLongEdge );
 
-    values[ posterizeLevel - 1 ] = maxT; // make the brightest truly bright
-    values[ posterizeLevel ] = maxT;     // for cases like 5 when 255 is divisible by 51
+        if ( S_OK == hr )
+            return OrientWICBitmap( source, transformOptions );
 
-    for ( int y = 0; y < height; y++ )
+        // Fall back to the original
+
+        source.Reset();
+        hr = frame->QueryInterface( IID_IWICBitmapSource, reinterpret_cast<void **> ( source.GetAddressOf() ) );
+    }
+
+    // frame stays the original's so its metadata can be copied, even if the pixels come from the preview
+
+    if ( SUCCEEDED( hr ) && ( ( 0 != minLongEdge ) || ( WICBitmapTransformRotate0 != transformOptions ) ) )
     {
-        T * pRow = (T *) ( (byte *) image + y * stride );
-    
-        for ( int x = 0; x < width; x++ )
-        {
-            *pRow++ = Posterize( pRow, groupSpan, values );
-            *pRow++ = Posterize( pRow, groupSpan, values );
-            *pRow++ = Posterize( pRow, groupSpan, values );
-        }
+        ComPtr<IWICBitmapFrameDecode> decodeFrame = frame;
+        UseEmbeddedPreview( pwcPath, minLongEdge, decodeFrame, source );
+        hr = LoadReducedWICBitmap( decodeFrame, source, minLongEdge, transformOptions );
     }
-} //PosterizeImage
 
-long ColorDistance( int ra, int ga, int ba, int rb, int gb, int bb )
-{
-    long diffr = ra - rb;
-    long diffg = ga - gb;
-    long diffb = ba - bb;
-    return ( diffr * diffr ) + ( diffg * diffg ) + ( diffb * diffb );
-} //ColorDistance
+    // Convert to a smaller format to reduce RAM usage and make it something the JPG encoder is known to accept.
 
-long ColorDistance( int r, int g, int b, DWORD color2 )
-{
-    return ColorDistance( r, g, b, ( color2 >> 16 ) & 0xff, ( color2 >> 8 ) & 0xff, color2 & 0xff );
-} //ColorDistance
+    if ( SUCCEEDED( hr ) )
+        hr = ConvertBitmapTo24bppBGROr48bppRGB( source, force24bppBGR );
 
-DWORD FindNearestColor( int r, int g, int b, ColorizationData & cd, int posterizeLevel )
+    // Orient after converting so a codec that can't orient buffers the smaller pixels
+
+    if ( SUCCEEDED( hr ) )
+        hr = OrientWICBitmap( source, transformOptions );
+
+    return hr;
+} //LoadWICBitmap
+
+HRESULT CopyMetadata( ComPtr<IWICBitmapFrameEncode> encoder, ComPtr<IWICBitmapFrameDecode> & decoder )
 {
-    assert( posterizeLevel <= cd.bgrdata.size() );
+    ComPtr<IWICMetadataBlockWriter> blockWriter;
+    ComPtr<IWICMetadataBlockReader> blockReader;
+    
+    HRESULT hr = decoder->QueryInterface( IID_IWICMetadataBlockReader, (void **) blockReader.GetAddressOf() );
+    if ( FAILED( hr ) )
+        printf( "can't qi block reader: %#x\n", hr );
 
-    if ( mapColor == cd.mapping )
+    if ( SUCCEEDED( hr ) )
     {
-        DWORD idnearest;
-        cd.kdtree->Nearest( r, g, b, idnearest );
-
-        assert( idnearest < posterizeLevel );
-        return idnearest;
+        hr = encoder->QueryInterface( IID_IWICMetadataBlockWriter, (void **) blockWriter.GetAddressOf() );
+        if ( FAILED( hr ) )
+            printf( "can't qi block writer: %#x\n", hr );
     }
-
-    if ( mapGradient == cd.mapping )
+    
+    if ( SUCCEEDED( hr ) )
     {
-        int v = RGBToV( r, g, b );
-        double dv = (double) v / 255.0;
-        int bucket = (int) ( dv * (double) posterizeLevel );
-        if ( bucket == posterizeLevel ) // v of 255 will hit this; round down
-            bucket--;
-
-        assert( bucket >= 0 );
-        assert( bucket < posterizeLevel );
+        hr = blockWriter->InitializeFromBlockReader( blockReader.Get() );
+        if ( FAILED( hr ) )
+            printf( "can't initializefromblockreader (copy metadata): %#x\n", hr );
+    }
+    else if ( E_NOINTERFACE == hr )
+    {
+        // bmp files do this -- they have no metadata block and so don't support the interface
 
-        return bucket;
+        hr = S_OK;
     }
+    
+    return hr;
+} //CopyMetadata
 
-    assert( mapHue == cd.mapping || mapSaturation == cd.mapping || mapBrightness == cd.mapping );
+HRESULT ClipWICBitmap( ComPtr<IWICBitmapSource> & source, int outputWidth, int outputHeight )
+{
+    UINT width, height;
 
-    int h, s, v;
-    RGBToHSV( r, g, b, h, s, v );
+    HRESULT hr = source->GetSize( &width, &height );
+    if ( FAILED( hr ) )
+    {
+        printf( "can't get size of input bitmap: %#x\n", hr );
+        return hr;
+    }
 
-    byte val = ( mapHue == cd.mapping ) ? h : ( mapSaturation == cd.mapping ) ? s : v;
+    double targetAspectRatio = (double) outputWidth / (double) outputHeight;
+    double inputAspectRatio = (double) width / (double) height;
 
-    // lower_bound finds the first item >= to the search item. The closest match may be that
-    // or the prior item. lower_bound should be n log(n), rather than linear
+    UINT targetWidth, targetHeight;
+    WICRect roiRect;
 
-    auto iterGE = std::lower_bound( cd.hsvdata.begin(), cd.hsvdata.end(), val );
-    int nearest = 0;
-    if ( iterGE == cd.hsvdata.end() )
-        nearest = cd.hsvdata.size() - 1;
+    if ( targetAspectRatio >= inputAspectRatio )
+    {
+        roiRect.X = 0;
+        roiRect.Width = width;
+        roiRect.Height = (int) ( (double) width / targetAspectRatio );
+        roiRect.Y = ( height - roiRect.Height ) / 2;
+    }
     else
     {
-        DWORD index = std::distance( cd.hsvdata.begin(), iterGE );
-        if ( index > 0 )
-        {
-            byte ival = cd.hsvdata[ index ];
-            byte im1val = cd.hsvdata[ index - 1 ];
-
-            if ( abs( (int) ival - (int) val ) < abs( (int) im1val - (int) val ) )
-                nearest = index;
-            else
-                nearest = index - 1;
-        }
+        roiRect.Y = 0;
+        roiRect.Height = height;
+        roiRect.Width = (int) ( (double) height * targetAspectRatio );
+        roiRect.X = ( width - roiRect.Width ) / 2;
     }
 
-    return nearest;
-} //FindNearestColor
-
-// Posterize, but use the specified colors to map to brightness
-
-template <class T> void ColorizeImage( T * image, int stride, int width, int height, int posterizeLevel, ColorizationData * colorizationData )
-{
-    CTimed timeColorize( g_ColorizeImageTime );
-
-    assert( 0 != posterizeLevel );
-    const int maxT = ( 1 << sizeof( T ) * 8 ) - 1;
-    const int groupSpan = ( maxT + 1 ) / posterizeLevel;
-    const DWORD count = colorizationData->bgrdata.size();
-    //printf( "colorizing posterize %d, colors %zd, method %d\n", posterizeLevel, colorizationData->bgrdata.size(), colorizationData->mapping );
+    //printf( "original dimensions %u by %u, clip.x %d, clip.width %d, clip.y %d, clip.height %d\n",
+    //        width, height, roiRect.X, roiRect.Width, roiRect.Y, roiRect.Height );
 
-    //for ( int y = 0; y < height; y++ )
-    parallel_for ( 0, height, [&] ( int y )
+    ComPtr<IWICBitmapClipper> clipper;
+    hr = g_IWICFactory->CreateBitmapClipper( clipper.GetAddressOf() );
+    if ( FAILED( hr ) )
     {
-        T * pRow = (T *) ( (byte *) image + y * stride );
-    
-        for ( int x = 0; x < width; x++ )
-        {
-            byte r, g, b;
+        printf( "can't create a clipper: %#x\n", hr );
+        return hr;
+    }
 
-            // The input/output image is either 24bppGBR or 48bppRGB
+    hr = clipper->Initialize( source.Get(), &roiRect );
+    if ( FAILED( hr ) )
+    {
+        printf( "can't initialize clipper: %#x\n", hr );
+        return hr;
+    }
 
-            if ( 1 == sizeof( T ) )
-            {
-                b = pRow[ 0 ];
-                g = pRow[ 1 ];
-                r = pRow[ 2 ];
-            }
-            else
-            {
-                assert( 2 == sizeof( T ) );
+    source.Reset();
+    source.Attach( clipper.Detach() );
 
-                r = (unsigned short) pRow[ 0 ] >> 8;
-                g = (unsigned short) pRow[ 1 ] >> 8;
-                b = (unsigned short) pRow[ 2 ] >> 8;
-            }
+    return hr;
+} //ClipWICBitmap
 
-            DWORD index = FindNearestColor( r, g, b, *colorizationData, posterizeLevel );
+static int StrideInBytes( int width, int bitsPerPixel )
+{
+    // Not sure if it's documented anywhere, but Windows seems to use 4-byte-aligned strides.
+    // Stride is the number of bytes per row of an image. The last bytes to get to 4-byte alignment are unused.
+    // Based on Internet searches, some other platforms use 8-byte-aligned strides.
+    // I don't know how to query the runtime environment to tell what the default stride alignment is. Assume 4.
 
-            // index = __min( count - 1, y / ( height / posterizeLevel ) );      // testing to see all colors
+    int bytesPerPixel = bitsPerPixel / 8;
 
-            assert( index < count );
-            DWORD c = colorizationData->bgrdata[ index ];
-            ColorBytes cb( c );
+    if ( 0 != ( bitsPerPixel % 8 ) )
+        bytesPerPixel++;
 
-            if ( 1 == sizeof( T ) )
-            {
-                pRow[ 0 ] = cb.b;
-                pRow[ 1 ] = cb.g;
-                pRow[ 2 ] = cb.r;
-            }
-            else
-            {
-                pRow[ 0 ] = ( (T) cb.r ) << 8;
-                pRow[ 1 ] = ( (T) cb.g ) << 8;
-                pRow[ 2 ] = ( (T) cb.b ) << 8;
-            }
+    const int AlignmentForStride = 4;
 
-            pRow += 3;
-        }
-    } );
-} //ColorizeImage
+    return (((width * bytesPerPixel) + (AlignmentForStride - 1)) / AlignmentForStride) * AlignmentForStride;
+} //StrideInBytes
 
-int compare_colors( const void * a, const void * b )
+HRESULT CreateWICEncoder( WCHAR const * pwcPath, ComPtr<IWICBitmapEncoder> & encoder,
+                          ComPtr<IWICBitmapFrameEncode> & bitmapFrameEncode, WCHAR const * outputMimetype,
+                          bool lowQualityOutput )
 {
-    int ca = * (int *) a;
-    int cb = * (int *) b;
+    ComPtr<IStream> stream;
+    HRESULT hr = S_OK;
 
-    return ca - cb;
-} //compare_colors
+    if ( IsStdio( pwcPath ) )
+    {
+        // Encode to memory. CommitEncoder writes it to stdout.
 
-unsigned long lrand()
-{
-    unsigned long r = 0;
+        hr = CreateStreamOnHGlobal( NULL, TRUE, stream.GetAddressOf() );
+        if ( FAILED( hr ) )
+        {
+            printf( "can't create memory stream, error %#x\n", hr );
+            return hr;
+        }
 
-    for ( int i = 0; i < 5; i++ )
-        r = ( r << 15 ) | ( rand() & 0x7FFF );
+        g_StdoutStream = stream;
+    }
+    else
+    {
+        ComPtr<IWICStream> fileStream;
+        hr = g_IWICFactory->CreateStream( fileStream.GetAddressOf() );
+        if ( FAILED( hr ) )
+        {
+            printf( "can't create stream from factory, error %#x\n", hr );
+            return hr;
+        }
 
-    return r;
-} //lrand
+        hr = fileStream->InitializeFromFilename( pwcPath, GENERIC_WRITE );
+        if ( FAILED( hr ) )
+        {
+            printf( "can't initialize from filename, error %#x, path %ws\n", hr, pwcPath );
+            return hr;
+        }
 
-HRESULT PngFromVector( vector<DWORD> & vec, WCHAR const * pwcFile )
-{
-    int width = 128;
-    int height = vec.size() / width;
-    if ( vec.size() % width )
-        height++;
+        stream = fileStream;
+    }
 
-    ComPtr<IWICBitmapEncoder> encoder;
-    ComPtr<IWICBitmapFrameEncode> bitmapFrameEncode;
-    HRESULT hr = CreateWICEncoder( pwcFile, encoder, bitmapFrameEncode, L"image/png", false );
-    if ( FAILED( hr ) )
+    if ( !wcscmp( outputMimetype, L"image/bmp" ) )
+        hr = g_IWICFactory->CreateEncoder( GUID_ContainerFormatBmp, NULL, encoder.GetAddressOf() );
+    else if ( !wcscmp( outputMimetype, L"image/gif" ) )
+        hr = g_IWICFactory->CreateEncoder( GUID_ContainerFormatGif, NULL, encoder.GetAddressOf() );
+    else if ( !wcscmp( outputMimetype, L"image/jpeg" ) )
+        hr = g_IWICFactory->CreateEncoder( GUID_ContainerFormatJpeg, NULL, encoder.GetAddressOf() );
+    else if ( !wcscmp( outputMimetype, L"image/png" ) )
+        hr = g_IWICFactory->CreateEncoder( GUID_ContainerFormatPng, NULL, encoder.GetAddressOf() );
+    else if ( !wcscmp( outputMimetype, L"image/tiff" ) )
+        hr = g_IWICFactory->CreateEncoder( GUID_ContainerFormatTiff, NULL, encoder.GetAddressOf() );
+    else
     {
-        printf( "can't create a wic encoder, error %#x\n", hr );
-        return hr;
+        printf( "unexpected output mimetype %ws\n", outputMimetype );
+        hr = STATUS_INVALID_PARAMETER;
     }
-    
-    hr = bitmapFrameEncode->SetSize( width, height );
+
     if ( FAILED( hr ) )
     {
-        printf( "failed to set encoder frame size %d, %d, error %#x\n", width, height, hr );
+        printf( "can't create encoder, error %#x\n", hr );
         return hr;
     }
-    
-    WICPixelFormatGUID formatRequest = g_GuidPixelFormat;
-    hr = bitmapFrameEncode->SetPixelFormat( & formatRequest );
+
+    hr = encoder->Initialize( stream.Get(), WICBitmapEncoderNoCache );
     if ( FAILED( hr ) )
     {
-        printf( "failed to set encoder pixel format %#x\n", hr );
+        printf( "can't initialize encoder, error %#x\n", hr );
         return hr;
     }
-    
-    if ( formatRequest != g_GuidPixelFormat )
+
+    ComPtr<IPropertyBag2> propertyBag;
+    hr = encoder->CreateNewFrame( bitmapFrameEncode.GetAddressOf(), propertyBag.GetAddressOf() );
+    if ( FAILED( hr ) )
     {
-        printf( "didn't get the pixel format requested for writing\n" );
-        return E_FAIL;
+        printf( "can't create new frame, error %#x\n", hr );
+        return hr;
     }
-    
-    int bppOut = g_BitsPerPixel;
-    int strideOut = StrideInBytes( width, bppOut );
-    int cbOut = strideOut * height;
-    vector<byte> bufferOut( cbOut );
-    ZeroMemory( bufferOut.data(), cbOut );
-    printf( "buffer size: %d\n", cbOut );
-    printf( "vec size %d\n", (int) vec.size() );
-    printf( "width %d, height %d\n", width, height );
 
-    for ( int y = 0; y < height; y++ )
+    if ( false ) // useful for debugging
     {
-        for ( int x = 0; x < width; x++ )
+        ULONG cProps = 0;
+        HRESULT hrProps = propertyBag->CountProperties( & cProps );
+
+        if ( SUCCEEDED( hrProps ) )
         {
-            byte * p = bufferOut.data() + y * strideOut + 3 * x;
-            int vecoffset = y * width + x;
-            if ( vecoffset < vec.size() )
+            printf( "there are %d properties\n", cProps );
+
+            for ( ULONG i = 0; i < cProps; i++ )
             {
-                ColorBytes cb( vec[ y * width + x ] );
-                *p++ = cb.b;
-                *p++ = cb.g;
-                *p++ = cb.r;
+                ULONG read;
+                PROPBAG2 bag;
+                hrProps = propertyBag->GetPropertyInfo( i, 1, &bag, &read );
+                if ( SUCCEEDED( hrProps ) )
+                {
+                    printf( "  property name %ws\n", bag.pstrName );
+                    CoTaskMemFree( bag.pstrName );
+                }
             }
         }
     }
-    
-    hr = bitmapFrameEncode->WritePixels( height, strideOut, cbOut, bufferOut.data() );
-    if ( FAILED( hr ) )
-    {
-        printf( "failed to write pixels %#x\n", hr );
-        return hr;
-    }
-    
-    hr = CommitEncoder( bitmapFrameEncode, encoder );
-    if ( FAILED( hr ) )
+
+    if ( !wcscmp( outputMimetype, L"image/tiff" ) )
     {
-        printf( "failed to commit the encoder %#x\n", hr );
-        return hr;
-    }
+        PROPBAG2 optionQuality = { 0 };
+        optionQuality.pstrName = L"CompressionQuality";
+        VARIANT varValueQuality;
+        VariantInit( &varValueQuality );
+        varValueQuality.vt = VT_R4;
 
-    return hr;
-} //PngFromVector
+        if ( lowQualityOutput )
+            varValueQuality.fltVal = 0.6;
+        else
+            varValueQuality.fltVal = 1.0;
 
-struct ColorAndCount
-{
-    DWORD color;
-    DWORD count;
-};
-
-int compare_cac_color( const void * a, const void * b )
-{
-    ColorAndCount & caca = * (ColorAndCount *) a;
-    ColorAndCount & cacb = * (ColorAndCount *) b;
-
-    return ( caca.color > cacb.color ) ? -1 : ( caca.color == cacb.color ) ? 0 : 1;
-} //compare_cac_color
-
-int compare_cac_count( const void * a, const void * b )
-{
-    ColorAndCount & caca = * (ColorAndCount *) a;
-    ColorAndCount & cacb = * (ColorAndCount *) b;
+        hr = propertyBag->Write( 1, &optionQuality, &varValueQuality );
+        if ( FAILED( hr ) )
+        {
+            printf( "can't write compressionquality to property bag, error %#x\n", hr );
+            return hr;
+        }
+    }
 
-    return ( caca.count > cacb.count ) ? -1 : ( caca.count == cacb.count ) ? 0 : 1;
-} //compare_cac_count
+    if ( !wcscmp( outputMimetype, L"image/jpeg" ) )
+    {
+        PROPBAG2 optionQuality = { 0 };
+        optionQuality.pstrName = L"ImageQuality";
+        VARIANT varValueQuality;
+        VariantInit( &varValueQuality );
+        varValueQuality.vt = VT_R4;
 
-template <class T> void ShowColorsFromBuffer( T * p, int bpp, int stride, int width, int height,
-                                              int showColorCount, vector<DWORD> & centroids,
-                                              bool printColors )
-{
-    // store all the colors in a DWORD vector, removing adjacent duplicates
+        if ( lowQualityOutput )
+            varValueQuality.fltVal = 0.6; // lower quality, smaller
+        else
+            varValueQuality.fltVal = 1.0; // slower but more compressed
 
-    vector<ColorAndCount> vcac;
+        hr = propertyBag->Write( 1, &optionQuality, &varValueQuality );
+        if ( FAILED( hr ) )
+        {
+            printf( "can't write imagequality to property bag, error %#x\n", hr );
+            return hr;
+        }
+    }
 
+    if ( !wcscmp( outputMimetype, L"image/jpeg" ) )
     {
-        CTimed showColorsCopyTime( g_ShowColorsCopyTime );
-        T * row = p;
-        DWORD prevColor = 0xffffffff; // use a strange alpha value
-        int prevIndex = -1;
-    
-        for ( int y = 0; y < height; y++ )
-        {
-            T * pixel = row;
-        
-            for ( int x = 0; x < width; x++ )
-            {
-                byte r, g, b;
-    
-                // The input/output image is either 24bppGBR or 48bppRGB
-    
-                if ( 1 == sizeof( T ) )
-                {
-                    b = pixel[ 0 ];
-                    g = pixel[ 1 ];
-                    r = pixel[ 2 ];
-                }
-                else
-                {
-                    assert( 2 == sizeof( T ) );
-    
-                    r = (byte) ( (unsigned short) pixel[ 0 ] >> 8 );
-                    g = (byte) ( (unsigned short) pixel[ 1 ] >> 8 );
-                    b = (byte) ( (unsigned short) pixel[ 2 ] >> 8 );
-                }
-    
-                DWORD color = b | ( g << 8 ) | ( r << 16 );
-    
-                if ( color == prevColor )
-                {
-                    assert( -1 != prevIndex );
-                    vcac[ prevIndex ].count++;
-                }
-                else
-                {
-                    ColorAndCount cac;
-                    cac.color = color;
-                    cac.count = 1;
-                    vcac.push_back( cac );
+        PROPBAG2 optionSub = { 0 };
+        optionSub.pstrName = L"JpegYCrCbSubsampling";
+        VARIANT varValueSub;
+        VariantInit( &varValueSub );
+        varValueSub.vt = VT_UI1;
+        if ( lowQualityOutput )
+            varValueSub.iVal = WICJpegYCrCbSubsampling422;  // throw away color data to make it smaller
+        else
+            varValueSub.iVal = WICJpegYCrCbSubsampling444; // preserve color data
 
-                    prevColor = color;
-                    prevIndex = vcac.size() - 1;
-                }
-    
-                pixel += 3;
-            }
-    
-            row += ( stride * sizeof( T ) );
+        hr = propertyBag->Write( 1, &optionSub, &varValueSub );
+        if ( FAILED( hr ) )
+        {
+            printf( "can't write Subsampling to property bag, error %#x\n", hr );
+            return hr;
         }
     }
 
+    hr = bitmapFrameEncode->Initialize( propertyBag.Get() );
+    if ( FAILED( hr ) )
     {
-        CTimed showColorsSortTime( g_ShowColorsSortTime );
+        printf( "can't initialize frame encode with property bag, error %#x\n", hr );
+        return hr;
+    }
 
-        // std::sort is faster and MedianHybridQuickSort is even faster, but sorting over structs, not basic type
+    return hr;
+} //CreateWICEncoder
 
-        qsort( vcac.data(), vcac.size(), sizeof( ColorAndCount ), compare_cac_color );
+HRESULT CommitEncoder( ComPtr<IWICBitmapFrameEncode> & bitmapFrameEncode, ComPtr<IWICBitmapEncoder> & encoder )
+{
+    HRESULT hr = bitmapFrameEncode->Commit();
+    if ( FAILED( hr ) )
+    {
+        printf( "can't commit the frame encoder, error %#x\n", hr );
+        return hr;
     }
 
-    // copy unique colors. update color count.
+    hr = encoder->Commit();
+    if ( FAILED( hr ) )
+    {
+        printf( "can't commit the encoder, error %#x\n", hr );
+        return hr;
+    }
 
-    vector<ColorAndCount> unique_vcac;
+    if ( g_StdoutStream )
+        hr = WriteStdoutStream();
 
-    {
-        CTimed showColorsUniqueTime( g_ShowColorsUniqueTime );
-        DWORD prevColor = 0xffffffff; // alpha value doesn't exist
-        int prevIndex = -1;
-    
-        for ( int i = 0; i < vcac.size(); i++ )
-        {
-            if ( vcac[ i ].color == prevColor )
-            {
-                assert( -1 != prevIndex );
-                unique_vcac[ prevIndex ].count += vcac[ i ].count;
-            }
-            else
-            {
-                ColorAndCount cac;
-                cac.color = vcac[ i ].color;
-                cac.count = 1;
-                unique_vcac.push_back( cac );
+    return hr;
+} //CommitEncoder
 
-                prevColor = vcac[ i ].color;
-                prevIndex = unique_vcac.size() - 1;
-            }
-        }
-    }
+template <class T> void FloodFill( T * buffer, int width, int height, int fillColor )
+{
+    // Only written and tested for 24bppBGR and 48bppRGB
 
-    qsort( unique_vcac.data(), unique_vcac.size(), sizeof( ColorAndCount ), compare_cac_count );
-    showColorCount = __min( showColorCount, unique_vcac.size() );
+    int bitsShiftLeft = 8 * ( sizeof T - 1 );
+    T fillRed = ( ( fillColor & 0xff0000 ) >> 16 ) << bitsShiftLeft;
+    T fillGreen = ( ( fillColor & 0xff00 ) >> 8 ) << bitsShiftLeft;
+    T fillBlue = ( fillColor & 0xff ) << bitsShiftLeft;
 
-    // get a sample set of the colors for clustering
+    if ( 2 == sizeof( T ) )
+        Swap( fillRed, fillBlue );
 
-    const int sampleSize = 20000;
+    int strideInT = StrideInBytes( width, 3 * 8 * sizeof T ) / sizeof T;
 
-    if ( printColors )
+    for ( int y = 0; y < height; y++ )
     {
-        printf( "pixels in image:   %12d\n", height * width );
-        printf( "first-pass unique: %12zd\n", vcac.size() );
-        printf( "unique colors:     %12zd\n", unique_vcac.size() );
-        printf( "shown colors:      %12d\n", showColorCount );
-        printf( "sample size:       %12d\n", sampleSize );
-
-        //for ( int i = 0; i < unique_vcac.size(); i++ )
-        //    printf( "  color %d: %08x, count %d\n", i, unique_vcac[ i ].color, unique_vcac[ i ].count );
+        T * p = ( buffer + y * strideInT );
+        for ( int x = 0; x < width; x++ )
+        {
+            *p++ = fillBlue;
+            *p++ = fillGreen;
+            *p++ = fillRed;
+        }
     }
+} //FloodFill
 
-    CTimed showColorsClusterFeatureSelectionTime( g_ShowColorsClusterFeatureSelectionTime );
+// Fill a rectangle of a 24bppBGR buffer by copying from a row that's already the fill color for the full width
 
-    vcac.clear();
+void FillRect( byte * pOut, int strideOut, CellRect const & rect, byte const * pFillRow )
+{
+    const int bytesPP = g_BitsPerPixel / 8;
+    int offset = rect.x * bytesPP;
+    int bytesWide = rect.width * bytesPP;
 
-    if ( unique_vcac.size() <= showColorCount )
-    {
-        // no need to cluster -- just use the unique colors
+    for ( int y = rect.y; y < ( rect.y + rect.height ); y++ )
+        memcpy( pOut + (size_t) y * strideOut + offset, pFillRow + offset, bytesWide );
+} //FillRect
 
-        for ( int i = 0; i < unique_vcac.size(); i++ )
-            centroids.push_back( unique_vcac[ i ].color );
+// Fill just the parts of a 24bppBGR buffer not covered by any of the rectangles: spacing, letterboxing, and
+// the tail of the last row. Rectangle tops and bottoms split the buffer into horizontal bands; within a band
+// the same rectangles cover every row, so the gaps are computed once per band and the rows filled in parallel.
 
-        showColorsClusterFeatureSelectionTime.Complete();
-    }
-    else
+void FillUncovered( byte * pOut, int strideOut, int width, int height, vector<CellRect> const & covered, int fillColor )
+{
+    vector<byte> fillRow( StrideInBytes( width, g_BitsPerPixel ) );
+    FloodFill( fillRow.data(), width, 1, fillColor );
+
+    vector<int> edges;
+    edges.push_back( 0 );
+    edges.push_back( height );
+
+    for ( size_t i = 0; i < covered.size(); i++ )
     {
-        int clusteredColorCount = __max( showColorCount, __min( sampleSize, unique_vcac.size() ) );
-        if ( printColors )
-            printf( "clusteredColorCount: %10d\n", clusteredColorCount );
-    
-        vector<DWORD> clusteredColors( clusteredColorCount );
-    
-        srand( time( 0 ) );
-        vector<ColorAndCount> randomized_uvcac( unique_vcac );
-        Randomize( randomized_uvcac );
+        edges.push_back( __max( 0, __min( height, covered[ i ].y ) ) );
+        edges.push_back( __max( 0, __min( height, covered[ i ].y + covered[ i ].height ) ) );
+    }
 
-        for ( int i = 0; i < clusteredColorCount; i++ )
-            clusteredColors[ i ] = randomized_uvcac[ i ].color;
+    sort( edges.begin(), edges.end() );
+    edges.erase( unique( edges.begin(), edges.end() ), edges.end() );
 
-        showColorsClusterFeatureSelectionTime.Complete();
+    //for ( int band = 0; band < edges.size() - 1; band++ )
+    parallel_for( 0, (int) edges.size() - 1, [&] ( int band )
+    {
+        int top = edges[ band ];
+        int bottom = edges[ band + 1 ];
 
-        // cluster the sample set
-    
-        vector<KMeansPoint> all_points;
+        vector<pair<int, int>> spans;
+        for ( size_t i = 0; i < covered.size(); i++ )
         {
-            CTimed showColorsFeaturizeClusterTime( g_ShowColorsFeaturizeClusterTime );
-        
-            for ( int i = 0; i < clusteredColorCount; i++ )
-            {
-                ColorBytes cb( clusteredColors[ i ] );
-                all_points.emplace_back( i, cb.r, cb.g, cb.b );
-            }
+            CellRect const & r = covered[ i ];
+            if ( r.y < bottom && ( r.y + r.height ) > top )
+                spans.push_back( make_pair( __max( 0, r.x ), __min( width, r.x + r.width ) ) );
         }
-    
-        const int iters = 100;
-        const int K = showColorCount;
-        KMeans kmeans( K, iters );
 
+        sort( spans.begin(), spans.end() );
+
+        vector<CellRect> gaps;
+        int x = 0;
+        for ( size_t i = 0; i < spans.size(); i++ )
         {
-            CTimed showColorsClusterRunTime( g_ShowColorsClusterRunTime );
-            kmeans.run( all_points );
+            if ( spans[ i ].first > x )
+                gaps.push_back( { x, 0, spans[ i ].first - x, 1 } );
+            x = __max( x, spans[ i ].second );
         }
 
-        {
-            CTimed showColorsClusterRunTime( g_ShowColorsPostClusterTime );
-    
-            // it was sorted on counts; sort again on colors for lookups below
+        if ( x < width )
+            gaps.push_back( { x, 0, width - x, 1 } );
 
-            qsort( unique_vcac.data(), unique_vcac.size(), sizeof( ColorAndCount ), compare_cac_color );
+        if ( 0 == gaps.size() )
+            return;
 
-            #ifndef NDEBUG
-            for ( size_t i = 0; i < unique_vcac.size(); i++ )
+        //for ( int y = top; y < bottom; y++ )
+        parallel_for( top, bottom, [&] ( int y )
+        {
+            for ( size_t g = 0; g < gaps.size(); g++ )
             {
-                if ( i != ( unique_vcac.size() - 1 ) )
-                    assert( unique_vcac[ i ].color != unique_vcac[ i + 1 ].color );
+                CellRect row = gaps[ g ];
+                row.y = y;
+                FillRect( pOut, strideOut, row, fillRow.data() );
             }
-            #endif
-    
-            kmeans.sort();
+        });
+    });
+} //FillUncovered
 
-            //kmeans.getbgrSynthetic( centroids ); // get the synthetic color centroids; they may not be in actual image
-            kmeans.getbgrClosest( centroids );  // get the actual image colors closest to the centoids
+template <class T> __forceinline T MakeGreyscale( T r, T g, T b )
+{
+    // for 24bpp it's 0 and 8. For 48bpp it's 8 and 16;
 
-            vcac.resize( K );
-            vector<DWORD> items;
-            for ( int i = 0; i < K; i++ )
+    const int lshift = 8 * ( sizeof( T ) - 1 );
+    const int rshift = 8 * ( sizeof( T ) );
+
+    return (T) ( ( (int) r * ( 54 << lshift ) + (int) g * ( 182 << lshift ) + (int) b * ( 18 << lshift ) ) >> rshift );
+    // very slow: return (T) round( 0.2125 * (double) r + 0.7154 * (double) g + 0.0721 * (double) b );
+} //MakeGreyscale
+
+template <class T> void CopyPixels( int start, int beyond, int width, T * pOutBase, T * pInBase, int strideOut, int strideIn, bool makeGreyscale )
+{
+    byte * pbOut = (byte *) pOutBase + ( strideOut * start );
+    byte * pbIn = (byte *) pInBase + ( strideIn * start );
+    const int bytesWide = 3 * width * ( sizeof T );
+    
+    for ( int y = start; y < beyond; y++ )
+    {
+        if ( makeGreyscale )
+        {
+            T * pRowIn = (T *) pbIn;
+            T * pRowOut = (T *) pbOut;
+    
+            for ( int x = 0; x < width; x++ )
             {
-                vcac[ i ].color = centroids[ i ];
-                vcac[ i ].count = 0;
-                kmeans.getClusterbgrItems( i, items );
+                T b = *pRowIn++; T g = *pRowIn++; T r = *pRowIn++;
 
-                for ( int e = 0; e < items.size(); e++ )
-                {
-                    ColorAndCount key;
-                    key.color = items[ e ];
-                    ColorAndCount * pcac = (ColorAndCount *) bsearch( &key, unique_vcac.data(), unique_vcac.size(), sizeof key, compare_cac_color );
-                    assert( 0 != pcac );
-                    assert( pcac->color == items[ e ] );
-                    vcac[ i ].count += pcac->count;
-                }
-            }
+                // The input/output image is either 24bppGBR or 48bppRGB
 
-            qsort( vcac.data(), vcac.size(), sizeof( ColorAndCount ), compare_cac_count );
+                T grey = ( 1 == sizeof( T ) ) ? MakeGreyscale( r, g, b ) : MakeGreyscale( b, g, r );
 
-            for ( int i = 0; i < K; i++ )
-            {
-                centroids[ i ] = vcac[ i ].color;
-                tracer.Trace( "  centroid %d -- color %08x, count %d\n", i, vcac[ i ].color, vcac[ i ].count );
+                *pRowOut++ = grey; *pRowOut++ = grey; *pRowOut++ = grey;
             }
         }
+        else
+        {
+            memcpy( pbOut, pbIn, bytesWide );
+        }
+
+        pbOut += strideOut;
+        pbIn += strideIn;
     }
+} //CopyPixels
 
-    if ( printColors )
+ULONG CountPixelsOn( BYTE * image, int width, int height, int stride )
+{
+    ULONG pixelsOn = 0;
+    byte * pb = image;
+
+    for ( int y = 0; y < height; y++ )
     {
-        printf( "centroid colors ordered by cluster size:\n" );
-        printf( "static DWORD ColorizationColors%zd[] =\n{", centroids.size() );
+        byte * p = pb;
 
-        for ( int i = 0; i < centroids.size(); i++ )
+        for ( int x = 0; x < width; x++ )
         {
-            if ( 0 == ( i % 8 ) )
-                printf( "\n    " );
-            printf( "%#08x, ", centroids[ i ] );
+            if ( 0 != *p )
+                pixelsOn++;
+
+            p += 3;
         }
-        printf( "\n};\n" );
+
+        pb += stride;
     }
-} //ShowColorsFromBuffer
 
-HRESULT ShowColors( WCHAR const * input, int showColorCount, vector<DWORD> & centroids,
-                    bool printColors, WCHAR const * pwcOutput = 0, WCHAR const * outputMimetype = 0 )
+    return pixelsOn;
+} //CountPixelsOn
+
+void CreateWAVFromImage( int waveMethod, WCHAR const * pwcWAVBase, BYTE * image, int stride, int width, int height, int bpp )
 {
-    vector<byte> bufferIn;
-    int bppIn, strideIn;
-    UINT width = 0;
-    UINT height = 0;
-    CTimed timedShowColorsAll( g_ShowColorsAllTime );
-    HRESULT hr = 0;
+    // NOTE: This is still very much in prototype mode. Not sure how it will pan out.
+    // NOTE: current code below assumes posterization /p:1 and greyscale /g have been set.
+
+    if ( waveMethod > 4 || 24 != bpp )
+        return;
 
+    const WORD bytesPerSample = sizeof( short );
+    const int sampleRate = 88200;
+    WCHAR awcWAV[ MAX_PATH ];
+    wcscpy( awcWAV, pwcWAVBase );
+    wcscat( awcWAV, L".wav" );
+    vector<short> wav;
+    int samples;
+    
+    if ( 1 == waveMethod || 2 == waveMethod )
     {
-        // GDI is single-threaded
+        // stretch the image as much as needed to make a wav file that contains all on pixels
+
+        bool allPixels = ( 1 == waveMethod) ? false : true;  // true == airplane?  false == fart?
+        samples = allPixels ? width * height : CountPixelsOn( image, width, height, stride );
+        wav.resize( samples );
+        ZeroMemory( wav.data(), samples * sizeof( short ) );
+        int cur = 0;
     
-        lock_guard<mutex> lock( g_mtxGDI );
-        CTimed timedShowColorsOpen( g_ShowColorsOpenTime );
+        for ( int x = 0; x < width; x++ )
+        {
+            for ( int y = 0; y < height; y++ )
+            {
+                byte * pb = image + ( y * stride ) + ( 3 * x );
+                if ( *pb )
+                {
+                    // put in the range of -1..1
+                    double yv = ( 2.0 * ( (double) y / (double) height ) - 1.0 );
     
-        ComPtr<IWICBitmapSource> source;
-        ComPtr<IWICBitmapFrameDecode> frame;
+                    short v = (short) ( round ( -yv * 32767.0 ) );
     
-        hr = LoadWICBitmap( input, source, frame, true );
-        if ( FAILED( hr ) )
-        {
-            printf( "can't load wic bitmap %#x\n", hr );
-            return hr;
+                    wav[ cur++ ] = v;
+                }
+                else if ( allPixels )
+                    wav[ cur++ ] = -32768;
+            }
         }
-    
-        hr = source->GetSize( &width, &height );
-        if ( FAILED( hr ) )
+    }
+    else if ( 3 == waveMethod || 4 == waveMethod )
+    {
+        byte *pb = image;
+        vector<short> maxY( width );
+        ZeroMemory( maxY.data(), width * sizeof( short ) );
+
+        if ( 3 == waveMethod )
         {
-            printf( "can't get dimensions of path %ws\n", input );
-            return hr;
-        }
-    
-        timedShowColorsOpen.Complete();
+            // for each X, only set the vertically highest Y. If no Y are set, set the midpoint. Flip on even/odd X for highest/lowest Y
     
-        #if false // even though this can be much faster, WIC modifies colors when resizing, even if there are 2 colors!
-            const UINT maxSourceImageDimension = 1000;
-        
-            if ( width > maxSourceImageDimension || height > maxSourceImageDimension )
+            for ( int x = 0; x < width; x++ )
             {
-                hr = ScaleWICBitmap( source, maxSourceImageDimension );
-                if ( FAILED( hr ) )
+                bool anyY = false;
+    
+                if ( true ) //x & 1 )
                 {
-                    printf( "can't scale the input bitmap, error %#x\n", hr );
-                    return hr;
+                    for ( int y = 0; y < height; y++ )
+                    {
+                        byte * p = pb + ( y * stride ) + ( x * 3 );
+         
+                        if ( ! anyY )
+                        {
+                            if ( *p )
+                            {
+                                anyY = true;
+                                maxY[ x ] = (short) ( (double) ( height - y ) / (double) height * 32767 );
+                            }
+                        }
+                        else
+                        {
+                            *p++ = 0; *p++ = 0; *p = 0;
+                        }
+                    }
                 }
+                else
+                {
+                    for ( int y = height - 1; y >= 0; y-- )
+                    {
+                        byte * p = pb + ( y * stride ) + ( x * 3 );
         
-                hr = source->GetSize( &width, &height );
-                if ( FAILED( hr ) )
+                        if ( ! anyY )
+                        {
+                            if ( *p )
+                            {
+                                anyY = true;
+                                maxY[ x ] = (short) ( (double) ( height - y ) / (double) height * 32767 );
+                            }
+                        }
+                        else
+                        {
+                            *p++ = 0; *p++ = 0; *p = 0;
+                        }
+                    }
+                }
+    
+                if ( !anyY )
                 {
-                    printf( "can't get dimensions after scaling of path %ws\n", input );
-                    return hr;
+                    byte * p = pb + ( ( height / 2 ) * stride ) + ( x * 3 );
+                    *p++ = 255; *p++ = 255; *p = 255;
+                    maxY[ x ] = height / 2;
                 }
             }
-        #endif
+        }
+        else
+        {
+            assert( 4 == waveMethod );
+            // Find the Y offset of the brightest Y for each X
     
-        CTimed showReadPixels( g_ShowReadPixelsTime );
-        bppIn = g_BitsPerPixel;
-        strideIn = StrideInBytes( width, bppIn );
+            for ( int x = 0; x < width; x++ )
+            {
+                byte brightestY = 0;
+                for ( int y = 0; y < height; y++ )
+                {
+                    byte * p = pb + ( y * stride ) + ( x * 3 );
+                    if ( *p > brightestY )
+                    {
+                        brightestY = *p;
+                        maxY[ x ] = (short) ( (double) ( height - y ) / (double) height * 32767 );
+                    }
+                }
     
-        int cbIn = strideIn * height;
-        bufferIn.resize( cbIn );
+                // if none set, use the midpoint
     
-        hr = source->CopyPixels( 0, strideIn, cbIn, bufferIn.data() );
-        showReadPixels.Complete();
-        if ( FAILED( hr ) )
-        {
-            printf( "ShowColors() failed to read input pixels in CopyPixels() %#x\n", hr );
-            return hr;
+                if ( 0 == brightestY )
+                {
+                    byte * p = pb + ( ( height / 2 ) * stride ) + ( x * 3 );
+                    *p++ = 255; *p++ = 255; *p = 255;
+                    maxY[ x ] = height / 2;
+                }
+            }
         }
-    }
 
-    ShowColorsFromBuffer( bufferIn.data(), bppIn, strideIn, width, height, showColorCount, centroids, printColors );
+        // The image is now the first half of the waveform. Invert it to make the second half.
+        // Target A above middle C -- 440 Hz at 88200 samples per second, for one second of sound
 
-    if ( pwcOutput )
-    {
-        CTimed showColorsPalette( g_ShowColorsPaletteTime );
+        samples = 88200;
+        int samplesPerWave = (int) round( (double) 1.0 / (double) 440.0 * (double) samples );
+        int halfSamplesPerWave = samplesPerWave / 2;
+        printf( "width %d, samplesPerWave %d, halfSamplesPerWave %d\n", width, samplesPerWave, halfSamplesPerWave );
 
-        // create an output bitmap 128 pixels wide with a 16 pixel band for each color
-        const UINT width = 128;
-        const UINT bandHeight = 16;
+        wav.resize( samples );
+        ZeroMemory( wav.data(), samples * sizeof( short ) );
 
-        ComPtr<IWICBitmapEncoder> encoder;
-        ComPtr<IWICBitmapFrameEncode> bitmapFrameEncode;
-        HRESULT hr = CreateWICEncoder( pwcOutput, encoder, bitmapFrameEncode, outputMimetype, false );
-        if ( FAILED( hr ) )
-        {
-            printf( "can't create a wic encoder, error %#x\n", hr );
-            return hr;
-        }
-    
-        UINT height = bandHeight * centroids.size();
-        hr = bitmapFrameEncode->SetSize( width, height );
-        if ( FAILED( hr ) )
-        {
-            printf( "failed to set encoder frame size %d, %d, error %#x\n", width, height, hr );
-            return hr;
-        }
-    
-        WICPixelFormatGUID formatRequest = g_GuidPixelFormat;
-        hr = bitmapFrameEncode->SetPixelFormat( & formatRequest );
-        if ( FAILED( hr ) )
-        {
-            printf( "failed to set encoder pixel format %#x\n", hr );
-            return hr;
-        }
-    
-        if ( formatRequest != g_GuidPixelFormat )
+        for ( int t = 0; t < halfSamplesPerWave; t++ )
         {
-            printf( "didn't get the pixel format requested for writing\n" );
-            return E_FAIL;
+            int x = (int) round( (double) t / (double) halfSamplesPerWave * (double) width );
+            wav[ t ] = maxY[ x ];
+            wav[ t + halfSamplesPerWave ] = - maxY[ x ];
         }
-    
-        int bppOut = g_BitsPerPixel;
-        int strideOut = StrideInBytes( width, bppOut );
-        int cbOut = strideOut * height;
 
-        // write the RGB values over color bars for each entry in the centroids palette
-
-        HFONT hfont = CreateFont( bandHeight - 1, 0, 0, 0, FW_THIN, FALSE, FALSE, FALSE, ANSI_CHARSET, OUT_OUTLINE_PRECIS,
-                                  CLIP_DEFAULT_PRECIS, ANTIALIASED_QUALITY, FIXED_PITCH, L"Consolas" );
-        if ( 0 == hfont )
-        {
-            hr = HRESULT_FROM_WIN32( GetLastError() );
-            printf( "can't create a font, error %#x\n", hr );
-            return hr;
-        }
+        // replicate the wave throughout the buffer
 
-        HDC memdc = CreateCompatibleDC( GetDC( 0 ) );
-        if ( 0 == memdc )
-        {
-            DeleteObject( hfont );
-            hr = HRESULT_FROM_WIN32( GetLastError() );
-            printf( "can't create a compatible dc, error %#x\n", hr );
-            return hr;
-        }
+        int copies = samples / samplesPerWave;
+        for ( int c = 1; c < copies; c++ )
+            memcpy( wav.data() + c * samplesPerWave, wav.data(), samplesPerWave * sizeof( short ) );
+    }
 
-        BITMAPINFO bmi;
-        ZeroMemory( &bmi, sizeof bmi );
-        bmi.bmiHeader.biSize = sizeof bmi;
-        bmi.bmiHeader.biWidth = width;
-        bmi.bmiHeader.biHeight = -height; // negative means top-down dib
-        bmi.bmiHeader.biPlanes = 1;
-        bmi.bmiHeader.biBitCount = 24;
-        bmi.bmiHeader.biCompression = BI_RGB;   
-        byte *pbBits;
-        HBITMAP bitmap = CreateDIBSection( GetDC( 0 ), &bmi, DIB_RGB_COLORS, (void **) &pbBits, 0, 0 );
-        if ( 0 == bitmap )
-        {
-            DeleteObject( hfont );
-            DeleteDC( memdc );
-            hr = HRESULT_FROM_WIN32( GetLastError() );
-            printf( "can't create a DIBSection, error %#x\n", hr );
-            return hr;
-        }
+    // write the WAV to disk
 
-        HBITMAP oldbitmap = (HBITMAP) SelectObject( memdc, bitmap );
-        HFONT fontOld = (HFONT) SelectObject( memdc, hfont );
+    DjlParseWav::WavSubchunk fmtOut( 1, 1, sampleRate, bytesPerSample, 8 * bytesPerSample );
+    DjlParseWav output( awcWAV, fmtOut );
+    if ( !output.OpenSuccessful() )
+    {
+        printf( "can't open WAV output file %ws\n", awcWAV );
+        return;
+    }
+    
+    bool ok = output.WriteWavFile( (byte *) wav.data(), samples * sizeof( short ) );
+    if ( !ok )
+        printf( "can't write WAV file %ws\n", awcWAV );
+    else
+        printf( "created WAV file: %ws\n", awcWAV );
+} //CreateWAVFromImage
 
-        for ( int c = 0; c < centroids.size(); c++ )
-        {
-            int yoffset = c * bandHeight;
-            RECT rc = { 0, (LONG) yoffset, (LONG) width, (LONG) ( yoffset + bandHeight ) };
-            ColorBytes cb( centroids[ c ] );
-            Swap( cb.r, cb.b ); // GDI APIs take RGB, but the data in pvBits appears to be BGR
-            DWORD colorRGB = cb.dw;
-            COLORREF crBkOld = SetBkColor( memdc, colorRGB );
-            COLORREF crText = ColorDistance( 0, 0, 0, colorRGB ) < ColorDistance( 255, 255, 255, colorRGB ) ? 0xffffff : 0;
-            COLORREF crTextOld = SetTextColor( memdc, crText );
-            HBRUSH brush = CreateSolidBrush( colorRGB );
-            FillRect( memdc, &rc, brush );
-            DeleteObject( brush );
+template <class T> __forceinline T Posterize( T * pt, int groupSpan, vector<int> & values )
+{
+    // posterization level 1 values: 255         // it'll be all white
+    //                     2       : 0 and 255
+    //                     3       : 0, 127, 255
+    //                     4       : 0, 85, 170, 255
+    //                     5       : 0, 63, 127, 191, 255
+    //                     6       : 0, 51, 102, 153, 204, 255
+    //                     7       : 0, 42, 85, 127, 170, 212, 255
 
-            // RGB hex standard notation is actually BGR (blue is lowest byte on the right).
-            // the width in %#06x for wsprintf is different than printf. printf includes the 0x in the
-            // width and wsprintf does not.
+    int element = *pt / groupSpan;
+    assert( element < values.size() );
+    return values[ element ];
+} //Posterize
 
-            static WCHAR awcColor[ 30 ] = {0};
-            wsprintf( awcColor, L"%#06x", centroids[ c ] );
-            TextOut( memdc, 1, 1 + yoffset, awcColor, wcslen( awcColor ) );
+template <class T> void PosterizeImage( T * image, int stride, int width, int height, int posterizeLevel )
+{
+    CTimed timePosterize( g_PosterizePixelsTime );
+    assert( 0 != posterizeLevel );
+    const int maxT = ( 1 << sizeof( T ) * 8 ) - 1;
+    const int groupSpan = ( maxT + 1 ) / posterizeLevel;
 
-            SetTextColor( memdc, crTextOld );
-            SetBkColor( memdc, crBkOld );
-        }
+    // use the vector so double math can compute the values once
 
-        GdiFlush(); // make sure all the writes above are complete
-        hr = bitmapFrameEncode->WritePixels( height, strideOut, cbOut, pbBits );
+    vector<int> values( posterizeLevel + 1 );
+    for ( int v = 0; v < posterizeLevel; v++ )
+        values[ v ] = floor( (double) v * (double) maxT / (double) ( posterizeLevel - 1 ) );
 
-        // delay hr check until after resources are freed
+    values[ posterizeLevel - 1 ] = maxT; // make the brightest truly bright
+    values[ posterizeLevel ] = maxT;     // for cases like 5 when 255 is divisible by 51
 
-        SelectObject( memdc, fontOld );
-        SelectObject( memdc, oldbitmap );
-        DeleteObject( hfont );
-        DeleteDC( memdc );
-        DeleteObject( bitmap );
-    
-        if ( FAILED( hr ) )
-        {
-            printf( "failed to write pixels %#x\n", hr );
-            return hr;
-        }
+    for ( int y = 0; y < height; y++ )
+    {
+        T * pRow = (T *) ( (byte *) image + y * stride );
     
-        hr = CommitEncoder( bitmapFrameEncode, encoder );
-        if ( FAILED( hr ) )
+        for ( int x = 0; x < width; x++ )
         {
-            printf( "failed to commit the encoder %#x\n", hr );
-            return hr;
+            *pRow++ = Posterize( pRow, groupSpan, values );
+            *pRow++ = Posterize( pRow, groupSpan, values );
+            *pRow++ = Posterize( pRow, groupSpan, values );
         }
     }
+} //PosterizeImage
 
-    return hr;
-} //ShowColors
+long ColorDistance( int ra, int ga, int ba, int rb, int gb, int bb )
+{
+    long diffr = ra - rb;
+    long diffg = ga - gb;
+    long diffb = ba - bb;
+    return ( diffr * diffr ) + ( diffg * diffg ) + ( diffb * diffb );
+} //ColorDistance
 
-void DrawCaption( const WCHAR * pwcPath, byte * pOut, int stride, int xOffset, int yOffset,
-                  int width, int height, int fullWidth, int fullHeight, int bpp,
-                  bool fontSizeRelativeToWidth = true )
+long ColorDistance( int r, int g, int b, DWORD color2 )
 {
-    // GDI is single-threaded
+    return ColorDistance( r, g, b, ( color2 >> 16 ) & 0xff, ( color2 >> 8 ) & 0xff, color2 & 0xff );
+} //ColorDistance
 
-    lock_guard<mutex> lock( g_mtxGDI );
+DWORD FindNearestColor( int r, int g, int b, ColorizationData & cd, int posterizeLevel )
+{
+    assert( posterizeLevel <= cd.bgrdata.size() );
 
-    // rgb vs bgr doesn't matter because text is black and white
+    if ( mapColor == cd.mapping )
+    {
+        DWORD idnearest;
+        cd.kdtree->Nearest( r, g, b, idnearest );
 
-    PixelFormat pixelFormat = ( 24 == bpp ) ? PixelFormat24bppRGB : PixelFormat32bppRGB;
+        assert( idnearest < posterizeLevel );
+        return idnearest;
+    }
 
-    // Get just the filename from the path to use as a caption
+    if ( mapGradient == cd.mapping )
+    {
+        int v = RGBToV( r, g, b );
+        double dv = (double) v / 255.0;
+        int bucket = (int) ( dv * (double) posterizeLevel );
+        if ( bucket == posterizeLevel ) // v of 255 will hit this; round down
+            bucket--;
 
-    WCHAR caption[ MAX_PATH ];
-    const WCHAR * slash = wcsrchr( pwcPath, L'\\' );
-    if ( slash )
-        wcscpy( caption, slash + 1 );
-    else
-        wcscpy( caption, pwcPath );
+        assert( bucket >= 0 );
+        assert( bucket < posterizeLevel );
 
-    WCHAR * dot = wcsrchr( caption, L'.' );
-    if ( dot )
-        *dot = 0;
+        return bucket;
+    }
 
-    // Create a gdi+ bitmap and write the text. Use paths for multiple colors
-    // so that the text appears on any image instead of blending into similar colors.
+    assert( mapHue == cd.mapping || mapSaturation == cd.mapping || mapBrightness == cd.mapping );
 
-    Bitmap bitmap( fullWidth, fullHeight, stride, pixelFormat, pOut );
+    int h, s, v;
+    RGBToHSV( r, g, b, h, s, v );
 
-    FontFamily fontFamily( L"Arial" );
-    Font font( &fontFamily, 12, FontStyleBold, UnitPoint );
-
-    StringFormat stringFormat;
-    stringFormat.SetAlignment( StringAlignmentCenter );
-    stringFormat.SetLineAlignment( StringAlignmentCenter );
-
-    RectF rect( (REAL) xOffset, (REAL) yOffset + (REAL) height * 3.0 / 4.0,
-                (REAL) width, (REAL) height / 4.0 );
-
-    Graphics graphics( & bitmap );
-    graphics.SetSmoothingMode( SmoothingModeAntiAlias );
-    graphics.SetInterpolationMode( InterpolationModeHighQualityBicubic );
-
-    GraphicsPath path;
-    int fontSize = ( fontSizeRelativeToWidth ? width : height ) / 16;
-    path.AddString( caption, wcslen( caption ), &fontFamily, FontStyleRegular, fontSize, rect, &stringFormat );
-    Pen pen( Color( 255, 255, 255 ), 4 );
-    pen.SetLineJoin( LineJoinRound );
-    graphics.DrawPath( &pen, &path);
-    SolidBrush brush( Color( 0, 0, 0 ) );
-    graphics.FillPath( &brush, &path );
-} //DrawCaption
+    byte val = ( mapHue == cd.mapping ) ? h : ( mapSaturation == cd.mapping ) ? s : v;
 
-// Note: this is effectively a blt -- there is no stretching or scaling.
+    // lower_bound finds the first item >= to the search item. The closest match may be that
+    // or the prior item. lower_bound should be n log(n), rather than linear
 
-HRESULT DrawImage( byte * pOut, int strideOut, ComPtr<IWICBitmapSource> & source, int waveMethod, const WCHAR * pwcWAVBase,
-                   int posterizeLevel, ColorizationData * colorizationData, bool makeGreyscale, int offsetX, int offsetY,
-                   int width, int height, int bppIn, int bppOut )
-{
-    int strideIn = StrideInBytes( width, bppIn );
+    auto iterGE = std::lower_bound( cd.hsvdata.begin(), cd.hsvdata.end(), val );
+    int nearest = 0;
+    if ( iterGE == cd.hsvdata.end() )
+        nearest = cd.hsvdata.size() - 1;
+    else
+    {
+        DWORD index = std::distance( cd.hsvdata.begin(), iterGE );
+        if ( index > 0 )
+        {
+            byte ival = cd.hsvdata[ index ];
+            byte im1val = cd.hsvdata[ index - 1 ];
 
-    tracer.Trace( "DrawImage: strideIn %d, strideOut %d, offsetX %d, offsetY %d, width %d, height %d, bppIn %d, bppOut %d\n",
-                  strideIn, strideOut, offsetX, offsetY, width, height, bppIn, bppOut );
+            if ( abs( (int) ival - (int) val ) < abs( (int) im1val - (int) val ) )
+                nearest = index;
+            else
+                nearest = index - 1;
+        }
+    }
 
-    // this function only supports 24BGR to 24BGR or 48RGB to 48RGB
+    return nearest;
+} //FindNearestColor
 
-    if ( bppIn != bppOut || ( bppIn != 24 && bppIn != 48 ) )
-    {
-        printf( "bppIn %d doesn't match bppOut %d\n", bppIn, bppOut );
-        return E_FAIL;
-    }
+// Posterize, but use the specified colors to map to brightness
 
-    int cbIn = strideIn * height;
-    vector<byte> bufferIn( cbIn );
-    
-    {
-        CTimed timed( g_CollageStitchReadPixelsTime );
-        CTimed timedReadPixels( g_ReadPixelsTime );
+template <class T> void ColorizeImage( T * image, int stride, int width, int height, int posterizeLevel, ColorizationData * colorizationData )
+{
+    CTimed timeColorize( g_ColorizeImageTime );
 
-        // Almost all of the runtime of this app will be in source->CopyPixels(), where the input file is parsed and scaled
+    assert( 0 != posterizeLevel );
+    const int maxT = ( 1 << sizeof( T ) * 8 ) - 1;
+    const int groupSpan = ( maxT + 1 ) / posterizeLevel;
+    const DWORD count = colorizationData->bgrdata.size();
+    //printf( "colorizing posterize %d, colors %zd, method %d\n", posterizeLevel, colorizationData->bgrdata.size(), colorizationData->mapping );
 
-        HRESULT hr = source->CopyPixels( 0, strideIn, cbIn, bufferIn.data() );
-        if ( FAILED( hr ) )
+    //for ( int y = 0; y < height; y++ )
+    parallel_for ( 0, height, [&] ( int y )
+    {
+        T * pRow = (T *) ( (byte *) image + y * stride );
+    
+        for ( int x = 0; x < width; x++ )
         {
-            printf( "DrawImage() failed to read input pixels in CopyPixels() %#x\n", hr );
-            return hr;
-        }
-    }
+            byte r, g, b;
 
-    CTimed stitchDraw( g_CollageStitchDrawTime );
-    int bytesppOut = bppOut / 8;
-    byte * pbOutBase = pOut + ( offsetY * strideOut ) + ( offsetX * bytesppOut );
-    byte * pbInBase = bufferIn.data();
+            // The input/output image is either 24bppGBR or 48bppRGB
 
-    if ( 24 == bppIn )
-        CopyPixels( 0, height, width, pbOutBase, pbInBase, strideOut, strideIn, makeGreyscale );
-    else
-        CopyPixels( 0, height, width, (USHORT *) pbOutBase, (USHORT *) pbInBase, strideOut, strideIn, makeGreyscale );
+            if ( 1 == sizeof( T ) )
+            {
+                b = pRow[ 0 ];
+                g = pRow[ 1 ];
+                r = pRow[ 2 ];
+            }
+            else
+            {
+                assert( 2 == sizeof( T ) );
 
-    if ( 0 != colorizationData )
-    {
-        assert( 0 != posterizeLevel );
+                r = (unsigned short) pRow[ 0 ] >> 8;
+                g = (unsigned short) pRow[ 1 ] >> 8;
+                b = (unsigned short) pRow[ 2 ] >> 8;
+            }
 
-        if ( 24 == bppOut )
-            ColorizeImage( pbOutBase, strideOut, width, height, posterizeLevel, colorizationData );
-        else
-            ColorizeImage( (USHORT *) pbOutBase, strideOut, width, height, posterizeLevel, colorizationData );
-    }
-    else  if ( 0 != posterizeLevel )
-    {
-        if ( 24 == bppOut )
-            PosterizeImage( pbOutBase, strideOut, width, height, posterizeLevel );
-        else
-            PosterizeImage( (USHORT *) pbOutBase, strideOut, width, height, posterizeLevel );
-    }
+            DWORD index = FindNearestColor( r, g, b, *colorizationData, posterizeLevel );
 
-    if ( 0 != waveMethod )
-       CreateWAVFromImage( waveMethod, pwcWAVBase, pbOutBase, strideOut, width, height, bppOut );
+            // index = __min( count - 1, y / ( height / posterizeLevel ) );      // testing to see all colors
 
-    return S_OK;
-} //DrawImage
+            assert( index < count );
+            DWORD c = colorizationData->bgrdata[ index ];
+            ColorBytes cb( c );
 
-HRESULT WriteWICBitmap( WCHAR const * pwcOutput, ComPtr<IWICBitmapSource> & source, ComPtr<IWICBitmapFrameDecode> & frame,
-                        int longEdge, int waveMethod, int posterizeLevel, ColorizationData * colorizationData,
-                        bool makeGreyscale, double aspectRatio, int fillColor, WCHAR const * outputMimetype,
-                        bool lowQualityOutput, bool gameBoy, bool highQualityScaling )
+            if ( 1 == sizeof( T ) )
+            {
+                pRow[ 0 ] = cb.b;
+                pRow[ 1 ] = cb.g;
+                pRow[ 2 ] = cb.r;
+            }
+            else
+            {
+                pRow[ 0 ] = ( (T) cb.r ) << 8;
+                pRow[ 1 ] = ( (T) cb.g ) << 8;
+                pRow[ 2 ] = ( (T) cb.b ) << 8;
+            }
+
+            pRow += 3;
+        }
+    } );
+} //ColorizeImage
+
+int compare_colors( const void * a, const void * b )
+{
+    int ca = * (int *) a;
+    int cb = * (int *) b;
+
+    return ca - cb;
+} //compare_colors
+
+unsigned long lrand()
+{
+    unsigned long r = 0;
+
+    for ( int i = 0; i < 5; i++ )
+        r = ( r << 15 ) | ( rand() & 0x7FFF );
+
+    return r;
+} //lrand
+
+HRESULT PngFromVector( vector<DWORD> & vec, WCHAR const * pwcFile )
 {
+    int width = 128;
+    int height = vec.size() / width;
+    if ( vec.size() % width )
+        height++;
+
     ComPtr<IWICBitmapEncoder> encoder;
     ComPtr<IWICBitmapFrameEncode> bitmapFrameEncode;
-    HRESULT hr = CreateWICEncoder( pwcOutput, encoder, bitmapFrameEncode, outputMimetype, lowQualityOutput );
+    HRESULT hr = CreateWICEncoder( pwcFile, encoder, bitmapFrameEncode, L"image/png", false );
     if ( FAILED( hr ) )
     {
         printf( "can't create a wic encoder, error %#x\n", hr );
         return hr;
     }
-
-#if false // this fails in WIC when copying from TIF to JPG because the layout isn't indentical
-    hr = CopyMetadata( bitmapFrameEncode, frame );
+    
+    hr = bitmapFrameEncode->SetSize( width, height );
     if ( FAILED( hr ) )
     {
-        printf( "can't copy image metadata, error %#x\n", hr );
+        printf( "failed to set encoder frame size %d, %d, error %#x\n", width, height, hr );
         return hr;
     }
-#endif
-
-    UINT width, height;
-    hr = source->GetSize( &width, &height );
+    
+    WICPixelFormatGUID formatRequest = g_GuidPixelFormat;
+    hr = bitmapFrameEncode->SetPixelFormat( & formatRequest );
     if ( FAILED( hr ) )
     {
-        printf( "can't get the dimensions of the source bitmap: %#x\n", hr );
+        printf( "failed to set encoder pixel format %#x\n", hr );
         return hr;
     }
-
-    tracer.Trace( "source bitmap width %d, height %d\n", width, height );
-
-    double originalAspectRatio = (double) width / (double) height;
-
-    if ( !gameBoy && ( ( ( 0.0 == aspectRatio ) || SameDouble( aspectRatio, originalAspectRatio ) ) && ( 0 == posterizeLevel ) && ( 0 == waveMethod ) ) )
+    
+    if ( formatRequest != g_GuidPixelFormat )
     {
-        // This codepath is just an optimization for when it can be used. 
-
-        if ( makeGreyscale )
-        {
-            // it'll be written out as 1 8-bit channel to the JPG, but in the meantime...
+        printf( "didn't get the pixel format requested for writing\n" );
+        return E_FAIL;
+    }
     
-            GUID pixelFormat = GUID_WICPixelFormat32bppGrayFloat;
-            hr = bitmapFrameEncode->SetPixelFormat( & pixelFormat  );
-            if ( FAILED( hr ) )
-            {
-                printf( "can't make pixel format greyscale, error %#x\n", hr );
-                return hr;
-            }
-        }
+    int bppOut = g_BitsPerPixel;
+    int strideOut = StrideInBytes( width, bppOut );
+    int cbOut = strideOut * height;
+    vector<byte> bufferOut( cbOut );
+    ZeroMemory( bufferOut.data(), cbOut );
+    printf( "buffer size: %d\n", cbOut );
+    printf( "vec size %d\n", (int) vec.size() );
+    printf( "width %d, height %d\n", width, height );
 
-        if ( 0 != longEdge )
+    for ( int y = 0; y < height; y++ )
+    {
+        for ( int x = 0; x < width; x++ )
         {
-            hr = ScaleWICBitmap( source, longEdge, highQualityScaling );
-            if ( FAILED( hr ) )
+            byte * p = bufferOut.data() + y * strideOut + 3 * x;
+            int vecoffset = y * width + x;
+            if ( vecoffset < vec.size() )
             {
-                printf( "failed to scale input bitmap %#x\n", hr );
-                return hr;
+                ColorBytes cb( vec[ y * width + x ] );
+                *p++ = cb.b;
+                *p++ = cb.g;
+                *p++ = cb.r;
             }
         }
-
-        hr = bitmapFrameEncode->WriteSource( source.Get(), NULL );
-        if ( FAILED( hr ) )
-        {
-            if ( MF_E_INVALID_FORMAT == hr )
-                printf( "  MF_E_INVALID_FORMAT:  " );
-            printf( "can't write bitmap to encoder, error %#x\n", hr );
-            return hr;
-        }
     }
-    else
+    
+    hr = bitmapFrameEncode->WritePixels( height, strideOut, cbOut, bufferOut.data() );
+    if ( FAILED( hr ) )
     {
-        // fill the bitmap with the fill color then center the source in the output
+        printf( "failed to write pixels %#x\n", hr );
+        return hr;
+    }
+    
+    hr = CommitEncoder( bitmapFrameEncode, encoder );
+    if ( FAILED( hr ) )
+    {
+        printf( "failed to commit the encoder %#x\n", hr );
+        return hr;
+    }
 
-        UINT offsetX = 0;
-        UINT offsetY = 0;
-        UINT wOut = width;
-        UINT hOut = height;
-        UINT wIn = width;
-        UINT hIn = height;
+    return hr;
+} //PngFromVector
 
-        if ( 0.0 == aspectRatio )
-            aspectRatio = originalAspectRatio;
+struct ColorAndCount
+{
+    DWORD color;
+    DWORD count;
+};
 
-        if ( 0 != longEdge )
-        {
-            // Don't allow scaling to a resolution larger than the original (that upscaling is accounted for elsewhere)
+int compare_cac_color( const void * a, const void * b )
+{
+    ColorAndCount & caca = * (ColorAndCount *) a;
+    ColorAndCount & cacb = * (ColorAndCount *) b;
 
-            if ( longEdge > width && longEdge > height )
-                longEdge = __max( width, height );
+    return ( caca.color > cacb.color ) ? -1 : ( caca.color == cacb.color ) ? 0 : 1;
+} //compare_cac_color
 
-            UINT wScaled = 0;
-            UINT hScaled = 0;
+// Both sort descending. The color order matches compare_cac_color so bsearch works on the result.
 
-            if ( aspectRatio > originalAspectRatio )
-            {
-                wOut = longEdge;
-                hOut = (UINT) round( (double) longEdge / aspectRatio );
+void SortCacOnColor( vector<ColorAndCount> & v )
+{
+    RadixSort( v.data(), v.size(), [] ( ColorAndCount const & cac ) { return cac.color; }, true );
+} //SortCacOnColor
 
-                hIn = hOut;
-                wIn = (UINT) round( (double) width * (double) hIn / (double) height );
-                offsetX = ( wOut - wIn ) / 2;
-            }
-            else
-            {
-                hOut = longEdge;
-                wOut = (UINT) round( (double) longEdge * aspectRatio );
+void SortCacOnCount( vector<ColorAndCount> & v )
+{
+    RadixSort( v.data(), v.size(), [] ( ColorAndCount const & cac ) { return cac.count; }, true );
+} //SortCacOnCount
 
-                wIn = wOut;
-                hIn = (UINT) round( (double) height * (double) wIn / (double) width );
-                offsetY = ( hOut - hIn ) / 2;
-            }
-        }
-        else
-        {
-            if ( SameDouble( aspectRatio, 1.0f ) )
-            {
-                hOut = __max( height, width );
-                wOut = hOut;
+template <class T> void ShowColorsFromBuffer( T * p, int bpp, int stride, int width, int height,
+                                              int showColorCount, vector<DWORD> & centroids,
+                                              bool printColors )
+{
+    // store all the colors in a DWORD vector, removing adjacent duplicates
 
-                if ( width > height )
-                    offsetY = ( hOut - height ) / 2;
-                else
-                    offsetX = ( wOut - width ) / 2;
-            }
-            else if ( aspectRatio > originalAspectRatio )
-            {
-                wOut = (UINT) round( (double) height * aspectRatio );
-                offsetX = ( wOut - width ) / 2;
-            }
-            else
+    vector<ColorAndCount> vcac;
+
+    {
+        CTimed showColorsCopyTime( g_ShowColorsCopyTime );
+        T * row = p;
+        DWORD prevColor = 0xffffffff; // use a strange alpha value
+        int prevIndex = -1;
+    
+        for ( int y = 0; y < height; y++ )
+        {
+            T * pixel = row;
+        
+            for ( int x = 0; x < width; x++ )
             {
-                hOut = (UINT) round( ( (double) width / aspectRatio ) );
-                offsetY = ( hOut - height ) / 2;
+                byte r, g, b;
+    
+                // The input/output image is either 24bppGBR or 48bppRGB
+    
+                if ( 1 == sizeof( T ) )
+                {
+                    b = pixel[ 0 ];
+                    g = pixel[ 1 ];
+                    r = pixel[ 2 ];
+                }
+                else
+                {
+                    assert( 2 == sizeof( T ) );
+    
+                    r = (byte) ( (unsigned short) pixel[ 0 ] >> 8 );
+                    g = (byte) ( (unsigned short) pixel[ 1 ] >> 8 );
+                    b = (byte) ( (unsigned short) pixel[ 2 ] >> 8 );
+                }
+    
+                DWORD color = b | ( g << 8 ) | ( r << 16 );
+    
+                if ( color == prevColor )
+                {
+                    assert( -1 != prevIndex );
+                    vcac[ prevIndex ].count++;
+                }
+                else
+                {
+                    ColorAndCount cac;
+                    cac.color = color;
+                    cac.count = 1;
+                    vcac.push_back( cac );
+
+                    prevColor = color;
+                    prevIndex = vcac.size() - 1;
+                }
+    
+                pixel += 3;
             }
+    
+            row += ( stride * sizeof( T ) );
         }
+    }
 
-        tracer.Trace( "WriteWICBitmap: offsetx %d, offsety %d, wIn %d, hIn %d, wOut %d, hOut %d\n", offsetX, offsetY, wIn, hIn, wOut, hOut );
+    {
+        CTimed showColorsSortTime( g_ShowColorsSortTime );
 
-        if ( gameBoy )
-        {
-            wOut = 128;
-            hOut = 112;
-            offsetX = 0;
-            offsetY = 0;
+        // there can be one entry per pixel, so this is a radix sort rather than a comparison sort
 
-            double targetAspectRatio = (double) wOut / (double) hOut;
-            double inputAspectRatio = (double) width / (double) height;
+        SortCacOnColor( vcac );
+    }
 
-            if ( targetAspectRatio >= inputAspectRatio )
-            {
-                wIn = wOut;
-                hIn = (int) ( (double) height * ( (double) wIn / (double) width ) );
-            }
-            else
-            {
-                hIn = hOut;
-                wIn = (int) ( (double) width * ( (double) hIn / (double) height ) );
-            }
-        }
+    // copy unique colors. update color count.
 
-        hr = ScaleWICBitmap( source, wIn > hIn ? wIn : hIn, highQualityScaling );
-        if ( FAILED( hr ) )
-        {
-            printf( "failed to scale input bitmap %#x\n", hr );
-            return hr;
-        }
+    vector<ColorAndCount> unique_vcac;
 
-        if ( gameBoy )
+    {
+        CTimed showColorsUniqueTime( g_ShowColorsUniqueTime );
+        DWORD prevColor = 0xffffffff; // alpha value doesn't exist
+        int prevIndex = -1;
+    
+        for ( int i = 0; i < vcac.size(); i++ )
         {
-            hr = ClipWICBitmap( source, wOut, hOut );
-            if ( FAILED( hr ) )
+            if ( vcac[ i ].color == prevColor )
             {
-                printf( "failed to clip input bitmap: %#x\n", hr );
-                return hr;
+                assert( -1 != prevIndex );
+                unique_vcac[ prevIndex ].count += vcac[ i ].count;
             }
+            else
+            {
+                ColorAndCount cac;
+                cac.color = vcac[ i ].color;
+                cac.count = 1;
+                unique_vcac.push_back( cac );
 
-            wIn = wOut;
-            hIn = hOut;
-
-            makeGreyscale = true;
-            posterizeLevel = 4;
+                prevColor = vcac[ i ].color;
+                prevIndex = unique_vcac.size() - 1;
+            }
         }
+    }
 
-        hr = bitmapFrameEncode->SetSize( wOut, hOut );
-        if ( FAILED( hr ) )
-        {
-            printf( "failed to set encoder frame size %d, %d, error %#x\n", wOut, hOut, hr );
-            return hr;
-        }
+    SortCacOnCount( unique_vcac );
+    showColorCount = __min( showColorCount, unique_vcac.size() );
 
-        WICPixelFormatGUID formatSource;
-        hr = source->GetPixelFormat( &formatSource );
-        if ( FAILED( hr ) )
-        {
-            printf( "can't get source pixelFormat: %#x\n", hr );
-            return hr;
-        }
+    // get a sample set of the colors for clustering
 
-        // try for output of 24bppBGR unless input is 48bppRGB and output is tiff
+    const int sampleSize = 20000;
 
-        WICPixelFormatGUID formatRequest = g_GuidPixelFormat;
+    if ( printColors )
+    {
+        printf( "pixels in image:   %12d\n", height * width );
+        printf( "first-pass unique: %12zd\n", vcac.size() );
+        printf( "unique colors:     %12zd\n", unique_vcac.size() );
+        printf( "shown colors:      %12d\n", showColorCount );
+        printf( "sample size:       %12d\n", sampleSize );
 
-        if ( !wcscmp( outputMimetype, L"image/tiff" ) )
-            formatRequest = formatSource;
+        //for ( int i = 0; i < unique_vcac.size(); i++ )
+        //    printf( "  color %d: %08x, count %d\n", i, unique_vcac[ i ].color, unique_vcac[ i ].count );
+    }
 
-        hr = bitmapFrameEncode->SetPixelFormat( & formatRequest );
-        if ( FAILED( hr ) )
-        {
-            printf( "failed to set encoder pixel format %#x\n", hr );
-            return hr;
-        }
+    CTimed showColorsClusterFeatureSelectionTime( g_ShowColorsClusterFeatureSelectionTime );
 
-        if ( formatRequest != formatSource )
-        {
-            printf( "didn't get the pixel format requested for writing\n" );
-            return E_FAIL;
-        }
+    vcac.clear();
 
-        int bppOut = g_BitsPerPixel;
-        if ( GUID_WICPixelFormat48bppRGB == formatRequest )
-            bppOut = 48;
+    if ( unique_vcac.size() <= showColorCount )
+    {
+        // no need to cluster -- just use the unique colors
 
-        int bppIn = g_BitsPerPixel;
-        if ( GUID_WICPixelFormat48bppRGB == formatSource )
-            bppIn = 48;
+        for ( int i = 0; i < unique_vcac.size(); i++ )
+            centroids.push_back( unique_vcac[ i ].color );
 
-        tracer.Trace( "bppIn %d, bppOut %d\n", bppIn, bppOut );
+        showColorsClusterFeatureSelectionTime.Complete();
+    }
+    else
+    {
+        int clusteredColorCount = __max( showColorCount, __min( sampleSize, unique_vcac.size() ) );
+        if ( printColors )
+            printf( "clusteredColorCount: %10d\n", clusteredColorCount );
+    
+        vector<DWORD> clusteredColors( clusteredColorCount );
+    
+        srand( time( 0 ) );
+        vector<ColorAndCount> randomized_uvcac( unique_vcac );
+        Randomize( randomized_uvcac );
 
-        int strideOut = StrideInBytes( wOut, bppOut );
-        int cbOut = strideOut * hOut;
-        vector<byte> bufferOut( cbOut );
+        for ( int i = 0; i < clusteredColorCount; i++ )
+            clusteredColors[ i ] = randomized_uvcac[ i ].color;
 
-        if ( 24 == bppOut )
-            FloodFill( bufferOut.data(), wOut, hOut, fillColor );
-        else
-            FloodFill( (USHORT *) bufferOut.data(), wOut, hOut, fillColor );
+        showColorsClusterFeatureSelectionTime.Complete();
 
-        hr = DrawImage( bufferOut.data(), strideOut, source, waveMethod, pwcOutput, posterizeLevel,
-                        colorizationData, makeGreyscale, offsetX, offsetY, wIn, hIn, bppIn, bppOut );
-        if ( FAILED( hr ) )
+        // cluster the sample set
+    
+        vector<KMeansPoint> all_points;
         {
-            printf( "failed to DrawImage %#x\n", hr );
-            return hr;
+            CTimed showColorsFeaturizeClusterTime( g_ShowColorsFeaturizeClusterTime );
+        
+            for ( int i = 0; i < clusteredColorCount; i++ )
+            {
+                ColorBytes cb( clusteredColors[ i ] );
+                all_points.emplace_back( i, cb.r, cb.g, cb.b );
+            }
         }
+    
+        const int iters = 100;
+        const int K = showColorCount;
+        KMeans kmeans( K, iters );
 
-        CTimed writePixels( g_WritePixelsTime );
-        hr = bitmapFrameEncode->WritePixels( hOut, strideOut, cbOut, bufferOut.data() );
-        if ( FAILED( hr ) )
         {
-            printf( "failed to write pixels %#x\n", hr );
-            return hr;
+            CTimed showColorsClusterRunTime( g_ShowColorsClusterRunTime );
+            kmeans.run( all_points );
         }
-    }
-
-    hr = CommitEncoder( bitmapFrameEncode, encoder );
-
-    return hr;
-} //WriteWICBitmap
 
-HRESULT GetBitmapDimensions( WCHAR const * path, UINT & width, UINT & height )
-{
-    width = 0;
-    height = 0;
+        {
+            CTimed showColorsClusterRunTime( g_ShowColorsPostClusterTime );
+    
+            // it was sorted on counts; sort again on colors for lookups below
 
-    ComPtr<IWICBitmapSource> source;
-    ComPtr<IWICBitmapFrameDecode> frame;
+            SortCacOnColor( unique_vcac );
 
-    HRESULT hr = LoadWICBitmap( path, source, frame, false );
-    if ( FAILED( hr ) )
-    {
-        printf( "can't open bitmap %ws\n", path );
-        return hr;
-    }
+            #ifndef NDEBUG
+            for ( size_t i = 0; i < unique_vcac.size(); i++ )
+            {
+                if ( i != ( unique_vcac.size() - 1 ) )
+                    assert( unique_vcac[ i ].color != unique_vcac[ i + 1 ].color );
+            }
+            #endif
+    
+            kmeans.sort();
 
-    hr = source->GetSize( &width, &height );
-    if ( FAILED( hr ) )
-        printf( "can't get dimensions of path %ws\n", path );
+            //kmeans.getbgrSynthetic( centroids ); // get the synthetic color centroids; they may not be in actual image
+            kmeans.getbgrClosest( centroids );  // get the actual image colors closest to the centoids
 
-    return hr;
-} //GetBitmapDimensions
+            vcac.resize( K );
+            vector<DWORD> items;
+            for ( int i = 0; i < K; i++ )
+            {
+                vcac[ i ].color = centroids[ i ];
+                vcac[ i ].count = 0;
+                kmeans.getClusterbgrItems( i, items );
 
-HRESULT StitchImages2( WCHAR const * pwcOutput, CPathArray & pathArray, vector<int> & sortedIndexes,
-                       vector<int> & columnsToUse, vector<int> & yOffsets,
-                       vector<BitmapDimensions> & dimensions, int columns,
-                       int targetHeight, int targetWidth, int spacing, int imageWidth, int fillColor,
-                       int posterizeLevel, ColorizationData * colorizationData, bool makeGreyscale,
-                       WCHAR const * outputMimetype, bool lowQualityOutput, bool highQualityScaling,
-                       bool namesAsCaptions )
-{
-    CTimed timeStitch( g_CollageStitchTime );
-    ComPtr<IWICBitmapEncoder> encoder;
-    ComPtr<IWICBitmapFrameEncode> bitmapFrameEncode;
-    HRESULT hr = CreateWICEncoder( pwcOutput, encoder, bitmapFrameEncode, outputMimetype, lowQualityOutput );
-    if ( FAILED( hr ) )
-    {
-        printf( "can't create a wic encoder: error %#x\n", hr );
-        return hr;
+                for ( int e = 0; e < items.size(); e++ )
+                {
+                    ColorAndCount key;
+                    key.color = items[ e ];
+                    ColorAndCount * pcac = (ColorAndCount *) bsearch( &key, unique_vcac.data(), unique_vcac.size(), sizeof key, compare_cac_color );
+                    assert( 0 != pcac );
+                    assert( pcac->color == items[ e ] );
+                    vcac[ i ].count += pcac->count;
+                }
+            }
+
+            SortCacOnCount( vcac );
+
+            for ( int i = 0; i < K; i++ )
+            {
+                centroids[ i ] = vcac[ i ].color;
+                tracer.Trace( "  centroid %d -- color %08x, count %d\n", i, vcac[ i ].color, vcac[ i ].count );
+            }
+        }
     }
-    
-    hr = bitmapFrameEncode->SetSize( targetWidth, targetHeight );
-    if ( FAILED( hr ) )
+
+    if ( printColors )
     {
-        printf( "failed to set encoder frame size %#x\n", hr );
-        return hr;
+        printf( "centroid colors ordered by cluster size:\n" );
+        printf( "static DWORD ColorizationColors%zd[] =\n{", centroids.size() );
+
+        for ( int i = 0; i < centroids.size(); i++ )
+        {
+            if ( 0 == ( i % 8 ) )
+                printf( "\n    " );
+            printf( "%#08x, ", centroids[ i ] );
+        }
+        printf( "\n};\n" );
     }
-    
-    WICPixelFormatGUID formatRequest = g_GuidPixelFormat;
-    hr = bitmapFrameEncode->SetPixelFormat( & formatRequest );
-    if ( FAILED( hr ) )
+} //ShowColorsFromBuffer
+
+HRESULT ShowColors( WCHAR const * input, int showColorCount, vector<DWORD> & centroids,
+                    bool printColors, WCHAR const * pwcOutput = 0, WCHAR const * outputMimetype = 0 )
+{
+    vector<byte> bufferIn;
+    int bppIn, strideIn;
+    UINT width = 0;
+    UINT height = 0;
+    CTimed timedShowColorsAll( g_ShowColorsAllTime );
+    HRESULT hr = 0;
+
     {
-        printf( "failed to set encoder pixel format %#x\n", hr );
-        return hr;
-    }
+        // GDI is single-threaded
     
-    if ( formatRequest != g_GuidPixelFormat )
-    {
-        printf( "didn't get the pixel format requested for writing\n" );
-        return E_FAIL;
-    }
+        lock_guard<mutex> lock( g_mtxGDI );
+        CTimed timedShowColorsOpen( g_ShowColorsOpenTime );
     
-    int strideOut = StrideInBytes( targetWidth, g_BitsPerPixel );
-    int cbOut = strideOut * targetHeight;
-    vector<byte> bufferOut( cbOut );
+        ComPtr<IWICBitmapSource> source;
+        ComPtr<IWICBitmapFrameDecode> frame;
     
-    {
-        CTimed timedFlood( g_CollageStitchFloodTime );
+        hr = LoadWICBitmap( input, source, frame, true );
+        if ( FAILED( hr ) )
+        {
+            printf( "can't load wic bitmap %#x\n", hr );
+            return hr;
+        }
+    
+        hr = source->GetSize( &width, &height );
+        if ( FAILED( hr ) )
+        {
+            printf( "can't get dimensions of path %ws\n", input );
+            return hr;
+        }
+    
+        timedShowColorsOpen.Complete();
+    
+        #if false // even though this can be much faster, WIC modifies colors when resizing, even if there are 2 colors!
+            const UINT maxSourceImageDimension = 1000;
+        
+            if ( width > maxSourceImageDimension || height > maxSourceImageDimension )
+            {
+                hr = ScaleWICBitmap( source, maxSourceImageDimension );
+                if ( FAILED( hr ) )
+                {
+                    printf( "can't scale the input bitmap, error %#x\n", hr );
+                    return hr;
+                }
+        
+                hr = source->GetSize( &width, &height );
+                if ( FAILED( hr ) )
+                {
+                    printf( "can't get dimensions after scaling of path %ws\n", input );
+                    return hr;
+                }
+            }
+        #endif
     
-        FloodFill( bufferOut.data(), targetWidth, targetHeight, fillColor );
+        CTimed showReadPixels( g_ShowReadPixelsTime );
+        bppIn = g_BitsPerPixel;
+        strideIn = StrideInBytes( width, bppIn );
+    
+        int cbIn = strideIn * height;
+        bufferIn.resize( cbIn );
+    
+        hr = source->CopyPixels( 0, strideIn, cbIn, bufferIn.data() );
+        showReadPixels.Complete();
+        if ( FAILED( hr ) )
+        {
+            printf( "ShowColors() failed to read input pixels in CopyPixels() %#x\n", hr );
+            return hr;
+        }
     }
 
-    int imageCount = pathArray.Count();
+    ShowColorsFromBuffer( bufferIn.data(), bppIn, strideIn, width, height, showColorCount, centroids, printColors );
 
-    //for ( int i = 0; i < imageCount; i++ )
-    parallel_for( 0, imageCount, [&] ( int i )
+    if ( pwcOutput )
     {
-        int si = sortedIndexes[ i ];
-        int columnToUse = columnsToUse[ si ];
-        int imageHeight = round( (double) imageWidth / (double) dimensions[ si ].width * (double) dimensions[ si ].height );
+        CTimed showColorsPalette( g_ShowColorsPaletteTime );
 
-        ComPtr<IWICBitmapSource> source;
-        ComPtr<IWICBitmapFrameDecode> frame;
-        HRESULT hr = LoadWICBitmap( pathArray[ si ].pwcPath, source, frame, true );
+        // create an output bitmap 128 pixels wide with a 16 pixel band for each color
+        const UINT width = 128;
+        const UINT bandHeight = 16;
+
+        ComPtr<IWICBitmapEncoder> encoder;
+        ComPtr<IWICBitmapFrameEncode> bitmapFrameEncode;
+        HRESULT hr = CreateWICEncoder( pwcOutput, encoder, bitmapFrameEncode, outputMimetype, false );
         if ( FAILED( hr ) )
-            printf( "can't open bitmap, error: %#x\n", hr );
+        {
+            printf( "can't create a wic encoder, error %#x\n", hr );
+            return hr;
+        }
     
-        if ( SUCCEEDED( hr ) )
+        UINT height = bandHeight * centroids.size();
+        hr = bitmapFrameEncode->SetSize( width, height );
+        if ( FAILED( hr ) )
         {
-            hr = ScaleWICBitmap( source, __max( imageWidth, imageHeight ), highQualityScaling );
-            if ( FAILED( hr ) )
-                printf( "can't scale source bitmap, error %#x\n", hr );
+            printf( "failed to set encoder frame size %d, %d, error %#x\n", width, height, hr );
+            return hr;
         }
     
-        UINT width = 0, height = 0;
+        WICPixelFormatGUID formatRequest = g_GuidPixelFormat;
+        hr = bitmapFrameEncode->SetPixelFormat( & formatRequest );
+        if ( FAILED( hr ) )
+        {
+            printf( "failed to set encoder pixel format %#x\n", hr );
+            return hr;
+        }
     
-        if ( SUCCEEDED( hr ) )
+        if ( formatRequest != g_GuidPixelFormat )
         {
-            hr = source->GetSize( &width, &height );
-            if ( FAILED( hr ) )
-                printf( "can't get dimensions of path error %#x\n", hr );
+            printf( "didn't get the pixel format requested for writing\n" );
+            return E_FAIL;
         }
+    
+        int bppOut = g_BitsPerPixel;
+        int strideOut = StrideInBytes( width, bppOut );
+        int cbOut = strideOut * height;
 
-        if ( SUCCEEDED( hr ) )
+        // write the RGB values over color bars for each entry in the centroids palette
+
+        HFONT hfont = CreateFont( bandHeight - 1, 0, 0, 0, FW_THIN, FALSE, FALSE, FALSE, ANSI_CHARSET, OUT_OUTLINE_PRECIS,
+                                  CLIP_DEFAULT_PRECIS, ANTIALIASED_QUALITY, FIXED_PITCH, L"Consolas" );
+        if ( 0 == hfont )
         {
-            int xOffset = columnToUse * ( spacing + imageWidth );
-            int yOffset = yOffsets[ si ];
-            assert( ( yOffset + height ) <= targetHeight );
-    
-            //printf( "calling DrawImage, xoffset %d, yoffset %d, width %d, height %d\n", xOffset, yOffset, width, height );
-        
-            DrawImage( bufferOut.data(), strideOut, source, 0, pwcOutput, posterizeLevel, colorizationData, makeGreyscale,
-                       xOffset, yOffset, width, height, g_BitsPerPixel, g_BitsPerPixel );
+            hr = HRESULT_FROM_WIN32( GetLastError() );
+            printf( "can't create a font, error %#x\n", hr );
+            return hr;
+        }
 
-            if ( namesAsCaptions )
-                DrawCaption( pathArray[ si ].pwcPath, bufferOut.data(), strideOut, xOffset, yOffset,
-                             width, height, targetWidth, targetHeight, g_BitsPerPixel );
+        HDC memdc = CreateCompatibleDC( GetDC( 0 ) );
+        if ( 0 == memdc )
+        {
+            DeleteObject( hfont );
+            hr = HRESULT_FROM_WIN32( GetLastError() );
+            printf( "can't create a compatible dc, error %#x\n", hr );
+            return hr;
         }
-    });
 
-    timeStitch.Complete();
+        BITMAPINFO bmi;
+        ZeroMemory( &bmi, sizeof bmi );
+        bmi.bmiHeader.biSize = sizeof bmi;
+        bmi.bmiHeader.biWidth = width;
+        bmi.bmiHeader.biHeight = -height; // negative means top-down dib
+        bmi.bmiHeader.biPlanes = 1;
+        bmi.bmiHeader.biBitCount = 24;
+        bmi.bmiHeader.biCompression = BI_RGB;   
+        byte *pbBits;
+        HBITMAP bitmap = CreateDIBSection( GetDC( 0 ), &bmi, DIB_RGB_COLORS, (void **) &pbBits, 0, 0 );
+        if ( 0 == bitmap )
+        {
+            DeleteObject( hfont );
+            DeleteDC( memdc );
+            hr = HRESULT_FROM_WIN32( GetLastError() );
+            printf( "can't create a DIBSection, error %#x\n", hr );
+            return hr;
+        }
 
-    // If the output image is large, most of the time in the app is spent here compressing and writing the image
+        HBITMAP oldbitmap = (HBITMAP) SelectObject( memdc, bitmap );
+        HFONT fontOld = (HFONT) SelectObject( memdc, hfont );
 
-    CTimed timeWrite( g_CollageWriteTime );
+        for ( int c = 0; c < centroids.size(); c++ )
+        {
+            int yoffset = c * bandHeight;
+            RECT rc = { 0, (LONG) yoffset, (LONG) width, (LONG) ( yoffset + bandHeight ) };
+            ColorBytes cb( centroids[ c ] );
+            Swap( cb.r, cb.b ); // GDI APIs take RGB, but the data in pvBits appears to be BGR
+            DWORD colorRGB = cb.dw;
+            COLORREF crBkOld = SetBkColor( memdc, colorRGB );
+            COLORREF crText = ColorDistance( 0, 0, 0, colorRGB ) < ColorDistance( 255, 255, 255, colorRGB ) ? 0xffffff : 0;
+            COLORREF crTextOld = SetTextColor( memdc, crText );
+            HBRUSH brush = CreateSolidBrush( colorRGB );
+            FillRect( memdc, &rc, brush );
+            DeleteObject( brush );
 
-    hr = bitmapFrameEncode->WritePixels( targetHeight, strideOut, cbOut, bufferOut.data() );
-    if ( FAILED( hr ) )
-    {
-        printf( "failed to write pixels %#x\n", hr );
-        return hr;
-    }
+            // RGB hex standard notation is actually BGR (blue is lowest byte on the right).
+            // the width in %#06x for wsprintf is different than printf. printf includes the 0x in the
+            // width and wsprintf does not.
+
+            static WCHAR awcColor[ 30 ] = {0};
+            wsprintf( awcColor, L"%#06x", centroids[ c ] );
+            TextOut( memdc, 1, 1 + yoffset, awcColor, wcslen( awcColor ) );
+
+            SetTextColor( memdc, crTextOld );
+            SetBkColor( memdc, crBkOld );
+        }
+
+        GdiFlush(); // make sure all the writes above are complete
+        hr = bitmapFrameEncode->WritePixels( height, strideOut, cbOut, pbBits );
+
+        // delay hr check until after resources are freed
+
+        SelectObject( memdc, fontOld );
+        SelectObject( memdc, oldbitmap );
+        DeleteObject( hfont );
+        DeleteDC( memdc );
+        DeleteObject( bitmap );
+    
+        if ( FAILED( hr ) )
+        {
+            printf( "failed to write pixels %#x\n", hr );
+            return hr;
+        }
+    
+        hr = CommitEncoder( bitmapFrameEncode, encoder );
+        if ( FAILED( hr ) )
+        {
+            printf( "failed to commit the encoder %#x\n", hr );
+            return hr;
+        }
+    }
+
+    return hr;
+} //ShowColors
+
+// Get just the filename from the path to use as a caption
+
+void CaptionFromPath( const WCHAR * pwcPath, WCHAR * caption )
+{
+    const WCHAR * slash = wcsrchr( pwcPath, L'\\' );
+    if ( slash )
+        wcscpy( caption, slash + 1 );
+    else
+        wcscpy( caption, pwcPath );
+
+    WCHAR * dot = wcsrchr( caption, L'.' );
+    if ( dot )
+        *dot = 0;
+} //CaptionFromPath
+
+// Rasterize every character used in the captions once with GDI+ into the atlas. This is the only part of
+// captioning that uses GDI+, so it's the only part that holds the GDI lock. Text is drawn as a path with a
+// white outline and a black fill so it shows up on any image instead of blending into similar colors.
+
+void BuildCaptionAtlas( CCaptionAtlas & atlas, CPathArray & pathArray, int fontSize )
+{
+    lock_guard<mutex> lock( g_mtxGDI );
+
+    const int penWidth = 4;
+    FontFamily fontFamily( L"Arial" );
+    Font font( &fontFamily, (REAL) fontSize, FontStyleRegular, UnitPixel );
+    int lineHeight = (int) ceil( (double) fontSize * fontFamily.GetLineSpacing( FontStyleRegular ) / fontFamily.GetEmHeight( FontStyleRegular ) );
+    int padding = penWidth / 2 + 2;
+    int maskHeight = lineHeight + 2 * padding;
+
+    atlas.Initialize( fontSize, lineHeight, padding );
+
+    StringFormat stringFormat( StringFormat::GenericTypographic() );
+    stringFormat.SetFormatFlags( stringFormat.GetFormatFlags() | StringFormatFlagsMeasureTrailingSpaces );
+
+    Bitmap measureBitmap( 1, 1, PixelFormat32bppRGB );
+    Graphics measureGraphics( &measureBitmap );
+    vector<byte> outlineMask;
+    vector<byte> fillMask;
+
+    for ( size_t i = 0; i < pathArray.Count(); i++ )
+    {
+        WCHAR caption[ MAX_PATH ];
+        CaptionFromPath( pathArray[ i ].pwcPath, caption );
+
+        for ( WCHAR * pwc = caption; *pwc; pwc++ )
+        {
+            WCHAR c = *pwc;
+            if ( atlas.Contains( c ) )
+                continue;
+
+            RectF bounds;
+            measureGraphics.MeasureString( &c, 1, &font, PointF( 0, 0 ), &stringFormat, &bounds );
+            int advance = (int) round( bounds.Width );
+            int maskWidth = advance + 2 * padding;
+
+            Bitmap bitmap( maskWidth, maskHeight, PixelFormat32bppRGB );
+            Graphics graphics( &bitmap );
+            graphics.SetSmoothingMode( SmoothingModeAntiAlias );
+
+            GraphicsPath path;
+            path.AddString( &c, 1, &fontFamily, FontStyleRegular, (REAL) fontSize, PointF( (REAL) padding, (REAL) padding ), &stringFormat );
+
+            outlineMask.resize( maskWidth * maskHeight );
+            fillMask.resize( maskWidth * maskHeight );
+
+            for ( int pass = 0; pass < 2; pass++ )
+            {
+                graphics.Clear( Color( 0, 0, 0 ) );
+
+                if ( 0 == pass )
+                {
+                    Pen pen( Color( 255, 255, 255 ), penWidth );
+                    pen.SetLineJoin( LineJoinRound );
+                    graphics.DrawPath( &pen, &path );
+                }
+                else
+                {
+                    SolidBrush brush( Color( 255, 255, 255 ) );
+                    graphics.FillPath( &brush, &path );
+                }
+
+                graphics.Flush( FlushIntentionSync );
+
+                Rect rect( 0, 0, maskWidth, maskHeight );
+                BitmapData data;
+                if ( Ok == bitmap.LockBits( &rect, ImageLockModeRead, PixelFormat32bppRGB, &data ) )
+                {
+                    byte * pMask = ( 0 == pass ) ? outlineMask.data() : fillMask.data();
+
+                    for ( int y = 0; y < maskHeight; y++ )
+                    {
+                        byte const * pRow = (byte const *) data.Scan0 + y * data.Stride;
+                        for ( int x = 0; x < maskWidth; x++ )
+                            pMask[ y * maskWidth + x ] = pRow[ x * 4 ];
+                    }
+
+                    bitmap.UnlockBits( &data );
+                }
+            }
+
+            atlas.AddGlyph( c, maskWidth, advance, outlineMask.data(), fillMask.data(), maskWidth );
+        }
+    }
+} //BuildCaptionAtlas
+
+// Lock-free; the atlas must already hold the caption's glyphs.
+
+void DrawCaption( CCaptionAtlas const & atlas, const WCHAR * pwcPath, byte * pOut, int stride, int xOffset, int yOffset,
+                  int width, int height, int fullWidth, int fullHeight, int bpp )
+{
+    WCHAR caption[ MAX_PATH ];
+    CaptionFromPath( pwcPath, caption );
+
+    atlas.Draw( caption, pOut, stride, bpp, fullWidth, fullHeight, xOffset, yOffset + height * 3 / 4, width, height / 4 );
+} //DrawCaption
+
+// Scratch memory for when pixels can't be decoded in place. One buffer per thread that's reused from image to image,
+// so parallel callers don't contend and don't allocate for each image.
+
+byte * ScratchBuffer( size_t cb )
+{
+    thread_local vector<byte> scratch;
+
+    if ( scratch.size() < cb )
+        scratch.resize( cb );
+
+    return scratch.data();
+} //ScratchBuffer
+
+// Note: this is effectively a blt -- there is no stretching or scaling.
+
+HRESULT DrawImage( byte * pOut, int strideOut, ComPtr<IWICBitmapSource> & source, int waveMethod, const WCHAR * pwcWAVBase,
+                   int posterizeLevel, ColorizationData * colorizationData, bool makeGreyscale, int offsetX, int offsetY,
+                   int width, int height, int bppIn, int bppOut )
+{
+    int strideIn = StrideInBytes( width, bppIn );
+
+    tracer.Trace( "DrawImage: strideIn %d, strideOut %d, offsetX %d, offsetY %d, width %d, height %d, bppIn %d, bppOut %d\n",
+                  strideIn, strideOut, offsetX, offsetY, width, height, bppIn, bppOut );
+
+    // this function only supports 24BGR to 24BGR or 48RGB to 48RGB
+
+    if ( bppIn != bppOut || ( bppIn != 24 && bppIn != 48 ) )
+    {
+        printf( "bppIn %d doesn't match bppOut %d\n", bppIn, bppOut );
+        return E_FAIL;
+    }
+
+    int bytesppOut = bppOut / 8;
+    byte * pbOutBase = pOut + ( offsetY * strideOut ) + ( offsetX * bytesppOut );
+
+    // When the source exactly fills the destination rectangle, decode straight into the output buffer.
+    // Otherwise go through scratch memory so the source can't write outside the rectangle.
+
+    UINT sourceWidth = 0, sourceHeight = 0;
+    HRESULT hr = source->GetSize( &sourceWidth, &sourceHeight );
+    if ( FAILED( hr ) )
+    {
+        printf( "DrawImage() can't get source dimensions %#x\n", hr );
+        return hr;
+    }
+
+    bool direct = ( sourceWidth == (UINT) width && sourceHeight == (UINT) height );
+    int cbIn = strideIn * height;
+    byte * pbInBase = direct ? pbOutBase : ScratchBuffer( cbIn );
+    
+    {
+        CTimed timed( g_CollageStitchReadPixelsTime );
+        CTimed timedReadPixels( g_ReadPixelsTime );
+
+        // Almost all of the runtime of this app will be in source->CopyPixels(), where the input file is parsed and scaled
+
+        if ( direct )
+        {
+            WICRect rect = { 0, 0, width, height };
+            UINT cbOut = strideOut * ( height - 1 ) + width * bytesppOut;
+            hr = source->CopyPixels( &rect, strideOut, cbOut, pbOutBase );
+        }
+        else
+        {
+            memset( pbInBase, 0, cbIn );
+            hr = source->CopyPixels( 0, strideIn, cbIn, pbInBase );
+        }
+
+        if ( FAILED( hr ) )
+        {
+            printf( "DrawImage() failed to read input pixels in CopyPixels() %#x\n", hr );
+            return hr;
+        }
+    }
+
+    CTimed stitchDraw( g_CollageStitchDrawTime );
+
+    // Pixels decoded directly are already in place. Greyscale conversion can run in place over them.
+
+    if ( !direct || makeGreyscale )
+    {
+        int strideFrom = direct ? strideOut : strideIn;
+
+        if ( 24 == bppIn )
+            CopyPixels( 0, height, width, pbOutBase, pbInBase, strideOut, strideFrom, makeGreyscale );
+        else
+            CopyPixels( 0, height, width, (USHORT *) pbOutBase, (USHORT *) pbInBase, strideOut, strideFrom, makeGreyscale );
+    }
+
+    if ( 0 != colorizationData )
+    {
+        assert( 0 != posterizeLevel );
+
+        if ( 24 == bppOut )
+            ColorizeImage( pbOutBase, strideOut, width, height, posterizeLevel, colorizationData );
+        else
+            ColorizeImage( (USHORT *) pbOutBase, strideOut, width, height, posterizeLevel, colorizationData );
+    }
+    else  if ( 0 != posterizeLevel )
+    {
+        if ( 24 == bppOut )
+            PosterizeImage( pbOutBase, strideOut, width, height, posterizeLevel );
+        else
+            PosterizeImage( (USHORT *) pbOutBase, strideOut, width, height, posterizeLevel );
+    }
+
+    if ( 0 != waveMethod )
+       CreateWAVFromImage( waveMethod, pwcWAVBase, pbOutBase, strideOut, width, height, bppOut );
+
+    return S_OK;
+} //DrawImage
+
+HRESULT WriteWICBitmap( WCHAR const * pwcOutput, ComPtr<IWICBitmapSource> & source, ComPtr<IWICBitmapFrameDecode> & frame,
+                        int longEdge, int waveMethod, int posterizeLevel, ColorizationData * colorizationData,
+                        bool makeGreyscale, double aspectRatio, int fillColor, WCHAR const * outputMimetype,
+                        bool lowQualityOutput, bool gameBoy, bool highQualityScaling )
+{
+    ComPtr<IWICBitmapEncoder> encoder;
+    ComPtr<IWICBitmapFrameEncode> bitmapFrameEncode;
+    HRESULT hr = CreateWICEncoder( pwcOutput, encoder, bitmapFrameEncode, outputMimetype, lowQualityOutput );
+    if ( FAILED( hr ) )
+    {
+        printf( "can't create a wic encoder, error %#x\n", hr );
+        return hr;
+    }
+
+#if false // this fails in WIC when copying from TIF to JPG because the layout isn't indentical
+    hr = CopyMetadata( bitmapFrameEncode, frame );
+    if ( FAILED( hr ) )
+    {
+        printf( "can't copy image metadata, error %#x\n", hr );
+        return hr;
+    }
+#endif
+
+    UINT width, height;
+    hr = source->GetSize( &width, &height );
+    if ( FAILED( hr ) )
+    {
+        printf( "can't get the dimensions of the source bitmap: %#x\n", hr );
+        return hr;
+    }
+
+    tracer.Trace( "source bitmap width %d, height %d\n", width, height );
+
+    double originalAspectRatio = (double) width / (double) height;
+
+    if ( !gameBoy && ( ( ( 0.0 == aspectRatio ) || SameDouble( aspectRatio, originalAspectRatio ) ) && ( 0 == posterizeLevel ) && ( 0 == waveMethod ) ) )
+    {
+        // This codepath is just an optimization for when it can be used. 
+
+        if ( makeGreyscale )
+        {
+            // it'll be written out as 1 8-bit channel to the JPG, but in the meantime...
+    
+            GUID pixelFormat = GUID_WICPixelFormat32bppGrayFloat;
+            hr = bitmapFrameEncode->SetPixelFormat( & pixelFormat  );
+            if ( FAILED( hr ) )
+            {
+                printf( "can't make pixel format greyscale, error %#x\n", hr );
+                return hr;
+            }
+        }
+
+        if ( 0 != longEdge )
+        {
+            hr = ScaleWICBitmap( source, longEdge, highQualityScaling );
+            if ( FAILED( hr ) )
+            {
+                printf( "failed to scale input bitmap %#x\n", hr );
+                return hr;
+            }
+        }
+
+        hr = bitmapFrameEncode->WriteSource( source.Get(), NULL );
+        if ( FAILED( hr ) )
+        {
+            if ( MF_E_INVALID_FORMAT == hr )
+                printf( "  MF_E_INVALID_FORMAT:  " );
+            printf( "can't write bitmap to encoder, error %#x\n", hr );
+            return hr;
+        }
+    }
+    else
+    {
+        // fill the bitmap with the fill color then center the source in the output
+
+        UINT offsetX = 0;
+        UINT offsetY = 0;
+        UINT wOut = width;
+        UINT hOut = height;
+        UINT wIn = width;
+        UINT hIn = height;
+
+        if ( 0.0 == aspectRatio )
+            aspectRatio = originalAspectRatio;
+
+        if ( 0 != longEdge )
+        {
+            // Don't allow scaling to a resolution larger than the original (that upscaling is accounted for elsewhere)
+
+            if ( longEdge > width && longEdge > height )
+                longEdge = __max( width, height );
+
+            UINT wScaled = 0;
+            UINT hScaled = 0;
+
+            if ( aspectRatio > originalAspectRatio )
+            {
+                wOut = longEdge;
+                hOut = (UINT) round( (double) longEdge / aspectRatio );
+
+                hIn = hOut;
+                wIn = (UINT) round( (double) width * (double) hIn / (double) height );
+                offsetX = ( wOut - wIn ) / 2;
+            }
+            else
+            {
+                hOut = longEdge;
+                wOut = (UINT) round( (double) longEdge * aspectRatio );
+
+                wIn = wOut;
+                hIn = (UINT) round( (double) height * (double) wIn / (double) width );
+                offsetY = ( hOut - hIn ) / 2;
+            }
+        }
+        else
+        {
+            if ( SameDouble( aspectRatio, 1.0f ) )
+            {
+                hOut = __max( height, width );
+                wOut = hOut;
+
+                if ( width > height )
+                    offsetY = ( hOut - height ) / 2;
+                else
+                    offsetX = ( wOut - width ) / 2;
+            }
+            else if ( aspectRatio > originalAspectRatio )
+            {
+                wOut = (UINT) round( (double) height * aspectRatio );
+                offsetX = ( wOut - width ) / 2;
+            }
+            else
+            {
+                hOut = (UINT) round( ( (double) width / aspectRatio ) );
+                offsetY = ( hOut - height ) / 2;
+            }
+        }
+
+        tracer.Trace( "WriteWICBitmap: offsetx %d, offsety %d, wIn %d, hIn %d, wOut %d, hOut %d\n", offsetX, offsetY, wIn, hIn, wOut, hOut );
+
+        if ( gameBoy )
+        {
+            wOut = 128;
+            hOut = 112;
+            offsetX = 0;
+            offsetY = 0;
+
+            double targetAspectRatio = (double) wOut / (double) hOut;
+            double inputAspectRatio = (double) width / (double) height;
+
+            if ( targetAspectRatio >= inputAspectRatio )
+            {
+                wIn = wOut;
+                hIn = (int) ( (double) height * ( (double) wIn / (double) width ) );
+            }
+            else
+            {
+                hIn = hOut;
+                wIn = (int) ( (double) width * ( (double) hIn / (double) height ) );
+            }
+        }
+
+        hr = ScaleWICBitmap( source, wIn > hIn ? wIn : hIn, highQualityScaling );
+        if ( FAILED( hr ) )
+        {
+            printf( "failed to scale input bitmap %#x\n", hr );
+            return hr;
+        }
+
+        if ( gameBoy )
+        {
+            hr = ClipWICBitmap( source, wOut, hOut );
+            if ( FAILED( hr ) )
+            {
+                printf( "failed to clip input bitmap: %#x\n", hr );
+                return hr;
+            }
+
+            wIn = wOut;
+            hIn = hOut;
+
+            makeGreyscale = true;
+            posterizeLevel = 4;
+        }
+
+        hr = bitmapFrameEncode->SetSize( wOut, hOut );
+        if ( FAILED( hr ) )
+        {
+            printf( "failed to set encoder frame size %d, %d, error %#x\n", wOut, hOut, hr );
+            return hr;
+        }
+
+        WICPixelFormatGUID formatSource;
+        hr = source->GetPixelFormat( &formatSource );
+        if ( FAILED( hr ) )
+        {
+            printf( "can't get source pixelFormat: %#x\n", hr );
+            return hr;
+        }
+
+        // try for output of 24bppBGR unless input is 48bppRGB and output is tiff
+
+        WICPixelFormatGUID formatRequest = g_GuidPixelFormat;
+
+        if ( !wcscmp( outputMimetype, L"image/tiff" ) )
+            formatRequest = formatSource;
+
+        hr = bitmapFrameEncode->SetPixelFormat( & formatRequest );
+        if ( FAILED( hr ) )
+        {
+            printf( "failed to set encoder pixel format %#x\n", hr );
+            return hr;
+        }
+
+        if ( formatRequest != formatSource )
+        {
+            printf( "didn't get the pixel format requested for writing\n" );
+            return E_FAIL;
+        }
+
+        int bppOut = g_BitsPerPixel;
+        if ( GUID_WICPixelFormat48bppRGB == formatRequest )
+            bppOut = 48;
+
+        int bppIn = g_BitsPerPixel;
+        if ( GUID_WICPixelFormat48bppRGB == formatSource )
+            bppIn = 48;
+
+        tracer.Trace( "bppIn %d, bppOut %d\n", bppIn, bppOut );
+
+        int strideOut = StrideInBytes( wOut, bppOut );
+        int cbOut = strideOut * hOut;
+        vector<byte> bufferOut( cbOut );
+
+        if ( 24 == bppOut )
+            FloodFill( bufferOut.data(), wOut, hOut, fillColor );
+        else
+            FloodFill( (USHORT *) bufferOut.data(), wOut, hOut, fillColor );
+
+        hr = DrawImage( bufferOut.data(), strideOut, source, waveMethod, pwcOutput, posterizeLevel,
+                        colorizationData, makeGreyscale, offsetX, offsetY, wIn, hIn, bppIn, bppOut );
+        if ( FAILED( hr ) )
+        {
+            printf( "failed to DrawImage %#x\n", hr );
+            return hr;
+        }
+
+        CTimed writePixels( g_WritePixelsTime );
+        hr = bitmapFrameEncode->WritePixels( hOut, strideOut, cbOut, bufferOut.data() );
+        if ( FAILED( hr ) )
+        {
+            printf( "failed to write pixels %#x\n", hr );
+            return hr;
+        }
+    }
+
+    hr = CommitEncoder( bitmapFrameEncode, encoder );
+
+    return hr;
+} //WriteWICBitmap
+
+// The dimensions of an image as it will be drawn: upright, so swapped if its orientation rotates it 90 degrees.
+// The metadata cache has the stored dimensions and the orientation separately.
+
+HRESULT GetBitmapDimensions( WCHAR const * path, UINT & width, UINT & height )
+{
+    width = 0;
+    height = 0;
+
+    WCHAR awcFile[ MAX_PATH ];
+    UINT frameIndex = 0;
+    if ( SplitFramePath( path, awcFile, _countof( awcFile ), frameIndex ) && 0 == frameIndex )
+        path = awcFile;
+
+    ImageMetadata md;
+    if ( !g_pMetadataCache || !g_pMetadataCache->Lookup( path, md ) )
+        memset( &md, 0, sizeof md );
+
+    UINT flagsFound = md.flags;
+    HRESULT hr = S_OK;
+    ComPtr<IWICBitmapFrameDecode> frame;
+
+    if ( md.flags & mdDimensions )
+    {
+        width = md.width;
+        height = md.height;
+    }
+    else
+    {
+        // Only the header is read; orienting here would decode the whole image
+
+        ComPtr<IWICBitmapSource> source;
+
+        hr = LoadWICBitmap( path, source, frame, false, 0, false );
+        if ( FAILED( hr ) )
+        {
+            printf( "can't open bitmap %ws\n", path );
+            return hr;
+        }
+
+        hr = source->GetSize( &width, &height );
+        if ( FAILED( hr ) )
+        {
+            printf( "can't get dimensions of path %ws\n", path );
+            return hr;
+        }
+
+        md.width = width;
+        md.height = height;
+        md.flags |= mdDimensions;
+    }
+
+    // If the frame was opened for the dimensions, its metadata has the orientation
+
+    int orientation = ImageOrientation( path, md, ( 0 == frameIndex ) ? frame.Get() : 0 );
+
+    if ( g_pMetadataCache && flagsFound != md.flags )
+        g_pMetadataCache->Store( md );
+
+    if ( OrientationSwapsAxes( orientation ) )
+        swap( width, height );
+
+    return hr;
+} //GetBitmapDimensions
+
+// Relative cost of decoding an image. The codec must parse every compressed byte and produce every pixel, and
+// some codecs are much slower than others per byte. This is only used to order work, so it needn't be precise.
+
+double EstimateDecodeCost( WCHAR const * pwcPath, BitmapDimensions const & dimensions )
+{
+    static const WCHAR * slowFormats[] = { L".png", L".tif", L".tiff", L".bmp", L".gif" };
+    static const WCHAR * slowerFormats[] = { L".heic", L".hif", L".heif", L".avif", L".webp", L".jxr", L".wdp" };
+    static const WCHAR * rawFormats[] = { L".cr2", L".cr3", L".crw", L".nef", L".nrw", L".arw", L".sr2", L".dng",
+                                          L".raf", L".rw2", L".orf", L".pef", L".srw", L".3fr", L".rwl", L".x3f" };
+
+    WCHAR const * pwcExt = PathFindExtension( pwcPath );
+    double weight = 1.0; // JPG and anything else not listed
+
+    for ( int i = 0; i < _countof( slowFormats ); i++ )
+        if ( !_wcsicmp( pwcExt, slowFormats[ i ] ) )
+            weight = 2.0;
+
+    for ( int i = 0; i < _countof( slowerFormats ); i++ )
+        if ( !_wcsicmp( pwcExt, slowerFormats[ i ] ) )
+            weight = 3.0;
+
+    for ( int i = 0; i < _countof( rawFormats ); i++ )
+        if ( !_wcsicmp( pwcExt, rawFormats[ i ] ) )
+            weight = 4.0;
+
+    double fileSize = 0.0;
+    WIN32_FILE_ATTRIBUTE_DATA fad;
+    if ( GetFileAttributesEx( pwcPath, GetFileExInfoStandard, &fad ) )
+        fileSize = (double) ( ( (ULONGLONG) fad.nFileSizeHigh << 32 ) | fad.nFileSizeLow );
+
+    return weight * ( fileSize + (double) dimensions.width * (double) dimensions.height );
+} //EstimateDecodeCost
+
+// Peak memory for one decode is about the size of the full-resolution bitmap.
+
+unsigned long long EstimateDecodeMemory( BitmapDimensions const & dimensions )
+{
+    return (unsigned long long) dimensions.width * dimensions.height * ( g_BitsPerPixel / 8 );
+} //EstimateDecodeMemory
+
+// Don't let concurrent decodes use more than half of the RAM that's available now.
+
+unsigned long long DecodeMemoryBudget()
+{
+    MEMORYSTATUSEX msex;
+    msex.dwLength = sizeof msex;
+    if ( GlobalMemoryStatusEx( &msex ) )
+        return msex.ullAvailPhys / 2;
+
+    return 0;
+} //DecodeMemoryBudget
+
+struct SlowDecode
+{
+    long long duration;
+    WCHAR awcPath[ MAX_PATH ];
+};
+
+const int SlowDecodeCount = 5;
+
+struct DecodeTail
+{
+    long long tailTime;
+    long long idleTime;
+    SlowDecode slowDecodes[ SlowDecodeCount ];
+
+    // Keep the count slowest decodes, longest first
+
+    void AddDecode( long long duration, WCHAR const * pwcPath )
+    {
+        for ( int s = 0; s < SlowDecodeCount; s++ )
+        {
+            if ( duration > slowDecodes[ s ].duration )
+            {
+                for ( int m = SlowDecodeCount - 1; m > s; m-- )
+                    slowDecodes[ m ] = slowDecodes[ m - 1 ];
+
+                slowDecodes[ s ].duration = duration;
+                wcsncpy_s( slowDecodes[ s ].awcPath, _countof( slowDecodes[ s ].awcPath ), pwcPath, _TRUNCATE );
+                break;
+            }
+        }
+    } //AddDecode
+};
+
+// The worst tail of any collage this process made and the slowest decodes across them, for -i.
+// Daemon jobs make collages concurrently, so each one's stats are gathered separately and merged under the lock.
+
+DecodeTail g_DecodeTail = {};
+std::mutex g_mtxDecodeTail;
+
+// Save the tail statistics and slowest decodes for -i, and trace each image's decode time.
+
+void RecordDecodeTail( CCostScheduler & scheduler, CPathArray & pathArray )
+{
+    DecodeTail tail = {};
+    scheduler.TailStats( tail.tailTime, tail.idleTime );
+
+    vector<CCostScheduler::ItemTiming> & timings = scheduler.Timings();
+
+    for ( size_t i = 0; i < timings.size(); i++ )
+    {
+        CCostScheduler::ItemTiming & t = timings[ i ];
+        long long duration = t.end - t.start;
+        WCHAR const * pwcPath = pathArray[ t.index ].pwcPath;
+
+        tracer.Trace( "decode %zd on worker %d: start %lld, %lld ms, %ws\n", i, t.worker, t.start / CTimed::NanoPerMilli(),
+                      duration / CTimed::NanoPerMilli(), pwcPath );
+
+        tail.AddDecode( duration, pwcPath );
+    }
+
+    lock_guard<mutex> lock( g_mtxDecodeTail );
+
+    if ( tail.tailTime > g_DecodeTail.tailTime )
+    {
+        g_DecodeTail.tailTime = tail.tailTime;
+        g_DecodeTail.idleTime = tail.idleTime;
+    }
+
+    for ( int s = 0; s < SlowDecodeCount && 0 != tail.slowDecodes[ s ].duration; s++ )
+        g_DecodeTail.AddDecode( tail.slowDecodes[ s ].duration, tail.slowDecodes[ s ].awcPath );
+} //RecordDecodeTail
+
+// Each image is scaled to exactly the size of its rectangle, which should be close to the image's aspect ratio.
+// Used by collage methods that compute their own layout.
+
+HRESULT StitchImagesToRects( WCHAR const * pwcOutput, CPathArray & pathArray, vector<BitmapDimensions> & dimensions,
+                             vector<CellRect> & rects, int targetHeight, int targetWidth, int captionFontSize, int fillColor,
+                             int posterizeLevel, ColorizationData * colorizationData, bool makeGreyscale,
+                             WCHAR const * outputMimetype, bool lowQualityOutput, bool highQualityScaling,
+                             bool namesAsCaptions )
+{
+    CTimed timeStitch( g_CollageStitchTime );
+    ComPtr<IWICBitmapEncoder> encoder;
+    ComPtr<IWICBitmapFrameEncode> bitmapFrameEncode;
+    HRESULT hr = CreateWICEncoder( pwcOutput, encoder, bitmapFrameEncode, outputMimetype, lowQualityOutput );
+    if ( FAILED( hr ) )
+    {
+        printf( "can't create a wic encoder: error %#x\n", hr );
+        return hr;
+    }
+    
+    hr = bitmapFrameEncode->SetSize( targetWidth, targetHeight );
+    if ( FAILED( hr ) )
+    {
+        printf( "failed to set encoder frame size %#x\n", hr );
+        return hr;
+    }
+    
+    WICPixelFormatGUID formatRequest = g_GuidPixelFormat;
+    hr = bitmapFrameEncode->SetPixelFormat( & formatRequest );
+    if ( FAILED( hr ) )
+    {
+        printf( "failed to set encoder pixel format %#x\n", hr );
+        return hr;
+    }
+    
+    if ( formatRequest != g_GuidPixelFormat )
+    {
+        printf( "didn't get the pixel format requested for writing\n" );
+        return E_FAIL;
+    }
+    
+    int imageCount = pathArray.Count();
+
+    // The buffer isn't initialized; every byte is either filled here or drawn by an image
+
+    int strideOut = StrideInBytes( targetWidth, g_BitsPerPixel );
+    int cbOut = strideOut * targetHeight;
+    unique_ptr<byte[]> bufferOut( new byte[ cbOut ] );
+    
+    {
+        CTimed timedFlood( g_CollageStitchFloodTime );
+    
+        FillUncovered( bufferOut.get(), strideOut, targetWidth, targetHeight, rects, fillColor );
+    }
+
+    vector<byte> fillRow( strideOut );
+    FloodFill( fillRow.data(), targetWidth, 1, fillColor );
+
+    CCaptionAtlas captionAtlas;
+    if ( namesAsCaptions )
+        BuildCaptionAtlas( captionAtlas, pathArray, __max( 1, captionFontSize ) );
+
+    CCostScheduler scheduler( DecodeMemoryBudget() );
+
+    for ( int i = 0; i < imageCount; i++ )
+        scheduler.Add( i, EstimateDecodeCost( pathArray[ i ].pwcPath, dimensions[ i ] ), EstimateDecodeMemory( dimensions[ i ] ) );
+
+    scheduler.Run( [&] ( size_t index )
+    {
+        int si = (int) index;
+        CellRect & rect = rects[ si ];
+
+        // Scale to exactly the size the layout expects, since the fill only covered the gaps around that
+
+        ComPtr<IWICBitmapSource> source;
+        ComPtr<IWICBitmapFrameDecode> frame;
+        HRESULT hr = LoadWICBitmap( pathArray[ si ].pwcPath, source, frame, true, __max( rect.width, rect.height ) );
+        if ( FAILED( hr ) )
+            printf( "can't open bitmap, error: %#x\n", hr );
+    
+        if ( SUCCEEDED( hr ) )
+        {
+            hr = ScaleWICBitmapToSize( source, rect.width, rect.height, highQualityScaling );
+            if ( FAILED( hr ) )
+                printf( "can't scale source bitmap, error %#x\n", hr );
+        }
+
+        if ( SUCCEEDED( hr ) )
+        {
+            //printf( "calling DrawImage, xoffset %d, yoffset %d, width %d, height %d\n", rect.x, rect.y, rect.width, rect.height );
+        
+            hr = DrawImage( bufferOut.get(), strideOut, source, 0, pwcOutput, posterizeLevel, colorizationData, makeGreyscale,
+                            rect.x, rect.y, rect.width, rect.height, g_BitsPerPixel, g_BitsPerPixel );
+        }
+
+        if ( FAILED( hr ) )
+            FillRect( bufferOut.get(), strideOut, rect, fillRow.data() );
+        else if ( namesAsCaptions )
+            DrawCaption( captionAtlas, pathArray[ si ].pwcPath, bufferOut.get(), strideOut, rect.x, rect.y,
+                         rect.width, rect.height, targetWidth, targetHeight, g_BitsPerPixel );
+    });
+
+    RecordDecodeTail( scheduler, pathArray );
+    timeStitch.Complete();
+
+    // If the output image is large, most of the time in the app is spent here compressing and writing the image
+
+    CTimed timeWrite( g_CollageWriteTime );
+
+    hr = bitmapFrameEncode->WritePixels( targetHeight, strideOut, cbOut, bufferOut.get() );
+    if ( FAILED( hr ) )
+    {
+        printf( "failed to write pixels %#x\n", hr );
+        return hr;
+    }
+
+    hr = CommitEncoder( bitmapFrameEncode, encoder );
+
+    return hr;
+} //StitchImagesToRects
+
+HRESULT StitchImages1( WCHAR const * pwcOutput, CPathArray & pathArray, vector<BitmapDimensions> & dimensions,
+                       int imagesWide, int imagesHigh, int cellDX, int cellDY, int stitchDX, int stitchDY,
+                       int fillColor, int waveMethod, int posterizeLevel,
+                       ColorizationData * colorizationData, bool makeGreyscale, WCHAR const * outputMimetype,
+                       bool lowQualityOutput, bool highQualityScaling, bool namesAsCaptions )
+{
+    CTimed timeStitch( g_CollageStitchTime );
+    bool makeEverythingSquare = ( cellDX == cellDY );
+    ComPtr<IWICBitmapEncoder> encoder;
+    ComPtr<IWICBitmapFrameEncode> bitmapFrameEncode;
+    HRESULT hr = CreateWICEncoder( pwcOutput, encoder, bitmapFrameEncode, outputMimetype, lowQualityOutput );
+    if ( FAILED( hr ) )
+    {
+        printf( "can't create a wic encoder: error %#x\n", hr );
+        return hr;
+    }
+    
+    hr = bitmapFrameEncode->SetSize( stitchDX, stitchDY );
+    if ( FAILED( hr ) )
+    {
+        printf( "failed to set encoder frame size %#x\n", hr );
+        return hr;
+    }
+    
+    WICPixelFormatGUID formatRequest = g_GuidPixelFormat;
+    hr = bitmapFrameEncode->SetPixelFormat( & formatRequest );
+    if ( FAILED( hr ) )
+    {
+        printf( "failed to set encoder pixel format %#x\n", hr );
+        return hr;
+    }
+    
+    if ( formatRequest != g_GuidPixelFormat )
+    {
+        printf( "didn't get the pixel format requested for writing\n" );
+        return E_FAIL;
+    }
+    
+    // Where each image lands: scaled to fit the cell, and centered if cells are square
+
+    int cellCount = __min( (int) pathArray.Count(), imagesWide * imagesHigh );
+    vector<CellRect> rects( cellCount );
+
+    for ( int i = 0; i < cellCount; i++ )
+    {
+        UINT width, height;
+        ScaledSize( dimensions[ i ].width, dimensions[ i ].height, __max( cellDY, cellDX ), width, height );
+
+        int rectX = ( i % imagesWide ) * cellDX;
+        int rectY = ( i / imagesWide ) * cellDY;
+
+        if ( makeEverythingSquare && ( width != height ) )
+        {
+            if ( width > height )
+            {
+                double diff = width - height;
+                double resultDiff = round( diff * (double) cellDY / (double) width );
+                rectY += (int) round( resultDiff / 2.0 );
+            }
+            else
+            {
+                double diff = height - width;
+                double resultDiff = round( diff * (double) cellDX / (double) height );
+                rectX += (int) round( resultDiff / 2.0 );
+            }
+        }
+
+        rects[ i ] = { rectX, rectY, (int) width, (int) height };
+    }
+
+    // The buffer isn't initialized; every byte is either filled here or drawn by an image
+
+    int strideOut = StrideInBytes( stitchDX, g_BitsPerPixel );
+    int cbOut = strideOut * stitchDY;
+    unique_ptr<byte[]> bufferOut( new byte[ cbOut ] );
+    
+    {
+        CTimed timedFlood( g_CollageStitchFloodTime );
+    
+        FillUncovered( bufferOut.get(), strideOut, stitchDX, stitchDY, rects, fillColor );
+    }
+
+    vector<byte> fillRow( strideOut );
+    FloodFill( fillRow.data(), stitchDX, 1, fillColor );
+    
+    // Cells are independent, so decode them in cost order rather than row by row
+
+    CCaptionAtlas captionAtlas;
+    if ( namesAsCaptions )
+        BuildCaptionAtlas( captionAtlas, pathArray, __max( 1, cellDX / 16 ) );
+
+    CCostScheduler scheduler( DecodeMemoryBudget() );
+
+    for ( int i = 0; i < cellCount; i++ )
+        scheduler.Add( i, EstimateDecodeCost( pathArray[ i ].pwcPath, dimensions[ i ] ), EstimateDecodeMemory( dimensions[ i ] ) );
+
+    scheduler.Run( [&] ( size_t index )
+    {
+        int curSource = (int) index;
+        int xOffset = ( curSource % imagesWide ) * cellDX;
+        int yOffset = ( curSource / imagesWide ) * cellDY;
+        CellRect & rect = rects[ curSource ];
+
+        ComPtr<IWICBitmapSource> source;
+        ComPtr<IWICBitmapFrameDecode> frame;
+        HRESULT hr = LoadWICBitmap( pathArray[curSource].pwcPath, source, frame, true, __max( cellDY, cellDX ) );
+        if ( FAILED( hr ) )
+            printf( "can't open bitmap, error: %#x\n", hr );
+    
+        if ( SUCCEEDED( hr ) )
+        {
+            hr = ScaleWICBitmapToSize( source, rect.width, rect.height, highQualityScaling );
+            if ( FAILED( hr ) )
+                printf( "can't scale source bitmap, error %#x\n", hr );
+        }
+    
+        if ( SUCCEEDED( hr ) )
+            hr = DrawImage( bufferOut.get(), strideOut, source, waveMethod, pwcOutput, posterizeLevel, colorizationData,
+                            makeGreyscale, rect.x, rect.y, rect.width, rect.height, g_BitsPerPixel, g_BitsPerPixel );
+
+        if ( FAILED( hr ) )
+            FillRect( bufferOut.get(), strideOut, rect, fillRow.data() );
+        else if ( namesAsCaptions )
+            DrawCaption( captionAtlas, pathArray[ curSource ].pwcPath, bufferOut.get(), strideOut, xOffset, yOffset,
+                         cellDX, cellDY, stitchDX, stitchDY, g_BitsPerPixel );
+    });
+
+    RecordDecodeTail( scheduler, pathArray );
+    timeStitch.Complete();
+
+    // If the output image is large, most of the time in the app is spent here compressing and writing the image
+
+    CTimed timeWrite( g_CollageWriteTime );
+
+    hr = bitmapFrameEncode->WritePixels( stitchDY, strideOut, cbOut, bufferOut.get() );
+    if ( FAILED( hr ) )
+    {
+        printf( "failed to write pixels %#x\n", hr );
+        return hr;
+    }
+
+    hr = CommitEncoder( bitmapFrameEncode, encoder );
+
+    return hr;
+} //StitchImages1
+
+vector<BitmapDimensions> * g_pdimensions = 0;
+
+static int aspectCompare( const void * a, const void * b )
+{
+    int ia = * (int *) a;
+    int ib = * (int *) b;
+
+    vector<BitmapDimensions> & dim = * g_pdimensions;
+
+    double aspecta = (double) dim[ ia ].width / (double) dim[ ia ].height;
+    double aspectb = (double) dim[ ib ].width / (double) dim[ ib ].height;
+
+    if ( aspecta > aspectb )
+        return 1;
+
+    if ( aspecta < aspectb )
+        return -1;
+
+    return 0;
+} //aspectCompare
+
+void Randomize( vector<int> & elements, std::mt19937 & gen )
+{
+    if ( elements.size() <= 1 )
+        return;
+
+    std::uniform_int_distribution<> distrib( 0, (int) elements.size() - 1 );
+
+    for ( size_t i = 0; i < elements.size() * 2; i++ )
+    {
+        int a = distrib( gen );
+        int b = distrib( gen );
+
+        swap( elements[ a ], elements[ b ] );
+    }
+} //Randomize
+
+ULONG GetPrimaryHSV( const WCHAR * pwc )
+{
+    ImageMetadata md;
+    if ( g_pMetadataCache && g_pMetadataCache->Lookup( pwc, md ) && ( md.flags & mdColors ) )
+        return md.primaryHSV;
+
+    vector<DWORD> centroids;
+    ShowColors( pwc, _countof( md.colors ), centroids, false, 0, 0 );
+    if ( 0 == centroids.size() )
+        return 0;
+
+    int h, s, v;
+    BGRToHSV( centroids[ 0 ], h, s, v );
+    ULONG hsv = h << 16 | s << 8 | v;
+
+    if ( g_pMetadataCache )
+    {
+        for ( size_t c = 0; c < centroids.size() && c < _countof( md.colors ); c++ )
+            md.colors[ c ] = centroids[ c ];
+
+        md.primaryHSV = hsv;
+        md.flags |= mdColors;
+        g_pMetadataCache->Store( md );
+    }
+
+    return hsv;
+} //GetPrimaryHSV
+
+void SortPathArrayByColor( CPathArray & pathArray )
+{
+    parallel_for( (size_t) 0, pathArray.Count(), [&] ( size_t i )
+    //for ( size_t i = 0; i < pathArray.Count(); i++ )
+    {
+        pathArray[ i ].ulAttribute = GetPrimaryHSV( pathArray[ i ].pwcPath );
+    } );
+
+    pathArray.SortOnAttribute();
+
+    //for ( size_t i = 0; i < pathArray.Count(); i++ )
+    //    tracer.Trace( "hsv %08x, path %ws\n", pathArray[ i ].ulAttribute, pathArray[ i ].pwcPath );
+} //SortPathArrayByColor
+
+// Break images (in order) into rows for a justified layout. A row of images i..j-1 scaled to the same height
+// fills the width exactly when height = ( width - spacing between them ) / sum of their aspect ratios.
+// The row height that makes the whole collage come out at the requested aspect ratio is
+// width / sqrt( aspectRatio * sum of all aspect ratios ). Dynamic programming finds the break points that
+// minimize the sum of squared differences between each row's height and that target. Rows that would be
+// shorter than a third of the target are never considered, which bounds the work at O( N * images-per-row ).
+// The last row isn't stretched taller than the target, so it may be left short of full width.
+// Returns the target row height; rowStarts gets the index of the first image in each row.
+
+double LayoutJustifiedRows( vector<double> const & aspects, int width, int spacing, double aspectRatio, vector<int> & rowStarts )
+{
+    size_t count = aspects.size();
+    vector<double> prefix( count + 1, 0.0 );
+    for ( size_t i = 0; i < count; i++ )
+        prefix[ i + 1 ] = prefix[ i ] + aspects[ i ];
+
+    double target = (double) width / sqrt( aspectRatio * prefix[ count ] );
+
+    vector<double> best( count + 1, DBL_MAX );
+    vector<int> breaks( count + 1, 0 );
+    best[ 0 ] = 0.0;
+
+    for ( size_t j = 1; j <= count; j++ )
+    {
+        for ( size_t i = j; i-- > 0; )
+        {
+            if ( DBL_MAX == best[ i ] )
+                continue;
+
+            double available = (double) width - (double) spacing * (double) ( j - i - 1 );
+            double height = available / ( prefix[ j ] - prefix[ i ] );
+            bool lastRow = ( j == count );
+
+            if ( available <= 0.0 || ( height < target / 3.0 && i < j - 1 ) )
+                break;
+
+            double diff = ( lastRow && height > target ) ? 0.0 : ( height - target );
+            double cost = best[ i ] + diff * diff;
+
+            if ( cost < best[ j ] )
+            {
+                best[ j ] = cost;
+                breaks[ j ] = (int) i;
+            }
+        }
+    }
+
+    rowStarts.clear();
+    for ( size_t j = count; j > 0; j = breaks[ j ] )
+        rowStarts.push_back( breaks[ j ] );
+
+    reverse( rowStarts.begin(), rowStarts.end() );
+    return target;
+} //LayoutJustifiedRows
+
+// Convert the row breaks into pixel rectangles. Widths in a row are derived from rounded cumulative
+// positions so they sum to exactly the collage width. Returns the collage height.
+
+int PlaceJustifiedRows( vector<double> const & aspects, vector<int> const & rowStarts, int width, int spacing,
+                        double targetHeight, vector<CellRect> & rects )
+{
+    int count = (int) aspects.size();
+    int y = 0;
+
+    for ( size_t r = 0; r < rowStarts.size(); r++ )
+    {
+        int start = rowStarts[ r ];
+        int beyond = ( r + 1 < rowStarts.size() ) ? rowStarts[ r + 1 ] : count;
+
+        double sumAspects = 0.0;
+        for ( int i = start; i < beyond; i++ )
+            sumAspects += aspects[ i ];
+
+        int available = width - spacing * ( beyond - start - 1 );
+        double height = (double) available / sumAspects;
+        bool shortLastRow = ( beyond == count ) && ( height > targetHeight );
+
+        if ( shortLastRow )
+            height = targetHeight;
+
+        int rowHeight = __max( 1, (int) round( height ) );
+        double cumulative = 0.0;
+        int x = 0;
+
+        for ( int i = start; i < beyond; i++ )
+        {
+            int left = (int) round( cumulative * height );
+            cumulative += aspects[ i ];
+            int right = ( i == beyond - 1 && !shortLastRow ) ? available : (int) round( cumulative * height );
+
+            rects[ i ] = { x, y, __max( 1, right - left ), rowHeight };
+            x += rects[ i ].width + spacing;
+        }
+
+        y += rowHeight + spacing;
+    }
+
+    return __max( 1, y - spacing );
+} //PlaceJustifiedRows
+
+// Page 0 of an atlas uses the output name as-is. Later pages get _N before the extension.
+
+void AtlasPageName( WCHAR const * pwcOutput, int page, WCHAR * pwcPage )
+{
+    wcscpy( pwcPage, pwcOutput );
+
+    if ( 0 != page )
+    {
+        WCHAR * pwcExt = PathFindExtension( pwcPage );
+        WCHAR awcExt[ MAX_PATH ];
+        wcscpy( awcExt, pwcExt );
+        swprintf( pwcExt, MAX_PATH - ( pwcExt - pwcPage ), L"_%d%ws", page, awcExt );
+    }
+} //AtlasPageName
+
+// Returns false if the string can't be converted to UTF-8
+
+bool WriteJSONString( FILE * fp, WCHAR const * pwc )
+{
+    int cb = WideCharToMultiByte( CP_UTF8, 0, pwc, -1, 0, 0, 0, 0 );
+    if ( 0 == cb )
+        return false;
+
+    vector<char> ac( cb );
+    if ( 0 == WideCharToMultiByte( CP_UTF8, 0, pwc, -1, ac.data(), cb, 0, 0 ) )
+        return false;
+
+    fputc( '"', fp );
+
+    for ( char const * pc = ac.data(); *pc; pc++ )
+    {
+        if ( '"' == *pc || '\\' == *pc )
+            fputc( '\\', fp );
+
+        if ( (unsigned char) *pc >= ' ' )
+            fputc( *pc, fp );
+        else
+            fprintf( fp, "\\u%04x", (unsigned char) *pc );
+    }
+
+    fputc( '"', fp );
+    return true;
+} //WriteJSONString
+
+// Writes the output name with a .json extension, listing the page files and where each image was placed, in input order.
+
+HRESULT WriteAtlasIndex( WCHAR const * pwcOutput, CPathArray & pathArray, vector<CellRect> & rects, vector<int> & pageOf,
+                         int pageCount, int pageWidth, int pageHeight )
+{
+    WCHAR awcIndex[ MAX_PATH ];
+    wcscpy( awcIndex, pwcOutput );
+    PathRenameExtension( awcIndex, L".json" );
+
+    FILE * fp = _wfopen( awcIndex, L"w" );
+    if ( !fp )
+    {
+        printf( "can't create atlas index file %ws\n", awcIndex );
+        return E_FAIL;
+    }
+
+    bool ok = true;
+    fprintf( fp, "{\n  \"pages\": [\n" );
+
+    for ( int p = 0; p < pageCount; p++ )
+    {
+        WCHAR awcPage[ MAX_PATH ];
+        AtlasPageName( pwcOutput, p, awcPage );
+
+        fprintf( fp, "    { \"file\": " );
+        ok = WriteJSONString( fp, PathFindFileName( awcPage ) ) && ok;
+        fprintf( fp, ", \"width\": %d, \"height\": %d }%s\n", pageWidth, pageHeight, ( p + 1 < pageCount ) ? "," : "" );
+    }
+
+    fprintf( fp, "  ],\n  \"images\": [\n" );
+
+    for ( size_t i = 0; i < pathArray.Count(); i++ )
+    {
+        fprintf( fp, "    { \"path\": " );
+        ok = WriteJSONString( fp, pathArray[ i ].pwcPath ) && ok;
+        fprintf( fp, ", \"page\": %d, \"x\": %d, \"y\": %d, \"width\": %d, \"height\": %d }%s\n",
+                 pageOf[ i ], rects[ i ].x, rects[ i ].y, rects[ i ].width, rects[ i ].height,
+                 ( i + 1 < pathArray.Count() ) ? "," : "" );
+    }
+
+    fprintf( fp, "  ]\n}\n" );
+    ok = ( 0 == fclose( fp ) ) && ok;
+
+    if ( !ok )
+    {
+        printf( "can't write atlas index file %ws\n", awcIndex );
+        DeleteFile( awcIndex );
+        return E_FAIL;
+    }
+
+    printf( "atlas index written: %ws\n", awcIndex );
+    return S_OK;
+} //WriteAtlasIndex
+
+// Add path|N for each frame of a path|* input
+
+HRESULT FindFramePaths( WCHAR const * pwcInput, CPathArray & pathArray )
+{
+    WCHAR awcFile[ MAX_PATH ];
+    UINT frameIndex;
+    if ( !SplitFramePath( pwcInput, awcFile, _countof( awcFile ), frameIndex ) )
+        return E_INVALIDARG;
+
+    ComPtr<IWICBitmapDecoder> decoder;
+    HRESULT hr = g_IWICFactory->CreateDecoderFromFilename( awcFile, NULL, GENERIC_READ, WICDecodeMetadataCacheOnDemand, decoder.GetAddressOf() );
+
+    UINT frameCount = 0;
+    if ( SUCCEEDED( hr ) )
+        hr = decoder->GetFrameCount( &frameCount );
+
+    if ( FAILED( hr ) )
+    {
+        printf( "can't get the frame count of %ws: %#x\n", awcFile, hr );
+        return hr;
+    }
+
+    tracer.Trace( "%ws has %u frames\n", awcFile, frameCount );
+
+    for ( UINT f = 0; f < frameCount; f++ )
+    {
+        wstring frame = wstring( awcFile ) + L"|" + to_wstring( f );
+        pathArray.Add( &frame[ 0 ] );
+    }
+
+    return S_OK;
+} //FindFramePaths
+
+// pwcInput is either a .txt file with one image path per line or a path specifier like d:\pics\*.jpg.
+// Note that pwcInput may be modified.
+
+HRESULT FindInputPaths( WCHAR * pwcInput, CPathArray & pathArray, bool recurse = false )
+{
+    if ( FindFrameSuffix( pwcInput ) )
+        return FindFramePaths( pwcInput, pathArray );
+
+    WCHAR const * pwcQuery = CMetadataIndex::FindQuery( pwcInput );
+    if ( pwcQuery )
+    {
+        wstring indexPath( pwcInput, pwcQuery - pwcInput );
+        CMetadataIndex index;
+
+        HRESULT hr = index.Open( indexPath.c_str() );
+        if ( SUCCEEDED( hr ) )
+            hr = index.Query( ( L'?' == *pwcQuery ) ? pwcQuery + 1 : pwcQuery, pathArray );
+
+        return hr;
+    }
+
+    WCHAR * pwcDot = wcsrchr( pwcInput, L'.' );
+    if ( pwcDot && !wcsicmp( pwcDot, L".txt" ) )
+    {
+        FILE * fp = _wfopen( pwcInput, L"r" );
+        if ( !fp )
+        {
+            printf( "can't open input file %ws\n", pwcInput );
+            return E_FAIL;
+        }
+
+        char acPath[ MAX_PATH ];
+        while ( fgets( acPath, sizeof( acPath ), fp ) )
+        {
+            char * peol = strchr( acPath, '\r' );
+            if ( peol )
+                *peol = 0;
+            peol = strchr( acPath, '\n' );
+            if ( peol )
+                *peol = 0;
+
+            if ( 0 != acPath[ 0 ] )
+                pathArray.Add( acPath );
+        }
+
+        fclose( fp );
+    }
+    else
+    {
+        WCHAR awcPath[ MAX_PATH + 1 ];
+        WCHAR awcSpec[ MAX_PATH + 1 ];
+        
+        WCHAR * pwcSlash = wcsrchr( pwcInput, L'\\' );
+        
+        if ( NULL == pwcSlash )
+        {
+            wcscpy( awcSpec, pwcInput );
+            _wfullpath( awcPath, L".\\", sizeof awcPath / sizeof WCHAR );
+        }
+        else
+        {
+            wcscpy( awcSpec, pwcSlash + 1 );
+            *(pwcSlash + 1) = 0;
+            _wfullpath( awcPath, pwcInput, sizeof awcPath / sizeof WCHAR );
+        }
+        
+        tracer.Trace( "FindInputPaths: Path '%ws', File Specificaiton '%ws'\n", awcPath, awcSpec );
+    
+        CEnumFolder enumPaths( recurse, &pathArray, NULL, 0 );
+        enumPaths.Enumerate( awcPath, awcSpec );
+    }
+
+    return S_OK;
+} //FindInputPaths
+
+// Lists of paths in .txt files, index queries, and frames are read quickly; folders can take a while to enumerate
+
+bool IsFolderInput( WCHAR const * pwcInput )
+{
+    return ( 0 == CMetadataIndex::FindQuery( pwcInput ) ) && ( 0 == FindFrameSuffix( pwcInput ) ) &&
+           _wcsicmp( PathFindExtension( pwcInput ), L".txt" );
+} //IsFolderInput
+
+// Calls work( path ) from workerCount threads for each input path as it's found, so the work starts before the
+// enumeration of a large or remote folder finishes. Paths run in the order found. The workers are plain threads
+// rather than PPL tasks because they block waiting for paths, and the enumeration itself uses parallel_for.
+
+template <typename Func> HRESULT StreamInputPaths( WCHAR * pwcInput, CPathArray & pathArray, int workerCount, Func work )
+{
+    HRESULT hr = S_OK;
+    atomic<size_t> next( 0 );
+    pathArray.BeginStream();
+
+    thread finder( [&] ()
+    {
+        hr = FindInputPaths( pwcInput, pathArray );
+        pathArray.Complete();
+    } );
+
+    vector<thread> workers;
+
+    for ( int w = 0; w < workerCount; w++ )
+        workers.emplace_back( [&] ( int worker )
+        {
+            CPathArray::PathItem item;
+            size_t i;
+
+            while ( pathArray.Next( i = next.fetch_add( 1 ), item ) )
+                work( worker, i, item.pwcPath );
+        }, w );
+
+    finder.join();
+
+    for ( size_t w = 0; w < workers.size(); w++ )
+        workers[ w ].join();
+
+    return hr;
+} //StreamInputPaths
+
+// Parse the metadata of every matching file in the input's folder and its subfolders into an index for queries
+
+HRESULT BuildIndex( WCHAR * pwcInput, WCHAR const * pwcIndex )
+{
+    CPathArray pathArray;
+    HRESULT hr = FindInputPaths( pwcInput, pathArray, true );
+    if ( FAILED( hr ) )
+        return hr;
+
+    if ( 0 == pathArray.Count() )
+    {
+        printf( "no input files found for the index\n" );
+        return E_FAIL;
+    }
+
+    long long timeBuild = 0;
+    CTimed timedBuild( timeBuild );
+
+    hr = CMetadataIndex::Build( pathArray, pwcIndex );
+
+    timedBuild.Complete();
+
+    if ( SUCCEEDED( hr ) )
+        printf( "index of %zd files written successfully in %lld milliseconds: %ws\n", pathArray.Count(),
+                timeBuild / CTimed::NanoPerMilli(), pwcIndex );
+
+    return hr;
+} //BuildIndex
+
+HRESULT GenerateCollage( int collageMethod, WCHAR * pwcInput, const WCHAR * pwcOutput, int longEdge, int posterizeLevel,
+                         ColorizationData * colorizationData, bool makeGreyscale, int collageColumns, int collageSpacing,
+                         bool collageSortByColor, bool collageSortByAspect, bool collageSpaced, double aspectRatio, int fillColor,
+                         WCHAR const * outputMimetype, bool randomizeCollage, bool lowQualityOutput, bool highQualityScaling,
+                         bool namesAsCaptions, double expandCollageImages, int atlasPageSize, vector<wstring> & companionOutputs )
+{
+    CTimed timePrep( g_CollagePrepTime );
+
+    if ( 0.0 == aspectRatio )
+        aspectRatio = 1.0;
+
+    // Load dimensions as paths are found. Each worker keeps its own results, which are merged once all are in.
+
+    CPathArray pathArray;
+    int workerCount = __max( 1, (int) thread::hardware_concurrency() );
+    vector<vector<pair<size_t, BitmapDimensions>>> workerDimensions( workerCount );
+    vector<HRESULT> workerResults( workerCount, S_OK );
+
+    HRESULT hr = StreamInputPaths( pwcInput, pathArray, workerCount, [&] ( int worker, size_t i, WCHAR const * pwcPath )
+    {
+        BitmapDimensions dim = { 0, 0 };
+        HRESULT hrPath = GetBitmapDimensions( pwcPath, dim.width, dim.height );
+
+        if ( FAILED( hrPath ) && SUCCEEDED( workerResults[ worker ] ) )
+            workerResults[ worker ] = hrPath;
+
+        workerDimensions[ worker ].push_back( make_pair( i, dim ) );
+    } );
+
+    if ( FAILED( hr ) )
+        return hr;
+
+    size_t fileCount = pathArray.Count();
+    printf( "files found: %zd\n", fileCount );
+
+    if ( 0 == fileCount )
+    {
+        printf( "no files found in input %ws\n", pwcInput );
+        return E_FAIL;
+    }
+
+    for ( int w = 0; w < workerCount; w++ )
+    {
+        if ( FAILED( workerResults[ w ] ) )
+        {
+            printf( "loading dimensions failed for one or more images\n" );
+            return workerResults[ w ];
+        }
+    }
+
+    vector<BitmapDimensions> dimensions( fileCount );
+
+    for ( size_t w = 0; w < workerDimensions.size(); w++ )
+        for ( size_t d = 0; d < workerDimensions[ w ].size(); d++ )
+            dimensions[ workerDimensions[ w ][ d ].first ] = workerDimensions[ w ][ d ].second;
+
+    std::random_device rd;
+    std::mt19937 gen( rd() );
+
+    if ( randomizeCollage || collageSortByColor )
+    {
+        // Reordering moves the items but not their paths, so each path pointer still finds its dimensions
+
+        unordered_map<WCHAR const *, BitmapDimensions> pathDimensions;
+        for ( size_t i = 0; i < fileCount; i++ )
+            pathDimensions[ pathArray[ i ].pwcPath ] = dimensions[ i ];
+
+        if ( randomizeCollage )
+            pathArray.Randomize();
+        else
+            SortPathArrayByColor( pathArray );
+
+        for ( size_t i = 0; i < fileCount; i++ )
+            dimensions[ i ] = pathDimensions[ pathArray[ i ].pwcPath ];
+    }
+
+    int minEdge = 1000000000;
+    int minDXEdge = minEdge;
+    int minDYEdge = minEdge;
+    vector<UINT> longEdges( fileCount );
+
+    for ( size_t i = 0; i < fileCount; i++ )
+    {
+        longEdges[i] = __max( dimensions[i].height, dimensions[i].width );
+
+        if ( longEdges[i] < minEdge )
+            minEdge = longEdges[i];
+
+        if ( dimensions[i].width < minDXEdge )
+            minDXEdge = dimensions[i].width;
+
+        if ( dimensions[i].height < minDYEdge )
+            minDYEdge = dimensions[i].height;
+    }
+
+    if ( 0 == minEdge )
+    {
+        printf( "need a non-0-sized bitmap" );
+        return E_FAIL;
+    }
+
+    bool allSameAspect = true;
+
+    // Check if the aspect ratio of all images is roughly the same
+
+    double aspect = 0.0;
+    for ( size_t i = 0; i < fileCount; i++ )
+    {
+        double a = (double) dimensions[i].width / (double) dimensions[i].height;
+
+        if ( SameDouble( aspect, 0.0 ) )
+            aspect = a;
+        else
+        {
+            if ( !SameDouble( a, aspect ) )
+            {
+                allSameAspect = false;
+                break;
+            }
+        }
+    }
+
+    // by default, the output is limited by the lowest-resolution input image. This relaxes that by 2x
+
+    if ( 1.0 != expandCollageImages )
+    {
+        minDYEdge = (int) ( expandCollageImages * (float) minDYEdge );
+        minDXEdge = (int) ( expandCollageImages * (float) minDXEdge );
+        minEdge   = (int) ( expandCollageImages * (float) minEdge );
+    }
+
+    tracer.Trace( "GenerateCollage: minEdge %d minDXEdge %d, min DYEdge %d, all same aspect: %d\n", minEdge, minDXEdge, minDYEdge, allSameAspect );
+
+    if ( 1 == collageMethod )
+    {
+        // Try each permutation of stacking the images to find the one that most conforms to the target aspect ratio.
+    
+        int imagesWide = 0;
+        int imagesHigh = 0;
+        double bestAspect = 100000.0;
+        double desiredAspect = aspectRatio; // count across / count up and down
+    
+        for ( size_t x = 1; x <= fileCount; x++ )
+        {
+            for ( int y = 1; y <= fileCount; y++ )
+            {
+                int capacity = x * y;
+                if ( capacity < fileCount )
+                    continue;
+    
+                int unused = capacity - fileCount;
+                if ( unused >= x || unused >= y )
+                    continue;
+    
+                double testAspect = 0;
+    
+                if ( allSameAspect )
+                    testAspect = ( (double) x * (double) minDXEdge ) / ( (double) y * (double) minDYEdge );
+                else
+                    testAspect = ( (double) x * (double) minEdge ) / ( (double) y * (double) minEdge );
+    
+                double distance = fabs( desiredAspect - testAspect );
+                if ( distance < bestAspect )
+                {
+                    bestAspect = distance;
+                    imagesWide = x;
+                    imagesHigh = y;
+                }
+            }
+        }
+    
+        int stitchX = imagesWide * minEdge;
+        int stitchY = imagesHigh * minEdge;
+    
+        if ( allSameAspect )
+        {
+            stitchX = imagesWide * minDXEdge;
+            stitchY = imagesHigh * minDYEdge;
+        }
+    
+        // 2 billion is probably enough?
+        int maxLongestDimension = 2000000000;
+    
+        if ( 0 != longEdge )
+            maxLongestDimension = longEdge;
+    
+        // Note: the logic below may result in a dimension and/or aspect ratio that isn't exactly as requested
+        // by the caller since the dimensions must be a multiple of the individual image sizes.
+    
+        double dmaxLongestDimension = (double) maxLongestDimension;
+    
+        if ( stitchX > maxLongestDimension || stitchY > maxLongestDimension )
+        {
+            if ( allSameAspect )
+            {
+                if ( minDYEdge > minDXEdge )
+                {
+                    double dScale = ( dmaxLongestDimension / (double) imagesHigh ) / (double) minDYEdge;
+                    minDXEdge = (int) round( dScale * (double) minDXEdge );
+                    minDYEdge = maxLongestDimension / imagesHigh;
+                    stitchY = maxLongestDimension;
+                    stitchX = imagesWide * minDXEdge;
+                }
+                else
+                {
+                    double dScale = ( dmaxLongestDimension / (double) imagesWide ) / (double) minDXEdge;
+                    minDYEdge = (int) round( dScale * (double) minDYEdge );
+                    minDXEdge = maxLongestDimension / imagesWide;
+                    stitchX = maxLongestDimension;
+                    stitchY = imagesHigh * minDYEdge;
+                }
+            }
+            else
+            {
+                if ( stitchX > stitchY )
+                    minEdge = maxLongestDimension / imagesWide;
+                else
+                    minEdge = maxLongestDimension / imagesHigh;
+    
+                stitchX = minEdge * imagesWide;
+                stitchY = minEdge * imagesHigh;
+            }
+        }
+    
+        if ( !allSameAspect )
+        {
+            minDXEdge = minEdge;
+            minDYEdge = minEdge;
+        }
+    
+        timePrep.Complete();
+    
+        printf( "source images%s all have the same aspect ratio\n", allSameAspect ? "" : " don't" );
+        printf( "collage will be %d by %d, each element %d by %d, and %d by %d images\n", stitchX, stitchY, minDXEdge, minDYEdge, imagesWide, imagesHigh );
+    
+        return StitchImages1( pwcOutput, pathArray, dimensions, imagesWide, imagesHigh, minDXEdge, minDYEdge, stitchX, stitchY,
+                              fillColor, 0, posterizeLevel, colorizationData, makeGreyscale, outputMimetype,
+                              lowQualityOutput, highQualityScaling, namesAsCaptions );
+    }
+
+    if ( 2 == collageMethod )
+    {
+        // Method 2 means a fixed # of columns. Each image is made the same width.
+
+        const int columns = __min( fileCount, collageColumns );
+        const int targetWidth = ( 0 == longEdge ) ? 4096 : longEdge;
+        const int spacing = collageSpacing; // # of fillColor pixels between images. Not applied to the outside border of the collage
+
+        int imageWidth = ( targetWidth - ( ( columns - 1 ) * spacing ) ) / columns;
+        int fullWidth = ( imageWidth * columns ) + ( ( columns - 1 ) * spacing );
+        vector<int> columnsToUse( fileCount );
+        vector<int> yOffsets( fileCount );
+        vector<int> bottoms( fileCount );
+
+        // sort by aspect ratio so the tallest images are placed first. This helps minimize one column being much taller than the others
+
+        vector<int> sortedIndexes( fileCount );
+        for ( int i = 0; i < fileCount; i++ )
+            sortedIndexes[ i ] = i;
+
+        g_pdimensions = &dimensions;
+        qsort( sortedIndexes.data(), fileCount, sizeof( int ), aspectCompare );
+
+        // Lay out the images
+
+        for ( int i = 0; i < fileCount; i++ )
+        {
+            int si = sortedIndexes[ i ];
+            int columnToUse = 0;
+            int highestBottom = INT_MAX;
+            for ( int c = 0; c < columns; c++ )
+            {
+                if ( bottoms[ c ] < highestBottom )
+                {
+                    highestBottom = bottoms[ c ];
+                    columnToUse = c;
+                }
+            }
+    
+            int imageHeight = round( (double) imageWidth / (double) dimensions[ si ].width * (double) dimensions[ si ].height );
+    
+            yOffsets[ si ] = bottoms[ columnToUse ];
+            bottoms[ columnToUse ] += ( spacing + imageHeight );
+            columnsToUse[ si ] = columnToUse;
+        }
+
+        // find the tallest column -- that's the collage height
+
+        int fullHeight = 0;
+        for ( int c = 0; c < columns; c++ )
+        {
+            //printf( "height of column %d: %d\n", c, bottoms[ c ] );
+            if ( bottoms[ c ] > fullHeight )
+                fullHeight = bottoms[ c ];
+        }
+
+        fullHeight -= spacing;
+
+        // randomize the vertical position of photos within each column.
+
+        if ( !collageSortByAspect )
+        {
+            for ( int c = 0; c < columns; c++ )
+            {
+                // find the indexes of photos in this column
+    
+                vector<int> randIndex;
+                for ( int i = 0; i < fileCount; i++ )
+                {
+                    int si = sortedIndexes[ i ];
+                    if ( columnsToUse[ si ] == c )
+                        randIndex.push_back( si );
+                }
+
+                Randomize( randIndex, gen );
+
+                // even out the spacing
+
+                int spaceCount = randIndex.size() - 1;
+                int extraSpace = fullHeight - ( spaceCount * spacing );
+                for ( int i = 0; i < randIndex.size(); i++ )
+                {
+                    int ri = randIndex[ i ];
+                    int imageHeight = round( (double) imageWidth / (double) dimensions[ ri ].width * (double) dimensions[ ri ].height );
+                    extraSpace -= imageHeight;
+                }
+
+                int extraSpaceBetween = collageSpaced ? spaceCount ? ( extraSpace / spaceCount ) : 0 : 0;
+                int extraSpaceLast = collageSpaced ? spaceCount ? ( extraSpace % spaceCount ) : 0 : 0;
+                //printf( "extraspace %d, between %d, last %d, spaceCount %d\n", extraSpace, extraSpaceBetween, extraSpaceLast, spaceCount );
+
+                // recompute the y offset of each photo in the column
+    
+                int currenty = 0;
+                for ( int i = 0; i < randIndex.size(); i++ )
+                {
+                    int ri = randIndex[ i ];
+
+                    yOffsets[ ri ] = currenty;
+                    int imageHeight = round( (double) imageWidth / (double) dimensions[ ri ].width * (double) dimensions[ ri ].height );
+                    currenty += ( spacing + imageHeight + extraSpaceBetween + ( ( i == spaceCount - 1 ) ? extraSpaceLast : 0 ) );
+                }
+            }
+        }
+
+        timePrep.Complete();
+
+        //printf( "columns %d, target width %d, collage width %d, collage height %d, imageWidth %d\n", columns, targetWidth, fullWidth, fullHeight, imageWidth );
+
+        vector<CellRect> rects( fileCount );
+
+        for ( int i = 0; i < fileCount; i++ )
+        {
+            int imageHeight = round( (double) imageWidth / (double) dimensions[ i ].width * (double) dimensions[ i ].height );
+            UINT width, height;
+            ScaledSize( dimensions[ i ].width, dimensions[ i ].height, __max( imageWidth, imageHeight ), width, height );
+            rects[ i ] = { columnsToUse[ i ] * ( spacing + imageWidth ), yOffsets[ i ], (int) width, (int) height };
+            assert( ( rects[ i ].y + rects[ i ].height ) <= fullHeight );
+        }
+
+        return StitchImagesToRects( pwcOutput, pathArray, dimensions, rects, fullHeight, fullWidth, imageWidth / 16, fillColor,
+                                    posterizeLevel, colorizationData, makeGreyscale, outputMimetype, lowQualityOutput,
+                                    highQualityScaling, namesAsCaptions );
+    }
+
+    if ( 3 == collageMethod )
+    {
+        // Method 3 means justified rows. Every image in a row has the same height and keeps its aspect ratio,
+        // and each row is exactly the collage width. Rows are broken to keep their heights close to a target.
+
+        const int spacing = collageSpacing;
+        const int longest = ( 0 == longEdge ) ? 4096 : longEdge;
+        const int targetWidth = ( aspectRatio >= 1.0 ) ? longest : __max( 1, (int) round( longest * aspectRatio ) );
+
+        vector<double> aspects( fileCount );
+        for ( size_t i = 0; i < fileCount; i++ )
+            aspects[ i ] = (double) dimensions[ i ].width / (double) dimensions[ i ].height;
+
+        vector<int> rowStarts;
+        double rowHeight = LayoutJustifiedRows( aspects, targetWidth, spacing, aspectRatio, rowStarts );
+
+        vector<CellRect> rects( fileCount );
+        int fullHeight = PlaceJustifiedRows( aspects, rowStarts, targetWidth, spacing, rowHeight, rects );
+
+        timePrep.Complete();
+
+        printf( "collage will be %d by %d with %zd rows of images\n", targetWidth, fullHeight, rowStarts.size() );
+
+        // Size captions as if for a 3:2 landscape image of the target row height
+
+        return StitchImagesToRects( pwcOutput, pathArray, dimensions, rects, fullHeight, targetWidth,
+                                    (int) ( rowHeight * 1.5 / 16.0 ), fillColor, posterizeLevel, colorizationData,
+                                    makeGreyscale, outputMimetype, lowQualityOutput, highQualityScaling, namesAsCaptions );
+    }
+
+    if ( 4 == collageMethod )
+    {
+        // Method 4 means an atlas (sprite sheet). Images are packed at their own size, or scaled down so the long
+        // edge is at most longEdge, onto as many fixed-size pages as needed. Nothing is cropped or letterboxed.
+        // Spacing is added to the right and bottom of each image, so it falls off the edge of the page.
+
+        const int spacing = collageSpacing;
+        const int pageWidth = ( aspectRatio >= 1.0 ) ? atlasPageSize : __max( 1, (int) round( atlasPageSize * aspectRatio ) );
+        const int pageHeight = ( aspectRatio >= 1.0 ) ? __max( 1, (int) round( atlasPageSize / aspectRatio ) ) : atlasPageSize;
+
+        vector<CellRect> rects( fileCount );
+        vector<int> sortedIndexes( fileCount );
+
+        for ( int i = 0; i < fileCount; i++ )
+        {
+            UINT width = dimensions[ i ].width;
+            UINT height = dimensions[ i ].height;
+
+            if ( 0 != longEdge && __max( width, height ) > (UINT) longEdge )
+                ScaledSize( dimensions[ i ].width, dimensions[ i ].height, longEdge, width, height );
+
+            if ( width > (UINT) pageWidth || height > (UINT) pageHeight )
+            {
+                double scale = __min( (double) pageWidth / (double) width, (double) pageHeight / (double) height );
+                ScaledSize( dimensions[ i ].width, dimensions[ i ].height, (int) floor( scale * __max( width, height ) ), width, height );
+            }
+
+            rects[ i ] = { 0, 0, (int) __max( 1, width ), (int) __max( 1, height ) };
+            sortedIndexes[ i ] = i;
+        }
+
+        // Tallest first, then widest, keeps the skyline short
+
+        sort( sortedIndexes.begin(), sortedIndexes.end(), [&] ( int a, int b )
+        {
+            if ( rects[ a ].height != rects[ b ].height )
+                return rects[ a ].height > rects[ b ].height;
+            return rects[ a ].width > rects[ b ].width;
+        });
+
+        vector<CSkylinePacker> pages;
+        vector<int> pageOf( fileCount );
+
+        for ( int i = 0; i < fileCount; i++ )
+        {
+            int si = sortedIndexes[ i ];
+            int w = rects[ si ].width + spacing;
+            int h = rects[ si ].height + spacing;
+            bool placed = false;
+
+            for ( size_t p = 0; !placed && p < pages.size(); p++ )
+            {
+                if ( pages[ p ].Insert( w, h, rects[ si ].x, rects[ si ].y ) )
+                {
+                    pageOf[ si ] = (int) p;
+                    placed = true;
+                }
+            }
+
+            if ( !placed )
+            {
+                pages.emplace_back( pageWidth + spacing, pageHeight + spacing );
+                pages.back().Insert( w, h, rects[ si ].x, rects[ si ].y );
+                pageOf[ si ] = (int) pages.size() - 1;
+            }
+        }
+
+        int pageCount = (int) pages.size();
+        timePrep.Complete();
+
+        printf( "atlas will be %d page%s of %d by %d\n", pageCount, ( 1 == pageCount ) ? "" : "s", pageWidth, pageHeight );
+
+        hr = WriteAtlasIndex( pwcOutput, pathArray, rects, pageOf, pageCount, pageWidth, pageHeight );
+
+        if ( SUCCEEDED( hr ) )
+        {
+            WCHAR awcIndex[ MAX_PATH ];
+            wcscpy( awcIndex, pwcOutput );
+            PathRenameExtension( awcIndex, L".json" );
+            companionOutputs.push_back( awcIndex );
+        }
+
+        for ( int p = 0; SUCCEEDED( hr ) && p < pageCount; p++ )
+        {
+            CPathArray pagePaths;
+            vector<BitmapDimensions> pageDimensions;
+            vector<CellRect> pageRects;
+            int captionWidth = 0;
+
+            for ( int i = 0; i < fileCount; i++ )
+            {
+                if ( pageOf[ i ] == p )
+                {
+                    pagePaths.Add( pathArray[ i ].pwcPath );
+                    pageDimensions.push_back( dimensions[ i ] );
+                    pageRects.push_back( rects[ i ] );
+                    captionWidth += rects[ i ].width;
+                }
+            }
+
+            WCHAR awcPage[ MAX_PATH ];
+            AtlasPageName( pwcOutput, p, awcPage );
+
+            hr = StitchImagesToRects( awcPage, pagePaths, pageDimensions, pageRects, pageHeight, pageWidth,
+                                      captionWidth / (int) pageRects.size() / 16, fillColor, posterizeLevel, colorizationData,
+                                      makeGreyscale, outputMimetype, lowQualityOutput, highQualityScaling, namesAsCaptions );
+            if ( SUCCEEDED( hr ) && 0 != p )
+            {
+                printf( "atlas page written: %ws\n", awcPage );
+                companionOutputs.push_back( awcPage );
+            }
+        }
+
+        return hr;
+    }
+
+    return E_FAIL;
+} //GenerateCollage
+
+HRESULT ConvertImage( WCHAR const * input, WCHAR const * output, int longEdge, int waveMethod, int posterizeLevel, ColorizationData * colorizationData,
+                      bool makeGreyscale, double aspectRatio, int fillColor, WCHAR const * outputMimetype, bool lowQualityOutput, bool gameBoy,
+                      bool highQualityScaling )
+{
+    ComPtr<IWICBitmapSource> source;
+    ComPtr<IWICBitmapFrameDecode> frame;
+    bool force24bppBGR = wcscmp( outputMimetype, L"image/tiff" );
+
+    // The Game Boy path center-crops, so it needs all the pixels. Otherwise the output's long edge is never more than longEdge.
+
+    HRESULT hr = LoadWICBitmap( input, source, frame, force24bppBGR, gameBoy ? 0 : longEdge );
+    if ( SUCCEEDED( hr ) )
+        hr = WriteWICBitmap( output, source, frame, longEdge, waveMethod, posterizeLevel, colorizationData,
+                             makeGreyscale, aspectRatio, fillColor, outputMimetype, lowQualityOutput, gameBoy, highQualityScaling );
+    
+    frame.Reset();
+    source.Reset();
+    return hr;
+} //ConvertImage
+
+// Replace the * in the output pattern with a long edge, e.g. photo_*.jpg becomes photo_1024.jpg.
+// Returns false if the result is too long to be a path, which fails just that size.
+
+bool LadderOutputPath( WCHAR const * pwcPattern, int longEdge, wstring & output )
+{
+    WCHAR const * pwcStar = wcschr( pwcPattern, L'*' );
+    if ( !pwcStar )
+        return false;
+
+    output.assign( pwcPattern, pwcStar - pwcPattern );
+    output += to_wstring( longEdge );
+    output += pwcStar + 1;
+
+    return ( output.length() < MAX_PATH );
+} //LadderOutputPath
+
+// Write one output per long edge while decoding the input just once. longEdges is sorted largest first.
+// Each size is scaled from the smallest size already made that's at least twice as large, or from the decoded
+// image if there is none; a 2x or greater reduction with the high-quality scaler loses nothing visible, but
+// chaining smaller steps would soften the image. The sizes are then encoded in parallel.
+
+HRESULT ConvertLadder( WCHAR const * input, WCHAR const * outputPattern, vector<int> const & longEdges, int posterizeLevel,
+                       ColorizationData * colorizationData, bool makeGreyscale, double aspectRatio, int fillColor,
+                       WCHAR const * outputMimetype, bool lowQualityOutput, bool highQualityScaling )
+{
+    ComPtr<IWICBitmapSource> source;
+    ComPtr<IWICBitmapFrameDecode> frame;
+    bool force24bppBGR = wcscmp( outputMimetype, L"image/tiff" );
+
+    HRESULT hr = LoadWICBitmap( input, source, frame, force24bppBGR, longEdges[ 0 ] );
+    if ( FAILED( hr ) )
+        return hr;
+
+    // WIC sources are lazy, so copy the decoded pixels into memory or each size would decode again
+
+    ComPtr<IWICBitmap> decoded;
+    hr = g_IWICFactory->CreateBitmapFromSource( source.Get(), WICBitmapCacheOnLoad, decoded.GetAddressOf() );
+    if ( FAILED( hr ) )
+    {
+        printf( "can't create bitmap from decoded image: %#x\n", hr );
+        return hr;
+    }
+
+    UINT width, height;
+    hr = decoded->GetSize( &width, &height );
+    if ( FAILED( hr ) )
+        return hr;
+
+    const UINT decodedEdge = __max( width, height );
+    const size_t count = longEdges.size();
+    vector<ComPtr<IWICBitmapSource>> levels( count );
+    vector<UINT> levelEdges( count );
+
+    for ( size_t i = 0; i < count; i++ )
+    {
+        UINT edge = (UINT) longEdges[ i ];
+
+        // WriteWICBitmap does any upscaling, just as it would for a single -l
+
+        if ( edge >= decodedEdge )
+        {
+            decoded.As( &levels[ i ] );
+            levelEdges[ i ] = decodedEdge;
+            continue;
+        }
+
+        ComPtr<IWICBitmapSource> from;
+        decoded.As( &from );
+
+        for ( size_t l = 0; l < i; l++ )
+            if ( levelEdges[ l ] >= ( 2 * edge ) && levelEdges[ l ] < decodedEdge )
+                from = levels[ l ];
+
+        hr = ScaleWICBitmap( from, edge, highQualityScaling );
+        if ( FAILED( hr ) )
+            return hr;
+
+        ComPtr<IWICBitmap> scaled;
+        hr = g_IWICFactory->CreateBitmapFromSource( from.Get(), WICBitmapCacheOnLoad, scaled.GetAddressOf() );
+        if ( FAILED( hr ) )
+        {
+            printf( "can't create bitmap for long edge %u: %#x\n", edge, hr );
+            return hr;
+        }
+
+        scaled.As( &levels[ i ] );
+        levelEdges[ i ] = edge;
+    }
+
+    atomic<size_t> failures( 0 );
+
+    parallel_for( (size_t) 0, count, [&] ( size_t i )
+    {
+        wstring output;
+        if ( !LadderOutputPath( outputPattern, longEdges[ i ], output ) )
+        {
+            printf( "can't create an output filename for long edge %d\n", longEdges[ i ] );
+            failures++;
+            return;
+        }
+
+        WCHAR const * pwcOutput = output.c_str();
+
+        ComPtr<IWICBitmapSource> level = levels[ i ];
+        HRESULT hrLevel = WriteWICBitmap( pwcOutput, level, frame, longEdges[ i ], 0, posterizeLevel, colorizationData,
+                                          makeGreyscale, aspectRatio, fillColor, outputMimetype, lowQualityOutput, false, highQualityScaling );
+        if ( SUCCEEDED( hrLevel ) )
+            printf( "output written successfully: %ws\n", pwcOutput );
+        else
+        {
+            printf( "writing %ws failed with error %#x\n", pwcOutput, hrLevel );
+            DeleteFile( pwcOutput );
+            failures++;
+        }
+    });
+
+    return ( 0 == failures ) ? S_OK : E_FAIL;
+} //ConvertLadder
+
+// Replace the * in the output pattern with the input's filename without its extension.
+// Frames get their number after the name, e.g. scan.tif|3 becomes scan_3. Returns false if the result is
+// too long to be a path, which fails just that input.
+
+bool BatchOutputPath( WCHAR const * pwcPattern, WCHAR const * pwcInput, wstring & output )
+{
+    WCHAR const * pwcStar = wcschr( pwcPattern, L'*' );
+    if ( !pwcStar )
+        return false;
+
+    WCHAR awcFile[ MAX_PATH ];
+    UINT frameIndex = 0;
+    bool isFrame = SplitFramePath( pwcInput, awcFile, _countof( awcFile ), frameIndex );
+    if ( isFrame )
+        pwcInput = awcFile;
+
+    WCHAR const * pwcName = PathFindFileName( pwcInput );
+    WCHAR const * pwcExt = PathFindExtension( pwcName );
+
+    WCHAR awcFrame[ 16 ] = {0};
+    if ( isFrame )
+        swprintf_s( awcFrame, _countof( awcFrame ), L"_%u", frameIndex );
+
+    output.assign( pwcPattern, pwcStar - pwcPattern );
+    output.append( pwcName, pwcExt - pwcName );
+    output += awcFrame;
+    output += pwcStar + 1;
+
+    return ( output.length() < MAX_PATH );
+} //BatchOutputPath
+
+// The manifest digest of an input. A frame's is its file's plus the frame number.
+
+bool InputDigest( WCHAR const * pwcInput, unsigned long long & digest )
+{
+    WCHAR awcFile[ MAX_PATH ];
+    UINT frameIndex;
+    if ( !SplitFramePath( pwcInput, awcFile, _countof( awcFile ), frameIndex ) )
+        return CBuildManifest::InputDigest( pwcInput, digest );
+
+    if ( !CBuildManifest::InputDigest( awcFile, digest ) )
+        return false;
+
+    CBuildManifest::CDigest d;
+    d.Add( digest );
+    d.Add( frameIndex );
+    digest = d.Get();
+    return true;
+} //InputDigest
+
+// Convert many images with one process so COM, the WIC factory, and colorization data are set up just once.
+// At most maxInFlight conversions run at a time (0 means one per core), largest files first so a big file
+// that happens to be last doesn't leave the other cores idle.
+// Inputs that differ only by extension, e.g. a.jpg and a.png, map to the same output. The first one in the
+// list (or found, for folders) claims it and the others fail, rather than having two workers write one file.
+
+HRESULT ConvertBatch( WCHAR * pwcInput, WCHAR const * pwcOutputPattern, int maxInFlight, int longEdge, int waveMethod, int posterizeLevel,
+                      ColorizationData * colorizationData, bool makeGreyscale, double aspectRatio, int fillColor,
+                      WCHAR const * outputMimetype, bool lowQualityOutput, bool gameBoy, bool highQualityScaling )
+{
+    atomic<size_t> failures( 0 );
+    std::mutex mtxClaims;
+    unordered_set<wstring> claimedOutputs;
+
+    // Returns false, having reported why, if pwcPath has no output of its own
+
+    auto claimOutput = [&] ( WCHAR const * pwcPath, wstring & output ) -> bool
+    {
+        if ( !BatchOutputPath( pwcOutputPattern, pwcPath, output ) || !_wcsicmp( output.c_str(), pwcPath ) )
+        {
+            printf( "can't create an output filename for %ws\n", pwcPath );
+            failures++;
+            return false;
+        }
+
+        wstring key( output );
+        transform( key.begin(), key.end(), key.begin(), towlower );
+
+        lock_guard<mutex> lock( mtxClaims );
+        if ( !claimedOutputs.insert( key ).second )
+        {
+            printf( "%ws isn't converted because another input also maps to %ws\n", pwcPath, output.c_str() );
+            failures++;
+            return false;
+        }
+
+        return true;
+    };
+
+    auto convert = [&] ( WCHAR const * pwcPath, WCHAR const * pwcOutput )
+    {
+        unsigned long long digest = 0;
+
+        if ( g_pManifest )
+        {
+            vector<unsigned long long> inputDigests( 1 );
+            if ( InputDigest( pwcPath, inputDigests[ 0 ] ) )
+                digest = g_pManifest->JobDigest( inputDigests );
+
+            if ( 0 != digest && g_pManifest->IsCurrent( pwcOutput, digest ) )
+            {
+                tracer.Trace( "%ws is up to date\n", pwcOutput );
+                return;
+            }
+        }
+
+        HRESULT hr = ConvertImage( pwcPath, pwcOutput, longEdge, waveMethod, posterizeLevel, colorizationData, makeGreyscale,
+                                   aspectRatio, fillColor, outputMimetype, lowQualityOutput, gameBoy, highQualityScaling );
+        if ( SUCCEEDED( hr ) )
+        {
+            tracer.Trace( "converted %ws to %ws\n", pwcPath, pwcOutput );
+
+            if ( 0 != digest )
+                g_pManifest->Record( pwcOutput, digest );
+        }
+        else
+        {
+            printf( "conversion of %ws failed with error %#x\n", pwcPath, hr );
+            DeleteFile( pwcOutput );
+            failures++;
+        }
+    };
+
+    CPathArray pathArray;
+    HRESULT hr = S_OK;
+
+    if ( IsFolderInput( pwcInput ) )
+    {
+        // Start converting as files are found. Without the full list up front there are no cost estimates,
+        // so files are converted in the order found.
+
+        int workerCount = ( maxInFlight > 0 ) ? maxInFlight : __max( 1, (int) thread::hardware_concurrency() );
+        hr = StreamInputPaths( pwcInput, pathArray, workerCount, [&] ( int worker, size_t i, WCHAR const * pwcPath )
+        {
+            wstring output;
+            if ( claimOutput( pwcPath, output ) )
+                convert( pwcPath, output.c_str() );
+        } );
+    }
+    else
+        hr = FindInputPaths( pwcInput, pathArray );
+
+    if ( FAILED( hr ) )
+        return hr;
+
+    size_t fileCount = pathArray.Count();
+    printf( "files found: %zd\n", fileCount );
+
+    if ( 0 == fileCount )
+    {
+        printf( "no files found in input %ws\n", pwcInput );
+        return E_FAIL;
+    }
+
+    if ( !IsFolderInput( pwcInput ) )
+    {
+        // Claim outputs in list order before the scheduler reorders the inputs by cost
+
+        vector<wstring> outputs( fileCount );
+        CCostScheduler scheduler( 0, maxInFlight );
+        BitmapDimensions unknown = { 0, 0 };
+
+        for ( size_t i = 0; i < fileCount; i++ )
+        {
+            if ( claimOutput( pathArray[ i ].pwcPath, outputs[ i ] ) )
+            {
+                scheduler.Add( i, EstimateDecodeCost( pathArray[ i ].pwcPath, unknown ) );
+            }
+        }
+
+        scheduler.Run( [&] ( size_t i ) { convert( pathArray[ i ].pwcPath, outputs[ i ].c_str() ); } );
+    }
+
+    if ( g_pManifest )
+        printf( "converted %zd of %zd files; %zd were up to date\n", fileCount - failures - g_pManifest->Skipped(), fileCount, g_pManifest->Skipped() );
+    else
+        printf( "converted %zd of %zd files\n", fileCount - failures, fileCount );
+
+    return ( 0 == failures ) ? S_OK : E_FAIL;
+} //ConvertBatch
+
+// In daemon mode a bad request mustn't end the process, so Usage() throws instead of exiting
+
+thread_local bool t_UsageThrows = false;
+
+void Usage( char * message = 0 )
+{
+    if ( t_UsageThrows )
+        throw runtime_error( message ? message : "invalid arguments" );
+
+    if ( message )
+        printf( "%s\n", message );
+
+    printf( "usage: ic <input> /o:<filename>\n" );
+    printf( "  Image Convert\n" );
+    printf( "  arguments: <input>           The input image filename. Or for a collage a path specifier or .txt file with image paths\n" );
+    printf( "             -a:<aspectratio>  Aspect ratio of output (widthXheight) (e.g. 3x2, 3x4, 16x9, 1x1, 8.51x3.14). Default 1x1 for collages.\n" );
+    printf( "             -b                Converts an image into a Game Boy Camera format: 128x112 and 4 shades of grey. Center crop if needed.\n" );
+    printf( "             -c                Generates a collage using method 1 (pack images + make square if not all the same aspect ratio.\n" );
+    printf( "             -c:1:C            Same as -c -- collage using method 1, but sorts images based on primary color\n" );
+    printf( "             -c:2:C:S:A        Generate a collage using method 2 with C fixed-width columns and S pixel spacing. A arrangement (see below)\n" );
+    printf( "             -c:3:S            Generate a collage using method 3: justified rows with S pixel spacing. Keeps each image's aspect ratio.\n" );
+    printf( "             -c:4:P:S          Generate an atlas (sprite sheet) using method 4: pack images onto PxP pages with S pixel spacing, plus a .json index.\n" );
+    printf( "             -d[:name]         Daemon mode: run jobs sent as lines of arguments to pipe \\\\.\\pipe\\name (default ic). See notes.\n" );
+    printf( "             -e[:N]            Batch mode: convert every image in <input> (like a collage) to /o:, whose * is replaced by each input's name. N at once.\n" );
+    printf( "             -f:<fillcolor>    Color fill for empty space. ARGB or RGB in hex. Default is black.\n" );
+    printf( "             -g                Greyscale the output image. Does not apply to the fillcolor.\n" );
+    printf( "             -h                Turn off HighQualityCubic scaling and use NearestNeighbor.\n" );
+    printf( "             -i                Show CPU and RAM usage.\n" );
+    printf( "             -j                Use the JPG preview in RAW and HEIF files instead of decoding them when it's at least the size needed.\n" );
+    printf( "             -k[:file]         Cache collage image dimensions and colors across runs in file. Default is .iccache next to the input.\n" );
+    printf( "             -l:<longedge>     Pixel count for the long edge of the output photo or for /c:2 the collage width.\n" );
+    printf( "             -l:e1,e2,...      A list of long edges writes one output per size from a single decode. /o: needs a * for the size.\n" );
+    printf( "             -m[:file]         Skip collage and batch outputs whose inputs and options haven't changed. Default is .icmanifest next to the output.\n" );
+    printf( "             -n                show file Names as cations in collages.\n" );
+    printf( "             -o:<filename>     The output filename. Required argument. File will contain no exif info like GPS location.\n" );
+    printf( "             -p:x              Posterization level. 1..256 inclusive, Default 0 means none. # colors per channel.\n" );
+    printf( "             -q                Sacrifice image quality to produce a smaller JPG output file (4:2:2 not 4:4:4, 60%% not 100%%).\n" );
+    printf( "             -r                Randomize the layout of images in a collage.\n" );
+    printf( "             -s:x              Clusters color groups and shows most common X colors, Default is 64, 1-256 valid.\n" );
+    printf( "             -t                Enable debug tracing to ic.txt. Use -T to start with a fresh ic.txt\n" );
+    printf( "             -u:<folder>       Cache 256/512/1024/2048 pixel copies of images in folder and use them instead of originals when scaling down.\n" );
+    printf( "             -v[:N]            Use frame N (from 0) of a multi-frame input like a TIFF, GIF, or HEIF sequence. -v alone uses every frame. See notes.\n" );
+    printf( "             -w:x              Create a WAV file based on the image using methods 1..10. (prototype)\n" );
+    printf( "             -x:f              Expand the smallest source image in a collage by up to f times (1.0-10.0). Default is 1.0.\n" );
+    printf( "             -zc:x             Colorization. Works like posterization (1-256), but maps to a built-in color table.\n" );
+    printf( "             -zc:x,color1,...  Specify x colors that should be used. See example below.\n" );
+    printf( "             -zc:x;filename    Use centroids from x color clusters taken from the input file.\n" );
+    printf( "             -zc:x;file.icpal  Use a palette saved earlier with /o:file.icpal. x is ignored; the file has the color count.\n" );
+    printf( "             -zb               Same as -zc, but maps colors by matching brightness instead of color.\n" );
+    printf( "             -zs               Same as -zc, but maps colors by matching saturation instead of color.\n" );
+    printf( "             -zh               Same as -zc, but maps colors by matching hue instead of color.\n" );
+    printf( "             -zg               Same as -zc, but maps colors by matching brightness gradient instead of color.\n" );
+    printf( "  sample usage: (arguments can use - or /)\n" );
+    printf( "    ic picture.jpg /o:newpicture.jpg /l:800\n" );
+    printf( "    ic picture.jpg /p o:newpicture.jpg /l:800\n" );
+    printf( "    ic picture.jpg /o:c:\\folder\\newpicture.jpg /l:800 /a:1x1\n" );
+    printf( "    ic tsuki.tif /o:newpicture.jpg /l:300 /a:1x4 /f:0x003300\n" );
+    printf( "    ic miku.tif /o:newpicture.tif /l:300 /a:1x4 /f:2211\n" );
+    printf( "    ic phoebe.jpg /o:phoebe_grey.tif /l:3000 /g\n" );
+    printf( "    ic julien.jpg /o:julien_grey_posterized.tif /l:3000 /g /p:2 /w:1\n" );
+    printf( "    ic picture.jpg /o:newpicture.jpg /l:2000 /a:5.2x3.9\n" );
+    printf( "    ic *.jpg /c /o:c:\\collage.jpg /l:2000 /a:5x3 /f:0xff00aa88\n" );
+    printf( "    ic images_to_use.txt /c /o:c:\\collage.jpg /l:2000 /a:5x3 /f:0xff00aa88\n" );
+    printf( "    ic d:\\pictures\\mitski\\*.jpg /c /o:mitski_collage.jpg /l:10000 /a:4x5\n" );
+    printf( "    ic cheekface.jpg /s\n" );
+    printf( "    ic cheekface.jpg /s:16 /o:top_16_colors.png\n" );
+    printf( "    ic cheekface.jpg /o:cheeckface_colorized.png /zc:3\n" );
+    printf( "    ic cheekface.jpg /o:cheeckface_posterized.png /p:8 /g\n" );
+    printf( "    ic cfc.jpg /o:out_cfc.png /zc:4,0xfaa616,0x697e94,0xb09e59,0xfdfbe5\n" );
+    printf( "    ic cfc.jpg /o:out_cfc.png /zc:16;inputcolors.jpg\n" );
+    printf( "    ic cfc.jpg /o:out_cfc.png /zb:64;inputcolors.jpg\n" );
+    printf( "    ic cfc.jpg /o:out_cfc.png /zh:8;inputcolors.jpg\n" );
+    printf( "    ic /c:2:6:10:S /r /l:4096 d:\\treefort_pics\\*.jpg /o:treefort.png\n" );
+    printf( "    ic /c:2:6:10:s /r /l:4096 d:\\treefort_pics\\*.jpg /o:treefort.png\n" );
+    printf( "    ic /c:3:8 /l:8192 /a:16x9 d:\\treefort_pics\\*.jpg /o:treefort_rows.jpg\n" );
+    printf( "    ic /c:4:2048:2 /l:256 d:\\icons\\*.png /o:sprites.png\n" );
+    printf( "    ic /c:1:C /k d:\\treefort_pics\\*.jpg /o:treefort_by_color.jpg\n" );
+    printf( "    ic /c:2:6:10:S /l:4096 /u:d:\\ic_thumbs d:\\treefort_pics\\*.jpg /o:treefort.png\n" );
+    printf( "    ic d:\\treefort_pics\\*.jpg /e:8 /o:d:\\treefort_small\\*.jpg /l:1024\n" );
+    printf( "    ic d:\\raw\\*.nef /j /e /o:d:\\raw_small\\*.jpg /l:1024\n" );
+    printf( "    ic d:\\treefort_pics\\*.jpg /e /m /o:d:\\treefort_small\\*.jpg /l:1024\n" );
+    printf( "    ic photo.jpg /l:256,512,1024,2048 /o:d:\\web\\photo_*.jpg\n" );
+    printf( "    ic scan.tif /v /e /o:d:\\pages\\*.jpg /l:1600\n" );
+    printf( "    ic scan.tif /v /c:3:8 /l:4096 /o:contact_sheet.jpg\n" );
+    printf( "    ic burst.heic /v:2 /o:frame2.jpg\n" );
+    printf( "    ic /zc:32;sunset.jpg /o:sunset.icpal\n" );
+    printf( "    ic picture.jpg /o:sunset_picture.png /zc:0;sunset.icpal\n" );
+    printf( "    ic d:\\photos\\*.jpg /o:d:\\photos.icindex\n" );
+    printf( "    ic \"d:\\photos.icindex?date=2023,fl<35,sort=time\" /c /o:wide2023.jpg\n" );
+    printf( "    ic /d:imagesvc /k:d:\\ic\\meta.iccache /u:d:\\ic\\thumbs\n" );
+    printf( "    ic - /o:-.png /l:800 < in.jpg > out.png\n" );
+    printf( "    ic /c:2:6 /o:tf2.png z:\\tf2\\*.jpg /f:eb6145 /l:8192\n" );
+    printf( "    ic /i z:\\jbrekkie\\*.jpg /o:michelle_8.png /c:2:5:4:S /zc:8,0xdd9f1a,0xbe812e,0xe3c871,0xe0b74b,0xeee1c1,0xc69948,0x3a3732,0x82543d /f:0xdd9f1a /g\n" );
+    printf( "  notes:    - -g only applies to the image, not fillcolor. Use /f with identical rgb values for greyscale fills.\n" );
+    printf( "            - Exif data is stripped for your protection.\n" );
+    printf( "            - Images are rotated and flipped upright per their Exif orientation, including in collage layouts. The codec does it while\n" );
+    printf( "              decoding when it can; otherwise it's done as the image is scaled.\n" );
+    printf( "            - fillcolor is always hex, may or may not start with 0x.\n" );
+    printf( "            - Both -a and -l are aspirational for collages. Aspect ratio and long edge may change to accomodate content.\n" );
+    printf( "            - -k cache entries are keyed by full path and are ignored once a file's size or last-write time changes.\n" );
+    printf( "            - -m rebuilds an output if an input, a pixel-affecting option, the -z palette, the ic build, or the output itself changed.\n" );
+    printf( "            - -u cache levels are raw pixels, so the folder can get large. Delete it at any time; levels are rebuilt as needed.\n" );
+    printf( "              Levels are only made from full decodes, never from -j previews.\n" );
+    printf( "            - -j applies when -l or the collage cell size is no larger than the preview, usually 1600 to 8000 pixels. The RAW isn't\n" );
+    printf( "              decoded, which makes batches and collages of RAW files much faster. Previews are the camera's rendering of the RAW.\n" );
+    printf( "            - With -e the default for N is one per core; all conversions share one set of -z colorization data.\n" );
+    printf( "            - -e inputs that differ only by extension would share an output, so only the first is converted and the others are errors.\n" );
+    printf( "            - Collages and -e start on images while a folder is still being enumerated. -e then converts in the order files are found\n" );
+    printf( "              rather than largest first. Paths longer than MAX_PATH are found and passed on with the \\\\?\\ prefix.\n" );
+    printf( "            - -d clients write one job per line, e.g. 'in.jpg /o:out.jpg /l:800', and read one reply line: 'ok' or 'error <hr> <why>'.\n" );
+    printf( "            - -d jobs share the WIC factory, -k and -u caches, and -z color data. Send 'quit' to stop. -i -j -k -t -u are for the daemon itself.\n" );
+    printf( "            - Only the account that started -d can connect to its pipe. A client that sends a line over 64KB is disconnected.\n" );
+    printf( "            - An <input> or /o: of - means stdin or stdout. Use -.png etc. to pick the output format. Messages then go to stderr.\n" );
+    printf( "            - With a list of long edges, each size is scaled from a larger size if that's at least 2x, else from the decoded image.\n" );
+    printf( "            - -v with -e converts every frame in parallel to * replaced by name_N, e.g. scan_0.jpg. -v with -c makes a collage of the frames.\n" );
+    printf( "              GIF frames are used as stored rather than composited. Frames other than 0 don't use the -k or -u caches or Exif orientation.\n" );
+    printf( "            - /o:lib.icindex builds a metadata index of <input> and its subfolders. Then lib.icindex?query as a collage or -e <input> selects\n" );
+    printf( "              and orders images without opening them. Terms are comma-separated and all must match: date=2023 date>=2023-06 fl<35 (35mm\n" );
+    printf( "              equivalent) rating>=4 camera=z 7 lens!=50mm gps=yes|no sort=time|fl|rating|camera|lens|path (-time is descending).\n" );
+    printf( "            - If a precise collage aspect ratio or long edge are required, run the app twice; on a single image it's exact.\n" );
+    printf( "            - Writes as high a quality of JPG as it can: 1.0 quality and 4:4:4\n" );
+    printf( "            - <input> can be any WIC-compatible format: heic, tif, png, bmp, cr2, jpg, etc.\n" );
+    printf( "            - Output file is always 24bpp unless both input and output are tif and input is 48bpp, which results in 48bpp.\n" );
+    printf( "            - Output file type is inferred from the extension specified. JPG is assumed if not obvious.\n" );
+    printf( "            - If an output file is specified with /s, a 128-pixel wide image is created with strips for each color.\n" );
+    printf( "            -    collage method 1: -- packs all images of the same aspect ratio or uses squares otherwise.\n" );
+    printf( "            -                      -- attempts to match /a: aspect ratio.\n" );
+    printf( "            -    collage method 2: -- adds spacing between images and creates identical-width columns.\n" );
+    printf( "            -                      -- The longedge argument applies to the width, which may be shorter than the height.\n" );
+    printf( "            -                      -- defaults are 3 columns, 6 pixels of spacing, and don't sort by aspect ratio (-c:2:3:6:n).\n" );
+    printf( "            -                      -- doesn't attempt to match /a: aspect ratio since a column count is specified.\n" );
+    printf( "            -                      -- /A arrangement arguments - uppercase yes, lowercase no\n" );
+    printf( "            -                         T (tallest items on top) / t (random arrangement (default))\n" );
+    printf( "            -                         S (space images out (default)) / s (force consistent spacing and perhaps leave blank space at bottom\n" );
+    printf( "            -    collage method 3: -- justified rows: images in a row share a height and each row spans the full width.\n" );
+    printf( "            -                      -- row breaks are chosen so row heights stay close to what matches /a: aspect ratio.\n" );
+    printf( "            -                      -- the longedge argument applies to the long side of /a: aspect ratio. Default spacing is 6 (-c:3:6).\n" );
+    printf( "            -    collage method 4: -- packs images at their own size (scaled down to longedge if given) with no cropping.\n" );
+    printf( "            -                      -- pages are P on the long side of /a: aspect ratio. Defaults are 4096 pixels and 6 pixel spacing (-c:4:4096:6).\n" );
+    printf( "            -                      -- pages after the first are named with _1, _2, etc. before the extension.\n" );
+    printf( "            -                      -- the .json index has each page's file and each image's page, x, y, width, and height.\n" );
+    exit( 0 );
+} //Usage
+
+double ParseAspectRatio( WCHAR const * p )
+{
+    WCHAR const * px = wcschr( p, L'x' );
+    if ( ( 0 == px ) || ( wcslen( p ) > 20 ) )
+    {
+        printf( "aspect ratio specification is invalid: %ws\n", p );
+        Usage();
+    }
+
+    WCHAR awc[ 21 ];
+    wcscpy( awc, p );
+    awc[ px - p ] = 0;
+
+    double w = _wtof( awc );
+    double h = _wtof( awc + ( px - p ) + 1 );
+
+    if ( w <= 0.0 || h <= 0.0 )
+    {
+        printf( "aspect ratio %lf by %lf is invalid\n", w, h );
+        Usage();
+    }
+
+    tracer.Trace( "aspect ratio %ws: w %lf, h %lf, a %lf\n", p, w, h, w / h );
+
+    return w / h;
+} //ParseAspectRatio
+
+void AppendLongLong( char *pc, long long n )
+{
+    if ( n < 0 )
+    {
+        *pc++ = '-';
+        *pc = 0;
+        AppendLongLong( pc, -n );
+    }
+
+    if ( n < 1000 )
+    {
+        sprintf( pc, "%lld", n );
+        return;
+    }
+
+    AppendLongLong( pc, n / 1000 );
+
+    pc += strlen( pc );
+    sprintf( pc, ",%03lld", n % 1000 );
+} //AppendLongLong
+
+void PrintStat( char const * pcName, long long n, int widthName = 20, int widthN = 13 )
+{
+    // LLONG_MAX is 9,223,372,036,854,775,807. Add a negative sign and that's 26 characters.
+
+    char acNum[ 40 ];
+    acNum[0] = 0;
+    AppendLongLong( acNum, n );
+    printf( "%-*s %*s\n", widthName, pcName, widthN, acNum );
+} //PrintStat
+
+const WCHAR * InferOutputType( WCHAR *ext )
+{
+    if ( !wcsicmp( ext, L".bmp" ) )
+        return L"image/bmp";
+
+    if ( !wcsicmp( ext, L".gif" ) )
+        return L"image/gif";
+
+    if ( ( !wcsicmp( ext, L".jpg" ) ) || ( !wcsicmp( ext, L".jpeg" ) ) )
+        return L"image/jpeg";
+
+    if ( !wcsicmp( ext, L".png" ) )
+        return L"image/png";
+
+    if ( ( !wcsicmp( ext, L".tif" ) ) || ( !wcsicmp( ext, L".tiff" ) ) )
+        return L"image/tiff";
+
+    return L"image/jpeg";
+} //InferOutputType
+
+static DWORD ColorizationColors2[] =
+{
+    0xbfbbaf, 0x905c54,
+};
+
+static DWORD ColorizationColors4[] =
+{
+    0xddd0bd, 0xe38853, 0x7099bf, 0x5b4644,
+};
+
+static DWORD ColorizationColors8[] =
+{
+    0xeea665, 0xeecea1, 0x797874, 0x97b9c6, 0x473d35, 0xd55838, 0xdadce3, 0x4b8edd,
+};
+
+static DWORD ColorizationColors16[] =
+{
+    0xeda48c, 0xf3dea5, 0x5b4f4d, 0x90a093, 0xe8e4e3, 0x7a766e, 0xe67a69, 0x99c4e6,
+    0x61a3e5, 0xf2673e, 0xc0bcb3, 0x342724, 0xb83d2e, 0x4379cf, 0xf0d94d, 0x308c36,
+};
+
+static DWORD ColorizationColors32[] =
+{
+    0xee9b81, 0xf5b1a4, 0xf9785d, 0xf5e8a0, 0xebd8ce, 0xf25d32, 0xf0ede9, 0x9bbde3,
+    0x6b6b6e, 0x89878e, 0x433939, 0xa8a49b, 0xc2bfb8, 0xfbd96b, 0x4e525d, 0x734b41,
+    0xd27469, 0xb4d8f2, 0x261a18, 0xc7301b, 0x7fa0d6, 0x3d9ae8, 0x5c84c9, 0x67b7f2,
+    0x948061, 0xb14d52, 0xf2d026, 0x3069d2, 0x78c196, 0x389964, 0x179e14, 0xfd89fc,
+};
+
+static DWORD ColorizationColors64[] =
+{
+    0xf88f7f, 0xf2a89e, 0xf67464, 0xf6be7c, 0xf0d6a5, 0xf85c43, 0x4f4538, 0xf5e8c8,
+    0x312f31, 0x60645d, 0x9d9593, 0x8d817b, 0x444f55, 0xc7bdb4, 0xf7bfc2, 0xf5f1eb,
+    0xeca354, 0xaba5a9, 0xe94d25, 0x715448, 0x221817, 0xf6f4a1, 0x747272, 0xd9d3ce,
+    0xb22b25, 0xd07a77, 0xdb9590, 0xf6f174, 0xe3e6ea, 0xd35c58, 0x718292, 0x92b6c9,
+    0x6d9abb, 0x477ed0, 0xa94c52, 0x4e9bed, 0xafc6d6, 0xf6e04c, 0x6eaeec, 0x93b8ed,
+    0x51667b, 0xc2ddf2, 0x7c9be2, 0x946553, 0x627ad2, 0xe78721, 0x7cc5f2, 0xc0ad82,
+    0x74b986, 0x3862c4, 0xacd7f8, 0x2b99ee, 0xb49555, 0x9fd3ee, 0xd8310d, 0xf8e819,
+    0x782f2e, 0x92ce9b, 0x359f77, 0x52c8ee, 0x1c71db, 0x1b7d1c, 0x12a70d, 0x06fffe,
+};
+
+static DWORD ColorizationColors128[] =
+{
+    0xf58374, 0xf9958c, 0xf9a5a1, 0xf86a62, 0xeea775, 0xaea8a8, 0xf9ecb3, 0x63676b,
+    0x79848d, 0xbebab8, 0xf85c43, 0xa89b91, 0xf68757, 0xf6be8c, 0x626058, 0x907c72,
+    0xf4f5f2, 0xfacc6e, 0xf9d9cb, 0x4d4f50, 0xf64b2f, 0x948e8c, 0x77757a, 0xf6f179,
+    0x493f41, 0x5d4e37, 0x6cabf2, 0xcfc7c9, 0xefac53, 0xdd8d8a, 0xfbea50, 0xda756e,
+    0x909aa4, 0xf6f599, 0xd45e59, 0xf7d1ae, 0x7d6c5a, 0xf2e3e3, 0xfad899, 0xf7bfc2,
+    0xf8f4d3, 0xedb4ad, 0xe04f16, 0xe1d8d8, 0x5699ea, 0xf66d3f, 0x73524e, 0x96b9f2,
+    0xe0ebf5, 0xdfa19d, 0x4a3b28, 0x83bef6, 0xb6cadb, 0xab271a, 0xa0bbd5, 0x363336,
+    0x95acc7, 0x6a8fe0, 0xa96163, 0x302827, 0xcc7a7d, 0xb4d8f2, 0x4c7edd, 0xcfdbe6,
+    0x5d6dcf, 0xbe4a52, 0xe2dd9f, 0xbe3431, 0x3671d9, 0x46556c, 0x6d97bf, 0x7eaedc,
+    0x5b748a, 0xdb2d0b, 0x4fb5f7, 0x7ec190, 0x849be7, 0x558bbb, 0xe1d6ba, 0xc5b281,
+    0x963e4f, 0x96d2f7, 0xcec49e, 0xbfe3fb, 0xa4976b, 0xfac52b, 0x201c16, 0xa6c9f3,
+    0x329cf2, 0xf3f21b, 0x6ab282, 0x334b57, 0x91d3da, 0x6b8ba9, 0xd08143, 0x7f6532,
+    0x599160, 0x3556c1, 0xe38e2b, 0x3fa8d8, 0x78373d, 0x2289e6, 0x0f0a07, 0x993f27,
+    0x2a364c, 0x1b2429, 0xf48407, 0x41200d, 0x75c6b8, 0xa57a3d, 0x2a110d, 0xaad4ae,
+    0x37af82, 0x386eb4, 0x5dcfea, 0x7e2217, 0xb5ab3c, 0x3a796d, 0x179e14, 0x98d58e,
+    0x19957e, 0x2e9b2a, 0x3b5789, 0x0f7b0e, 0xe63636, 0x0856f4, 0xfd89fc, 0x06fffe,
+};
+
+static DWORD ColorizationColors256[] =
+{
+    0xf86b55, 0x948e8c, 0xf9958a, 0xf87a6d, 0xfaf0b5, 0xfadbcb, 0xf7f3e8, 0x86817d,
+    0xfc5b49, 0x4d464d, 0xf8f4d3, 0x626260, 0x585759, 0xd76e6c, 0xe0d7d2, 0x49423b,
+    0xa59c8b, 0xc7bcbe, 0xaba9ae, 0xfb6941, 0x5d636f, 0xa2a39f, 0x8ec3f3, 0x4fb5f7,
+    0xe9dfe1, 0x5b4a3b, 0x716a69, 0xe3f1f2, 0xf6f5f9, 0xfae49e, 0xe48074, 0xf88c5e,
+    0x6ea6f3, 0xf88b78, 0xf8a398, 0x7ba2e7, 0xda5e5a, 0xf77c82, 0x40352c, 0xf9e0de,
+    0x2e2b2d, 0xf4c090, 0xf24b3b, 0xe48b89, 0xf2f66d, 0xfbd8ae, 0xeca17e, 0xfbd776,
+    0x51a1de, 0xc35b5c, 0xf8fa8c, 0xbcd9f6, 0x90969f, 0x84c28e, 0x727079, 0xf5c8cd,
+    0xfbf59f, 0x3b3538, 0xfab07f, 0x635148, 0xd29292, 0xfac3bf, 0x735754, 0x947f6e,
+    0xb7a69d, 0x475669, 0xe04519, 0xd68278, 0xe79b91, 0xfe8949, 0xabc6db, 0xccbf94,
+    0x828490, 0xd2551d, 0xf2c8a6, 0x507dd8, 0x96a4b4, 0xbec4c9, 0xe7e1a5, 0xf4be5e,
+    0xeeafb2, 0xf6bd78, 0xf9ada8, 0xaa3e21, 0x4081e7, 0xcb322d, 0x7b8c96, 0xfacf84,
+    0xa3b6c5, 0x5290f3, 0xd8d2b5, 0x88adce, 0xfa5630, 0xcfdce8, 0x4e8bce, 0xb61f16,
+    0xd4c7c5, 0x70b27e, 0xe82708, 0xa8d0f6, 0xe88554, 0x271d1c, 0x8b7275, 0x689ddf,
+    0xbdaa7d, 0xf93c1e, 0x8395ad, 0x96b9d6, 0x7f695b, 0xd2dddb, 0x3a6edb, 0xae464f,
+    0x362722, 0xf6ce9b, 0xe7a05e, 0xf99399, 0xf45c6f, 0xdfd69b, 0xf5ab57, 0xdfa19d,
+    0x3b9df4, 0x75c6b8, 0x3c4e5c, 0xbdd2e0, 0xeda86c, 0xaaa168, 0xf0ec81, 0xeb6236,
+    0x618be6, 0x7bbef3, 0x2c63ca, 0x6493bc, 0x91aeef, 0xefd5be, 0xb3b5b7, 0x9cbeeb,
+    0xac8683, 0xc9484f, 0xcc7a7d, 0x994141, 0x866239, 0x727c8b, 0x9b5561, 0x82bee2,
+    0x94d5fe, 0x6d4245, 0xf9ca32, 0x313c4f, 0xbcb4a9, 0xb4696d, 0xb6302f, 0x827761,
+    0x698bae, 0xf8fb4c, 0x4f4220, 0xefaf99, 0x523237, 0x566d7d, 0xa5bbd8, 0xd1eafb,
+    0x248bf4, 0xd2c8d1, 0x3289d3, 0x4f67c7, 0xafdefe, 0xe87927, 0xf8ea18, 0xfcb99f,
+    0x1a73de, 0xfaef35, 0xe4bcbb, 0x4b84b5, 0xd47e36, 0xfeda5d, 0x66bae8, 0xb88653,
+    0xf99aa4, 0x788ddc, 0x687ed3, 0x5db98f, 0x34b07b, 0x6c693c, 0xaedceb, 0x6ec5ff,
+    0xef9c3d, 0xf2571e, 0x6c8194, 0x9d6355, 0xf6dd53, 0xcab6ab, 0xfbe909, 0x7b3128,
+    0x75a0c3, 0xf9acc1, 0x29363f, 0x645423, 0xe9ebc5, 0x93d3e0, 0x96b9fd, 0x495c54,
+    0x8ecfc6, 0x60758d, 0xb05f3b, 0xdfb1ad, 0xebf199, 0x8a4452, 0x3b200f, 0x5d9d68,
+    0x18a108, 0x261012, 0x3c8967, 0x666cda, 0x98d58e, 0x8f2b14, 0x95894d, 0x3e5682,
+    0x171717, 0x1d232f, 0xaeab40, 0x20676b, 0x3556c1, 0xf67800, 0xaad4ae, 0xf6b712,
+    0x0d0d0f, 0x648359, 0xcbc563, 0x19957e, 0x8f96e7, 0x3c130f, 0x5d9954, 0x090504,
+    0x842640, 0x378e2b, 0x37b3d9, 0x210909, 0x691d29, 0x4d799e, 0x3562a6, 0x037602,
+    0x51e5ef, 0xb1bdef, 0xc5b627, 0x29554a, 0x281b08, 0xfd89fc, 0x06fffe, 0x182a14,
+    0x232c67, 0x034afe, 0x187218, 0x7fffff, 0x00a637, 0xcfcaff, 0x8bfe02, 0xf0335b,
+};
+
+// Everything that can be set with arguments. In daemon mode each request has its own.
+
+struct AppOptions
+{
+    WCHAR awcInput[ MAX_PATH ] = {0};
+    WCHAR awcOutput[ MAX_PATH ] = {0};
+    bool gameBoy = false;
+    bool generateCollage = false;
+    int collageMethod = 1;
+    int collageColumns = 3;
+    int collageSpacing = 6;
+    int atlasPageSize = 4096;
+    bool collageSortByAspect = false;
+    bool collageSortByColor = false;
+    bool collageSpaced = true;
+    bool namesAsCaptions = false;
+    bool randomizeCollage = false;
+    bool runtimeInfo = false;
+    bool highQualityScaling = true;
+    bool useEmbeddedPreviews = false;
+    int inputFrame = -1;     // -v:N; -1 means frame 0
+    bool allFrames = false;  // -v
+    bool showColors = false;
+    int showColorCount = 64;
+    bool makeGreyscale = false;
+    bool lowQualityOutput = false;
+    int posterizeLevel = 0;  // 0 means none
+    ColorizationData * colorizationData = 0; // null means none
+    int waveMethod = 0;      // 0 means none; don't create a WAV file
+    int longEdge = 0;
+    vector<int> longEdges;   // more than one means an output ladder
+    int fillColor = 0xff << 24; // black, non-transparent
+    double aspectRatio = 0.0;
+    int breakTileSize = 0; // if 0, don't do it.
+    double tileProbability = 1.0;
+    bool enableTracing = false;
+    bool clearTraceFile = false;
+    double expandCollageImages = 1.0;
+    bool batchMode = false;
+    int batchInFlight = 0;   // 0 means one per core
+    bool useMetadataCache = false;
+    WCHAR awcMetadataCache[ MAX_PATH ] = {0};
+    bool useManifest = false;
+    WCHAR awcManifest[ MAX_PATH ] = {0};
+    WCHAR awcThumbnailCache[ MAX_PATH ] = {0};
+    bool daemonMode = false;
+    WCHAR awcPipeName[ MAX_PATH ] = {0};
+    WCHAR const * pwcColorization = 0; // the -z argument, if any
+    ColorizationData cd;
+};
+
+void ParseColorization( WCHAR const * parg, ColorizationData & cd, int & posterizeLevel )
+{
+    WCHAR const * pnext = parg + 2;
+    if ( L'b' == *pnext )
+        cd.mapping = mapBrightness;
+    else if ( 's' == *pnext )
+        cd.mapping = mapSaturation;
+    else if ( 'h' == *pnext )
+        cd.mapping = mapHue;
+    else if ( 'g' == *pnext )
+        cd.mapping = mapGradient;
+    else if ( 'c' == *pnext )
+        cd.mapping = mapColor;
+    else
+        Usage( "invalid /z flag specified" );
 
-    hr = CommitEncoder( bitmapFrameEncode, encoder );
+    pnext++;
+    if ( L':' != *pnext )
+        Usage( "colon not found in /z flag" );
 
-    return hr;
-} //StitchImages2
+    // A precompiled palette has its own color count and usually its search structure
 
-HRESULT StitchImages1( WCHAR const * pwcOutput, CPathArray & pathArray, vector<BitmapDimensions> & dimensions,
-                       int imagesWide, int imagesHigh, int cellDX, int cellDY, int stitchDX, int stitchDY,
-                       int fillColor, int waveMethod, int posterizeLevel,
-                       ColorizationData * colorizationData, bool makeGreyscale, WCHAR const * outputMimetype,
-                       bool lowQualityOutput, bool highQualityScaling, bool namesAsCaptions )
-{
-    CTimed timeStitch( g_CollageStitchTime );
-    bool makeEverythingSquare = ( cellDX == cellDY );
-    ComPtr<IWICBitmapEncoder> encoder;
-    ComPtr<IWICBitmapFrameEncode> bitmapFrameEncode;
-    HRESULT hr = CreateWICEncoder( pwcOutput, encoder, bitmapFrameEncode, outputMimetype, lowQualityOutput );
-    if ( FAILED( hr ) )
-    {
-        printf( "can't create a wic encoder: error %#x\n", hr );
-        return hr;
-    }
-    
-    hr = bitmapFrameEncode->SetSize( stitchDX, stitchDY );
-    if ( FAILED( hr ) )
-    {
-        printf( "failed to set encoder frame size %#x\n", hr );
-        return hr;
-    }
-    
-    WICPixelFormatGUID formatRequest = g_GuidPixelFormat;
-    hr = bitmapFrameEncode->SetPixelFormat( & formatRequest );
-    if ( FAILED( hr ) )
-    {
-        printf( "failed to set encoder pixel format %#x\n", hr );
-        return hr;
-    }
-    
-    if ( formatRequest != g_GuidPixelFormat )
-    {
-        printf( "didn't get the pixel format requested for writing\n" );
-        return E_FAIL;
-    }
-    
-    int strideOut = StrideInBytes( stitchDX, g_BitsPerPixel );
-    int cbOut = strideOut * stitchDY;
-    vector<byte> bufferOut( cbOut );
-    
-    {
-        CTimed timedFlood( g_CollageStitchFloodTime );
-    
-        FloodFill( bufferOut.data(), stitchDX, stitchDY, fillColor );
-    }
-    
-    //for ( int y = 0; y < imagesHigh; y++ )
-    parallel_for( 0, imagesHigh, [&] ( int y )
+    WCHAR const *semi = wcschr( parg, L';' );
+    if ( semi && CPaletteFile::IsPaletteFile( semi + 1 ) )
     {
-        int yOffset = y * cellDY;
-    
-        //for ( int x = 0; x < imagesWide; x++ )
-        parallel_for( 0, imagesWide, [&] ( int x )
-        {
-            int xOffset = x * cellDX;
-            int curSource = y * imagesWide + x;
-    
-            if ( curSource < pathArray.Count() )
-            {
-                ComPtr<IWICBitmapSource> source;
-                ComPtr<IWICBitmapFrameDecode> frame;
-                HRESULT hr = LoadWICBitmap( pathArray[curSource].pwcPath, source, frame, true );
-                if ( FAILED( hr ) )
-                    printf( "can't open bitmap, error: %#x\n", hr );
-    
-                if ( SUCCEEDED( hr ) )
-                {
-                    hr = ScaleWICBitmap( source, __max( cellDY, cellDX ), highQualityScaling );
-                    if ( FAILED( hr ) )
-                        printf( "can't scale source bitmap, error %#x\n", hr );
-                }
-    
-                UINT width = 0, height = 0;
-    
-                if ( SUCCEEDED( hr ) )
-                {
-                    hr = source->GetSize( &width, &height );
-                    if ( FAILED( hr ) )
-                        printf( "can't get dimensions of path error %#x\n", hr );
-                }
-    
-                if ( SUCCEEDED( hr ) )
-                {
-                    int rectX = xOffset;
-                    int rectY = yOffset;
-    
-                    if ( makeEverythingSquare && ( width != height ) )
-                    {
-                        if ( width > height )
-                        {
-                            double diff = width - height;
-                            double resultDiff = round( diff * (double) cellDY / (double) width );
-                            rectY += (int) round( resultDiff / 2.0 );
-                        }
-                        else
-                        {
-                            double diff = height - width;
-                            double resultDiff = round( diff * (double) cellDX / (double) height );
-                            rectX += (int) round( resultDiff / 2.0 );
-                        }
-                    }
-    
-                    DrawImage( bufferOut.data(), strideOut, source, waveMethod, pwcOutput, posterizeLevel, colorizationData,
-                               makeGreyscale, rectX, rectY, width, height, g_BitsPerPixel, g_BitsPerPixel );
+        WCHAR awcPalette[ MAX_PATH ] = {0};
+        _wfullpath( awcPalette, semi + 1, _countof( awcPalette ) );
 
-                    if ( namesAsCaptions )
-                        DrawCaption( pathArray[ curSource ].pwcPath, bufferOut.data(), strideOut, xOffset, yOffset,
-                                     cellDX, cellDY, stitchDX, stitchDY, g_BitsPerPixel );
-                }
-            }
-        });
-    });
-    
-    timeStitch.Complete();
+        HRESULT hr = CPaletteFile::Load( awcPalette, cd.mapping, cd.bgrdata, cd.hsvdata, cd.kdtree );
+        if ( FAILED( hr ) )
+            Usage( "can't load /z palette file" );
 
-    // If the output image is large, most of the time in the app is spent here compressing and writing the image
+        if ( S_OK == hr )
+        {
+            if ( mapColor == cd.mapping )
+                cd.prepared = ( 0 != cd.kdtree );
+            else if ( mapGradient == cd.mapping )
+                cd.prepared = true;
+            else
+                cd.prepared = ( cd.hsvdata.size() == cd.bgrdata.size() );
+        }
 
-    CTimed timeWrite( g_CollageWriteTime );
+        tracer.Trace( "loaded %zd colors from palette %ws, prebuilt: %d\n", cd.bgrdata.size(), awcPalette, cd.prepared );
+        posterizeLevel = (int) cd.bgrdata.size();
+        return;
+    }
 
-    hr = bitmapFrameEncode->WritePixels( stitchDY, strideOut, cbOut, bufferOut.data() );
-    if ( FAILED( hr ) )
+    posterizeLevel = _wtoi( pnext + 1 );
+    if ( posterizeLevel < 1 || posterizeLevel > 256 )
     {
-        printf( "failed to write pixels %#x\n", hr );
-        return hr;
+        printf( "invalid colorization posterization level %d; must be 1-256\n", posterizeLevel );
+        Usage();
     }
 
-    hr = CommitEncoder( bitmapFrameEncode, encoder );
+    if ( semi )
+    {
+        WCHAR awcColorFile[ MAX_PATH ] = {0};
+        _wfullpath( awcColorFile, semi + 1, _countof( awcColorFile ) );
+        DWORD attr = GetFileAttributesW( awcColorFile );
+        if ( INVALID_FILE_ATTRIBUTES == attr )
+            Usage( "can't find /z color file" );
 
-    return hr;
-} //StitchImages1
+        cd.bgrdata.clear();
+        ShowColors( awcColorFile, posterizeLevel, cd.bgrdata, false, 0 );
+    }
+    else
+    {
+        WCHAR const *comma = wcschr( parg, L',' );
 
-vector<BitmapDimensions> * g_pdimensions = 0;
+        if ( comma )
+        {
+            // parse a list of colors
 
-static int aspectCompare( const void * a, const void * b )
-{
-    int ia = * (int *) a;
-    int ib = * (int *) b;
+            cd.bgrdata.clear();
 
-    vector<BitmapDimensions> & dim = * g_pdimensions;
+            do
+            {
+                comma++;
+                DWORD color;
+                int parsed = swscanf_s( comma, L"%x", & color );
+                if ( 0 == parsed )
+                    Usage( "can't parse color mapping color" );
+                cd.bgrdata.push_back( color );
+                comma = wcschr( comma, L',' );
+            } while ( comma );
+
+            if ( cd.bgrdata.size() != posterizeLevel )
+                Usage( "the /z: color count isn't the same as the number of colors specified" );
+        }
+        else
+        {
+            // use the built-in table
 
-    double aspecta = (double) dim[ ia ].width / (double) dim[ ia ].height;
-    double aspectb = (double) dim[ ib ].width / (double) dim[ ib ].height;
+            int countBuiltIn = 0;
+            DWORD * pBuiltInArray = NULL;
 
-    if ( aspecta > aspectb )
-        return 1;
+            if ( posterizeLevel <= 2 )
+            {
+                countBuiltIn = 2;
+                pBuiltInArray = ColorizationColors2;
+            }
+            else if ( posterizeLevel <= 4 )
+            {
+                countBuiltIn = 4;
+                pBuiltInArray = ColorizationColors4;
+            }
+            else if ( posterizeLevel <= 8 )
+            {
+                countBuiltIn = 8;
+                pBuiltInArray = ColorizationColors8;
+            }
+            else if ( posterizeLevel <= 16 )
+            {
+                countBuiltIn = 16;
+                pBuiltInArray = ColorizationColors16;
+            }
+            else if ( posterizeLevel <= 32 )
+            {
+                countBuiltIn = 32;
+                pBuiltInArray = ColorizationColors32;
+            }
+            else if ( posterizeLevel <= 64 )
+            {
+                countBuiltIn = 64;
+                pBuiltInArray = ColorizationColors64;
+            }
+            else if ( posterizeLevel <= 128 )
+            {
+                countBuiltIn = 128;
+                pBuiltInArray = ColorizationColors128;
+            }
+            else // anything greater is mapped to 256
+            {
+                countBuiltIn = 256;
+                pBuiltInArray = ColorizationColors256;
+            }
 
-    if ( aspecta < aspectb )
-        return -1;
+            cd.bgrdata.resize( __min( posterizeLevel, countBuiltIn ) );
 
-    return 0;
-} //aspectCompare
+            for ( int c = 0; c < cd.bgrdata.size(); c++ )
+               cd.bgrdata[ c ] = pBuiltInArray[ c ];
+        }
+    }
+} //ParseColorization
 
-void Randomize( vector<int> & elements, std::mt19937 & gen )
+// Create optimized data structures for specific color mapping scenarios
+
+void PrepareColorization( ColorizationData & cd )
 {
-    if ( elements.size() <= 1 )
+    if ( cd.prepared )
         return;
 
-    std::uniform_int_distribution<> distrib( 0, (int) elements.size() - 1 );
+    if ( mapColor == cd.mapping || mapGradient == cd.mapping )
+        qsort( cd.bgrdata.data(), cd.bgrdata.size(), sizeof DWORD, compare_brightness );
 
-    for ( size_t i = 0; i < elements.size() * 2; i++ )
+    if ( mapColor == cd.mapping )
     {
-        int a = distrib( gen );
-        int b = distrib( gen );
+        cd.kdtree.reset( new KDTreeBGR( cd.bgrdata.size() ) );
 
-        swap( elements[ a ], elements[ b ] );
+        for ( int i = 0; i < cd.bgrdata.size(); i++ )
+            cd.kdtree->Insert( cd.bgrdata[ i ] );
     }
-} //Randomize
-
-ULONG GetPrimaryHSV( const WCHAR * pwc )
-{
-    vector<DWORD> centroids;
-    ShowColors( pwc, 4, centroids, false, 0, 0 );
-    if ( 0 == centroids.size() )
-        return 0;
+    else  if ( mapBrightness == cd.mapping || mapHue == cd.mapping || mapSaturation == cd.mapping )
+    {
+        qsort( cd.bgrdata.data(), cd.bgrdata.size(), sizeof DWORD,
+               mapHue == cd.mapping ? compare_hue :
+               mapSaturation == cd.mapping ? compare_saturation :
+               compare_brightness );
 
-    int h, s, v;
-    BGRToHSV( centroids[ 0 ], h, s, v );
+        // calcuate the HSV data for the rgb data, if any
+    
+        cd.hsvdata.resize( cd.bgrdata.size() );
+    
+        for ( int i = 0; i < cd.bgrdata.size(); i++ )
+        {
+            int h,s,v;
+            BGRToHSV( cd.bgrdata[ i ], h, s, v );
 
-    return h << 16 | s << 8 | v;
-} //GetPrimaryHSV
+            if ( mapHue == cd.mapping )
+                cd.hsvdata[ i ] = h;
+            else if ( mapSaturation == cd.mapping )
+                cd.hsvdata[ i ] = s;
+            else if ( mapBrightness == cd.mapping )
+                cd.hsvdata[ i ] = v;
+        }
 
-void SortPathArrayByColor( CPathArray & pathArray )
-{
-    parallel_for( (size_t) 0, pathArray.Count(), [&] ( size_t i )
-    //for ( size_t i = 0; i < pathArray.Count(); i++ )
-    {
-        pathArray[ i ].ulAttribute = GetPrimaryHSV( pathArray[ i ].pwcPath );
-    } );
+        #ifndef NDEBUG
+        for ( int z = 0; z < cd.hsvdata.size() - 1; z++ )
+            assert( cd.hsvdata[ z ] <= cd.hsvdata[ z + 1 ] );
+        #endif
+    }
 
-    pathArray.SortOnAttribute();
+    cd.prepared = true;
+} //PrepareColorization
 
-    //for ( size_t i = 0; i < pathArray.Count(); i++ )
-    //    tracer.Trace( "hsv %08x, path %ws\n", pathArray[ i ].ulAttribute, pathArray[ i ].pwcPath );
-} //SortPathArrayByColor
+// The daemon builds colorization data once per distinct -z argument and shares it across requests, since
+// clustering a palette file and building the kd-tree can take longer than the conversion itself. The key
+// includes the size and last-write time of the argument's palette or image file, so an edited file is
+// rebuilt. Older entries are kept since running jobs may still be using them.
 
-HRESULT GenerateCollage( int collageMethod, WCHAR * pwcInput, const WCHAR * pwcOutput, int longEdge, int posterizeLevel,
-                         ColorizationData * colorizationData, bool makeGreyscale, int collageColumns, int collageSpacing,
-                         bool collageSortByColor, bool collageSortByAspect, bool collageSpaced, double aspectRatio, int fillColor,
-                         WCHAR const * outputMimetype, bool randomizeCollage, bool lowQualityOutput, bool highQualityScaling,
-                         bool namesAsCaptions, double expandCollageImages )
+struct CachedColorization
 {
-    CTimed timePrep( g_CollagePrepTime );
+    int posterizeLevel;
+    ColorizationData cd;
+};
 
-    if ( 0.0 == aspectRatio )
-        aspectRatio = 1.0;
+bool g_CacheColorizations = false;
+std::mutex g_mtxColorizations;
+unordered_map<wstring, unique_ptr<CachedColorization>> g_Colorizations;
 
-    CPathArray pathArray;
-    WCHAR * pwcDot = wcsrchr( pwcInput, L'.' );
-    if ( pwcDot && !wcsicmp( pwcDot, L".txt" ) )
+ColorizationData * GetColorization( WCHAR const * parg, ColorizationData & cd, int & posterizeLevel )
+{
+    if ( !g_CacheColorizations )
     {
-        FILE * fp = _wfopen( pwcInput, L"r" );
-        if ( !fp )
-        {
-            printf( "can't open input file %ws\n", pwcInput );
-            exit( 0 );
-        }
-
-        char acPath[ MAX_PATH ];
-        while ( fgets( acPath, sizeof( acPath ), fp ) )
-        {
-            char * peol = strchr( acPath, '\r' );
-            if ( peol )
-                *peol = 0;
-            peol = strchr( acPath, '\n' );
-            if ( peol )
-                *peol = 0;
+        ParseColorization( parg, cd, posterizeLevel );
+        PrepareColorization( cd );
+        return &cd;
+    }
 
-            if ( 0 != acPath[ 0 ] )
-                pathArray.Add( acPath );
-        }
+    wstring key( parg );
+    WCHAR const * semi = wcschr( parg, L';' );
+    WIN32_FILE_ATTRIBUTE_DATA fad;
 
-        fclose( fp );
+    if ( semi && GetFileAttributesEx( semi + 1, GetFileExInfoStandard, &fad ) )
+    {
+        WCHAR awcStamp[ 64 ];
+        swprintf_s( awcStamp, _countof( awcStamp ), L"|%lu:%lu|%lu:%lu", fad.nFileSizeHigh, fad.nFileSizeLow,
+                    fad.ftLastWriteTime.dwHighDateTime, fad.ftLastWriteTime.dwLowDateTime );
+        key += awcStamp;
     }
-    else
+
+    lock_guard<mutex> lock( g_mtxColorizations );
+
+    auto it = g_Colorizations.find( key );
+    if ( it == g_Colorizations.end() )
     {
-        WCHAR awcPath[ MAX_PATH + 1 ];
-        WCHAR awcSpec[ MAX_PATH + 1 ];
-        
-        WCHAR * pwcSlash = wcsrchr( pwcInput, L'\\' );
-        
-        if ( NULL == pwcSlash )
-        {
-            wcscpy( awcSpec, pwcInput );
-            _wfullpath( awcPath, L".\\", sizeof awcPath / sizeof WCHAR );
-        }
-        else
-        {
-            wcscpy( awcSpec, pwcSlash + 1 );
-            *(pwcSlash + 1) = 0;
-            _wfullpath( awcPath, pwcInput, sizeof awcPath / sizeof WCHAR );
-        }
-        
-        tracer.Trace( "GenerateCollage: Path '%ws', File Specificaiton '%ws'\n", awcPath, awcSpec );
-    
-        CEnumFolder enumPaths( false, &pathArray, NULL, 0 );
-        enumPaths.Enumerate( awcPath, awcSpec );
+        unique_ptr<CachedColorization> entry( new CachedColorization() );
+        entry->posterizeLevel = 0;
+        ParseColorization( parg, entry->cd, entry->posterizeLevel );
+        PrepareColorization( entry->cd );
+        it = g_Colorizations.emplace( key, move( entry ) ).first;
     }
 
-    size_t fileCount = pathArray.Count();
-    printf( "files found: %zd\n", fileCount );
+    posterizeLevel = it->second->posterizeLevel;
+    return &it->second->cd;
+} //GetColorization
+
+// Calls Usage(), which doesn't return, if the arguments aren't valid
 
-    if ( 0 == fileCount )
+void ParseArguments( int argc, WCHAR * argv[], AppOptions & opt )
+{
+    for ( int a = 1; a < argc; a++ )
     {
-        printf( "no files found in input %ws\n", pwcInput );
-        return E_FAIL;
-    }
+        WCHAR const * parg = argv[ a ];
 
-    std::random_device rd;
-    std::mt19937 gen( rd() );
+        if ( ( L'-' == parg[0] && !IsStdio( parg ) ) || L'/' == parg[0] )
+        {
+            WCHAR p = tolower( parg[1] );
 
-    if ( randomizeCollage )
-        pathArray.Randomize();
-    else if ( collageSortByColor )
-        SortPathArrayByColor( pathArray );
+            if ( L'a' == p )
+            {
+                if ( L':' != parg[2] )
+                    Usage( "malformed argument -- expecting a :" );
 
-    vector<BitmapDimensions> dimensions( fileCount );
-    HRESULT hr = S_OK;
+                opt.aspectRatio = ParseAspectRatio( parg + 3 );
+            }
+            else if ( L'b' == p )
+                opt.gameBoy = true;
+            else if ( L'c' == p )
+            {
+                opt.generateCollage = true;
 
-    //for ( size_t i = 0; i < fileCount; i++ )
-    parallel_for( (size_t) 0, fileCount, [&] ( size_t i )
-    {
-        HRESULT hrDim = GetBitmapDimensions( pathArray[ i ].pwcPath, dimensions[ i ].width, dimensions[ i ].height );
+                if ( ':' == parg[ 2 ] && 0 != parg[ 3 ] )
+                {
+                    opt.collageMethod = _wtoi( parg + 3 );
 
-        if ( FAILED( hrDim ) )
-            hr = hrDim;
-    });
+                    if ( opt.collageMethod < 1 || opt.collageMethod > 4 )
+                        Usage( "collage method isn't valid" );
 
-    if ( FAILED( hr ) )
-    {
-        printf( "loading dimensions failed for one or more images\n" );
-        return hr;
-    }
+                    if ( 1 == opt.collageMethod )
+                    {
+                        WCHAR const * pwcColon1 = wcschr( parg + 4, ':' );
 
-    int minEdge = 1000000000;
-    int minDXEdge = minEdge;
-    int minDYEdge = minEdge;
-    vector<UINT> longEdges( fileCount );
+                        if ( 0 != pwcColon1 && ( 'c' == tolower( pwcColon1[ 1 ] ) ) )
+                            opt.collageSortByColor = true;
+                    }
+                    else if ( 2 == opt.collageMethod )
+                    {
+                        WCHAR const * pwcColon1 = wcschr( parg + 4, ':' );
+                        WCHAR const * pwcColon2 = ( 0 != pwcColon1 ) ? wcschr( pwcColon1 + 1, ':' ) : 0;
+                        WCHAR const * pwcColon3 = ( 0 != pwcColon2 ) ? wcschr( pwcColon2 + 1, ':' ) : 0;
 
-    for ( size_t i = 0; i < fileCount; i++ )
-    {
-        longEdges[i] = __max( dimensions[i].height, dimensions[i].width );
+                        if ( 0 != pwcColon1 )
+                            opt.collageColumns = _wtoi( pwcColon1 + 1 );
 
-        if ( longEdges[i] < minEdge )
-            minEdge = longEdges[i];
+                        if ( 0 != pwcColon2 )
+                            opt.collageSpacing = _wtoi( pwcColon2 + 1 );
 
-        if ( dimensions[i].width < minDXEdge )
-            minDXEdge = dimensions[i].width;
+                        if ( 0 != pwcColon3 )
+                        {
+                            for ( const WCHAR * pwcA = pwcColon3 + 1; *pwcA; pwcA++ )
+                            {
+                                if ( 'T' == *pwcA )
+                                    opt.collageSortByAspect = true;
+                                else if ( 't' == *pwcA )
+                                    opt.collageSortByAspect = false;
+                                else if ( 'S' == *pwcA )
+                                    opt.collageSpaced = true;
+                                else if ( 's' == *pwcA )
+                                    opt.collageSpaced = false;
+                                else
+                                    Usage( "invalid collage A argument" );
+                            }
+                        }
 
-        if ( dimensions[i].height < minDYEdge )
-            minDYEdge = dimensions[i].height;
-    }
+                        if ( opt.collageColumns < 1 || opt.collageColumns > 100 )
+                            Usage( "invalid collage column count" );
 
-    if ( 0 == minEdge )
-    {
-        printf( "need a non-0-sized bitmap" );
-        return E_FAIL;
-    }
+                        if ( opt.collageSpacing < 0 || opt.collageSpacing > 100 )
+                            Usage( "invalid collage spacing" );
+                    }
+                    else if ( 3 == opt.collageMethod )
+                    {
+                        WCHAR const * pwcColon1 = wcschr( parg + 4, ':' );
 
-    bool allSameAspect = true;
+                        if ( 0 != pwcColon1 )
+                            opt.collageSpacing = _wtoi( pwcColon1 + 1 );
 
-    // Check if the aspect ratio of all images is roughly the same
+                        if ( opt.collageSpacing < 0 || opt.collageSpacing > 100 )
+                            Usage( "invalid collage spacing" );
+                    }
+                    else if ( 4 == opt.collageMethod )
+                    {
+                        WCHAR const * pwcColon1 = wcschr( parg + 4, ':' );
+                        WCHAR const * pwcColon2 = ( 0 != pwcColon1 ) ? wcschr( pwcColon1 + 1, ':' ) : 0;
 
-    double aspect = 0.0;
-    for ( size_t i = 0; i < fileCount; i++ )
-    {
-        double a = (double) dimensions[i].width / (double) dimensions[i].height;
+                        if ( 0 != pwcColon1 )
+                            opt.atlasPageSize = _wtoi( pwcColon1 + 1 );
 
-        if ( SameDouble( aspect, 0.0 ) )
-            aspect = a;
-        else
-        {
-            if ( !SameDouble( a, aspect ) )
+                        if ( 0 != pwcColon2 )
+                            opt.collageSpacing = _wtoi( pwcColon2 + 1 );
+
+                        if ( opt.atlasPageSize < 16 || opt.atlasPageSize > 32768 )
+                            Usage( "invalid atlas page size" );
+
+                        if ( opt.collageSpacing < 0 || opt.collageSpacing > 100 )
+                            Usage( "invalid collage spacing" );
+                    }
+                }
+            }
+            else if ( L'd' == p )
             {
-                allSameAspect = false;
-                break;
+                opt.daemonMode = true;
+
+                if ( L':' == parg[2] && 0 != parg[3] )
+                    wcscpy_s( opt.awcPipeName, _countof( opt.awcPipeName ), parg + 3 );
+                else if ( 0 != parg[2] )
+                    Usage( "malformed argument -- expecting a :<pipename> or nothing" );
             }
-        }
-    }
+            else if ( L'e' == p )
+            {
+                opt.batchMode = true;
 
-    // by default, the output is limited by the lowest-resolution input image. This relaxes that by 2x
+                if ( L':' == parg[2] )
+                {
+                    opt.batchInFlight = _wtoi( parg + 3 );
 
-    if ( 1.0 != expandCollageImages )
-    {
-        minDYEdge = (int) ( expandCollageImages * (float) minDYEdge );
-        minDXEdge = (int) ( expandCollageImages * (float) minDXEdge );
-        minEdge   = (int) ( expandCollageImages * (float) minEdge );
-    }
+                    if ( opt.batchInFlight < 1 || opt.batchInFlight > 1024 )
+                        Usage( "batch in-flight count must be in the range 1..1024" );
+                }
+                else if ( 0 != parg[2] )
+                    Usage( "malformed argument -- expecting a : or nothing" );
+            }
+            else if ( L'f' == p )
+            {
+                if ( L':' != parg[2] )
+                    Usage( "malformed argument -- expecting a :" );
 
-    tracer.Trace( "GenerateCollage: minEdge %d minDXEdge %d, min DYEdge %d, all same aspect: %d\n", minEdge, minDXEdge, minDYEdge, allSameAspect );
+               int parsed = swscanf_s( parg + 3, L"%x", & opt.fillColor );
 
-    if ( 1 == collageMethod )
-    {
-        // Try each permutation of stacking the images to find the one that most conforms to the target aspect ratio.
-    
-        int imagesWide = 0;
-        int imagesHigh = 0;
-        double bestAspect = 100000.0;
-        double desiredAspect = aspectRatio; // count across / count up and down
-    
-        for ( size_t x = 1; x <= fileCount; x++ )
-        {
-            for ( int y = 1; y <= fileCount; y++ )
+               if ( 0 == parsed )
+                   Usage( "can't parse fill color" );
+            }
+            else if ( L'g' == p )
+                opt.makeGreyscale = true;
+            else if ( L'h' == p )
+                opt.highQualityScaling = false;
+            else if ( L'i' == p )
+                opt.runtimeInfo = true;
+            else if ( L'j' == p )
+                opt.useEmbeddedPreviews = true;
+            else if ( L'k' == p )
             {
-                int capacity = x * y;
-                if ( capacity < fileCount )
-                    continue;
-    
-                int unused = capacity - fileCount;
-                if ( unused >= x || unused >= y )
-                    continue;
-    
-                double testAspect = 0;
-    
-                if ( allSameAspect )
-                    testAspect = ( (double) x * (double) minDXEdge ) / ( (double) y * (double) minDYEdge );
+                opt.useMetadataCache = true;
+
+                if ( L':' == parg[2] )
+                    _wfullpath( opt.awcMetadataCache, parg + 3, _countof( opt.awcMetadataCache ) );
+                else if ( 0 != parg[2] )
+                    Usage( "malformed argument -- expecting a : or nothing" );
+            }
+            else if ( L'l' == p )
+            {
+                if ( L':' != parg[2] )
+                    Usage( "malformed argument -- expecting a :" );
+
+                // A list of long edges, e.g. -l:256,512,1024, writes one output per size
+
+                opt.longEdges.clear();
+
+                for ( WCHAR const * pwc = parg + 3; ; pwc++ )
+                {
+                    int edge = _wtoi( pwc );
+
+                    if ( edge <= 0 )
+                    {
+                        printf( "long edge -l is invalid: %d\n", edge );
+                        Usage();
+                    }
+
+                    if ( opt.longEdges.end() == find( opt.longEdges.begin(), opt.longEdges.end(), edge ) )
+                        opt.longEdges.push_back( edge );
+
+                    pwc = wcschr( pwc, L',' );
+                    if ( !pwc )
+                        break;
+                }
+
+                sort( opt.longEdges.begin(), opt.longEdges.end(), greater<int>() );
+                opt.longEdge = opt.longEdges[ 0 ];
+            }
+            else if ( L'm' == p )
+            {
+                opt.useManifest = true;
+
+                if ( L':' == parg[2] )
+                    _wfullpath( opt.awcManifest, parg + 3, _countof( opt.awcManifest ) );
+                else if ( 0 != parg[2] )
+                    Usage( "malformed argument -- expecting a : or nothing" );
+            }
+            else if ( L'n' == p )
+                opt.namesAsCaptions = true;
+            else if ( L'o' == p )
+            {
+                if ( L':' != parg[2] )
+                    Usage( "malformed argument -- expecting a :" );
+
+                if ( IsStdio( parg + 3 ) )
+                    wcscpy_s( opt.awcOutput, _countof( opt.awcOutput ), parg + 3 );
                 else
-                    testAspect = ( (double) x * (double) minEdge ) / ( (double) y * (double) minEdge );
-    
-                double distance = fabs( desiredAspect - testAspect );
-                if ( distance < bestAspect )
+                    _wfullpath( opt.awcOutput, parg + 3, _countof( opt.awcOutput ) );
+            }
+            else if ( L'p' == p )
+            {
+                if ( L':' != parg[2] )
+                    Usage( "malformed argument -- expecting a :" );
+
+                opt.posterizeLevel = _wtoi( parg + 3 );
+                if ( opt.posterizeLevel < 1 || opt.posterizeLevel > 256 )
                 {
-                    bestAspect = distance;
-                    imagesWide = x;
-                    imagesHigh = y;
+                    printf( "invalid posterization level %d; must be 1..256\n", opt.posterizeLevel );
+                    Usage();
                 }
             }
-        }
-    
-        int stitchX = imagesWide * minEdge;
-        int stitchY = imagesHigh * minEdge;
-    
-        if ( allSameAspect )
-        {
-            stitchX = imagesWide * minDXEdge;
-            stitchY = imagesHigh * minDYEdge;
-        }
-    
-        // 2 billion is probably enough?
-        int maxLongestDimension = 2000000000;
-    
-        if ( 0 != longEdge )
-            maxLongestDimension = longEdge;
-    
-        // Note: the logic below may result in a dimension and/or aspect ratio that isn't exactly as requested
-        // by the caller since the dimensions must be a multiple of the individual image sizes.
-    
-        double dmaxLongestDimension = (double) maxLongestDimension;
-    
-        if ( stitchX > maxLongestDimension || stitchY > maxLongestDimension )
-        {
-            if ( allSameAspect )
+            else if ( L'q' == p )
+                opt.lowQualityOutput = true;
+            else if ( L'r' == p )
+                opt.randomizeCollage = true;
+            else if ( L's' == p )
             {
-                if ( minDYEdge > minDXEdge )
+                opt.showColors = true;
+
+                if ( L':' == parg[2] )
+                    opt.showColorCount = _wtoi( parg + 3 );
+
+                if ( opt.showColorCount < 0 || opt.showColorCount > 256 )
+                    Usage( "show color count must be in range 1..256" );
+            }
+            else if ( L't' == p )
+            {
+                if ( 0 != parg[2] )
+                    Usage( "unexpected characters after argument" );
+                opt.enableTracing = true;
+                opt.clearTraceFile = ( L'T' == parg[1] );
+            }
+            else if ( L'u' == p )
+            {
+                if ( L':' != parg[2] || 0 == parg[3] )
+                    Usage( "malformed argument -- expecting a :<folder>" );
+
+                _wfullpath( opt.awcThumbnailCache, parg + 3, _countof( opt.awcThumbnailCache ) );
+            }
+            else if ( L'v' == p )
+            {
+                if ( L':' == parg[2] )
                 {
-                    double dScale = ( dmaxLongestDimension / (double) imagesHigh ) / (double) minDYEdge;
-                    minDXEdge = (int) round( dScale * (double) minDXEdge );
-                    minDYEdge = maxLongestDimension / imagesHigh;
-                    stitchY = maxLongestDimension;
-                    stitchX = imagesWide * minDXEdge;
+                    if ( !iswdigit( parg[3] ) )
+                        Usage( "frame -v:N must be 0 or more" );
+
+                    opt.inputFrame = _wtoi( parg + 3 );
+                    opt.allFrames = false;
                 }
+                else if ( 0 != parg[2] )
+                    Usage( "malformed argument -- expecting a : or nothing" );
                 else
                 {
-                    double dScale = ( dmaxLongestDimension / (double) imagesWide ) / (double) minDXEdge;
-                    minDYEdge = (int) round( dScale * (double) minDYEdge );
-                    minDXEdge = maxLongestDimension / imagesWide;
-                    stitchX = maxLongestDimension;
-                    stitchY = imagesHigh * minDYEdge;
+                    opt.allFrames = true;
+                    opt.inputFrame = -1;
+                }
+            }
+            else if ( L'w' == p )
+            {
+                if ( L':' != parg[2] )
+                    Usage( "malformed argument -- expecting a :" );
+
+                opt.waveMethod = _wtoi( parg + 3 );
+                if ( opt.waveMethod < 0 || opt.waveMethod > 10 )
+                {
+                    printf( "invalid wave method %d\n", opt.waveMethod );
+                    Usage();
                 }
             }
-            else
+            else if ( L'x' == p )
             {
-                if ( stitchX > stitchY )
-                    minEdge = maxLongestDimension / imagesWide;
-                else
-                    minEdge = maxLongestDimension / imagesHigh;
-    
-                stitchX = minEdge * imagesWide;
-                stitchY = minEdge * imagesHigh;
+                if ( ':' != parg[2] )
+                {
+                    printf( "colon expected with /x:f\n" );
+                    Usage();
+                }
+
+                opt.expandCollageImages = _wtof( parg + 3 );
+
+                if ( opt.expandCollageImages < 1.0 || opt.expandCollageImages > 10.0 )
+                {
+                    printf( "value for /x:f must be in the range of 1.0 to 10.0, found %lf\n", opt.expandCollageImages );
+                    Usage();
+                }
             }
+            else if ( L'z' == p )
+                opt.pwcColorization = parg;
         }
-    
-        if ( !allSameAspect )
+        else if ( 0 != opt.awcInput[0] )
+            Usage( "input file specified twice" );
+        else if ( IsStdio( parg ) )
+            wcscpy_s( opt.awcInput, _countof( opt.awcInput ), parg );
+        else if ( CMetadataIndex::FindQuery( parg ) )
         {
-            minDXEdge = minEdge;
-            minDYEdge = minEdge;
-        }
-    
-        timePrep.Complete();
-    
-        printf( "source images%s all have the same aspect ratio\n", allSameAspect ? "" : " don't" );
-        printf( "collage will be %d by %d, each element %d by %d, and %d by %d images\n", stitchX, stitchY, minDXEdge, minDYEdge, imagesWide, imagesHigh );
-    
-        return StitchImages1( pwcOutput, pathArray, dimensions, imagesWide, imagesHigh, minDXEdge, minDYEdge, stitchX, stitchY,
-                              fillColor, 0, posterizeLevel, colorizationData, makeGreyscale, outputMimetype,
-                              lowQualityOutput, highQualityScaling, namesAsCaptions );
-    }
+            // Only the index path is a path; the query may contain slashes
 
-    if ( 2 == collageMethod )
-    {
-        // Method 2 means a fixed # of columns. Each image is made the same width.
+            WCHAR const * pwcQuery = CMetadataIndex::FindQuery( parg );
+            wstring indexPath( parg, pwcQuery - parg );
+            _wfullpath( opt.awcInput, indexPath.c_str(), _countof( opt.awcInput ) );
 
-        const int columns = __min( fileCount, collageColumns );
-        const int targetWidth = ( 0 == longEdge ) ? 4096 : longEdge;
-        const int spacing = collageSpacing; // # of fillColor pixels between images. Not applied to the outside border of the collage
+            if ( wcslen( opt.awcInput ) + wcslen( pwcQuery ) >= _countof( opt.awcInput ) )
+                Usage( "index query is too long" );
 
-        int imageWidth = ( targetWidth - ( ( columns - 1 ) * spacing ) ) / columns;
-        int fullWidth = ( imageWidth * columns ) + ( ( columns - 1 ) * spacing );
-        vector<int> columnsToUse( fileCount );
-        vector<int> yOffsets( fileCount );
-        vector<int> bottoms( fileCount );
+            wcscat_s( opt.awcInput, _countof( opt.awcInput ), pwcQuery );
+        }
+        else
+            _wfullpath( opt.awcInput, parg, _countof( opt.awcInput ) );
+    }
 
-        // sort by aspect ratio so the tallest images are placed first. This helps minimize one column being much taller than the others
+    if ( opt.pwcColorization )
+        opt.colorizationData = GetColorization( opt.pwcColorization, opt.cd, opt.posterizeLevel );
 
-        vector<int> sortedIndexes( fileCount );
-        for ( int i = 0; i < fileCount; i++ )
-            sortedIndexes[ i ] = i;
+    // The daemon gets inputs and outputs with each request
 
-        g_pdimensions = &dimensions;
-        qsort( sortedIndexes.data(), fileCount, sizeof( int ), aspectCompare );
+    if ( opt.daemonMode )
+        return;
 
-        // Lay out the images
+    // Saving a palette needs just the -z argument
 
-        for ( int i = 0; i < fileCount; i++ )
-        {
-            int si = sortedIndexes[ i ];
-            int columnToUse = 0;
-            int highestBottom = INT_MAX;
-            for ( int c = 0; c < columns; c++ )
-            {
-                if ( bottoms[ c ] < highestBottom )
-                {
-                    highestBottom = bottoms[ c ];
-                    columnToUse = c;
-                }
-            }
-    
-            int imageHeight = round( (double) imageWidth / (double) dimensions[ si ].width * (double) dimensions[ si ].height );
-    
-            yOffsets[ si ] = bottoms[ columnToUse ];
-            bottoms[ columnToUse ] += ( spacing + imageHeight );
-            columnsToUse[ si ] = columnToUse;
-        }
+    if ( CPaletteFile::IsPaletteFile( opt.awcOutput ) )
+    {
+        if ( !opt.colorizationData )
+            Usage( "a .icpal output requires a -z argument for the palette to save" );
 
-        // find the tallest column -- that's the collage height
+        return;
+    }
 
-        int fullHeight = 0;
-        for ( int c = 0; c < columns; c++ )
-        {
-            //printf( "height of column %d: %d\n", c, bottoms[ c ] );
-            if ( bottoms[ c ] > fullHeight )
-                fullHeight = bottoms[ c ];
-        }
+    if ( 0 == opt.awcInput[0] || ( 0 == opt.awcOutput[0] && !opt.showColors ) )
+        Usage( "input and/or output files not specified" );
 
-        fullHeight -= spacing;
+    if ( opt.waveMethod > 0 && opt.generateCollage )
+        Usage( "can't generate wav files when generating a collage" );
 
-        // randomize the vertical position of photos within each column.
+    if ( opt.batchMode )
+    {
+        if ( opt.generateCollage || opt.showColors )
+            Usage( "batch mode can't be used with collages or showing colors" );
 
-        if ( !collageSortByAspect )
-        {
-            for ( int c = 0; c < columns; c++ )
-            {
-                // find the indexes of photos in this column
-    
-                vector<int> randIndex;
-                for ( int i = 0; i < fileCount; i++ )
-                {
-                    int si = sortedIndexes[ i ];
-                    if ( columnsToUse[ si ] == c )
-                        randIndex.push_back( si );
-                }
+        if ( 0 == wcschr( opt.awcOutput, L'*' ) )
+            Usage( "batch mode requires an output pattern with a *, e.g. /o:d:\\out\\*.jpg" );
+    }
 
-                Randomize( randIndex, gen );
+    if ( opt.longEdges.size() > 1 )
+    {
+        if ( opt.generateCollage || opt.batchMode || opt.showColors || opt.gameBoy || opt.waveMethod > 0 )
+            Usage( "a list of long edges can't be used with collages, batch mode, showing colors, -b, or -w" );
 
-                // even out the spacing
+        if ( 0 == wcschr( opt.awcOutput, L'*' ) || IsStdio( opt.awcOutput ) )
+            Usage( "a list of long edges requires an output pattern with a *, e.g. /o:photo_*.jpg" );
+    }
 
-                int spaceCount = randIndex.size() - 1;
-                int extraSpace = fullHeight - ( spaceCount * spacing );
-                for ( int i = 0; i < randIndex.size(); i++ )
-                {
-                    int ri = randIndex[ i ];
-                    int imageHeight = round( (double) imageWidth / (double) dimensions[ ri ].width * (double) dimensions[ ri ].height );
-                    extraSpace -= imageHeight;
-                }
+    if ( opt.useManifest && !opt.generateCollage && !opt.batchMode )
+        Usage( "-m only applies to collages and batch mode" );
 
-                int extraSpaceBetween = collageSpaced ? spaceCount ? ( extraSpace / spaceCount ) : 0 : 0;
-                int extraSpaceLast = collageSpaced ? spaceCount ? ( extraSpace % spaceCount ) : 0 : 0;
-                //printf( "extraspace %d, between %d, last %d, spaceCount %d\n", extraSpace, extraSpaceBetween, extraSpaceLast, spaceCount );
+    if ( IsStdio( opt.awcInput ) && ( opt.generateCollage || opt.batchMode ) )
+        Usage( "collages and batch mode need input files, not stdin" );
 
-                // recompute the y offset of each photo in the column
-    
-                int currenty = 0;
-                for ( int i = 0; i < randIndex.size(); i++ )
-                {
-                    int ri = randIndex[ i ];
+    bool buildIndex = CMetadataIndex::IsIndexFile( opt.awcOutput );
 
-                    yOffsets[ ri ] = currenty;
-                    int imageHeight = round( (double) imageWidth / (double) dimensions[ ri ].width * (double) dimensions[ ri ].height );
-                    currenty += ( spacing + imageHeight + extraSpaceBetween + ( ( i == spaceCount - 1 ) ? extraSpaceLast : 0 ) );
-                }
-            }
-        }
+    if ( buildIndex && ( opt.generateCollage || opt.batchMode || opt.showColors || IsStdio( opt.awcInput ) || CMetadataIndex::FindQuery( opt.awcInput ) ) )
+        Usage( "a .icindex output is built from input files, not stdin, another index, collages, batch mode, or showing colors" );
 
-        timePrep.Complete();
+    if ( CMetadataIndex::FindQuery( opt.awcInput ) && !opt.generateCollage && !opt.batchMode )
+        Usage( "an index query selects the inputs for a collage or batch mode" );
 
-        //printf( "columns %d, target width %d, collage width %d, collage height %d, imageWidth %d\n", columns, targetWidth, fullWidth, fullHeight, imageWidth );
+    if ( IsStdio( opt.awcOutput ) && ( opt.batchMode || opt.waveMethod > 0 || ( opt.generateCollage && 4 == opt.collageMethod ) ) )
+        Usage( "batch mode, wav files, and atlases can't be written to stdout" );
 
-        return StitchImages2( pwcOutput, pathArray, sortedIndexes, columnsToUse, yOffsets, dimensions, columns,
-                              fullHeight, fullWidth, spacing, imageWidth, fillColor, posterizeLevel, colorizationData,
-                              makeGreyscale, outputMimetype, lowQualityOutput, highQualityScaling,
-                              namesAsCaptions );
+    if ( !opt.generateCollage && !opt.batchMode && !buildIndex && !IsStdio( opt.awcInput ) )
+    {
+        DWORD attr = GetFileAttributesW( opt.awcInput );
+        if ( INVALID_FILE_ATTRIBUTES == attr )
+        {
+            printf( "can't open file %ws\n", opt.awcInput );
+            Usage();
+        }
     }
 
-    return E_FAIL;
-} //GenerateCollage
+    // Frames are named path|N and path|* from here on; see FindFrameSuffix()
 
-HRESULT ConvertImage( WCHAR const * input, WCHAR const * output, int longEdge, int waveMethod, int posterizeLevel, ColorizationData * colorizationData,
-                      bool makeGreyscale, double aspectRatio, int fillColor, WCHAR const * outputMimetype, bool lowQualityOutput, bool gameBoy,
-                      bool highQualityScaling )
-{
-    ComPtr<IWICBitmapSource> source;
-    ComPtr<IWICBitmapFrameDecode> frame;
-    bool force24bppBGR = wcscmp( outputMimetype, L"image/tiff" );
+    if ( opt.allFrames || opt.inputFrame >= 0 )
+    {
+        DWORD attr = GetFileAttributesW( opt.awcInput );
+        if ( IsStdio( opt.awcInput ) || CMetadataIndex::FindQuery( opt.awcInput ) || buildIndex ||
+             INVALID_FILE_ATTRIBUTES == attr || ( attr & FILE_ATTRIBUTE_DIRECTORY ) )
+            Usage( "-v needs a single input file, not stdin, a folder, wildcards, or an index" );
 
-    HRESULT hr = LoadWICBitmap( input, source, frame, force24bppBGR );
-    if ( SUCCEEDED( hr ) )
-        hr = WriteWICBitmap( output, source, frame, longEdge, waveMethod, posterizeLevel, colorizationData,
-                             makeGreyscale, aspectRatio, fillColor, outputMimetype, lowQualityOutput, gameBoy, highQualityScaling );
-    
-    frame.Reset();
-    source.Reset();
-    return hr;
-} //ConvertImage
+        if ( opt.allFrames && !opt.generateCollage && !opt.batchMode )
+            Usage( "-v needs -c for a collage of the frames or -e for one output per frame; use -v:N for just one" );
 
-void Usage( char * message = 0 )
-{
-    if ( message )
-        printf( "%s\n", message );
+        if ( opt.inputFrame >= 0 && ( opt.generateCollage || opt.batchMode ) )
+            Usage( "-v:N converts one frame; use -v for a collage or batch of all of them" );
 
-    printf( "usage: ic <input> /o:<filename>\n" );
-    printf( "  Image Convert\n" );
-    printf( "  arguments: <input>           The input image filename. Or for a collage a path specifier or .txt file with image paths\n" );
-    printf( "             -a:<aspectratio>  Aspect ratio of output (widthXheight) (e.g. 3x2, 3x4, 16x9, 1x1, 8.51x3.14). Default 1x1 for collages.\n" );
-    printf( "             -b                Converts an image into a Game Boy Camera format: 128x112 and 4 shades of grey. Center crop if needed.\n" );
-    printf( "             -c                Generates a collage using method 1 (pack images + make square if not all the same aspect ratio.\n" );
-    printf( "             -c:1:C            Same as -c -- collage using method 1, but sorts images based on primary color\n" );
-    printf( "             -c:2:C:S:A        Generate a collage using method 2 with C fixed-width columns and S pixel spacing. A arrangement (see below)\n" );
-    printf( "             -f:<fillcolor>    Color fill for empty space. ARGB or RGB in hex. Default is black.\n" );
-    printf( "             -g                Greyscale the output image. Does not apply to the fillcolor.\n" );
-    printf( "             -h                Turn off HighQualityCubic scaling and use NearestNeighbor.\n" );
-    printf( "             -i                Show CPU and RAM usage.\n" );
-    printf( "             -l:<longedge>     Pixel count for the long edge of the output photo or for /c:2 the collage width.\n" );
-    printf( "             -n                show file Names as cations in collages.\n" );
-    printf( "             -o:<filename>     The output filename. Required argument. File will contain no exif info like GPS location.\n" );
-    printf( "             -p:x              Posterization level. 1..256 inclusive, Default 0 means none. # colors per channel.\n" );
-    printf( "             -q                Sacrifice image quality to produce a smaller JPG output file (4:2:2 not 4:4:4, 60%% not 100%%).\n" );
-    printf( "             -r                Randomize the layout of images in a collage.\n" );
-    printf( "             -s:x              Clusters color groups and shows most common X colors, Default is 64, 1-256 valid.\n" );
-    printf( "             -t                Enable debug tracing to ic.txt. Use -T to start with a fresh ic.txt\n" );
-    printf( "             -w:x              Create a WAV file based on the image using methods 1..10. (prototype)\n" );
-    printf( "             -x:f              Expand the smallest source image in a collage by up to f times (1.0-10.0). Default is 1.0.\n" );
-    printf( "             -zc:x             Colorization. Works like posterization (1-256), but maps to a built-in color table.\n" );
-    printf( "             -zc:x,color1,...  Specify x colors that should be used. See example below.\n" );
-    printf( "             -zc:x;filename    Use centroids from x color clusters taken from the input file.\n" );
-    printf( "             -zb               Same as -zc, but maps colors by matching brightness instead of color.\n" );
-    printf( "             -zs               Same as -zc, but maps colors by matching saturation instead of color.\n" );
-    printf( "             -zh               Same as -zc, but maps colors by matching hue instead of color.\n" );
-    printf( "             -zg               Same as -zc, but maps colors by matching brightness gradient instead of color.\n" );
-    printf( "  sample usage: (arguments can use - or /)\n" );
-    printf( "    ic picture.jpg /o:newpicture.jpg /l:800\n" );
-    printf( "    ic picture.jpg /p o:newpicture.jpg /l:800\n" );
-    printf( "    ic picture.jpg /o:c:\\folder\\newpicture.jpg /l:800 /a:1x1\n" );
-    printf( "    ic tsuki.tif /o:newpicture.jpg /l:300 /a:1x4 /f:0x003300\n" );
-    printf( "    ic miku.tif /o:newpicture.tif /l:300 /a:1x4 /f:2211\n" );
-    printf( "    ic phoebe.jpg /o:phoebe_grey.tif /l:3000 /g\n" );
-    printf( "    ic julien.jpg /o:julien_grey_posterized.tif /l:3000 /g /p:2 /w:1\n" );
-    printf( "    ic picture.jpg /o:newpicture.jpg /l:2000 /a:5.2x3.9\n" );
-    printf( "    ic *.jpg /c /o:c:\\collage.jpg /l:2000 /a:5x3 /f:0xff00aa88\n" );
-    printf( "    ic images_to_use.txt /c /o:c:\\collage.jpg /l:2000 /a:5x3 /f:0xff00aa88\n" );
-    printf( "    ic d:\\pictures\\mitski\\*.jpg /c /o:mitski_collage.jpg /l:10000 /a:4x5\n" );
-    printf( "    ic cheekface.jpg /s\n" );
-    printf( "    ic cheekface.jpg /s:16 /o:top_16_colors.png\n" );
-    printf( "    ic cheekface.jpg /o:cheeckface_colorized.png /zc:3\n" );
-    printf( "    ic cheekface.jpg /o:cheeckface_posterized.png /p:8 /g\n" );
-    printf( "    ic cfc.jpg /o:out_cfc.png /zc:4,0xfaa616,0x697e94,0xb09e59,0xfdfbe5\n" );
-    printf( "    ic cfc.jpg /o:out_cfc.png /zc:16;inputcolors.jpg\n" );
-    printf( "    ic cfc.jpg /o:out_cfc.png /zb:64;inputcolors.jpg\n" );
-    printf( "    ic cfc.jpg /o:out_cfc.png /zh:8;inputcolors.jpg\n" );
-    printf( "    ic /c:2:6:10:S /r /l:4096 d:\\treefort_pics\\*.jpg /o:treefort.png\n" );
-    printf( "    ic /c:2:6:10:s /r /l:4096 d:\\treefort_pics\\*.jpg /o:treefort.png\n" );
-    printf( "    ic /c:2:6 /o:tf2.png z:\\tf2\\*.jpg /f:eb6145 /l:8192\n" );
-    printf( "    ic /i z:\\jbrekkie\\*.jpg /o:michelle_8.png /c:2:5:4:S /zc:8,0xdd9f1a,0xbe812e,0xe3c871,0xe0b74b,0xeee1c1,0xc69948,0x3a3732,0x82543d /f:0xdd9f1a /g\n" );
-    printf( "  notes:    - -g only applies to the image, not fillcolor. Use /f with identical rgb values for greyscale fills.\n" );
-    printf( "            - Exif data is stripped for your protection.\n" );
-    printf( "            - fillcolor is always hex, may or may not start with 0x.\n" );
-    printf( "            - Both -a and -l are aspirational for collages. Aspect ratio and long edge may change to accomodate content.\n" );
-    printf( "            - If a precise collage aspect ratio or long edge are required, run the app twice; on a single image it's exact.\n" );
-    printf( "            - Writes as high a quality of JPG as it can: 1.0 quality and 4:4:4\n" );
-    printf( "            - <input> can be any WIC-compatible format: heic, tif, png, bmp, cr2, jpg, etc.\n" );
-    printf( "            - Output file is always 24bpp unless both input and output are tif and input is 48bpp, which results in 48bpp.\n" );
-    printf( "            - Output file type is inferred from the extension specified. JPG is assumed if not obvious.\n" );
-    printf( "            - If an output file is specified with /s, a 128-pixel wide image is created with strips for each color.\n" );
-    printf( "            -    collage method 1: -- packs all images of the same aspect ratio or uses squares otherwise.\n" );
-    printf( "            -                      -- attempts to match /a: aspect ratio.\n" );
-    printf( "            -    collage method 2: -- adds spacing between images and creates identical-width columns.\n" );
-    printf( "            -                      -- The longedge argument applies to the width, which may be shorter than the height.\n" );
-    printf( "            -                      -- defaults are 3 columns, 6 pixels of spacing, and don't sort by aspect ratio (-c:2:3:6:n).\n" );
-    printf( "            -                      -- doesn't attempt to match /a: aspect ratio since a column count is specified.\n" );
-    printf( "            -                      -- /A arrangement arguments - uppercase yes, lowercase no\n" );
-    printf( "            -                         T (tallest items on top) / t (random arrangement (default))\n" );
-    printf( "            -                         S (space images out (default)) / s (force consistent spacing and perhaps leave blank space at bottom\n" );
-    exit( 0 );
-} //Usage
+        size_t len = wcslen( opt.awcInput );
+        if ( len + 16 >= _countof( opt.awcInput ) )
+            Usage( "input path is too long for -v" );
 
-double ParseAspectRatio( WCHAR const * p )
-{
-    WCHAR const * px = wcschr( p, L'x' );
-    if ( ( 0 == px ) || ( wcslen( p ) > 20 ) )
-    {
-        printf( "aspect ratio specification is invalid: %ws\n", p );
-        Usage();
+        if ( opt.allFrames )
+            wcscat_s( opt.awcInput, _countof( opt.awcInput ), L"|*" );
+        else
+            swprintf_s( opt.awcInput + len, _countof( opt.awcInput ) - len, L"|%d", opt.inputFrame );
     }
+} //ParseArguments
 
-    WCHAR awc[ 21 ];
-    wcscpy( awc, p );
-    awc[ px - p ] = 0;
-
-    double w = _wtof( awc );
-    double h = _wtof( awc + ( px - p ) + 1 );
+// Changing the app can change its output, so outputs recorded in a manifest by a different build are rebuilt
 
-    if ( w <= 0.0 || h <= 0.0 )
+static const char * g_BuildStamp = __DATE__ " " __TIME__;
+
+// Digest of the build and every option that can affect the pixels written. Inputs and outputs aren't included;
+// the manifest keys on outputs and digests inputs separately.
+
+unsigned long long OptionsDigest( AppOptions const & opt )
+{
+    CBuildManifest::CDigest d;
+
+    d.Add( g_BuildStamp, strlen( g_BuildStamp ) );
+    d.Add( opt.longEdges.size() );
+    d.Add( opt.longEdges.data(), opt.longEdges.size() * sizeof( int ) );
+    d.Add( opt.longEdge );
+    d.Add( opt.aspectRatio );
+    d.Add( opt.fillColor );
+    d.Add( opt.posterizeLevel );
+    d.Add( opt.waveMethod );
+    d.Add( opt.makeGreyscale );
+    d.Add( opt.lowQualityOutput );
+    d.Add( opt.gameBoy );
+    d.Add( opt.highQualityScaling );
+    d.Add( opt.useEmbeddedPreviews );
+    d.Add( opt.generateCollage );
+    d.Add( opt.collageMethod );
+    d.Add( opt.collageColumns );
+    d.Add( opt.collageSpacing );
+    d.Add( opt.atlasPageSize );
+    d.Add( opt.collageSortByAspect );
+    d.Add( opt.collageSortByColor );
+    d.Add( opt.collageSpaced );
+    d.Add( opt.namesAsCaptions );
+    d.Add( opt.randomizeCollage );
+    d.Add( opt.expandCollageImages );
+
+    // The colorization palette rather than the -z argument, since a palette file's contents can change
+
+    if ( opt.colorizationData )
     {
-        printf( "aspect ratio %lf by %lf is invalid\n", w, h );
-        Usage();
+        d.Add( opt.colorizationData->mapping );
+        d.Add( opt.colorizationData->bgrdata.data(), opt.colorizationData->bgrdata.size() * sizeof( DWORD ) );
     }
 
-    tracer.Trace( "aspect ratio %ws: w %lf, h %lf, a %lf\n", p, w, h, w / h );
+    return d.Get();
+} //OptionsDigest
 
-    return w / h;
-} //ParseAspectRatio
+// The manifest digest for a collage: the options plus every member. Returns false if a member can't be found.
 
-void AppendLongLong( char *pc, long long n )
+bool CollageDigest( WCHAR * pwcInput, unsigned long long & digest )
 {
-    if ( n < 0 )
+    CPathArray pathArray;
+    if ( FAILED( FindInputPaths( pwcInput, pathArray ) ) || 0 == pathArray.Count() )
+        return false;
+
+    vector<unsigned long long> inputDigests( pathArray.Count() );
+
+    for ( size_t i = 0; i < pathArray.Count(); i++ )
+        if ( !InputDigest( pathArray[ i ].pwcPath, inputDigests[ i ] ) )
+            return false;
+
+    digest = g_pManifest->JobDigest( inputDigests );
+    return true;
+} //CollageDigest
+
+HRESULT RunJob( AppOptions & opt )
+{
+    HRESULT hr = S_OK;
+
+    const WCHAR * outputMimetype = opt.awcOutput[0] ? InferOutputType( PathFindExtension( opt.awcOutput ) ) : 0;
+
+    tracer.Trace( "input: %ws\n", opt.awcInput );
+    tracer.Trace( "output: %ws\n", opt.awcOutput );
+    tracer.Trace( "output type: %ws\n", outputMimetype );
+    tracer.Trace( "long edge: %d\n", opt.longEdge );
+
+    if ( CPaletteFile::IsPaletteFile( opt.awcOutput ) )
     {
-        *pc++ = '-';
-        *pc = 0;
-        AppendLongLong( pc, -n );
+        ColorizationData & cd = *opt.colorizationData;
+        hr = CPaletteFile::Save( opt.awcOutput, cd.mapping, cd.bgrdata, cd.hsvdata, cd.kdtree.get() );
+        if ( SUCCEEDED( hr ) )
+            printf( "palette of %zd colors written successfully: %ws\n", cd.bgrdata.size(), opt.awcOutput );
     }
+    else if ( CMetadataIndex::IsIndexFile( opt.awcOutput ) )
+        hr = BuildIndex( opt.awcInput, opt.awcOutput );
+    else if ( opt.showColors )
+    {
+        opt.cd.bgrdata.clear();
+        hr = ShowColors( opt.awcInput, opt.showColorCount, opt.cd.bgrdata, true, opt.awcOutput[0] ? opt.awcOutput : 0, outputMimetype );
+    }
+    else if ( opt.generateCollage )
+    {
+        unsigned long long digest = 0;
+        vector<wstring> companionOutputs; // other files the job writes, like atlas pages and the atlas index
 
-    if ( n < 1000 )
+        if ( g_pManifest && CollageDigest( opt.awcInput, digest ) && g_pManifest->IsCurrent( opt.awcOutput, digest ) )
+        {
+            printf( "collage is up to date: %ws\n", opt.awcOutput );
+            return S_OK;
+        }
+
+        hr = GenerateCollage( opt.collageMethod, opt.awcInput, opt.awcOutput, opt.longEdge, opt.posterizeLevel, opt.colorizationData,
+                              opt.makeGreyscale, opt.collageColumns, opt.collageSpacing, opt.collageSortByColor, opt.collageSortByAspect,
+                              opt.collageSpaced, opt.aspectRatio, opt.fillColor, outputMimetype, opt.randomizeCollage, opt.lowQualityOutput,
+                              opt.highQualityScaling, opt.namesAsCaptions, opt.expandCollageImages, opt.atlasPageSize, companionOutputs );
+        if ( SUCCEEDED( hr ) )
+        {
+            printf( "collage written successfully: %ws\n", opt.awcOutput );
+
+            if ( 0 != digest )
+                g_pManifest->Record( opt.awcOutput, digest, companionOutputs );
+        }
+        else if ( !IsStdio( opt.awcOutput ) )
+            DeleteFile( opt.awcOutput );
+    }
+    else if ( opt.batchMode )
+        hr = ConvertBatch( opt.awcInput, opt.awcOutput, opt.batchInFlight, opt.longEdge, opt.waveMethod, opt.posterizeLevel,
+                           opt.colorizationData, opt.makeGreyscale, opt.aspectRatio, opt.fillColor, outputMimetype,
+                           opt.lowQualityOutput, opt.gameBoy, opt.highQualityScaling );
+    else if ( opt.longEdges.size() > 1 )
+        hr = ConvertLadder( opt.awcInput, opt.awcOutput, opt.longEdges, opt.posterizeLevel, opt.colorizationData, opt.makeGreyscale,
+                            opt.aspectRatio, opt.fillColor, outputMimetype, opt.lowQualityOutput, opt.highQualityScaling );
+    else
     {
-        sprintf( pc, "%lld", n );
-        return;
+        hr = ConvertImage( opt.awcInput, opt.awcOutput, opt.longEdge, opt.waveMethod, opt.posterizeLevel, opt.colorizationData,
+                           opt.makeGreyscale, opt.aspectRatio, opt.fillColor, outputMimetype, opt.lowQualityOutput, opt.gameBoy,
+                           opt.highQualityScaling );
+        if ( SUCCEEDED( hr ) )
+            printf( "output written successfully: %ws\n", opt.awcOutput );
+        else
+        {
+            printf( "conversion of image failed with error %#x\n", hr );
+            if ( !IsStdio( opt.awcOutput ) )
+                DeleteFile( opt.awcOutput );
+        }
     }
 
-    AppendLongLong( pc, n / 1000 );
+    return hr;
+} //RunJob
 
-    pc += strlen( pc );
-    sprintf( pc, ",%03lld", n % 1000 );
-} //AppendLongLong
+// Daemon mode. Clients connect to \\.\pipe\<name> and write lines of UTF-8 text. Each line has the arguments
+// for one job, just as they'd be given on the command line. Jobs from all clients run concurrently and share
+// the WIC factory, the PPL scheduler, the caches, and colorization data. Each job gets a one-line reply:
+// "ok" or "error <hresult> <message>". A line with just "quit" stops the daemon once running jobs complete.
 
-void PrintStat( char const * pcName, long long n, int widthName = 20, int widthN = 13 )
+class CDaemonState
 {
-    // LLONG_MAX is 9,223,372,036,854,775,807. Add a negative sign and that's 26 characters.
+    private:
+        WCHAR awcPipe[ MAX_PATH ];
+        mutex mtx;
+        condition_variable cv;
+        int activeJobs;
+        bool quitting;
 
-    char acNum[ 40 ];
-    acNum[0] = 0;
-    AppendLongLong( acNum, n );
-    printf( "%-*s %*s\n", widthName, pcName, widthN, acNum );
-} //PrintStat
+    public:
+        CDaemonState() : activeJobs( 0 ), quitting( false ) { awcPipe[ 0 ] = 0; }
 
-const WCHAR * InferOutputType( WCHAR *ext )
-{
-    if ( !wcsicmp( ext, L".bmp" ) )
-        return L"image/bmp";
+        void Initialize( WCHAR const * pwcPipeName )
+        {
+            swprintf_s( awcPipe, _countof( awcPipe ), L"\\\\.\\pipe\\%ws", pwcPipeName );
+        } //Initialize
 
-    if ( !wcsicmp( ext, L".gif" ) )
-        return L"image/gif";
+        WCHAR const * PipePath() { return awcPipe; }
 
-    if ( ( !wcsicmp( ext, L".jpg" ) ) || ( !wcsicmp( ext, L".jpeg" ) ) )
-        return L"image/jpeg";
+        bool Quitting()
+        {
+            lock_guard<mutex> lock( mtx );
+            return quitting;
+        } //Quitting
 
-    if ( !wcsicmp( ext, L".png" ) )
-        return L"image/png";
+        bool BeginJob()
+        {
+            lock_guard<mutex> lock( mtx );
+            if ( quitting )
+                return false;
 
-    if ( ( !wcsicmp( ext, L".tif" ) ) || ( !wcsicmp( ext, L".tiff" ) ) )
-        return L"image/tiff";
+            activeJobs++;
+            return true;
+        } //BeginJob
 
-    return L"image/jpeg";
-} //InferOutputType
+        void EndJob()
+        {
+            {
+                lock_guard<mutex> lock( mtx );
+                activeJobs--;
+            }
 
-static DWORD ColorizationColors2[] =
-{
-    0xbfbbaf, 0x905c54,
-};
+            cv.notify_all();
+        } //EndJob
 
-static DWORD ColorizationColors4[] =
-{
-    0xddd0bd, 0xe38853, 0x7099bf, 0x5b4644,
-};
+        void Quit()
+        {
+            {
+                lock_guard<mutex> lock( mtx );
+                quitting = true;
+            }
 
-static DWORD ColorizationColors8[] =
-{
-    0xeea665, 0xeecea1, 0x797874, 0x97b9c6, 0x473d35, 0xd55838, 0xdadce3, 0x4b8edd,
-};
+            // Wake the listener, which is waiting for a connection
 
-static DWORD ColorizationColors16[] =
-{
-    0xeda48c, 0xf3dea5, 0x5b4f4d, 0x90a093, 0xe8e4e3, 0x7a766e, 0xe67a69, 0x99c4e6,
-    0x61a3e5, 0xf2673e, 0xc0bcb3, 0x342724, 0xb83d2e, 0x4379cf, 0xf0d94d, 0x308c36,
-};
+            HANDLE h = CreateFile( awcPipe, GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_EXISTING, 0, 0 );
+            if ( INVALID_HANDLE_VALUE != h )
+                CloseHandle( h );
+        } //Quit
 
-static DWORD ColorizationColors32[] =
-{
-    0xee9b81, 0xf5b1a4, 0xf9785d, 0xf5e8a0, 0xebd8ce, 0xf25d32, 0xf0ede9, 0x9bbde3,
-    0x6b6b6e, 0x89878e, 0x433939, 0xa8a49b, 0xc2bfb8, 0xfbd96b, 0x4e525d, 0x734b41,
-    0xd27469, 0xb4d8f2, 0x261a18, 0xc7301b, 0x7fa0d6, 0x3d9ae8, 0x5c84c9, 0x67b7f2,
-    0x948061, 0xb14d52, 0xf2d026, 0x3069d2, 0x78c196, 0x389964, 0x179e14, 0xfd89fc,
+        void WaitForJobs()
+        {
+            unique_lock<mutex> lock( mtx );
+            cv.wait( lock, [&] { return 0 == activeJobs; } );
+        } //WaitForJobs
 };
 
-static DWORD ColorizationColors64[] =
+string RunDaemonJob( char const * pcLine )
 {
-    0xf88f7f, 0xf2a89e, 0xf67464, 0xf6be7c, 0xf0d6a5, 0xf85c43, 0x4f4538, 0xf5e8c8,
-    0x312f31, 0x60645d, 0x9d9593, 0x8d817b, 0x444f55, 0xc7bdb4, 0xf7bfc2, 0xf5f1eb,
-    0xeca354, 0xaba5a9, 0xe94d25, 0x715448, 0x221817, 0xf6f4a1, 0x747272, 0xd9d3ce,
-    0xb22b25, 0xd07a77, 0xdb9590, 0xf6f174, 0xe3e6ea, 0xd35c58, 0x718292, 0x92b6c9,
-    0x6d9abb, 0x477ed0, 0xa94c52, 0x4e9bed, 0xafc6d6, 0xf6e04c, 0x6eaeec, 0x93b8ed,
-    0x51667b, 0xc2ddf2, 0x7c9be2, 0x946553, 0x627ad2, 0xe78721, 0x7cc5f2, 0xc0ad82,
-    0x74b986, 0x3862c4, 0xacd7f8, 0x2b99ee, 0xb49555, 0x9fd3ee, 0xd8310d, 0xf8e819,
-    0x782f2e, 0x92ce9b, 0x359f77, 0x52c8ee, 0x1c71db, 0x1b7d1c, 0x12a70d, 0x06fffe,
-};
+    // CommandLineToArgvW treats the first token as the program name, so provide one
 
-static DWORD ColorizationColors128[] =
-{
-    0xf58374, 0xf9958c, 0xf9a5a1, 0xf86a62, 0xeea775, 0xaea8a8, 0xf9ecb3, 0x63676b,
-    0x79848d, 0xbebab8, 0xf85c43, 0xa89b91, 0xf68757, 0xf6be8c, 0x626058, 0x907c72,
-    0xf4f5f2, 0xfacc6e, 0xf9d9cb, 0x4d4f50, 0xf64b2f, 0x948e8c, 0x77757a, 0xf6f179,
-    0x493f41, 0x5d4e37, 0x6cabf2, 0xcfc7c9, 0xefac53, 0xdd8d8a, 0xfbea50, 0xda756e,
-    0x909aa4, 0xf6f599, 0xd45e59, 0xf7d1ae, 0x7d6c5a, 0xf2e3e3, 0xfad899, 0xf7bfc2,
-    0xf8f4d3, 0xedb4ad, 0xe04f16, 0xe1d8d8, 0x5699ea, 0xf66d3f, 0x73524e, 0x96b9f2,
-    0xe0ebf5, 0xdfa19d, 0x4a3b28, 0x83bef6, 0xb6cadb, 0xab271a, 0xa0bbd5, 0x363336,
-    0x95acc7, 0x6a8fe0, 0xa96163, 0x302827, 0xcc7a7d, 0xb4d8f2, 0x4c7edd, 0xcfdbe6,
-    0x5d6dcf, 0xbe4a52, 0xe2dd9f, 0xbe3431, 0x3671d9, 0x46556c, 0x6d97bf, 0x7eaedc,
-    0x5b748a, 0xdb2d0b, 0x4fb5f7, 0x7ec190, 0x849be7, 0x558bbb, 0xe1d6ba, 0xc5b281,
-    0x963e4f, 0x96d2f7, 0xcec49e, 0xbfe3fb, 0xa4976b, 0xfac52b, 0x201c16, 0xa6c9f3,
-    0x329cf2, 0xf3f21b, 0x6ab282, 0x334b57, 0x91d3da, 0x6b8ba9, 0xd08143, 0x7f6532,
-    0x599160, 0x3556c1, 0xe38e2b, 0x3fa8d8, 0x78373d, 0x2289e6, 0x0f0a07, 0x993f27,
-    0x2a364c, 0x1b2429, 0xf48407, 0x41200d, 0x75c6b8, 0xa57a3d, 0x2a110d, 0xaad4ae,
-    0x37af82, 0x386eb4, 0x5dcfea, 0x7e2217, 0xb5ab3c, 0x3a796d, 0x179e14, 0x98d58e,
-    0x19957e, 0x2e9b2a, 0x3b5789, 0x0f7b0e, 0xe63636, 0x0856f4, 0xfd89fc, 0x06fffe,
-};
+    int cwc = MultiByteToWideChar( CP_UTF8, 0, pcLine, -1, 0, 0 );
+    if ( 0 == cwc )
+        return "error 0x80070057 arguments aren't valid UTF-8";
 
-static DWORD ColorizationColors256[] =
-{
-    0xf86b55, 0x948e8c, 0xf9958a, 0xf87a6d, 0xfaf0b5, 0xfadbcb, 0xf7f3e8, 0x86817d,
-    0xfc5b49, 0x4d464d, 0xf8f4d3, 0x626260, 0x585759, 0xd76e6c, 0xe0d7d2, 0x49423b,
-    0xa59c8b, 0xc7bcbe, 0xaba9ae, 0xfb6941, 0x5d636f, 0xa2a39f, 0x8ec3f3, 0x4fb5f7,
-    0xe9dfe1, 0x5b4a3b, 0x716a69, 0xe3f1f2, 0xf6f5f9, 0xfae49e, 0xe48074, 0xf88c5e,
-    0x6ea6f3, 0xf88b78, 0xf8a398, 0x7ba2e7, 0xda5e5a, 0xf77c82, 0x40352c, 0xf9e0de,
-    0x2e2b2d, 0xf4c090, 0xf24b3b, 0xe48b89, 0xf2f66d, 0xfbd8ae, 0xeca17e, 0xfbd776,
-    0x51a1de, 0xc35b5c, 0xf8fa8c, 0xbcd9f6, 0x90969f, 0x84c28e, 0x727079, 0xf5c8cd,
-    0xfbf59f, 0x3b3538, 0xfab07f, 0x635148, 0xd29292, 0xfac3bf, 0x735754, 0x947f6e,
-    0xb7a69d, 0x475669, 0xe04519, 0xd68278, 0xe79b91, 0xfe8949, 0xabc6db, 0xccbf94,
-    0x828490, 0xd2551d, 0xf2c8a6, 0x507dd8, 0x96a4b4, 0xbec4c9, 0xe7e1a5, 0xf4be5e,
-    0xeeafb2, 0xf6bd78, 0xf9ada8, 0xaa3e21, 0x4081e7, 0xcb322d, 0x7b8c96, 0xfacf84,
-    0xa3b6c5, 0x5290f3, 0xd8d2b5, 0x88adce, 0xfa5630, 0xcfdce8, 0x4e8bce, 0xb61f16,
-    0xd4c7c5, 0x70b27e, 0xe82708, 0xa8d0f6, 0xe88554, 0x271d1c, 0x8b7275, 0x689ddf,
-    0xbdaa7d, 0xf93c1e, 0x8395ad, 0x96b9d6, 0x7f695b, 0xd2dddb, 0x3a6edb, 0xae464f,
-    0x362722, 0xf6ce9b, 0xe7a05e, 0xf99399, 0xf45c6f, 0xdfd69b, 0xf5ab57, 0xdfa19d,
-    0x3b9df4, 0x75c6b8, 0x3c4e5c, 0xbdd2e0, 0xeda86c, 0xaaa168, 0xf0ec81, 0xeb6236,
-    0x618be6, 0x7bbef3, 0x2c63ca, 0x6493bc, 0x91aeef, 0xefd5be, 0xb3b5b7, 0x9cbeeb,
-    0xac8683, 0xc9484f, 0xcc7a7d, 0x994141, 0x866239, 0x727c8b, 0x9b5561, 0x82bee2,
-    0x94d5fe, 0x6d4245, 0xf9ca32, 0x313c4f, 0xbcb4a9, 0xb4696d, 0xb6302f, 0x827761,
-    0x698bae, 0xf8fb4c, 0x4f4220, 0xefaf99, 0x523237, 0x566d7d, 0xa5bbd8, 0xd1eafb,
-    0x248bf4, 0xd2c8d1, 0x3289d3, 0x4f67c7, 0xafdefe, 0xe87927, 0xf8ea18, 0xfcb99f,
-    0x1a73de, 0xfaef35, 0xe4bcbb, 0x4b84b5, 0xd47e36, 0xfeda5d, 0x66bae8, 0xb88653,
-    0xf99aa4, 0x788ddc, 0x687ed3, 0x5db98f, 0x34b07b, 0x6c693c, 0xaedceb, 0x6ec5ff,
-    0xef9c3d, 0xf2571e, 0x6c8194, 0x9d6355, 0xf6dd53, 0xcab6ab, 0xfbe909, 0x7b3128,
-    0x75a0c3, 0xf9acc1, 0x29363f, 0x645423, 0xe9ebc5, 0x93d3e0, 0x96b9fd, 0x495c54,
-    0x8ecfc6, 0x60758d, 0xb05f3b, 0xdfb1ad, 0xebf199, 0x8a4452, 0x3b200f, 0x5d9d68,
-    0x18a108, 0x261012, 0x3c8967, 0x666cda, 0x98d58e, 0x8f2b14, 0x95894d, 0x3e5682,
-    0x171717, 0x1d232f, 0xaeab40, 0x20676b, 0x3556c1, 0xf67800, 0xaad4ae, 0xf6b712,
-    0x0d0d0f, 0x648359, 0xcbc563, 0x19957e, 0x8f96e7, 0x3c130f, 0x5d9954, 0x090504,
-    0x842640, 0x378e2b, 0x37b3d9, 0x210909, 0x691d29, 0x4d799e, 0x3562a6, 0x037602,
-    0x51e5ef, 0xb1bdef, 0xc5b627, 0x29554a, 0x281b08, 0xfd89fc, 0x06fffe, 0x182a14,
-    0x232c67, 0x034afe, 0x187218, 0x7fffff, 0x00a637, 0xcfcaff, 0x8bfe02, 0xf0335b,
-};
+    vector<WCHAR> line( 3 + cwc );
+    wcscpy_s( line.data(), line.size(), L"ic " );
+    MultiByteToWideChar( CP_UTF8, 0, pcLine, -1, line.data() + 3, cwc );
 
-extern "C" int wmain( int argc, WCHAR * argv[] )
-{
-    #ifndef NDEBUG
-        parallel_for ( 0, 5, [&] ( int testing )
-        {
-            assert( KDTreeBGR::UnitTest() );
-        } );
-    #endif
+    int argc = 0;
+    WCHAR ** argv = CommandLineToArgvW( line.data(), &argc );
+    if ( 0 == argv )
+        return "error 0x80070057 can't parse arguments";
 
-    long long totalTime = 0;
-    CTimed timedTotal( totalTime );
+    unique_ptr<AppOptions> opt( new AppOptions() );
+    HRESULT hr = S_OK;
+    string message;
 
-    if ( argc < 2 )
-        Usage( "too few arguments" );
+    t_UsageThrows = true;
 
-    HRESULT hr = CoInitializeEx( NULL, COINIT_MULTITHREADED );
-    if ( FAILED( hr ) )
+    try
     {
-        printf( "can't initialize COM: %#x\n", hr );
-        Usage();
-    }
+        ParseArguments( argc, argv, *opt );
 
-    hr = CoCreateInstance( CLSID_WICImagingFactory, NULL, CLSCTX_INPROC_SERVER,
-                           __uuidof( IWICImagingFactory ),
-                           (void **) g_IWICFactory.GetAddressOf() );
-    if ( FAILED( hr ) )
+        if ( opt->daemonMode || opt->useMetadataCache || opt->awcThumbnailCache[0] || opt->enableTracing || opt->runtimeInfo || opt->useEmbeddedPreviews )
+            Usage( "-d, -i, -j, -k, -t, and -u can only be used when starting the daemon" );
+
+        if ( opt->useManifest )
+            Usage( "-m can't be used with the daemon" );
+
+        if ( IsStdio( opt->awcInput ) || IsStdio( opt->awcOutput ) )
+            Usage( "daemon jobs can't use stdin or stdout" );
+
+        hr = RunJob( *opt );
+        if ( FAILED( hr ) )
+            message = "job failed";
+    }
+    catch ( exception & e )
     {
-        printf( "can't create WIC imaging factory: %#x\n", hr );
-        Usage();
+        hr = E_INVALIDARG;
+        message = e.what();
     }
 
-    static WCHAR awcInput[ MAX_PATH ] = {0};
-    static WCHAR awcOutput[ MAX_PATH ] = {0};
-    bool gameBoy = false;
-    bool generateCollage = false;
-    int collageMethod = 1;
-    int collageColumns = 3;
-    int collageSpacing = 6;
-    bool collageSortByAspect = false;
-    bool collageSortByColor = false;
-    bool collageSpaced = true;
-    bool namesAsCaptions = false;
-    bool randomizeCollage = false;
-    bool runtimeInfo = false;
-    bool highQualityScaling = true;
-    bool showColors = false;
-    int showColorCount = 64;
-    bool makeGreyscale = false;
-    bool lowQualityOutput = false;
-    int posterizeLevel = 0;  // 0 means none
-    ColorizationData * colorizationData = 0; // null means none
-    int waveMethod = 0;      // 0 means none; don't create a WAV file
-    int longEdge = 0;
-    int fillColor = 0xff << 24; // black, non-transparent
-    double aspectRatio = 0.0;
-    int breakTileSize = 0; // if 0, don't do it.
-    double tileProbability = 1.0;
-    bool enableTracing = false;
-    bool clearTraceFile = false;
-    double expandCollageImages = 1.0;
+    t_UsageThrows = false;
+    LocalFree( argv );
 
-    ColorizationData cd;
+    if ( SUCCEEDED( hr ) )
+        return "ok";
 
-    for ( int a = 1; a < argc; a++ )
+    char acReply[ 300 ];
+    snprintf( acReply, sizeof acReply, "error %#x %s", hr, message.c_str() );
+    return acReply;
+} //RunDaemonJob
+
+// Longer than any command line Windows allows, so a longer pending line means the client isn't sending jobs
+
+const size_t MaxDaemonLine = 64 * 1024;
+
+void ServeDaemonClient( HANDLE hPipe, CDaemonState & state )
+{
+    string pending;
+    char acBuffer[ 4096 ];
+    DWORD cbRead = 0;
+    bool quit = false;
+
+    while ( !quit && ReadFile( hPipe, acBuffer, sizeof acBuffer, &cbRead, 0 ) && ( 0 != cbRead ) )
     {
-        WCHAR const * parg = argv[ a ];
+        pending.append( acBuffer, cbRead );
+        size_t eol;
 
-        if ( L'-' == parg[0] || L'/' == parg[0] )
+        if ( pending.size() > MaxDaemonLine && string::npos == pending.find( '\n' ) )
         {
-            WCHAR p = tolower( parg[1] );
+            tracer.Trace( "dropping daemon client that sent %zd bytes without a newline\n", pending.size() );
+            string reply = "error 0x80070057 the line is too long\n";
+            DWORD cbWritten = 0;
+            WriteFile( hPipe, reply.data(), (DWORD) reply.size(), &cbWritten, 0 );
+            break;
+        }
 
-            if ( L'a' == p )
-            {
-                if ( L':' != parg[2] )
-                    Usage( "malformed argument -- expecting a :" );
+        while ( !quit && ( string::npos != ( eol = pending.find( '\n' ) ) ) )
+        {
+            string line = pending.substr( 0, eol );
+            pending.erase( 0, eol + 1 );
 
-                aspectRatio = ParseAspectRatio( parg + 3 );
-            }
-            else if ( L'b' == p )
-                gameBoy = true;
-            else if ( L'c' == p )
-            {
-                generateCollage = true;
+            if ( !line.empty() && '\r' == line.back() )
+                line.pop_back();
 
-                if ( ':' == parg[ 2 ] && 0 != parg[ 3 ] )
-                {
-                    collageMethod = _wtoi( parg + 3 );
+            if ( line.empty() )
+                continue;
 
-                    if ( collageMethod < 1 || collageMethod > 2 )
-                        Usage( "collage method isn't valid" );
+            string reply;
+
+            if ( "quit" == line )
+            {
+                quit = true;
+                reply = "ok";
+            }
+            else if ( state.BeginJob() )
+            {
+                tracer.Trace( "daemon job: %s\n", line.c_str() );
+                reply = RunDaemonJob( line.c_str() );
+                state.EndJob();
+            }
+            else
+                reply = "error 0x8007045b the daemon is shutting down";
 
-                    if ( 1 == collageMethod )
-                    {
-                        WCHAR const * pwcColon1 = wcschr( parg + 4, ':' );
+            reply += "\n";
+            DWORD cbWritten = 0;
+            WriteFile( hPipe, reply.data(), (DWORD) reply.size(), &cbWritten, 0 );
+        }
+    }
 
-                        if ( 0 != pwcColon1 && ( 'c' == tolower( pwcColon1[ 1 ] ) ) )
-                            collageSortByColor = true;
-                    }
-                    else if ( 2 == collageMethod )
-                    {
-                        WCHAR const * pwcColon1 = wcschr( parg + 4, ':' );
-                        WCHAR const * pwcColon2 = ( 0 != pwcColon1 ) ? wcschr( pwcColon1 + 1, ':' ) : 0;
-                        WCHAR const * pwcColon3 = ( 0 != pwcColon2 ) ? wcschr( pwcColon2 + 1, ':' ) : 0;
+    FlushFileBuffers( hPipe );
+    DisconnectNamedPipe( hPipe );
+    CloseHandle( hPipe );
 
-                        if ( 0 != pwcColon1 )
-                            collageColumns = _wtoi( pwcColon1 + 1 );
+    if ( quit )
+        state.Quit();
+} //ServeDaemonClient
 
-                        if ( 0 != pwcColon2 )
-                            collageSpacing = _wtoi( pwcColon2 + 1 );
+// A security descriptor whose DACL gives only the current user access. Free it with LocalFree().
 
-                        if ( 0 != pwcColon3 )
-                        {
-                            for ( const WCHAR * pwcA = pwcColon3 + 1; *pwcA; pwcA++ )
-                            {
-                                if ( 'T' == *pwcA )
-                                    collageSortByAspect = true;
-                                else if ( 't' == *pwcA )
-                                    collageSortByAspect = false;
-                                else if ( 'S' == *pwcA )
-                                    collageSpaced = true;
-                                else if ( 's' == *pwcA )
-                                    collageSpaced = false;
-                                else
-                                    Usage( "invalid collage A argument" );
-                            }
-                        }
+HRESULT CurrentUserSecurityDescriptor( PSECURITY_DESCRIPTOR & psd )
+{
+    psd = 0;
+    HANDLE hToken = 0;
+    if ( !OpenProcessToken( GetCurrentProcess(), TOKEN_QUERY, &hToken ) )
+        return HRESULT_FROM_WIN32( GetLastError() );
+
+    DWORD cb = 0;
+    GetTokenInformation( hToken, TokenUser, 0, 0, &cb );
+    vector<byte> tokenUser( cb );
+    WCHAR * pwcSid = 0;
+    HRESULT hr = S_OK;
 
-                        if ( collageColumns < 1 || collageColumns > 100 )
-                            Usage( "invalid collage column count" );
+    if ( 0 == cb || !GetTokenInformation( hToken, TokenUser, tokenUser.data(), cb, &cb ) ||
+         !ConvertSidToStringSid( ( (TOKEN_USER *) tokenUser.data() )->User.Sid, &pwcSid ) )
+        hr = HRESULT_FROM_WIN32( GetLastError() );
 
-                        if ( collageSpacing < 0 || collageSpacing > 100 )
-                            Usage( "invalid collage spacing" );
-                    }
-                }
-            }
-            else if ( L'f' == p )
-            {
-                if ( L':' != parg[2] )
-                    Usage( "malformed argument -- expecting a :" );
+    CloseHandle( hToken );
 
-               int parsed = swscanf_s( parg + 3, L"%x", & fillColor );
+    if ( SUCCEEDED( hr ) )
+    {
+        // Protected DACL: generic all for the user, nothing inherited, nobody else
 
-               if ( 0 == parsed )
-                   Usage( "can't parse fill color" );
-            }
-            else if ( L'g' == p )
-                makeGreyscale = true;
-            else if ( L'h' == p )
-                highQualityScaling = false;
-            else if ( L'i' == p )
-                runtimeInfo = true;
-            else if ( L'l' == p )
-            {
-                if ( L':' != parg[2] )
-                    Usage( "malformed argument -- expecting a :" );
+        wstring sddl = L"D:P(A;;GA;;;";
+        sddl += pwcSid;
+        sddl += L")";
+        LocalFree( pwcSid );
 
-                longEdge = _wtoi( parg + 3 );
+        if ( !ConvertStringSecurityDescriptorToSecurityDescriptor( sddl.c_str(), SDDL_REVISION_1, &psd, 0 ) )
+            hr = HRESULT_FROM_WIN32( GetLastError() );
+    }
 
-                if ( longEdge <= 0 )
-                {
-                    printf( "long edge -l is invalid: %d\n", longEdge );
-                    Usage();
-                }
-            }
-            else if ( L'n' == p )
-                namesAsCaptions = true;
-            else if ( L'o' == p )
-            {
-                if ( L':' != parg[2] )
-                    Usage( "malformed argument -- expecting a :" );
+    return hr;
+} //CurrentUserSecurityDescriptor
 
-                _wfullpath( awcOutput, parg + 3, _countof( awcOutput ) );
-            }
-            else if ( L'p' == p )
-            {
-                if ( L':' != parg[2] )
-                    Usage( "malformed argument -- expecting a :" );
+HRESULT RunDaemon( WCHAR const * pwcPipeName )
+{
+    // Client threads are detached and may outlive this function, so the state never goes away
 
-                posterizeLevel = _wtoi( parg + 3 );
-                if ( posterizeLevel < 1 || posterizeLevel > 256 )
-                {
-                    printf( "invalid posterization level %d; must be 1..256\n", posterizeLevel );
-                    Usage();
-                }
-            }
-            else if ( L'q' == p )
-                lowQualityOutput = true;
-            else if ( L'r' == p )
-                randomizeCollage = true;
-            else if ( L's' == p )
-            {
-                showColors = true;
+    static CDaemonState state;
+    state.Initialize( pwcPipeName );
 
-                if ( L':' == parg[2] )
-                    showColorCount = _wtoi( parg + 3 );
+    // The default DACL lets other accounts on the machine connect; jobs read and write files as this user
 
-                if ( showColorCount < 0 || showColorCount > 256 )
-                    Usage( "show color count must be in range 1..256" );
-            }
-            else if ( L't' == p )
-            {
-                if ( 0 != parg[2] )
-                    Usage( "unexpected characters after argument" );
-                enableTracing = true;
-                clearTraceFile = ( L'T' == parg[1] );
-            }
-            else if ( L'w' == p )
-            {
-                if ( L':' != parg[2] )
-                    Usage( "malformed argument -- expecting a :" );
+    PSECURITY_DESCRIPTOR psd = 0;
+    HRESULT hr = CurrentUserSecurityDescriptor( psd );
+    if ( FAILED( hr ) )
+    {
+        printf( "can't create a security descriptor for the pipe, error %#x\n", hr );
+        return hr;
+    }
 
-                waveMethod = _wtoi( parg + 3 );
-                if ( waveMethod < 0 || waveMethod > 10 )
-                {
-                    printf( "invalid wave method %d\n", waveMethod );
-                    Usage();
-                }
-            }
-            else if ( L'x' == p )
-            {
-                if ( ':' != parg[2] )
-                {
-                    printf( "colon expected with /x:f\n" );
-                    Usage();
-                }
+    SECURITY_ATTRIBUTES sa = { sizeof( SECURITY_ATTRIBUTES ), psd, FALSE };
+    printf( "ic daemon listening on %ws\n", state.PipePath() );
 
-                expandCollageImages = _wtof( parg + 3 );
+    do
+    {
+        HANDLE hPipe = CreateNamedPipe( state.PipePath(), PIPE_ACCESS_DUPLEX,
+                                        PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                                        PIPE_UNLIMITED_INSTANCES, 65536, 65536, 0, &sa );
+        if ( INVALID_HANDLE_VALUE == hPipe )
+        {
+            hr = HRESULT_FROM_WIN32( GetLastError() );
+            printf( "can't create named pipe %ws, error %#x\n", state.PipePath(), hr );
+            break;
+        }
 
-                if ( expandCollageImages < 1.0 || expandCollageImages > 10.0 )
-                {
-                    printf( "value for /x:f must be in the range of 1.0 to 10.0, found %lf\n", expandCollageImages );
-                    Usage();
-                }
-            }
-            else if ( L'z' == p )
-            {
-                WCHAR const * pnext = parg + 2;
-                if ( L'b' == *pnext )
-                    cd.mapping = mapBrightness;
-                else if ( 's' == *pnext )
-                    cd.mapping = mapSaturation;
-                else if ( 'h' == *pnext )
-                    cd.mapping = mapHue;
-                else if ( 'g' == *pnext )
-                    cd.mapping = mapGradient;
-                else if ( 'c' == *pnext )
-                    cd.mapping = mapColor;
-                else
-                    Usage( "invalid /z flag specified" );
+        if ( !ConnectNamedPipe( hPipe, 0 ) && ( ERROR_PIPE_CONNECTED != GetLastError() ) )
+        {
+            CloseHandle( hPipe );
+            continue;
+        }
 
-                pnext++;
-                if ( L':' != *pnext )
-                    Usage( "colon not found in /z flag" );
+        if ( state.Quitting() )
+        {
+            CloseHandle( hPipe );
+            break;
+        }
 
-                posterizeLevel = _wtoi( pnext + 1 );
-                if ( posterizeLevel < 1 || posterizeLevel > 256 )
-                {
-                    printf( "invalid colorization posterization level %d; must be 1-256\n", posterizeLevel );
-                    Usage();
-                }
+        thread( ServeDaemonClient, hPipe, ref( state ) ).detach();
+    } while ( true );
 
-                colorizationData = &cd;
+    state.WaitForJobs();
+    LocalFree( psd );
+    printf( "ic daemon stopped\n" );
 
-                WCHAR const *semi = wcschr( parg, L';' );
-                if ( semi )
-                {
-                    static WCHAR awcColorFile[ MAX_PATH ] = {0};
-                    _wfullpath( awcColorFile, semi + 1, _countof( awcColorFile ) );
-                    DWORD attr = GetFileAttributesW( awcColorFile );
-                    if ( INVALID_FILE_ATTRIBUTES == attr )
-                        Usage( "can't find /z color file" );
-
-                    cd.bgrdata.clear();
-                    ShowColors( awcColorFile, posterizeLevel, cd.bgrdata, false, 0 );
-                }
-                else
-                {
-                    WCHAR const *comma = wcschr( parg, L',' );
-    
-                    if ( comma )
-                    {
-                        // parse a list of colors
+    return hr;
+} //RunDaemon
 
-                        cd.bgrdata.clear();
-    
-                        do
-                        {
-                            comma++;
-                            DWORD color;
-                            int parsed = swscanf_s( comma, L"%x", & color );
-                            if ( 0 == parsed )
-                                Usage( "can't parse color mapping color" );
-                            cd.bgrdata.push_back( color );
-                            comma = wcschr( comma, L',' );
-                        } while ( comma );
-    
-                        if ( cd.bgrdata.size() != posterizeLevel )
-                            Usage( "the /z: color count isn't the same as the number of colors specified" );
-                    }
-                    else
-                    {
-                        // use the built-in table
+extern "C" int wmain( int argc, WCHAR * argv[] )
+{
+    #ifndef NDEBUG
+        parallel_for ( 0, 5, [&] ( int testing )
+        {
+            assert( KDTreeBGR::UnitTest() );
+        } );
+    #endif
 
-                        int countBuiltIn = 0;
-                        DWORD * pBuiltInArray = NULL;
+    long long totalTime = 0;
+    CTimed timedTotal( totalTime );
 
-                        if ( posterizeLevel <= 2 )
-                        {
-                            countBuiltIn = 2;
-                            pBuiltInArray = ColorizationColors2;
-                        }
-                        else if ( posterizeLevel <= 4 )
-                        {
-                            countBuiltIn = 4;
-                            pBuiltInArray = ColorizationColors4;
-                        }
-                        else if ( posterizeLevel <= 8 )
-                        {
-                            countBuiltIn = 8;
-                            pBuiltInArray = ColorizationColors8;
-                        }
-                        else if ( posterizeLevel <= 16 )
-                        {
-                            countBuiltIn = 16;
-                            pBuiltInArray = ColorizationColors16;
-                        }
-                        else if ( posterizeLevel <= 32 )
-                        {
-                            countBuiltIn = 32;
-                            pBuiltInArray = ColorizationColors32;
-                        }
-                        else if ( posterizeLevel <= 64 )
-                        {
-                            countBuiltIn = 64;
-                            pBuiltInArray = ColorizationColors64;
-                        }
-                        else if ( posterizeLevel <= 128 )
-                        {
-                            countBuiltIn = 128;
-                            pBuiltInArray = ColorizationColors128;
-                        }
-                        else // anything greater is mapped to 256
-                        {
-                            countBuiltIn = 256;
-                            pBuiltInArray = ColorizationColors256;
-                        }
+    if ( argc < 2 )
+        Usage( "too few arguments" );
 
-                        cd.bgrdata.resize( __min( posterizeLevel, countBuiltIn ) );
+    HRESULT hr = CoInitializeEx( NULL, COINIT_MULTITHREADED );
+    if ( FAILED( hr ) )
+    {
+        printf( "can't initialize COM: %#x\n", hr );
+        Usage();
+    }
 
-                        for ( int c = 0; c < cd.bgrdata.size(); c++ )
-                           cd.bgrdata[ c ] = pBuiltInArray[ c ];
-                    }
-                }
-            }
-        }
-        else if ( 0 != awcInput[0] )
-            Usage( "input file specified twice" );
-        else
-            _wfullpath( awcInput, parg, _countof( awcInput ) );
+    hr = CoCreateInstance( CLSID_WICImagingFactory, NULL, CLSCTX_INPROC_SERVER,
+                           __uuidof( IWICImagingFactory ),
+                           (void **) g_IWICFactory.GetAddressOf() );
+    if ( FAILED( hr ) )
+    {
+        printf( "can't create WIC imaging factory: %#x\n", hr );
+        Usage();
     }
 
-    tracer.Enable( enableTracing, L"ic.txt", clearTraceFile );
+    static AppOptions opt;
+    ParseArguments( argc, argv, opt );
+
+    tracer.Enable( opt.enableTracing, L"ic.txt", opt.clearTraceFile );
+    g_UseEmbeddedPreviews = opt.useEmbeddedPreviews;
 
     ULONG_PTR gdiplusToken = 0;
 
-    if ( namesAsCaptions )
+    if ( opt.namesAsCaptions || opt.daemonMode )
     {
         GdiplusStartupInput si;
         GdiplusStartup( &gdiplusToken, &si, NULL );
     }
 
-    // Create optimized data structures for specific color mapping scenarios
+    if ( opt.useMetadataCache )
+    {
+        // By default the cache lives in the folder with the input images
 
-    if ( mapColor == cd.mapping || mapGradient == cd.mapping )
-        qsort( cd.bgrdata.data(), cd.bgrdata.size(), sizeof DWORD, compare_brightness );
+        if ( 0 == opt.awcMetadataCache[0] )
+        {
+            wcscpy_s( opt.awcMetadataCache, _countof( opt.awcMetadataCache ), opt.awcInput );
+            WCHAR * pwcSlash = wcsrchr( opt.awcMetadataCache, L'\\' );
+            if ( pwcSlash )
+                pwcSlash[ 1 ] = 0;
+            wcscat_s( opt.awcMetadataCache, _countof( opt.awcMetadataCache ), L".iccache" );
+        }
 
-    if ( mapColor == cd.mapping )
+        tracer.Trace( "metadata cache: %ws\n", opt.awcMetadataCache );
+        g_pMetadataCache = new CMetadataCache( opt.awcMetadataCache );
+    }
+
+    if ( 0 != opt.awcThumbnailCache[0] )
     {
-        cd.kdtree.reset( new KDTreeBGR( cd.bgrdata.size() ) );
+        if ( !CreateDirectory( opt.awcThumbnailCache, 0 ) && ( ERROR_ALREADY_EXISTS != GetLastError() ) )
+        {
+            printf( "can't create thumbnail cache folder %ws, error %d\n", opt.awcThumbnailCache, GetLastError() );
+            Usage();
+        }
 
-        for ( int i = 0; i < cd.bgrdata.size(); i++ )
-            cd.kdtree->Insert( cd.bgrdata[ i ] );
+        tracer.Trace( "thumbnail cache: %ws\n", opt.awcThumbnailCache );
+        g_pThumbnailCache = new CThumbnailCache( opt.awcThumbnailCache );
     }
-    else  if ( mapBrightness == cd.mapping || mapHue == cd.mapping || mapSaturation == cd.mapping )
+
+    if ( opt.useManifest && !opt.daemonMode )
     {
-        qsort( cd.bgrdata.data(), cd.bgrdata.size(), sizeof DWORD,
-               mapHue == cd.mapping ? compare_hue :
-               mapSaturation == cd.mapping ? compare_saturation :
-               compare_brightness );
+        // By default the manifest lives in the folder with the outputs
 
-        // calcuate the HSV data for the rgb data, if any
-    
-        cd.hsvdata.resize( cd.bgrdata.size() );
-    
-        for ( int i = 0; i < cd.bgrdata.size(); i++ )
+        if ( 0 == opt.awcManifest[0] )
         {
-            int h,s,v;
-            BGRToHSV( cd.bgrdata[ i ], h, s, v );
-
-            if ( mapHue == cd.mapping )
-                cd.hsvdata[ i ] = h;
-            else if ( mapSaturation == cd.mapping )
-                cd.hsvdata[ i ] = s;
-            else if ( mapBrightness == cd.mapping )
-                cd.hsvdata[ i ] = v;
+            _wfullpath( opt.awcManifest, opt.awcOutput, _countof( opt.awcManifest ) );
+            WCHAR * pwcSlash = wcsrchr( opt.awcManifest, L'\\' );
+            if ( pwcSlash )
+                pwcSlash[ 1 ] = 0;
+            wcscat_s( opt.awcManifest, _countof( opt.awcManifest ), L".icmanifest" );
         }
 
-        #ifndef NDEBUG
-        for ( int z = 0; z < cd.hsvdata.size() - 1; z++ )
-            assert( cd.hsvdata[ z ] <= cd.hsvdata[ z + 1 ] );
-        #endif
+        tracer.Trace( "manifest: %ws\n", opt.awcManifest );
+        g_pManifest = new CBuildManifest( opt.awcManifest, OptionsDigest( opt ) );
     }
 
-    if ( 0 == awcInput[0] || ( 0 == awcOutput[0] && !showColors ) )
-        Usage( "input and/or output files not specified" );
-
-    if ( waveMethod > 0 && generateCollage )
-        Usage( "can't generate wav files when generating a collage" );
-
-    if ( !generateCollage )
+    if ( opt.daemonMode )
     {
-        DWORD attr = GetFileAttributesW( awcInput );
-        if ( INVALID_FILE_ATTRIBUTES == attr )
-        {
-            printf( "can't open file %ws\n", awcInput );
-            Usage();
-        }
+        g_CacheColorizations = true;
+        hr = RunDaemon( opt.awcPipeName[0] ? opt.awcPipeName : L"ic" );
     }
+    else
+    {
+        if ( IsStdio( opt.awcOutput ) )
+            RedirectStdout();
 
-    const WCHAR * outputMimetype = awcOutput[0] ? InferOutputType( PathFindExtension( awcOutput ) ) : 0;
+        hr = IsStdio( opt.awcInput ) ? ReadStdin() : S_OK;
 
-    tracer.Trace( "input: %ws\n", awcInput );
-    tracer.Trace( "output: %ws\n", awcOutput );
-    tracer.Trace( "output type: %ws\n", outputMimetype );
-    tracer.Trace( "long edge: %d\n", longEdge );
+        if ( SUCCEEDED( hr ) )
+            hr = RunJob( opt );
+    }
+
+    size_t metadataCacheHits = 0, metadataCacheMisses = 0;
 
-    if ( showColors )
+    if ( g_pMetadataCache )
     {
-        cd.bgrdata.clear();
-        hr = ShowColors( awcInput, showColorCount, cd.bgrdata, true, awcOutput[0] ? awcOutput : 0, outputMimetype );
+        metadataCacheHits = g_pMetadataCache->Hits();
+        metadataCacheMisses = g_pMetadataCache->Misses();
+        g_pMetadataCache->Save();
+        delete g_pMetadataCache;
+        g_pMetadataCache = 0;
     }
-    else if ( generateCollage )
+
+    size_t manifestSkipped = 0, manifestBuilt = 0;
+
+    if ( g_pManifest )
     {
-        hr = GenerateCollage( collageMethod, awcInput, awcOutput, longEdge, posterizeLevel, colorizationData, makeGreyscale,
-                              collageColumns, collageSpacing, collageSortByColor, collageSortByAspect, collageSpaced, aspectRatio, fillColor,
-                              outputMimetype, randomizeCollage, lowQualityOutput, highQualityScaling, namesAsCaptions, expandCollageImages );
-        if ( SUCCEEDED( hr ) )
-            printf( "collage written successfully: %ws\n", awcOutput );
-        else
-            DeleteFile( awcOutput );
+        manifestSkipped = g_pManifest->Skipped();
+        manifestBuilt = g_pManifest->Built();
+        g_pManifest->Save();
+        delete g_pManifest;
+        g_pManifest = 0;
     }
-    else
+
+    size_t thumbnailCacheHits = 0, thumbnailCacheMisses = 0;
+
+    if ( g_pThumbnailCache )
     {
-        hr = ConvertImage( awcInput, awcOutput, longEdge, waveMethod, posterizeLevel, colorizationData, makeGreyscale,
-                           aspectRatio, fillColor, outputMimetype, lowQualityOutput, gameBoy, highQualityScaling );
-        if ( SUCCEEDED( hr ) )
-            printf( "output written successfully: %ws\n", awcOutput );
-        else
-        {
-            printf( "conversion of image failed with error %#x\n", hr );
-            DeleteFile( awcOutput );
-        }
+        thumbnailCacheHits = g_pThumbnailCache->Hits();
+        thumbnailCacheMisses = g_pThumbnailCache->Misses();
+        delete g_pThumbnailCache;
+        g_pThumbnailCache = 0;
     }
 
     if ( gdiplusToken )
@@ -3590,7 +6393,7 @@ extern "C" int wmain( int argc, WCHAR * argv[] )
     g_IWICFactory.Reset();
     CoUninitialize();
 
-    if ( runtimeInfo )
+    if ( opt.runtimeInfo )
     {
         timedTotal.Complete();
 
@@ -3602,6 +6405,24 @@ extern "C" int wmain( int argc, WCHAR * argv[] )
             PrintStat( "final working set:", pmc.WorkingSetSize );
         }
 
+        if ( opt.useMetadataCache )
+        {
+            PrintStat( "metadata cache hits:", metadataCacheHits );
+            PrintStat( "  misses:", metadataCacheMisses );
+        }
+
+        if ( opt.useManifest )
+        {
+            PrintStat( "manifest up to date:", manifestSkipped );
+            PrintStat( "  rebuilt:", manifestBuilt );
+        }
+
+        if ( 0 != opt.awcThumbnailCache[0] )
+        {
+            PrintStat( "thumbnail cache hits:", thumbnailCacheHits );
+            PrintStat( "  misses:", thumbnailCacheMisses );
+        }
+
         if ( 0 != g_ShowColorsAllTime )
         {
             PrintStat( "show colors total:", g_ShowColorsAllTime / CTimed::NanoPerMilli() );
@@ -3630,16 +6451,29 @@ extern "C" int wmain( int argc, WCHAR * argv[] )
                 PrintStat( "  palette file:", g_ShowColorsPaletteTime / CTimed::NanoPerMilli() );
         }
 
-        if ( generateCollage )
+        if ( opt.generateCollage )
         {
             PrintStat( "collage prep:", g_CollagePrepTime / CTimed::NanoPerMilli() );
             PrintStat( "collage stitch:", g_CollageStitchTime / CTimed::NanoPerMilli() );
             PrintStat( "  flood fill:", g_CollageStitchFloodTime / CTimed::NanoPerMilli() );
             PrintStat( "  read pixels:", g_CollageStitchReadPixelsTime / CTimed::NanoPerMilli() );
             PrintStat( "  draw:", g_CollageStitchDrawTime / CTimed::NanoPerMilli() );
+            PrintStat( "  decode tail:", g_DecodeTail.tailTime / CTimed::NanoPerMilli() );
+            PrintStat( "  idle core time:", g_DecodeTail.idleTime / CTimed::NanoPerMilli() );
+
+            for ( int i = 0; i < SlowDecodeCount && 0 != g_DecodeTail.slowDecodes[ i ].duration; i++ )
+                printf( "  slow decode %d: %10lld ms  %ws\n", i, g_DecodeTail.slowDecodes[ i ].duration / CTimed::NanoPerMilli(),
+                        g_DecodeTail.slowDecodes[ i ].awcPath );
+
             PrintStat( "collage write:", g_CollageWriteTime / CTimed::NanoPerMilli() );
         }
 
+        if ( 0 != g_ReducedDecodeTime )
+            PrintStat( "reduced decode:", g_ReducedDecodeTime / CTimed::NanoPerMilli() );
+
+        if ( 0 != g_EmbeddedPreviewTime )
+            PrintStat( "embedded previews:", g_EmbeddedPreviewTime / CTimed::NanoPerMilli() );
+
         if ( 0 != g_ReadPixelsTime )
             PrintStat( "read pixels:", g_ReadPixelsTime / CTimed::NanoPerMilli() );
 